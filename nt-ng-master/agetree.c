@@ -25,36 +25,15 @@
 static void agetree(ntree_t * tree)
 {
   long i;
+  heights_t * h = ntree_heights(tree);
 
-  for (i = 0; i < tree->inner_count; ++i)
-    tree->inner[i]->mark = 0;
+  if (!h->ultrametric)
+    fatal("Tree not ultrametric");
 
   for (i = 0; i < tree->leaves_count; ++i)
-  {
-    node_t * child = tree->leaves[i];
-    node_t * parent = child->parent;
-    child->age = 0;
-
-    while (parent)
-    {
-      /* if an inner node's age was already computed, check for ultrametricity
-         and break */
-      if (parent->mark)
-      {
-        //if (!((parent->age + __DBL_EPSILON__ >= child->age + child->length) &&
-        //    (parent->age - __DBL_EPSILON__ <= child->age + child->length)))
-        if (!((parent->age + 1e-5 >= child->age + child->length) &&
-            (parent->age - 1e-5 <= child->age + child->length)))
-          fatal("Tree not ultrametric");
-        break;
-      }
-      parent->age = child->age + child->length;
-      parent->mark = 1;
-      
-      child = parent;
-      parent = parent->parent;
-    }
-  }
+    tree->leaves[i]->age = 0;
+  for (i = 0; i < tree->inner_count; ++i)
+    tree->inner[i]->age = h->age[tree->leaves_count + i];
 }
 
 static int cb_cmp_nodeage(const void * a, const void * b)
@@ -65,23 +44,28 @@ static int cb_cmp_nodeage(const void * a, const void * b)
   double xage = (*x)->age;
   double yage = (*y)->age;
 
-  return xage > yage ? 1 : 0;
+  if (xage > yage) return 1;
+  if (xage < yage) return -1;
+
+  return 0;
 }
 
 void cmd_agetree()
 {
-  long i = 0;
-  FILE * fp_input;
+  long i;
+  long treeno = 0;
+  treeio_t * fp_input;
   FILE * fp_output;
   char * output_file;
   char * newick;
+  ntree_t * tree;
 
   /* TODO: Check the tree is ultrametric */
 
   if (!opt_treefile)
     fatal("An input file must be specified");
 
-  fp_input  = xopen(opt_treefile,"r");
+  fp_input  = treeio_open_selected(opt_treefile);
 
   /* prepare output medium */
   if (!opt_outfile)
@@ -97,20 +81,18 @@ void cmd_agetree()
   if (!opt_quiet)
     fprintf(stdout, "Parsing tree file...\n");
 
-  while ((newick = getnextline(fp_input)))
+  while (treeio_next(fp_input, &tree))
   {
-    ++i;
+    treeno = treeio_treeno(fp_input);
 
-    ntree_t * tree = ntree_parse_newick(newick);
     if (!tree)
       fatal("Cannot parse tree file");
-    free(newick);
 
     if (!ntree_check_rbinary(tree))
       fatal("--agetree works only on binary rooted trees");
 
     if (!opt_outfile)
-      fprintf(stdout,"Tree %ld:\n",i);
+      fprintf(stdout,"Tree %ld:\n",treeno);
 
     agetree(tree);
 
@@ -160,5 +142,5 @@ void cmd_agetree()
   if (opt_outfile)
     fclose(fp_output);
 
-  fclose(fp_input);
+  treeio_close(fp_input);
 }
@@ -24,16 +24,16 @@
 
 void cmd_attach()
 {
-  FILE * fp_input;
-  FILE * fp_attach;
+  treeio_t * fp_input;
+  treeio_t * fp_attach;
   FILE * fp_output;
   int i,j;
   
   if (!opt_treefile)
     fatal("An input file must be specified");
 
-  fp_input   = xopen(opt_treefile,"r");
-  fp_attach  = xopen(opt_attach,"r");
+  fp_input   = treeio_open_selected(opt_treefile);
+  fp_attach  = treeio_open(opt_attach);
 
   if (!opt_attachat)
     fatal("An attachment tip must be specified with --attach_at");
@@ -41,40 +41,35 @@ void cmd_attach()
   if (!opt_quiet)
     fprintf(stdout, "Parsing tree file...\n");
 
-  char * newick;
+  ntree_t * tree;
 
   /* read one attachment tree */
   ntree_t * attachtree = NULL;
   int attachtree_count = 0;
-  while ((newick = getnextline(fp_attach)))
+  while (treeio_next(fp_attach, &attachtree))
   {
-    attachtree = ntree_parse_newick(newick);
     if (!attachtree)
       fatal("Cannot parse attachment tree file %s", opt_attach);
     ++attachtree_count;
-    free(newick);
   }
   if (attachtree_count > 1)
     fatal("Attachment tree file must contain only one line/tree");
   if (attachtree_count == 0)
     fatal("No attachment tree found in file");
-  fclose(fp_attach);
+  treeio_close(fp_attach);
 
   assert(attachtree);
   assert(attachtree_count);
 
   /* iterate through input trees and attach */
-  while ((newick = getnextline(fp_input)))
+  while (treeio_next(fp_input, &tree))
   {
-    ntree_t * tree = ntree_parse_newick(newick);
     if (!tree)
       fatal("Cannot parse tree file %s", opt_treefile);
 
     fp_output = opt_outfile ?
                   xopen(opt_outfile,"w") : stdout;
 
-    free(newick);
-
     /* find tip */
     for (i = 0; i < tree->leaves_count; ++i)
       if (!strcmp(tree->leaves[i]->label,opt_attachat))
@@ -119,7 +114,7 @@ void cmd_attach()
       fclose(fp_output);
   }
 
-  fclose(fp_input);
+  treeio_close(fp_input);
   free(attachtree->leaves);
   free(attachtree->inner);
   free(attachtree);
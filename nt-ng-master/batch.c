@@ -0,0 +1,687 @@
+/*
+    Copyright (C) 2015-2017 Tomas Flouri
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Tomas Flouri <t.flouris@ucl.ac.uk>,
+    Department of Genetics, Evolution and Environment,
+    University College London,
+    Gower Street, London WC1E 6BT, England
+*/
+
+
+#include "newick-tools.h"
+
+/* Batch evaluation of inferred trees against a reference, replacing the
+   induce -> difftree -> induce --no-prune -> FP_counter.pl job loops of the
+   cluster scripts with a single process.
+
+   Each manifest line names an inferred tree file (first column) and
+   optionally a reference tree file (second column, otherwise --tree). For
+   every line in --range, the reference is pruned to the tips of the inferred
+   tree and the two trees are compared once. Then, for each of --depths bands
+   of subtree sizes (2^(d-1), 2^d], the subtrees of the compared tree that are
+   absent from the other tree are matched against the clade of their lowest
+   common ancestor in the other tree, and one row is written with the same
+   four values as FP_counter.pl. As in FP_counter.pl, only tips whose label
+   starts with --cell_prefix are counted as cells. The Robinson-Foulds
+   distance of each band, i.e. the number of non-root clades of that size
+   found in only one of the two trees, is kept in the checkpoint log and the
+   --binary results, but not in the rows, which keep the format of
+   FP_counter.pl.
+
+   With --measure fp the reference is compared against the inferred tree
+   (subtrees of the reference missing from the inferred tree, lca taken in
+   the inferred tree); with --measure fn the roles are swapped.
+
+   Trees are parsed serially, in chunks of BATCH_CHUNK_JOBS pairs per thread,
+   and each chunk is evaluated in parallel with threads_steal_for, as pairs
+   range from a few to thousands of tips. Rows are written in manifest
+   order.
+
+   With --checkpoint, the rows of every evaluated tree are also appended to a
+   log that is synced to disk after each chunk. A restarted run with the same
+   log skips the trees found in it, so an interrupted job loses at most the
+   chunk in progress. With --binary, the metrics are also written to a
+   columnar results file (see results.c) for --aggregate. */
+
+/* upper subtree size of the deepest band, as in the cluster scripts */
+#define BATCH_DEEPEST_LT 1000
+
+/* number of tree pairs parsed per thread before evaluating them */
+#define BATCH_CHUNK_JOBS 64
+
+typedef struct batch_entry_s
+{
+  long line;                  /* line number in manifest */
+  char * inferred;            /* inferred tree file */
+  char * reference;           /* reference tree file, NULL for --tree */
+  batch_metrics_t * metrics;  /* metrics read from the checkpoint log */
+} batch_entry_t;
+
+typedef struct batch_chunk_s
+{
+  batch_entry_t * entries;
+  ntree_t ** inferred;
+  ntree_t ** reference;
+  batch_metrics_t * metrics;  /* --depths rows per pair */
+  int measure;
+} batch_chunk_t;
+
+static void parse_range(long * first, long * last)
+{
+  *first = 1;
+  *last = LONG_MAX;
+
+  if (opt_range && !args_getrange(opt_range, first, last))
+    fatal("Argument --range must be of the form INT-INT, INT- or INT");
+}
+
+/* read the manifest once and keep the entries within the range */
+static batch_entry_t * manifest_load(const char * filename, long * count)
+{
+  FILE * fp;
+  char * line;
+  long lineno = 0;
+  long alloc = 0;
+  long first, last;
+  batch_entry_t * entries = NULL;
+
+  parse_range(&first, &last);
+
+  *count = 0;
+  fp = xopen(filename,"r");
+  while ((line = getnextline(fp)))
+  {
+    char * token;
+    char * saveptr;
+
+    ++lineno;
+    if (lineno < first || lineno > last)
+    {
+      free(line);
+      if (lineno > last) break;
+      continue;
+    }
+
+    token = strtok_r(line, " \t\r", &saveptr);
+    if (!token || token[0] == '#')
+    {
+      free(line);
+      continue;
+    }
+
+    if (*count == alloc)
+    {
+      alloc = alloc ? 2*alloc : 64;
+      entries = (batch_entry_t *)xrealloc(entries,
+                                          (size_t)alloc *
+                                          sizeof(batch_entry_t));
+    }
+
+    entries[*count].line = lineno;
+    entries[*count].inferred = xstrdup(token);
+    token = strtok_r(NULL, " \t\r", &saveptr);
+    entries[*count].reference = token ? xstrdup(token) : NULL;
+    entries[*count].metrics = NULL;
+    (*count)++;
+
+    free(line);
+  }
+  fclose(fp);
+
+  return entries;
+}
+
+static batch_entry_t * find_entry(batch_entry_t * entries,
+                                  long count,
+                                  long line)
+{
+  long lo = 0;
+  long hi = count;
+
+  /* entries are sorted by line number */
+  while (lo < hi)
+  {
+    long mid = lo + (hi-lo)/2;
+    if (entries[mid].line < line)
+      lo = mid+1;
+    else
+      hi = mid;
+  }
+
+  return (lo < count && entries[lo].line == line) ? entries+lo : NULL;
+}
+
+/* The checkpoint log starts with a line recording the options that affect
+   the results, followed by the metrics of each evaluated tree, one line per
+   depth from 1 to --depths. Lines of one tree are always written together,
+   so after a crash only the tail of the log can be incomplete; it is
+   truncated away. Returns the log opened for appending, and sets the metrics
+   of the entries found in it */
+static FILE * checkpoint_open(batch_entry_t * entries,
+                              long count,
+                              const char * signature,
+                              long * resumed)
+{
+  FILE * fp;
+  char * line = NULL;
+  size_t line_size = 0;
+  ssize_t len;
+  long offset = 0;
+  long valid = 0;
+  long lineno = 1;
+  long cur_line = 0;
+  long cur_depth = 0;
+  batch_entry_t * entry = NULL;
+  batch_metrics_t * metrics = NULL;
+
+  *resumed = 0;
+
+  fp = xopen(opt_checkpoint, "a+");
+  rewind(fp);
+
+  len = getline(&line, &line_size, fp);
+  if (len > 0 && line[len-1] == '\n')
+  {
+    if (strcmp(line, signature))
+      fatal("Checkpoint file %s was written with different options",
+            opt_checkpoint);
+
+    valid = offset = len;
+
+    while ((len = getline(&line, &line_size, fp)) > 0)
+    {
+      batch_metrics_t m;
+      char * tree;
+      char * end;
+      int fields;
+
+      /* a line cut short by the crash */
+      if (line[len-1] != '\n')
+        break;
+
+      ++lineno;
+      offset += len;
+
+      m.line = strtol(line, &tree, 10);
+      if (tree == line || *tree != '\t' || !(end = strchr(++tree, '\t')))
+        fatal("Checkpoint file %s is malformed at line %ld",
+              opt_checkpoint, lineno);
+
+      fields = sscanf(end, "%ld %ld %ld %ld %ld %ld %ld %lf",
+                      &m.depth, &m.matches, &m.mismatches,
+                      &m.fp_cells, &m.lca_cells, &m.cells, &m.rf, &m.rate);
+      if (fields != 8)
+        fatal("Checkpoint file %s is malformed at line %ld",
+              opt_checkpoint, lineno);
+
+      if (m.line != cur_line)
+      {
+        if (cur_depth)
+          fatal("Checkpoint file %s has missing lines before line %ld",
+                opt_checkpoint, lineno);
+
+        cur_line = m.line;
+        entry = find_entry(entries, count, m.line);
+        if (entry && strncmp(tree, entry->inferred, (size_t)(end-tree)))
+          fatal("Checkpoint file %s lists %.*s at manifest line %ld, "
+                "but the manifest lists %s", opt_checkpoint,
+                (int)(end-tree), tree, m.line, entry->inferred);
+
+        if (entry && !entry->metrics)
+          metrics = (batch_metrics_t *)xmalloc((size_t)opt_depths *
+                                               sizeof(batch_metrics_t));
+      }
+
+      if (m.depth != cur_depth+1)
+        fatal("Checkpoint file %s is malformed at line %ld",
+              opt_checkpoint, lineno);
+      cur_depth = m.depth;
+
+      if (metrics)
+        metrics[cur_depth-1] = m;
+
+      if (cur_depth == opt_depths)
+      {
+        if (metrics)
+        {
+          entry->metrics = metrics;
+          (*resumed)++;
+        }
+        metrics = NULL;
+        cur_line = cur_depth = 0;
+        valid = offset;
+      }
+    }
+
+    if (fflush(fp) || ftruncate(fileno(fp), valid))
+      fatal("Unable to truncate checkpoint file (%s)", opt_checkpoint);
+  }
+  else
+  {
+    /* new log, or one that crashed before its first line was complete */
+    if (fflush(fp) || ftruncate(fileno(fp), 0))
+      fatal("Unable to truncate checkpoint file (%s)", opt_checkpoint);
+    fputs(signature, fp);
+  }
+
+  free(line);
+  free(metrics);
+
+  fseek(fp, 0, SEEK_END);
+
+  return fp;
+}
+
+static void checkpoint_write(FILE * fp,
+                             batch_entry_t * entry,
+                             batch_metrics_t * metrics)
+{
+  long d;
+
+  for (d = 0; d < opt_depths; ++d)
+    fprintf(fp,
+            "%ld\t%s\t%ld\t%ld\t%ld\t%ld\t%ld\t%ld\t%ld\t%.17g\n",
+            entry->line,
+            entry->inferred,
+            metrics[d].depth,
+            metrics[d].matches,
+            metrics[d].mismatches,
+            metrics[d].fp_cells,
+            metrics[d].lca_cells,
+            metrics[d].cells,
+            metrics[d].rf,
+            metrics[d].rate);
+}
+
+static void checkpoint_sync(FILE * fp)
+{
+  if (fflush(fp) || fsync(fileno(fp)))
+    fatal("Unable to write checkpoint file (%s)", opt_checkpoint);
+}
+
+/* write the rows of one tree in the format of FP_counter.pl */
+static void write_rows(FILE * fp,
+                       batch_entry_t * entry,
+                       batch_metrics_t * metrics)
+{
+  long d;
+
+  for (d = 0; d < opt_depths; ++d)
+  {
+    batch_metrics_t * m = metrics + d;
+    long total = m->matches + m->mismatches;
+
+    fprintf(fp, "%ld\t%s\t%ld\t", entry->line, entry->inferred, m->depth);
+
+    if (m->matches < 0)
+      fprintf(fp, "NA\tNA\tNA\tNA\n");
+    else if (!total)
+      fprintf(fp, "NA\tNA\t%ld\t%ld\n", m->matches, m->mismatches);
+    else
+      fprintf(fp,
+              "%.4f\t%.4f\t%ld\t%ld\n",
+              m->rate / total,
+              m->matches / (double)total,
+              m->matches,
+              m->mismatches);
+  }
+}
+
+static ntree_t * load_tree(const char * filename)
+{
+  ntree_t * tree;
+  treeio_t * in = treeio_open(filename);
+
+  if (!treeio_next(in, &tree))
+    fatal("File %s does not contain a tree", filename);
+  if (!tree)
+    fatal("Cannot parse tree file %s", filename);
+
+  treeio_close(in);
+
+  return tree;
+}
+
+/* collect the tips below node into tips, returning their number */
+static long subtree_tips(node_t * node, node_t ** tips, node_t ** stack)
+{
+  long top = 0;
+  long count = 0;
+  int i;
+
+  stack[top++] = node;
+  while (top)
+  {
+    node = stack[--top];
+    if (!node->children_count)
+      tips[count++] = node;
+    else
+      for (i = node->children_count-1; i >= 0; --i)
+        stack[top++] = node->children[i];
+  }
+
+  return count;
+}
+
+static long count_cells(node_t ** tips, long count)
+{
+  long i;
+  long cells = 0;
+  size_t len = strlen(opt_cell_prefix);
+
+  for (i = 0; i < count; ++i)
+    if (tips[i]->label && !strncmp(tips[i]->label, opt_cell_prefix, len))
+      cells++;
+
+  return cells;
+}
+
+static void batch_evaluate(ntree_t * inferred,
+                           const ntree_t * reference,
+                           int measure,
+                           batch_metrics_t * metrics)
+{
+  long i;
+  long d;
+  ntree_t * induced = ntree_induce(reference, inferred, NULL);
+
+  /* difftree reference and input trees, and the tree in which the lca of
+     each mismatching subtree is looked up */
+  ntree_t * diffref;
+  ntree_t * diffinp;
+  ntree_t * lcatree;
+
+  if (measure == MEASURE_FP)
+  {
+    diffref = ntree_clone(inferred,NULL);
+    diffinp = ntree_clone(induced,NULL);
+    lcatree = inferred;
+  }
+  else
+  {
+    diffref = ntree_clone(induced,NULL);
+    diffinp = ntree_clone(inferred,NULL);
+    lcatree = induced;
+  }
+
+  int compared = bipart_difftree(diffref, diffinp);
+
+  /* size of each mismatching subtree and of its lca clade in lcatree */
+  long * cells = (long *)xcalloc((size_t)diffinp->inner_count, sizeof(long));
+  long * clade = (long *)xcalloc((size_t)diffinp->inner_count, sizeof(long));
+
+  if (compared)
+  {
+    long nodes = MAX(diffinp->leaves_count + diffinp->inner_count,
+                     lcatree->leaves_count + lcatree->inner_count);
+    node_t ** tips = (node_t **)xmalloc((size_t)nodes * sizeof(node_t *));
+    node_t ** stack = (node_t **)xmalloc((size_t)nodes * sizeof(node_t *));
+
+    for (i = 0; i < diffinp->inner_count; ++i)
+    {
+      node_t * node = diffinp->inner[i];
+      if (!node->mark) continue;
+
+      long count = subtree_tips(node, tips, stack);
+      node_t * lca = ntree_lca(lcatree, tips, count);
+
+      cells[i] = count_cells(tips, count);
+      clade[i] = count_cells(tips, subtree_tips(lca, tips, stack));
+    }
+
+    free(tips);
+    free(stack);
+  }
+
+  for (d = 1; d <= opt_depths; ++d)
+  {
+    long gt = 1l << (d-1);
+    long lt = d < opt_depths ? (1l << d) + 1 : BATCH_DEEPEST_LT;
+    batch_metrics_t * m = metrics + d-1;
+
+    memset(m, 0, sizeof(batch_metrics_t));
+    m->depth = d;
+
+    if (!compared)
+    {
+      m->matches = m->mismatches = m->rf = -1;
+      continue;
+    }
+
+    m->matches = bipart_count_matches(diffinp, gt, lt);
+
+    /* clades of the band in diffref but not in diffinp. Matching clades have
+       equal bitmasks and hence sizes, so they are the matches */
+    for (i = 0; i < diffref->inner_count; ++i)
+    {
+      node_t * node = diffref->inner[i];
+
+      if (node->parent && node->leaves > gt && node->leaves < lt)
+        m->rf++;
+    }
+    m->rf -= m->matches;
+
+    for (i = 0; i < diffinp->inner_count; ++i)
+    {
+      node_t * node = diffinp->inner[i];
+
+      if (!node->mark || node->leaves <= gt || node->leaves >= lt)
+        continue;
+
+      m->mismatches++;
+      m->cells += cells[i];
+      m->lca_cells += clade[i];
+      m->fp_cells += clade[i] - cells[i];
+      m->rf++;
+      if (clade[i])
+        m->rate += (clade[i] - cells[i]) / (double)clade[i];
+    }
+  }
+
+  free(cells);
+  free(clade);
+  ntree_destroy(diffref,free);
+  ntree_destroy(diffinp,free);
+  ntree_destroy(induced,NULL);
+}
+
+static void batch_job(long index, long thread, void * data)
+{
+  batch_chunk_t * chunk = (batch_chunk_t *)data;
+
+  if (!chunk->inferred[index])
+    return;
+
+  batch_evaluate(chunk->inferred[index],
+                 chunk->reference[index],
+                 chunk->measure,
+                 chunk->metrics + index*opt_depths);
+
+  ntree_destroy(chunk->inferred[index],NULL);
+  chunk->inferred[index] = NULL;
+}
+
+void cmd_batch()
+{
+  long i,j,d;
+  long count;
+  long done = 0;
+  FILE * fp_output;
+  batch_chunk_t chunk;
+  ntree_t * global_ref = NULL;
+  ntree_t * entry_ref = NULL;
+  char * entry_ref_name = NULL;
+  ntree_t ** retired;
+  long retired_count = 0;
+  long resumed = 0;
+  FILE * fp_checkpoint = NULL;
+  FILE * fp_binary = NULL;
+
+  if (!opt_measure || !strcasecmp(opt_measure, "fp"))
+    chunk.measure = MEASURE_FP;
+  else if (!strcasecmp(opt_measure, "fn"))
+    chunk.measure = MEASURE_FN;
+  else
+    fatal("Option --measure can be 'fp' or 'fn'");
+
+  batch_entry_t * entries = manifest_load(opt_batch, &count);
+
+  if (!count)
+    fatal("No trees listed in %s within the given range", opt_batch);
+
+  if (opt_checkpoint)
+  {
+    char signature[256];
+
+    snprintf(signature, sizeof(signature),
+             "# newick-tools --batch --measure %s --depths %ld "
+             "--cell_prefix %s (log version 3)\n",
+             chunk.measure == MEASURE_FP ? "fp" : "fn",
+             opt_depths,
+             opt_cell_prefix);
+    fp_checkpoint = checkpoint_open(entries, count, signature, &resumed);
+
+    if (!opt_quiet && resumed)
+      fprintf(stdout,
+              "Resuming from %s: %ld of %ld trees already evaluated\n",
+              opt_checkpoint, resumed, count);
+  }
+
+  if (opt_treefile && resumed < count)
+    global_ref = load_tree(opt_treefile);
+
+  fp_output = opt_outfile ?
+                xopen(opt_outfile,"w") : stdout;
+
+  fprintf(fp_output,
+          "line\ttree\tdepth\t%s\tacc\tmatches\tmismatches\n",
+          chunk.measure == MEASURE_FP ? "fp" : "fn");
+
+  if (opt_binary)
+    fp_binary = results_create(opt_binary, chunk.measure, opt_depths);
+
+  long chunk_size = MIN(MAX(opt_threads,1) * BATCH_CHUNK_JOBS, count);
+
+  chunk.inferred = (ntree_t **)xcalloc((size_t)chunk_size, sizeof(ntree_t *));
+  chunk.reference = (ntree_t **)xmalloc((size_t)chunk_size *
+                                        sizeof(ntree_t *));
+  chunk.metrics = (batch_metrics_t *)xmalloc((size_t)(chunk_size*opt_depths) *
+                                             sizeof(batch_metrics_t));
+  long * cost = (long *)xmalloc((size_t)chunk_size * sizeof(long));
+
+  /* references replaced within a chunk are kept until it is evaluated */
+  retired = (ntree_t **)xmalloc((size_t)chunk_size * sizeof(ntree_t *));
+
+  progress_init("Evaluating trees:", (unsigned long)count);
+  for (i = 0; i < count; i += chunk_size)
+  {
+    long chunk_count = MIN(chunk_size, count - i);
+
+    chunk.entries = entries + i;
+
+    /* parsing interns labels, hence it is done before going parallel */
+    for (j = 0; j < chunk_count; ++j)
+    {
+      batch_entry_t * entry = entries + i + j;
+      ntree_t * reference = global_ref;
+
+      if (entry->metrics)
+      {
+        memcpy(chunk.metrics + j*opt_depths,
+               entry->metrics,
+               (size_t)opt_depths * sizeof(batch_metrics_t));
+        free(entry->metrics);
+        entry->metrics = NULL;
+        chunk.inferred[j] = NULL;
+        cost[j] = 0;
+        continue;
+      }
+
+      if (entry->reference)
+      {
+        /* consecutive lines usually share the same reference */
+        if (!entry_ref_name || strcmp(entry_ref_name, entry->reference))
+        {
+          if (entry_ref)
+            retired[retired_count++] = entry_ref;
+          free(entry_ref_name);
+          entry_ref = load_tree(entry->reference);
+          entry_ref_name = xstrdup(entry->reference);
+        }
+        reference = entry_ref;
+      }
+
+      if (!reference)
+        fatal("No reference tree for %s (use --tree or a second column)",
+              entry->inferred);
+
+      chunk.reference[j] = reference;
+      chunk.inferred[j] = load_tree(entry->inferred);
+      cost[j] = chunk.inferred[j]->leaves_count;
+    }
+
+    threads_steal_for(chunk_count, cost, batch_job, &chunk, &done);
+
+    for (j = 0; j < chunk_count; ++j)
+    {
+      batch_metrics_t * metrics = chunk.metrics + j*opt_depths;
+
+      for (d = 0; d < opt_depths; ++d)
+        metrics[d].line = entries[i+j].line;
+
+      write_rows(fp_output, entries+i+j, metrics);
+      /* resumed trees have zero cost */
+      if (fp_checkpoint && cost[j])
+        checkpoint_write(fp_checkpoint, entries+i+j, metrics);
+    }
+
+    if (fp_binary)
+      results_write(fp_binary, chunk.metrics, chunk_count*opt_depths);
+
+    if (fp_checkpoint)
+      checkpoint_sync(fp_checkpoint);
+
+    for (j = 0; j < retired_count; ++j)
+      ntree_destroy(retired[j],NULL);
+    retired_count = 0;
+  }
+  progress_done();
+
+  if (opt_outfile)
+    fclose(fp_output);
+
+  if (fp_binary)
+    results_close(fp_binary);
+
+  if (fp_checkpoint)
+    fclose(fp_checkpoint);
+
+  free(chunk.metrics);
+  free(chunk.inferred);
+  free(chunk.reference);
+  free(cost);
+  free(retired);
+
+  ntree_destroy(global_ref,NULL);
+  ntree_destroy(entry_ref,NULL);
+  free(entry_ref_name);
+  for (i = 0; i < count; ++i)
+  {
+    free(entries[i].inferred);
+    free(entries[i].reference);
+  }
+  free(entries);
+}
@@ -0,0 +1,401 @@
+/*
+    Copyright (C) 2015-2017 Tomas Flouri
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Tomas Flouri <t.flouris@ucl.ac.uk>,
+    Department of Genetics, Evolution and Environment,
+    University College London,
+    Gower Street, London WC1E 6BT, England
+*/
+
+
+#include "newick-tools.h"
+
+/* Benchmark of the core tree operations on synthetic trees (--bench).
+
+   For each number of tips from 4 up to the given maximum, growing by a
+   factor of four, and for each shape (balanced, caterpillar and random,
+   i.e. random joining of two subtrees), a rooted binary tree with uniform
+   branch lengths is generated and the following operations are timed:
+
+     parse         ntree_parse_newick
+     export        ntree_export_newick
+     clone         ntree_clone
+     induce        ntree_induce on every other tip (and the last one)
+     difftree      bipart_difftree against a tree of the same shape with
+                   shuffled tip labels
+     bipartitions  bipart_compute
+     identical     identical_sort of two trees and identical_match
+
+   Each operation is repeated such that about BENCH_NODES nodes are
+   processed, and one tab-separated row is written per shape, size and
+   operation, giving the throughput in trees and nodes per second and the
+   peak memory of the process so far. difftree and bipartitions keep a
+   bitmask over all tips at each node, i.e. need memory quadratic in the
+   number of tips, and are only run up to BENCH_QUADRATIC_MAX tips. The same
+   holds for identical on caterpillars, where identical_sort rotates the
+   nodes below each inner node and takes quadratic time.
+
+   Each shape and size runs in its own thread with a stack proportional to
+   the number of tips, as some operations recurse as deep as the tree */
+
+#define BENCH_NODES 1000000
+#define BENCH_QUADRATIC_MAX 4096
+#define BENCH_STACK_PER_TIP 512
+
+#define SHAPE_BALANCED    0
+#define SHAPE_CATERPILLAR 1
+#define SHAPE_RANDOM      2
+#define SHAPE_COUNT       3
+
+static const char * shape_names[SHAPE_COUNT] =
+  { "balanced", "caterpillar", "random" };
+
+typedef struct bench_case_s
+{
+  FILE * out;
+  int shape;
+  long tips;
+  char ** labels;
+} bench_case_t;
+
+static long bench_nsec(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static node_t * join(node_t * nodes,
+                     node_t ** children,
+                     long tips,
+                     long * inner_used,
+                     node_t * a,
+                     node_t * b)
+{
+  node_t * node = nodes + tips + *inner_used;
+
+  node->children = children + 2*(*inner_used);
+  node->children[0] = a;
+  node->children[1] = b;
+  node->children_count = 2;
+  a->parent = node;
+  b->parent = node;
+  (*inner_used)++;
+
+  return node;
+}
+
+/* newick string of a rooted binary tree of the given shape whose i-th tip
+   (from left to right) is labelled labels[order[i]] */
+static char * bench_newick(int shape,
+                           long tips,
+                           char ** labels,
+                           long * order,
+                           rng_t * rng)
+{
+  long i,j;
+  long count = tips;
+  long inner_used = 0;
+  strbuf_t buf;
+
+  node_t * nodes = (node_t *)xcalloc((size_t)(2*tips-1), sizeof(node_t));
+  node_t ** children = (node_t **)xmalloc((size_t)(2*tips-2) *
+                                          sizeof(node_t *));
+  node_t ** active = (node_t **)xmalloc((size_t)tips * sizeof(node_t *));
+
+  for (i = 0; i < 2*tips-1; ++i)
+    nodes[i].length = rng_uniform(rng);
+
+  for (i = 0; i < tips; ++i)
+  {
+    nodes[i].label = labels[order[i]];
+    active[i] = nodes+i;
+  }
+
+  if (shape == SHAPE_CATERPILLAR)
+  {
+    for (i = 1; i < tips; ++i)
+      active[0] = join(nodes, children, tips, &inner_used, active[0],
+                       active[i]);
+  }
+  else if (shape == SHAPE_BALANCED)
+  {
+    /* join neighbouring subtrees level by level */
+    while (count > 1)
+    {
+      for (i = 0, j = 0; i+1 < count; i += 2)
+        active[j++] = join(nodes, children, tips, &inner_used, active[i],
+                           active[i+1]);
+      if (count % 2)
+        active[j++] = active[count-1];
+      count = j;
+    }
+  }
+  else
+  {
+    while (count > 1)
+    {
+      i = (long)rng_bounded(rng, (unsigned long)count);
+      j = (long)rng_bounded(rng, (unsigned long)(count-1));
+      if (j >= i)
+        ++j;
+      else
+        SWAP(i,j);
+
+      active[i] = join(nodes, children, tips, &inner_used, active[i],
+                       active[j]);
+      active[j] = active[--count];
+    }
+  }
+
+  strbuf_init(&buf);
+  ntree_newick_append(&buf, active[0], active[0]->length);
+
+  free(nodes);
+  free(children);
+  free(active);
+
+  return strbuf_detach(&buf);
+}
+
+static ntree_t * bench_parse(bench_case_t * bc, char * newick)
+{
+  ntree_t * tree = ntree_parse_newick(newick);
+  if (!tree)
+    fatal("Cannot parse generated %s tree of %ld tips",
+          shape_names[bc->shape], bc->tips);
+
+  return tree;
+}
+
+static void bench_row(bench_case_t * bc,
+                      const char * operation,
+                      long reps,
+                      long nsec)
+{
+  double seconds = nsec * 1e-9;
+  double nodes = (double)reps * (2*bc->tips-1);
+
+  fprintf(bc->out,
+          "%s\t%ld\t%s\t%ld\t%.6f\t%.1f\t%.1f\t%.1f\n",
+          shape_names[bc->shape],
+          bc->tips,
+          operation,
+          reps,
+          seconds,
+          seconds > 0 ? reps / seconds : 0,
+          seconds > 0 ? nodes / seconds : 0,
+          arch_get_memused() / (1024.0*1024.0));
+  fflush(bc->out);
+}
+
+static void * bench_run(void * data)
+{
+  bench_case_t * bc = (bench_case_t *)data;
+  long i,j;
+  long start;
+  long nsec;
+  long tips = bc->tips;
+  long reps = BENCH_NODES / (2*tips-1);
+  rng_t rng;
+
+  if (reps < 1)
+    reps = 1;
+
+  rng_seed(&rng, (unsigned long)opt_seed, (unsigned long)bc->shape);
+
+  long * order = (long *)xmalloc((size_t)tips * sizeof(long));
+  for (i = 0; i < tips; ++i)
+    order[i] = i;
+
+  char * newick = bench_newick(bc->shape, tips, bc->labels, order, &rng);
+  ntree_t * tree = bench_parse(bc, newick);
+
+  /* tree of every other tip from left to right, for induce. Keeping the
+     first and the last tip, both subtrees of the root keep a tip */
+  char ** sub_labels = (char **)xmalloc((size_t)tips * sizeof(char *));
+  for (i = 0, j = 0; i < tips; ++i)
+    if (i % 2 == 0 || i == tips-1)
+      sub_labels[j++] = tree->leaves[i]->label;
+  char * sub_newick = bench_newick(SHAPE_BALANCED, j, sub_labels, order,
+                                   &rng);
+  ntree_t * sub = bench_parse(bc, sub_newick);
+  free(sub_labels);
+
+  shuffle(&rng, order, (size_t)tips, sizeof(long));
+  char * other_newick = bench_newick(bc->shape, tips, bc->labels, order,
+                                     &rng);
+  ntree_t * other = bench_parse(bc, other_newick);
+
+  /* parse */
+  for (i = 0, nsec = 0; i < reps; ++i)
+  {
+    start = bench_nsec();
+    ntree_t * t = bench_parse(bc, newick);
+    nsec += bench_nsec() - start;
+    ntree_destroy(t,NULL);
+  }
+  bench_row(bc, "parse", reps, nsec);
+
+  /* export */
+  for (i = 0, nsec = 0; i < reps; ++i)
+  {
+    start = bench_nsec();
+    char * s = ntree_export_newick(tree);
+    nsec += bench_nsec() - start;
+    free(s);
+  }
+  bench_row(bc, "export", reps, nsec);
+
+  /* clone */
+  for (i = 0, nsec = 0; i < reps; ++i)
+  {
+    start = bench_nsec();
+    ntree_t * t = ntree_clone(tree,NULL);
+    nsec += bench_nsec() - start;
+    ntree_destroy(t,NULL);
+  }
+  bench_row(bc, "clone", reps, nsec);
+
+  /* induce */
+  for (i = 0, nsec = 0; i < reps; ++i)
+  {
+    start = bench_nsec();
+    ntree_t * t = ntree_induce(tree, sub, NULL);
+    nsec += bench_nsec() - start;
+    ntree_destroy(t,NULL);
+  }
+  bench_row(bc, "induce", reps, nsec);
+
+  if (tips <= BENCH_QUADRATIC_MAX)
+  {
+    /* difftree, on copies as bipart_difftree modifies both trees */
+    for (i = 0, nsec = 0; i < reps; ++i)
+    {
+      ntree_t * a = ntree_clone(tree,NULL);
+      ntree_t * b = ntree_clone(other,NULL);
+      start = bench_nsec();
+      bipart_difftree(a,b);
+      bipart_count_matches(b, 0, tips);
+      nsec += bench_nsec() - start;
+      ntree_destroy(a,free);
+      ntree_destroy(b,free);
+    }
+    bench_row(bc, "difftree", reps, nsec);
+
+    /* bipartitions */
+    for (i = 0, nsec = 0; i < reps; ++i)
+    {
+      ntree_t * a = ntree_clone(tree,NULL);
+      start = bench_nsec();
+      bipart_compute(stdout, a);
+      nsec += bench_nsec() - start;
+      ntree_destroy(a,free);
+    }
+    bench_row(bc, "bipartitions", reps, nsec);
+  }
+
+  /* identical */
+  if (tips <= BENCH_QUADRATIC_MAX || bc->shape != SHAPE_CATERPILLAR)
+  {
+    node_t ** ref_nodes = (node_t **)xmalloc((size_t)(2*tips-1) *
+                                             sizeof(node_t *));
+    node_t ** tgt_nodes = (node_t **)xmalloc((size_t)(2*tips-1) *
+                                             sizeof(node_t *));
+    for (i = 0, nsec = 0; i < reps; ++i)
+    {
+      start = bench_nsec();
+      identical_sort(tree, ref_nodes);
+      identical_sort(tree, tgt_nodes);
+      if (!identical_match(ref_nodes, tgt_nodes, 2*tips-1))
+        fatal("Internal error: tree not identical to itself");
+      nsec += bench_nsec() - start;
+    }
+    bench_row(bc, "identical", reps, nsec);
+
+    free(ref_nodes);
+    free(tgt_nodes);
+  }
+
+  ntree_destroy(tree,NULL);
+  ntree_destroy(other,NULL);
+  ntree_destroy(sub,NULL);
+  free(newick);
+  free(other_newick);
+  free(sub_newick);
+  free(order);
+
+  return NULL;
+}
+
+void cmd_bench()
+{
+  long i;
+  long tips;
+  int shape;
+  FILE * out;
+  bench_case_t bc;
+  pthread_t thread;
+  pthread_attr_t attr;
+
+  if (opt_bench < 4)
+    fatal("Argument --bench must be at least 4");
+
+  out = opt_outfile ?
+          xopen(opt_outfile,"w") : stdout;
+
+  bc.out = out;
+  bc.labels = (char **)xmalloc((size_t)opt_bench * sizeof(char *));
+  for (i = 0; i < opt_bench; ++i)
+    asprintf(bc.labels+i, "t%ld", i);
+
+  fprintf(out,
+          "shape\ttips\toperation\treps\tseconds\ttrees_per_sec\t"
+          "nodes_per_sec\tmaxrss_mb\n");
+
+  for (tips = 4; ; tips = MIN(4*tips, opt_bench))
+  {
+    for (shape = 0; shape < SHAPE_COUNT; ++shape)
+    {
+      if (!opt_quiet)
+        fprintf(stderr, "Benchmarking %s trees of %ld tips...\n",
+                shape_names[shape], tips);
+
+      bc.shape = shape;
+      bc.tips = tips;
+
+      pthread_attr_init(&attr);
+      if (pthread_attr_setstacksize(&attr,
+                                    (size_t)(8*1024*1024 +
+                                             BENCH_STACK_PER_TIP*tips)))
+        fatal("Cannot set the stack size of the benchmark thread");
+      if (pthread_create(&thread, &attr, bench_run, &bc))
+        fatal("Cannot create thread");
+      pthread_join(thread, NULL);
+      pthread_attr_destroy(&attr);
+    }
+
+    if (tips == opt_bench)
+      break;
+  }
+
+  if (opt_outfile)
+    fclose(out);
+
+  for (i = 0; i < opt_bench; ++i)
+    free(bc.labels[i]);
+  free(bc.labels);
+}
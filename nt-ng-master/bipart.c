@@ -22,9 +22,10 @@
 
 #include "newick-tools.h"
 
-static long bitmask_elms;
-static long bitmask_bits;
-static long lsize_bits;
+/* thread-local, as --batch compares several tree pairs at once */
+static __thread long bitmask_elms;
+static __thread long bitmask_bits;
+static __thread long lsize_bits;
 
 /* removes all nodes of degree 2 */
 static void prune_degree2(ntree_t * tree)
@@ -34,6 +35,8 @@ static void prune_degree2(ntree_t * tree)
 //  assert(tree->leaves_count > 3);
 //  assert(tree->inner_count > 1);
 
+  profile_begin(PROFILE_PRUNE);
+
   for (i = 0; i < tree->leaves_count; ++i)
   {
     node_t * x = tree->leaves[i];
@@ -123,321 +126,7 @@ static void prune_degree2(ntree_t * tree)
   free(tree->inner);
 
   wraptree(tree);
-}
-
-static void prune_tree(ntree_t * tree, int remove_count)
-{
-  int i,j,k;
-  long total_inner_deleted = 0;
-
-  /* TODO: Implement also a function that eliminates unary nodes */
-
-  for (i = 0; i < remove_count; ++i)
-  {
-    #if 0
-    if (!opt_quiet)
-      fprintf(stdout, "Pruning tip: %s\n", tree->leaves[i]->label);
-    #endif
-
-    node_t * parent = tree->leaves[i]->parent;
-    node_t * child  = tree->leaves[i];
-
-    /* 
-       if parent (inner node) remains with no children then delete
-       all adjacent ancestors with out-degree 1, i.e. nodes c and d 
-
-              /
-        *----*---*---*---*-------* 
-        a    b   c   d   parent   child
-
-    */
-    long inner_deleted = -1;
-    while (parent && child->children_count == 0)
-    {
-      node_t ** children = (node_t **)xmalloc((parent->children_count-1) *
-                                              sizeof(node_t *));
-
-      /* copy remaining children */
-      k = 0;
-      for (j = 0; j < parent->children_count; ++j)
-        if (parent->children[j] != child)
-          children[k++] = parent->children[j];
-      parent->children_count--;
-
-      free(parent->children);
-      parent->children = children;
-
-      /* delete child */
-      if (child->label)
-        free(child->label);
-      if (child->children)
-        free(child->children);
-      free(child);
-
-      child = parent;
-      parent = parent->parent;
-
-      inner_deleted++;
-    }
-    total_inner_deleted += inner_deleted;
-  }
-
-  /* wrap tree */
-  tree->leaves_count -= remove_count;
-  tree->inner_count  -= total_inner_deleted;
-  free(tree->leaves);
-  free(tree->inner);
-
-  wraptree(tree);
-}
-
-static void prune_binary(ntree_t * tree, int remove_count)
-{
-  int i;
-
-  for (i = 0; i < remove_count; ++i)
-  {
-    #if 0
-    if (!opt_quiet)
-      fprintf(stdout, "Pruning tip: %s\n", tree->leaves[i]->label);
-    #endif
-
-    node_t * parent = tree->leaves[i]->parent;
-    node_t * grandparent = parent->parent;
-
-    /* if rooted tree */
-    if (!grandparent)
-    {
-      fprintf(stderr,
-              "WARNING: All taxa from one subtree deleted. Root changed.\n");
-    }
-
-
-    /*
-
-      1. If grantparent exists:
-
-                  *  grandparent                 *  grandparemt
-                 / \                            / \
-                /   \                          /   \
-       parent  *    /\            ->          /    /\
-              / \  /__\                      /\   /__\
-             *   \                          /__\
-        tip      /\                 sibling
-                /__\
-                     sibling
-
-      2. Otherwise:
-               
-                  *  parent
-                 / \                         /\
-                /   \             ->        /__\
-               *    /\                            sibling
-           tip     /__\
-                        sibling
-          
-    */
-
-    node_t * sibling = (parent->children[0] == tree->leaves[i]) ?
-                             parent->children[1] : parent->children[0];
-
-    /* delete leaf */
-    if (tree->leaves[i]->label)
-      free(tree->leaves[i]->label);
-    free(tree->leaves[i]);
-
-    /* delete parent node */
-    if (parent->label)
-      free(parent->label);
-
-    /* check whether grandparent exists to distinguish cases */
-    if (grandparent)
-    {
-      if (grandparent->children[0] == parent)
-        grandparent->children[0] = sibling;
-      else
-        grandparent->children[1] = sibling;
-
-      sibling->length += parent->length;
-      sibling->parent = grandparent;
-    }
-    else
-    {
-      sibling->parent = NULL;
-
-      /* the next line will zero-out the root branch (origin) */
-      /* sibling->length = 0; */
-      tree->root = sibling;
-    }
-    free(parent->children);
-    free(parent);
-  }
-
-  /* wrap tree */
-  tree->leaves_count -= remove_count;
-  tree->inner_count  -= remove_count;
-  free(tree->leaves);
-  free(tree->inner);
-
-  wraptree(tree);
-}
-
-static void prune_unrooted(ntree_t * tree, int remove_count)
-{
-  int i,j;
-
-  for (i = 0; i < remove_count; ++i)
-  {
-    #if 0
-    if (!opt_quiet)
-      fprintf(stdout, "Pruning tip: %s\n", tree->leaves[i]->label);
-    #endif
-
-    node_t * parent = tree->leaves[i]->parent;
-    node_t * grandparent = parent->parent;
-
-    /*
-      
-      1. If grandparent exists
-
-                  *  grandparent                      *  grandparent
-                 /|\                                 /|\
-                / | \                               / | \
-               / /\  \                             / /\  \
-       parent * /__\  \           ->       parent / /__\  \
-             / \      /\                         /\       /\
-            *   \    /__\                       /__\     /__\
-        tip     /\                     sibling 
-               /__\
-                     sibling
-
-      2. Otherwise:
-
-                  *  parent                * newroot
-                 /|\                      /|\
-                / | \                    / | \
-               / u*  \                  /  |  \
-              /  / \  \        ->      /\  |  /\
-             *  /   \  \              /__\ | /__\
-        tip    /\   /\  \              a   |  b
-              /__\ /__\ /\                / \
-               a    b  /__\              /___\
-                        c                  c
-    */
-
-
-    if (grandparent)
-    {
-      node_t * sibling = (parent->children[0] == tree->leaves[i]) ?
-                               parent->children[1] : parent->children[0];
-      
-
-      /* delete parent node */
-      if (parent->label)
-        free(parent->label);
-
-      for (j = 0; j < grandparent->children_count; ++j)
-        if (grandparent->children[j] == parent)
-        {
-          grandparent->children[j] = sibling;
-          break;
-        }
-       
-       /* sanity check */
-       assert(j < grandparent->children_count);
-
-       sibling->length += parent->length;
-       sibling->parent = grandparent;
-
-       free(parent->children);
-       free(parent);
-    }
-    else
-    {
-      node_t * newroot = xmalloc(sizeof(node_t));
-      newroot->data = newroot->coord = NULL;
-      newroot->parent = NULL;
-      newroot->label = NULL;
-      newroot->length = 0;
-      newroot->children = (node_t **)xmalloc(3*sizeof(node_t *));
-      newroot->children_count = 3;
-
-      node_t * u;
-
-      /* find node u, i.e. the first inner node that is child of parent, and
-         copy its children (a,b) as children of the new root */
-      for (j = 0; j < parent->children_count; ++j)
-      {
-        if ((parent->children[j] != tree->leaves[i]) &&
-            (parent->children[j]->children_count))
-        {
-          u = parent->children[j];
-          memcpy(newroot->children,
-                 parent->children[j]->children,
-                 2*sizeof(node_t *));        /* node u */
-          break;
-        }
-      }
-
-      /* sanity check */
-      assert(j < parent->children_count);
-
-      /* find the remaining third child (irrespective of whether it is an inner
-         or tip node and make it a child of the new root */
-      assert(parent->children_count == 3);
-      for (j = 0; j < parent->children_count; ++j)
-      {
-        if ((parent->children[j] != tree->leaves[i]) &&
-            (parent->children[j] != u))
-        {
-          newroot->children[2] = parent->children[j];
-          break;
-        }
-      }
-
-      /* sanity check */
-      assert(j < parent->children_count);
-
-      /* re-parent children */
-      for (j = 0; j < 3; ++j)
-        newroot->children[j]->parent = newroot;
-      
-      /* fix the length of subtree c */
-      newroot->children[2]->length += u->length;
-
-      if (parent->label)
-      {
-        newroot->label = xstrdup(parent->label);
-        free(parent->label);
-      }
-      if (parent->label)
-        free(parent->label);
-      free(parent->children);
-      free(parent);
-
-      if (u->label)
-        free(u->label);
-      free(u->children);
-      free(u);
-
-      tree->root = newroot;
-
-    }
-
-    /* delete leaf */
-    if (tree->leaves[i]->label)
-      free(tree->leaves[i]->label);
-    free(tree->leaves[i]);
-  }
-
-  /* wrap tree */
-  tree->leaves_count -= remove_count;
-  tree->inner_count  -= remove_count;
-  free(tree->leaves);
-  free(tree->inner);
-
-  wraptree(tree);
-
+  profile_end(PROFILE_PRUNE);
 }
 
 static void mark_symmetric_diff(ntree_t * reftree,
@@ -449,37 +138,25 @@ static void mark_symmetric_diff(ntree_t * reftree,
   long ref_remove_count = 0;
   long inp_remove_count = 0;
 
-  /* hash reference tree tip labels */
-  hashtable_t * ht = hashtable_create(reftree->leaves_count);
   for (i = 0; i < reftree->leaves_count; ++i)
   {
-    pair_t * pair = (pair_t *)xmalloc(sizeof(pair_t));
-    pair->label = reftree->leaves[i]->label;
-    pair->index = i;
-
-    if (!hashtable_insert(ht,
-                          (void *)pair,
-                          hash_fnv(reftree->leaves[i]->label),
-                          hashtable_paircmp))
-      fatal("Duplicate taxon (%s)\n", reftree->leaves[i]->label);
-
+    node_t * tip = reftree->leaves[i];
+    if (reftree->taxa[tip->taxon] != tip)
+      fatal("Duplicate taxon (%s)\n", tip->label);
   }
 
   /* now match the tips in the input tree */
 
   for (i  = 0; i < inptree->leaves_count; ++i)
   {
-    pair_t * query = hashtable_find(ht,
-                                    inptree->leaves[i]->label,
-                                    hash_fnv(inptree->leaves[i]->label),
-                                    hashtable_paircmp);
-    if (!query)
+    long taxon = inptree->leaves[i]->taxon;
+    if (taxon >= reftree->taxa_count || !reftree->taxa[taxon])
     {
       inptree->leaves[i]->mark = 1;
       inp_remove_count++;
     }
     else
-      reftree->leaves[query->index]->mark = 1;
+      reftree->taxa[taxon]->mark = 1;
   }
 
   /* now inverse the marks in reference tree */
@@ -516,51 +193,33 @@ static void mark_symmetric_diff(ntree_t * reftree,
     }
   }
 
-  hashtable_destroy(ht,free);
-
   *ref_rem_count = ref_remove_count;
   *inp_rem_count = inp_remove_count;
 }
 
-static long height_recursive(node_t * node)
+/* reset branch lengths such that all tips are at the same distance from the
+   root and inner nodes are evenly spaced by their height (in edges) */
+static void ultrametric(ntree_t * tree)
 {
   long i;
-  long height;
-  long maxheight = 0;
+  heights_t * h = ntree_heights(tree);
+  double slice = 1.0 / h->height[NTREE_SLOT(tree,tree->root)];
 
-  if (!node->children_count)
+  for (i = 0; i < tree->leaves_count; ++i)
   {
-    node->age = 0;
-    return 0;
+    node_t * node = tree->leaves[i];
+    node->length = h->height[NTREE_SLOT(tree,node->parent)] * slice;
   }
 
-  for (i=0; i < node->children_count; ++i)
+  for (i = 0; i < tree->inner_count - 1; ++i)
   {
-    height = height_recursive(node->children[i]);
-    if (height > maxheight)
-      maxheight = height;
+    node_t * node = tree->inner[i];
+    node->length = (h->height[NTREE_SLOT(tree,node->parent)] -
+                    h->height[tree->leaves_count + i]) * slice;
   }
 
-  node->age = maxheight+1;
-
-  return node->age;
-}
-
-static void um_length_recursive(node_t * node, double slice)
-{
-  long i;
-  if (node->parent)
-    node->length = (node->parent->age - node->age)*slice;
-
-  for (i=0; i < node->children_count; ++i)
-    um_length_recursive(node->children[i],slice);
-}
-
-static void ultrametric(ntree_t * tree)
-{
-  long height = height_recursive(tree->root);
-
-  um_length_recursive(tree->root, 1.0 / height);
+  /* branch lengths changed */
+  ntree_heights_invalidate(tree);
 }
 
 
@@ -580,7 +239,7 @@ static void bitmask_print(FILE * out, unsigned long * bitmask)
       bits >>= 1ul;
     }
     bits_left -= bits_per_elm;
-    printf("  ");
+    fprintf(out,"  ");
   }
   for (i = 0; i < bitmask_elms; ++i)   fprintf(out, "     %lu", bitmask[i]);
   fprintf(out,"\n");
@@ -678,6 +337,20 @@ static void bipart_compute_recursive(node_t * node)
   node->data = (void *)bitmask;
 }
 
+/* Remove degree-2 nodes and store the bipartition bitmask of each node in
+   node->data, to be freed with ntree_destroy(tree,free). The order of tips
+   in the bitmasks is written to out if --show_bitmask is given */
+void bipart_compute(FILE * out, ntree_t * tree)
+{
+  prune_degree2(tree);
+
+  profile_begin(PROFILE_BITMASK);
+  bipart_init(tree->leaves_count);
+  bitmask_init(out, tree->leaves, tree->leaves_count);
+  bipart_compute_recursive(tree->root);
+  profile_end(PROFILE_BITMASK);
+}
+
 static void bipart_show(FILE * out, ntree_t * tree)
 {
   long i;
@@ -697,99 +370,125 @@ static void bipart_show(FILE * out, ntree_t * tree)
   }
 }
 
-void cmd_bipartitions_show()
+/* estimate of the memory for the bitmasks of tree and the output of
+   bipart_show, in bytes */
+static size_t bipart_show_size(const ntree_t * tree)
 {
-  long i = 0;
-  FILE * fp_input;
-  FILE * fp_output;
-  char * output_file;
-  char * newick;
+  long i;
+  size_t label_len = 0;
+  size_t nodes = (size_t)(tree->leaves_count + tree->inner_count);
+  size_t elms = (size_t)tree->leaves_count / (sizeof(long) * CHAR_BIT) + 1;
+  size_t size = nodes * (elms * sizeof(unsigned long) + 16);
 
-  if (!opt_treefile)
-    fatal("An input file must be specified");
+  if (opt_show_bitmask)
+    return size + (size_t)(tree->inner_count) *
+                  ((size_t)(tree->leaves_count) + 24*elms + 1);
 
-  fp_input  = xopen(opt_treefile,"r");
+  for (i = 0; i < tree->leaves_count; ++i)
+    if (tree->leaves[i]->label)
+      label_len += strlen(tree->leaves[i]->label);
+  label_len = label_len / (size_t)MAX(tree->leaves_count,1) + 1;
 
-  /* parse tree */
-  if (!opt_quiet)
-    fprintf(stdout, "Parsing tree file...\n");
+  for (i = 0; i < tree->inner_count; ++i)
+    size += (size_t)(tree->inner[i]->leaves) * label_len;
 
-  while ((newick = getnextline(fp_input)))
-  {
-    ++i;
+  return size;
+}
+
+static void * bipart_show_read(long * treeno, size_t * cost, void * data)
+{
+  ntree_t * tree;
 
-    ntree_t * tree = ntree_parse_newick(newick);
-    if (!tree)
-      fatal("Cannot parse tree file");
+  if (!treeio_next((treeio_t *)data, &tree))
+    return NULL;
 
-    free(newick);
+  if (!tree)
+    fatal("Cannot parse tree file");
 
-    if (tree->leaves_count < 4)
-    {
-      fprintf(stderr,
-              "Skipping tree %ld (no non-trivial bipartitions for %d tips)\n",
-              i, tree->leaves_count);
-      ntree_destroy(tree,free);
-      continue;
-    }
+  *treeno = treeio_treeno((treeio_t *)data);
+  *cost = ntree_size(tree) + bipart_show_size(tree);
 
-    
-    /* prepare output medium */
-    if (!opt_outfile)
-      fp_output = stdout;
-    else
-    {
-      asprintf(&output_file, "%s.%ld.txt", opt_outfile, i);
-      fp_output = xopen(output_file, "w");
-      free(output_file);
-    }
+  return tree;
+}
 
-    if (!opt_outfile)
-      fprintf(stdout,"Tree %ld:\n",i);
+/* output streams of cmd_bipartitions_show */
+#define BIPART_STDOUT   0
+#define BIPART_STDERR   1
+#define BIPART_OUTPUT   2
+#define BIPART_STREAMS  3
 
-    prune_degree2(tree);
+static int bipart_show_job(long treeno, void * item, FILE ** fp, void * data)
+{
+  ntree_t * tree = (ntree_t *)item;
 
-    bipart_init(tree->leaves_count);
-    bitmask_init(fp_output, tree->leaves, tree->leaves_count);
-    bipart_compute_recursive(tree->root);
+  if (tree->leaves_count < 4)
+  {
+    fprintf(fp[BIPART_STDERR],
+            "Skipping tree %ld (no non-trivial bipartitions for %d tips)\n",
+            treeno, tree->leaves_count);
+    ntree_destroy(tree,free);
+    return 0;
+  }
 
-#if REMOVED_NOW
-    /* if root is binary then zero-out its data element (bipartition bitmask)
-       and in the special case that one of the two descedents of the root is
-       a tip and we have only three tips in our tree, issue a warning */
-    if (tree->root->children_count == 2)
-    {
-      assert(tree->root->children[0]->data);
-      free(tree->root->children[0]->data);
-      tree->root->children[0]->data = NULL;
+  if (!opt_outfile)
+    fprintf(fp[BIPART_STDOUT],"Tree %ld:\n",treeno);
 
-      if (tree->leaves_count == 3)
-        fprintf(stderr,"WARNING: Tree %ld is rooted with three tips - "
-                       "printing a trivial bipartition\n", i);
-    }
-#endif
-    /* show bipartitions */
-    bipart_show(fp_output,tree);
+  bipart_compute(fp[BIPART_OUTPUT], tree);
 
-    /* deallocate tree structure */
-    ntree_destroy(tree,free);
+#if REMOVED_NOW
+  /* if root is binary then zero-out its data element (bipartition bitmask)
+     and in the special case that one of the two descedents of the root is
+     a tip and we have only three tips in our tree, issue a warning */
+  if (tree->root->children_count == 2)
+  {
+    assert(tree->root->children[0]->data);
+    free(tree->root->children[0]->data);
+    tree->root->children[0]->data = NULL;
 
-    if (opt_outfile)
-      fclose(fp_output);
+    if (tree->leaves_count == 3)
+      fprintf(fp[BIPART_STDERR],"WARNING: Tree %ld is rooted with three tips - "
+                     "printing a trivial bipartition\n", treeno);
   }
+#endif
+  /* show bipartitions */
+  bipart_show(fp[BIPART_OUTPUT],tree);
 
-  fclose(fp_input);
+  /* deallocate tree structure */
+  ntree_destroy(tree,free);
+
+  return 1;
 }
 
-static int cb_cmp_nodelabel(const void * a, const void * b)
+void cmd_bipartitions_show()
 {
-  node_t ** x = (node_t **)a;
-  node_t ** y = (node_t **)b;
+  treeio_t * fp_input;
+  treeout_t * outs[BIPART_STREAMS];
+
+  if (!opt_treefile)
+    fatal("An input file must be specified");
+
+  fp_input  = treeio_open_selected(opt_treefile);
+
+  /* parse tree */
+  if (!opt_quiet)
+    fprintf(stdout, "Parsing tree file...\n");
+
+  /* prepare output media */
+  outs[BIPART_STDOUT] = treeout_console(stdout);
+  outs[BIPART_STDERR] = treeout_console(stderr);
+  outs[BIPART_OUTPUT] = treeout_open("txt");
+
+  threads_pipeline(outs,
+                   BIPART_STREAMS,
+                   bipart_show_read,
+                   bipart_show_job,
+                   fp_input);
 
-  char * xlabel = (*x)->label;
-  char * ylabel = (*y)->label;
+  treeout_close(outs[BIPART_OUTPUT]);
+  treeout_close(outs[BIPART_STDERR]);
+  treeout_close(outs[BIPART_STDOUT]);
 
-  return strcmp(xlabel,ylabel);
+  treeio_close(fp_input);
 }
 
 static int cb_cmp_bitmask(const void * a, const void * b)
@@ -806,7 +505,7 @@ static int cb_cmp_bitmask(const void * a, const void * b)
   {
     if (xbitmask[i] > ybitmask[i]) return 1;
     
-    if (xbitmask[i] < ybitmask[i]) return 0;
+    if (xbitmask[i] < ybitmask[i]) return -1;
   }
 
   return 0;
@@ -863,6 +562,50 @@ static long compare_masks(node_t ** refnode,
   return diff;
 }
 
+/* recompute the bitmasks of inner nodes from the bitmasks of the tips,
+   re-using the already allocated bitmasks */
+static void bipart_update(ntree_t * tree)
+{
+  long i,j,k;
+
+  /* inner nodes are stored in postorder */
+  for (i = 0; i < tree->inner_count; ++i)
+  {
+    node_t * node = tree->inner[i];
+    unsigned long * bitmask = (unsigned long *)(node->data);
+
+    memset(bitmask, 0, (size_t)bitmask_elms * sizeof(unsigned long));
+
+    for (j = 0; j < node->children_count; ++j)
+    {
+      unsigned long * cbitmask = (unsigned long *)(node->children[j]->data);
+
+      for (k = 0; k < bitmask_elms; ++k)
+        bitmask[k] |= cbitmask[k];
+    }
+  }
+}
+
+/* count the non-root subtrees of the input tree whose number of leaves is
+   within the band (filter_gt, filter_lt), and which are also present in the
+   reference tree, i.e. unmarked after compare_masks() */
+long bipart_count_matches(ntree_t * inptree, long filter_gt, long filter_lt)
+{
+  long i;
+  long count = 0;
+
+  for (i = 0; i < inptree->inner_count; ++i)
+  {
+    node_t * node = inptree->inner[i];
+
+    if (node->leaves > filter_gt && node->leaves < filter_lt &&
+        !node->mark && node->parent)
+      count++;
+  }
+
+  return count;
+}
+
 static node_t ** bitmask_sort(ntree_t * tree)
 {
   long i,j;
@@ -886,375 +629,513 @@ static node_t ** bitmask_sort(ntree_t * tree)
   return node_list;
 }
 
-void cmd_difftree()
+/* Compares the reference tree against opt_permutations copies of the input
+   tree with randomly permuted tip labels, and reports the distribution of the
+   number of matching subtrees. Only the assignment of tip bitmasks changes
+   between permutations; the topology and allocated bitmasks are re-used */
+static void permutation_test(ntree_t * inptree,
+                             node_t ** refmasks,
+                             long refcount,
+                             long observed,
+                             long treeno,
+                             FILE * out)
+{
+  long i,k;
+  long inpcount = inptree->inner_count-1;
+  long max = 0;
+  long min = inptree->inner_count;
+  long exceed = 0;
+  double sum = 0;
+  rng_t rng;
+
+  /* each input tree has its own random stream */
+  rng_seed(&rng, (unsigned long)opt_seed, (unsigned long)(treeno-1));
+
+  long * hist = (long *)xcalloc((size_t)(inptree->inner_count+1),
+                                sizeof(long));
+  void ** tipmasks = (void **)xmalloc((size_t)(inptree->leaves_count) *
+                                      sizeof(void *));
+  for (i = 0; i < inptree->leaves_count; ++i)
+    tipmasks[i] = inptree->leaves[i]->data;
+
+  node_t ** inpmasks = bitmask_sort(inptree);
+
+  for (k = 0; k < opt_permutations; ++k)
+  {
+    shuffle(&rng, tipmasks, (size_t)(inptree->leaves_count), sizeof(void *));
+    for (i = 0; i < inptree->leaves_count; ++i)
+      inptree->leaves[i]->data = tipmasks[i];
+
+    bipart_update(inptree);
+
+    for (i = 0; i < inptree->inner_count; ++i)
+      inptree->inner[i]->mark = 0;
+
+    qsort(inpmasks, (size_t)inpcount, sizeof(node_t *), cb_cmp_bitmask);
+    compare_masks(refmasks, inpmasks, refcount, inpcount);
+
+    long count = bipart_count_matches(inptree, opt_filter_gt, opt_filter_lt);
+
+    hist[count]++;
+    sum += count;
+    min = MIN(min, count);
+    max = MAX(max, count);
+    if (count >= observed)
+      exceed++;
+  }
+
+  fprintf(out,
+          "  Permutation test (%ld label permutations):\n"
+          "    Observed matches: %ld\n"
+          "    Null matches: mean %f, min %ld, max %ld\n"
+          "    P(null >= observed): %f\n"
+          "    Null distribution (matches:permutations):",
+          opt_permutations,
+          observed,
+          sum / opt_permutations,
+          min,
+          max,
+          (exceed + 1) / (double)(opt_permutations + 1));
+  for (i = min; i <= max; ++i)
+    if (hist[i])
+      fprintf(out, " %ld:%ld", i, hist[i]);
+  fprintf(out, "\n");
+
+  free(inpmasks);
+  free(tipmasks);
+  free(hist);
+}
+
+/* pair the tips of the two trees by label id, such that tips with the same
+   label get the same bit in the bitmasks. Returns 0 if the trees do not have
+   the same tip labels */
+static int pair_tips(ntree_t * reftree,
+                     ntree_t * inptree,
+                     node_t ** reftips,
+                     node_t ** inptips)
 {
   long i;
-  long treeno = 0;
-  FILE * fp_ref;
-  FILE * fp_input;
-  FILE * fp_output;
-  char * output_file;
-  char * newick;
 
-  if (!opt_treefile)
-    fatal("An input file must be specified");
+  if (inptree->leaves_count != reftree->leaves_count)
+    return 0;
+
+  for (i = 0; i < reftree->leaves_count; ++i)
+  {
+    node_t * tip = reftree->leaves[i];
 
-  fp_input  = xopen(opt_treefile,"r");
+    if (reftree->taxa[tip->taxon] != tip || tip->taxon >= inptree->taxa_count)
+      return 0;
 
-  fp_ref = xopen(opt_difftree, "r");
-  char * ref_newick = getnextline(fp_ref);
-  fclose(fp_ref);
+    reftips[i] = tip;
+    inptips[i] = inptree->taxa[tip->taxon];
+    if (!inptips[i])
+      return 0;
+  }
 
-  ntree_t * original_reftree = ntree_parse_newick(ref_newick);
-  free(ref_newick);
+  return 1;
+}
 
-  if (original_reftree->leaves_count > 3)
-    prune_degree2(original_reftree);
-  else
-    fatal("ERROR: Reference tree contains less than four taxa (%ld taxa found)",
-          original_reftree->leaves_count);
+/* Compare the bipartitions of two trees as --difftree does (without --force).
+   Degree-2 nodes are removed from both trees, inner nodes of inptree whose
+   bipartition is absent from reftree are marked, and the bitmasks are left in
+   node->data, to be freed with ntree_destroy(tree,free). Returns 0 if the
+   trees have fewer than four or different tips */
+int bipart_difftree(ntree_t * reftree, ntree_t * inptree)
+{
+  if (reftree->leaves_count < 4 || inptree->leaves_count < 4)
+    return 0;
 
-  /* allocate space for sorting labels of input and reference trees */
-  node_t ** reftips = (node_t **)xmalloc((size_t)(original_reftree->leaves_count) *
+  prune_degree2(reftree);
+  prune_degree2(inptree);
+
+  node_t ** reftips = (node_t **)xmalloc((size_t)(reftree->leaves_count) *
                                          sizeof(node_t *));
-  node_t ** inptips = (node_t **)xmalloc((size_t)(original_reftree->leaves_count) *
+  node_t ** inptips = (node_t **)xmalloc((size_t)(reftree->leaves_count) *
                                          sizeof(node_t *));
 
-  /* parse tree */
-  if (!opt_quiet)
-    fprintf(stdout, "Parsing tree file...\n");
-
-  while ((newick = getnextline(fp_input)))
+  if (!pair_tips(reftree, inptree, reftips, inptips))
   {
-    ++treeno;
+    free(reftips);
+    free(inptips);
+    return 0;
+  }
 
-    ntree_t * inptree = ntree_parse_newick(newick);
-    if (!inptree)
-      fatal("Cannot parse tree file");
-    free(newick);
+  profile_begin(PROFILE_BITMASK);
+  bipart_init(reftree->leaves_count);
+  bitmask_init(stdout, reftips, reftree->leaves_count);
+  bipart_compute_recursive(reftree->root);
 
-    if (inptree->leaves_count > 3)
-      prune_degree2(inptree);
-    else
-    {
-      fprintf(stdout, "Input tree %ld contains less than four taxa (%d taxa found) - skipping...\n", treeno, inptree->leaves_count);
-      ntree_destroy(inptree,NULL);
-      continue;
-    }
+  bipart_init(inptree->leaves_count);
+  bitmask_init(stdout, inptips, inptree->leaves_count);
+  bipart_compute_recursive(inptree->root);
+  profile_end(PROFILE_BITMASK);
 
-    ntree_t * reftree = ntree_clone(original_reftree,NULL);
+  profile_begin(PROFILE_MATCH);
+  node_t ** refmasks = bitmask_sort(reftree);
+  node_t ** inpmasks = bitmask_sort(inptree);
 
-    fprintf(stdout, "Input tree %ld:\n", treeno);
-    if ((inptree->leaves_count != reftree->leaves_count) && !opt_force)
-    {
-      fprintf(stderr,
-              "Tree %ld differs in number of leaves. Use --force to override\n",
-              treeno);
-      ntree_destroy(inptree,NULL);
-      ntree_destroy(reftree,NULL);
-      continue;
-    }
+  compare_masks(refmasks,inpmasks,reftree->inner_count-1,inptree->inner_count-1);
+  profile_end(PROFILE_MATCH);
 
-    if (opt_force)
-    {
-      long ref_remove_count;
-      long inp_remove_count;
-      mark_symmetric_diff(reftree,inptree,&ref_remove_count,&inp_remove_count);
+  free(refmasks);
+  free(inpmasks);
+  free(reftips);
+  free(inptips);
+
+  return 1;
+}
+
+typedef struct difftree_s
+{
+  treeio_t * input;
+  ntree_t * reftree;
+} difftree_t;
+
+static void * difftree_read(long * treeno, size_t * cost, void * data)
+{
+  difftree_t * d = (difftree_t *)data;
+  ntree_t * inptree;
+
+  if (!treeio_next(d->input, &inptree))
+    return NULL;
 
-      fprintf(stdout,
-              "  Need to prune %ld from reference and %ld from input\n",
-              ref_remove_count, inp_remove_count);
+  if (!inptree)
+    fatal("Cannot parse tree file");
 
-      assert(!ntree_check_rbinary(reftree) && !ntree_check_rbinary(inptree));
-      if (ntree_check_rbinary(reftree) && ntree_check_rbinary(inptree))
+  *treeno = treeio_treeno(d->input);
+
+  /* the input tree, a copy of the reference, their bitmasks and the SVG */
+  size_t nodes = (size_t)(inptree->leaves_count + inptree->inner_count +
+                          d->reftree->leaves_count + d->reftree->inner_count);
+  size_t elms = (size_t)d->reftree->leaves_count / (sizeof(long)*CHAR_BIT) + 1;
+
+  *cost = ntree_size(inptree) + ntree_size(d->reftree) +
+          nodes * (elms * sizeof(unsigned long) + 16 + 256);
+
+  return inptree;
+}
+
+/* output streams of cmd_difftree */
+#define DIFF_STDOUT     0
+#define DIFF_STDERR     1
+#define DIFF_SVG        2
+#define DIFF_EXTRACT    3
+#define DIFF_STREAMS    4
+
+static int difftree_job(long treeno, void * item, FILE ** fp, void * data)
+{
+  long i;
+  char * newick;
+  difftree_t * d = (difftree_t *)data;
+  ntree_t * inptree = (ntree_t *)item;
+
+  if (inptree->leaves_count > 3)
+    prune_degree2(inptree);
+  else
+  {
+    fprintf(fp[DIFF_STDOUT], "Input tree %ld contains less than four taxa (%d taxa found) - skipping...\n", treeno, inptree->leaves_count);
+    ntree_destroy(inptree,NULL);
+    return 0;
+  }
+
+  ntree_t * reftree = ntree_clone(d->reftree,NULL);
+
+  fprintf(fp[DIFF_STDOUT], "Input tree %ld:\n", treeno);
+  if ((inptree->leaves_count != reftree->leaves_count) && !opt_force)
+  {
+    fprintf(fp[DIFF_STDERR],
+            "Tree %ld differs in number of leaves. Use --force to override\n",
+            treeno);
+    ntree_destroy(inptree,NULL);
+    ntree_destroy(reftree,NULL);
+    return 0;
+  }
+
+  if (opt_force)
+  {
+    long ref_remove_count;
+    long inp_remove_count;
+    int suppress_unary = 0;
+    int unrooted = 0;
+    mark_symmetric_diff(reftree,inptree,&ref_remove_count,&inp_remove_count);
+
+    fprintf(fp[DIFF_STDOUT],
+            "  Need to prune %ld from reference and %ld from input\n",
+            ref_remove_count, inp_remove_count);
+
+    assert(!ntree_check_rbinary(reftree) && !ntree_check_rbinary(inptree));
+    if (ntree_check_rbinary(reftree) && ntree_check_rbinary(inptree))
+    {
+      /* TODO: This case should never happen since we have already pruned all
+         degree 2 nodes */
+      if ((ref_remove_count > reftree->root->leaves - 3) ||
+          (inp_remove_count > inptree->root->leaves - 3))
       {
-        /* TODO: This case should never happen since we have already pruned all
-           degree 2 nodes */
-        if ((ref_remove_count > reftree->root->leaves - 3) ||
-            (inp_remove_count > inptree->root->leaves - 3))
-        {
-          if (ref_remove_count > reftree->root->leaves - 3)
-            fprintf(stderr,
-                    "WARNING: Number of tips to prune for reference tree can be at most %d",
-                    reftree->root->leaves-3);
-          else
-            fprintf(stderr,
-                    "WARNING: Number of tips to prune for input tree can be at most %d",
-                    inptree->root->leaves-3);
-
-          ntree_destroy(inptree,NULL);
-          ntree_destroy(reftree,NULL);
-          continue;
-        }
-        prune_binary(reftree, ref_remove_count);
-        prune_binary(inptree, inp_remove_count);
+        if (ref_remove_count > reftree->root->leaves - 3)
+          fprintf(fp[DIFF_STDERR],
+                  "WARNING: Number of tips to prune for reference tree can be at most %d",
+                  reftree->root->leaves-3);
+        else
+          fprintf(fp[DIFF_STDERR],
+                  "WARNING: Number of tips to prune for input tree can be at most %d",
+                  inptree->root->leaves-3);
+
+        ntree_destroy(inptree,NULL);
+        ntree_destroy(reftree,NULL);
+        return 0;
       }
-      else if (ntree_check_unrooted(reftree) && ntree_check_unrooted(inptree))
+      suppress_unary = 1;
+    }
+    else if (ntree_check_unrooted(reftree) && ntree_check_unrooted(inptree))
+    {
+      if ((ref_remove_count > reftree->leaves_count - 4) ||
+          (inp_remove_count > inptree->leaves_count - 4))
       {
-        if ((ref_remove_count > reftree->leaves_count - 4) ||
-            (inp_remove_count > inptree->leaves_count - 4))
-        {
-          if (ref_remove_count > reftree->root->leaves - 4)
-            fprintf(stderr,
-                    "WARNING: Number of tips to prune for reference tree can be at most %d",
-                    reftree->leaves_count-4);
-          else
-            fprintf(stderr,
-                    "WARNING: Number of tips to prune for input tree can be at most %d",
-                    inptree->leaves_count-4);
-          ntree_destroy(inptree,NULL);
-          ntree_destroy(reftree,NULL);
-          continue;
-        }
-        prune_unrooted(reftree,ref_remove_count);
-        prune_unrooted(inptree,inp_remove_count);
+        if (ref_remove_count > reftree->root->leaves - 4)
+          fprintf(fp[DIFF_STDERR],
+                  "WARNING: Number of tips to prune for reference tree can be at most %d",
+                  reftree->leaves_count-4);
+        else
+          fprintf(fp[DIFF_STDERR],
+                  "WARNING: Number of tips to prune for input tree can be at most %d",
+                  inptree->leaves_count-4);
+        ntree_destroy(inptree,NULL);
+        ntree_destroy(reftree,NULL);
+        return 0;
       }
-      else
+      suppress_unary = 1;
+      unrooted = 1;
+    }
+    else
+    {
+      if ((ref_remove_count > reftree->root->leaves - 1) ||
+          (inp_remove_count > inptree->root->leaves - 1))
       {
-        if ((ref_remove_count > reftree->root->leaves - 1) ||
-            (inp_remove_count > inptree->root->leaves - 1))
-        {
-          if (ref_remove_count > reftree->root->leaves - 1)
-            fprintf(stderr,
-                    "Number of tips to prune for reference tree can be at most %d",
-                    reftree->root->leaves-1);
-          else
-            fprintf(stderr,
-                    "Number of tips to prune for input tree can be at most %d",
-                    inptree->root->leaves-1);
-
-          ntree_destroy(inptree,NULL);
-          ntree_destroy(reftree,NULL);
-          continue;
-        }
-        prune_tree(reftree, ref_remove_count);
-        prune_tree(inptree, inp_remove_count);
-      }
+        if (ref_remove_count > reftree->root->leaves - 1)
+          fprintf(fp[DIFF_STDERR],
+                  "Number of tips to prune for reference tree can be at most %d",
+                  reftree->root->leaves-1);
+        else
+          fprintf(fp[DIFF_STDERR],
+                  "Number of tips to prune for input tree can be at most %d",
+                  inptree->root->leaves-1);
 
-    if (reftree->leaves_count > 3)
-      prune_degree2(reftree);
-    if (inptree->leaves_count > 3)
-      prune_degree2(inptree);
+        ntree_destroy(inptree,NULL);
+        ntree_destroy(reftree,NULL);
+        return 0;
+      }
     }
 
-    #if 0
-    if (inptree->inner_count != reftree->inner_count)
-    {
-      fprintf(stderr, "Tree %ld differs in number of inner nodes\n",treeno);
-      ntree_destroy(inptree,NULL);
-      ntree_destroy(reftree,NULL);
-      continue;
-    }
-    #endif
+    unsigned long * ref_remove = ntree_prune_first(reftree, ref_remove_count);
+    unsigned long * inp_remove = ntree_prune_first(inptree, inp_remove_count);
+    ntree_prune(reftree, ref_remove, suppress_unary, unrooted);
+    ntree_prune(inptree, inp_remove, suppress_unary, unrooted);
+    free(ref_remove);
+    free(inp_remove);
+
+  if (reftree->leaves_count > 3)
+    prune_degree2(reftree);
+  if (inptree->leaves_count > 3)
+    prune_degree2(inptree);
+  }
 
-    /* sort reference tree nodes according to label */
-    for (i = 0; i < reftree->leaves_count; ++i)
-      reftips[i] = reftree->leaves[i];
-    qsort(reftips,
-          (size_t)(reftree->leaves_count),
-          sizeof(node_t *),
-          cb_cmp_nodelabel);
+  #if 0
+  if (inptree->inner_count != reftree->inner_count)
+  {
+    fprintf(fp[DIFF_STDERR], "Tree %ld differs in number of inner nodes\n",treeno);
+    ntree_destroy(inptree,NULL);
+    ntree_destroy(reftree,NULL);
+    return 0;
+  }
+  #endif
 
-    /* sort input tree tips according to labels */
-    for (i = 0; i < inptree->leaves_count; ++i)
-      inptips[i] = inptree->leaves[i];
-    qsort(inptips,
-          (size_t)(inptree->leaves_count),
-          sizeof(node_t *),
-          cb_cmp_nodelabel);
+  /* allocate space for sorting labels of input and reference trees */
+  node_t ** reftips = (node_t **)xmalloc((size_t)(reftree->leaves_count) *
+                                         sizeof(node_t *));
+  node_t ** inptips = (node_t **)xmalloc((size_t)(reftree->leaves_count) *
+                                         sizeof(node_t *));
 
-    /* check that input tree has same labels as reference tree */
-    for (i = 0; i < inptree->leaves_count; ++i)
-      if (strcmp(inptips[i]->label,reftips[i]->label))
-        break;
-    if (i != inptree->leaves_count)
-    {
-      fprintf(stderr,"Tree %ld has different tip labels, skipping\n",treeno);
-      ntree_destroy(inptree,NULL);
-      ntree_destroy(reftree,NULL);
-      continue;
-    }
+  /* check that input tree has same labels as reference tree */
+  if (!pair_tips(reftree, inptree, reftips, inptips))
+  {
+    fprintf(fp[DIFF_STDERR],"Tree %ld has different tip labels, skipping\n",treeno);
+    ntree_destroy(inptree,NULL);
+    ntree_destroy(reftree,NULL);
+    free(reftips);
+    free(inptips);
+    return 0;
+  }
 
-    /* prepare output medium */
-    if (!opt_outfile)
-      fp_output = stdout;
+  /* initialize bitmasks for the sorted tips and then bitmasks for inners */
+  profile_begin(PROFILE_BITMASK);
+  bipart_init(reftree->leaves_count);
+  bitmask_init(fp[DIFF_STDOUT], reftips, reftree->leaves_count);
+  bipart_compute_recursive(reftree->root);
+
+  bipart_init(inptree->leaves_count);
+  bitmask_init(fp[DIFF_SVG], inptips, inptree->leaves_count);
+  bipart_compute_recursive(inptree->root);
+  profile_end(PROFILE_BITMASK);
+
+  #if 0
+  /* show bipartitions */
+  //printf("Reference tree bipartitions:\n");
+  //bipart_show(fp_output,reftree);
+  //printf("Input tree bipartitions:\n");
+  //bipart_show(fp_output,tree);
+
+  //printf("Reference tree trivial bipartitions:\n");
+  //for (i = 0; i < reftree->leaves_count; ++i)
+  //  bitmask_print(stdout, (unsigned long *)(reftree->leaves[i]->data));
+  //printf("Input tree trivial bipartitions:\n");
+  //for (i = 0; i < tree->leaves_count; ++i)
+  //  bitmask_print(stdout, (unsigned long *)(tree->leaves[i]->data));
+  #endif
+
+  profile_begin(PROFILE_MATCH);
+  node_t ** refmasks = bitmask_sort(reftree);
+  node_t ** inpmasks = bitmask_sort(inptree);
+
+  long diff = compare_masks(refmasks,inpmasks,reftree->inner_count-1,inptree->inner_count-1);
+  profile_end(PROFILE_MATCH);
+
+  /* print only the number of matches (not the size) */
+  long match_count = bipart_count_matches(inptree, opt_filter_gt, opt_filter_lt);
+  fprintf(fp[DIFF_STDERR],"%ld",match_count);
+
+  if (!diff)
+  {
+    fprintf(fp[DIFF_STDOUT],
+            "  All bipartitions of reference tree are compatible with "
+            "bipartitions of tree %ld\n", treeno);
+    if (reftree->inner_count == inptree->inner_count)
+      fprintf(fp[DIFF_STDOUT], "  The two trees are identical\n");
     else
     {
-      asprintf(&output_file, "%s.%ld.svg", opt_outfile, treeno);
-      fp_output = xopen(output_file, "w");
-      free(output_file);
+      assert(inptree->inner_count > reftree->inner_count);
+      fprintf(fp[DIFF_STDOUT],
+              "  Input tree contains %d additional bipartitions not in "
+              "reference tree (RF-b: %f)\n",
+              inptree->inner_count-reftree->inner_count,
+              (inptree->inner_count-reftree->inner_count) /
+              (double)(reftree->inner_count+inptree->inner_count-2));
     }
+  }
+  else
+  {
+    long compatible_count = reftree->inner_count-1 - diff;
+    long total_diff = diff + inptree->inner_count - 1 - compatible_count;
+
+    fprintf(fp[DIFF_STDOUT],
+            "  Reference tree has %ld/%d incompatible partitions with input "
+            "tree %ld (RF-a: %f and RF-b: %f)\n",
+            diff,
+            reftree->inner_count-1,
+            treeno,
+            ((double)diff)/(reftree->inner_count-1),
+            (double)total_diff/(reftree->inner_count+inptree->inner_count-2));
+  }
+
+  if (opt_ultrametric)
+    ultrametric(inptree);
+
+  svg_plot(inptree, fp[DIFF_SVG], fp[DIFF_STDERR], 1);
 
-    /* initialize bitmasks for the sorted tips and then bitmasks for inners */
-    bipart_init(reftree->leaves_count);
-    bitmask_init(stdout, reftips, reftree->leaves_count);
-    bipart_compute_recursive(reftree->root);
-
-    bipart_init(inptree->leaves_count);
-    bitmask_init(fp_output, inptips, inptree->leaves_count);
-    bipart_compute_recursive(inptree->root);
-
-    #if 0
-    /* show bipartitions */
-    //printf("Reference tree bipartitions:\n");
-    //bipart_show(fp_output,reftree);
-    //printf("Input tree bipartitions:\n");
-    //bipart_show(fp_output,tree);
-
-    //printf("Reference tree trivial bipartitions:\n");
-    //for (i = 0; i < reftree->leaves_count; ++i)
-    //  bitmask_print(stdout, (unsigned long *)(reftree->leaves[i]->data));
-    //printf("Input tree trivial bipartitions:\n");
-    //for (i = 0; i < tree->leaves_count; ++i)
-    //  bitmask_print(stdout, (unsigned long *)(tree->leaves[i]->data));
-    #endif
-
-    node_t ** refmasks = bitmask_sort(reftree);
-    node_t ** inpmasks = bitmask_sort(inptree);
-
-    long diff = compare_masks(refmasks,inpmasks,reftree->inner_count-1,inptree->inner_count-1);
-
-   //
-    //FILE * match;
-    /* open the file for writing*/
-    //match =    fopen ("match.txt","w");// change to "a" for append
-    //print the mismatches or matches of each interrogated bipartition 
-	int ctr=0;
+  /* if --extract then extract bipartitions */
+  if (opt_extract)
+  {
+    long filter_count = 0;
     for (i = 0; i < inptree->inner_count; ++i)
-      {
-      //here check for the desired size of the subtrees to interrogate
-       if (inptree->inner[i]->leaves > opt_filter_gt )
-       	{
-     	if (inptree->inner[i]->leaves < opt_filter_lt )
-//	if (opt_filter_lt && opt_filter_lt <= inptree->inner[i]->leaves)
-		{
-		  // if it is "marked" then is a mismatch, else is a match
-		 if (inptree->inner[i]->mark)
-		     {
-		     //fprintf(mismatch,"%d,",inptree->inner[i]->leaves);
-		     }
-		    else
-		     {
-		      if (inptree->inner[i]->parent)
-		      	{ctr++;
-		         //fprintf(match,"%d,", inptree->inner[i]->leaves);
-				}
-		     }
-       		}
-	 }
-       }
-       
-    // print only the number of matches (not the size)
-    fprintf(stderr,"%d",ctr);
-    
-    //close the file
-    //fclose(match);
-    
-   // ------ 
-    if (!diff)
     {
-      fprintf(stdout,
-              "  All bipartitions of reference tree are compatible with "
-              "bipartitions of tree %ld\n", treeno);
-      if (reftree->inner_count == inptree->inner_count)
-        fprintf(stdout, "  The two trees are identical\n");
-      else
+      int store_subtree = 0;
+
+      if (inptree->inner[i]->mark)
       {
-        assert(inptree->inner_count > reftree->inner_count);
-        fprintf(stdout,
-                "  Input tree contains %d additional bipartitions not in "
-                "reference tree (RF-b: %f)\n",
-                inptree->inner_count-reftree->inner_count,
-                (inptree->inner_count-reftree->inner_count) /
-                (double)(reftree->inner_count+inptree->inner_count-2));
-      }
-    }
-    else
-    {
-      long compatible_count = reftree->inner_count-1 - diff;
-      long total_diff = diff + inptree->inner_count - 1 - compatible_count;
-
-      fprintf(stdout,
-              "  Reference tree has %ld/%d incompatible partitions with input "
-              "tree %ld (RF-a: %f and RF-b: %f)\n",
-              diff,
-              reftree->inner_count-1,
-              treeno,
-              ((double)diff)/(reftree->inner_count-1),
-              (double)total_diff/(reftree->inner_count+inptree->inner_count-2));
-    }
+        store_subtree = 1;
 
-    if (opt_ultrametric)
-      ultrametric(inptree);
+        if (opt_filter_eq && opt_filter_eq != inptree->inner[i]->leaves)
+          store_subtree = 0;
 
-    svg_plot(inptree, fp_output, 1);
+        if (opt_filter_gt && opt_filter_gt >= inptree->inner[i]->leaves)
+          store_subtree = 0;
 
-    /* if --extract then extract bipartitions */
-    if (opt_extract)
-    {
-      FILE * fp_extract;
-      if (opt_outfile)
+        if (opt_filter_lt && opt_filter_lt <= inptree->inner[i]->leaves)
+          store_subtree = 0;
+      }
+
+      if (store_subtree)
       {
-        asprintf(&output_file, "%s.%ld.txt",opt_outfile,treeno);
+        filter_count++;
+        newick = ntree_export_subtree_newick(inptree->inner[i],0);
 
-        fp_extract = fopen(output_file,"w");
+        fprintf(fp[DIFF_EXTRACT], "%s\n", newick);
 
-        free(output_file);
-        
+        free(newick);
       }
-      else
-        fp_extract = stdout;
+    }
 
-      long filter_count = 0;
-      for (i = 0; i < inptree->inner_count; ++i)
-      {
-        int store_subtree = 0;
+    fprintf(fp[DIFF_STDOUT],"Tree %ld - filtered %ld subtrees\n", treeno, filter_count);
+  }
 
-        if (inptree->inner[i]->mark)
-        {
-          store_subtree = 1;
+  if (opt_permutations)
+    permutation_test(inptree,
+                     refmasks,
+                     reftree->inner_count-1,
+                     match_count,
+                     treeno,
+                     fp[DIFF_STDOUT]);
 
-          if (opt_filter_eq && opt_filter_eq != inptree->inner[i]->leaves)
-            store_subtree = 0;
+  /* deallocate tree structure */
+  ntree_destroy(inptree,free);
+  ntree_destroy(reftree,free);
 
-          if (opt_filter_gt && opt_filter_gt >= inptree->inner[i]->leaves)
-            store_subtree = 0;
+  free(refmasks);
+  free(inpmasks);
+  free(reftips);
+  free(inptips);
 
-          if (opt_filter_lt && opt_filter_lt <= inptree->inner[i]->leaves)
-            store_subtree = 0;
-        }
+  return 1;
+}
 
-        if (store_subtree)
-        {
-          filter_count++;
-          newick = ntree_export_subtree_newick(inptree->inner[i],0);
+void cmd_difftree()
+{
+  long i;
+  treeio_t * fp_input;
+  treeout_t * outs[DIFF_STREAMS];
+  difftree_t d;
 
-          fprintf(fp_extract, "%s\n", newick);
+  if (!opt_treefile)
+    fatal("An input file must be specified");
 
-          free(newick);
-        }
-      }
+  fp_input  = treeio_open_selected(opt_treefile);
 
-      fprintf(stdout,"Tree %ld - filtered %ld subtrees\n", treeno, filter_count);
+  ntree_t * original_reftree = treeio_read_first(opt_difftree);
 
-      if (opt_outfile)
-        fclose(fp_extract);
-    }
+  if (original_reftree->leaves_count > 3)
+    prune_degree2(original_reftree);
+  else
+    fatal("ERROR: Reference tree contains less than four taxa (%ld taxa found)",
+          original_reftree->leaves_count);
 
-    /* deallocate tree structure */
-    ntree_destroy(inptree,free);
-    ntree_destroy(reftree,free);
+  /* parse tree */
+  if (!opt_quiet)
+    fprintf(stdout, "Parsing tree file...\n");
 
-    if (opt_outfile)
-      fclose(fp_output);
-    
-    free(refmasks);
-    free(inpmasks);
-  }
+  /* prepare output media */
+  outs[DIFF_STDOUT] = treeout_console(stdout);
+  outs[DIFF_STDERR] = treeout_console(stderr);
+  outs[DIFF_SVG] = treeout_open("svg");
+  outs[DIFF_EXTRACT] = opt_extract ? treeout_open("txt") :
+                                     treeout_console(stdout);
+
+  d.input = fp_input;
+  d.reftree = original_reftree;
+  threads_pipeline(outs, DIFF_STREAMS, difftree_read, difftree_job, &d);
+
+  for (i = DIFF_STREAMS-1; i >= 0; --i)
+    treeout_close(outs[i]);
 
   ntree_destroy(original_reftree,NULL);
-  free(reftips);
-  free(inptips);
 
-  fclose(fp_input);
+  treeio_close(fp_input);
 }
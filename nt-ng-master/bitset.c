@@ -0,0 +1,83 @@
+/*
+    Copyright (C) 2015-2017 Tomas Flouri
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Tomas Flouri <t.flouris@ucl.ac.uk>,
+    Department of Genetics, Evolution and Environment,
+    University College London,
+    Gower Street, London WC1E 6BT, England
+*/
+
+
+#include "newick-tools.h"
+
+/* Bitsets are arrays of unsigned long, padded to a multiple of
+   BITSET_ALIGN_WORDS words such that the subset test can process full
+   vector registers without handling a remainder */
+
+long bitset_words(long bits)
+{
+  long words = (bits + (long)BITSET_BITS - 1) / (long)BITSET_BITS;
+
+  return (words + BITSET_ALIGN_WORDS - 1) & ~(long)(BITSET_ALIGN_WORDS-1);
+}
+
+unsigned long * bitset_create(long bits)
+{
+  long words = bitset_words(bits);
+
+  return (unsigned long *)xcalloc((size_t)(words ? words : BITSET_ALIGN_WORDS),
+                                  sizeof(unsigned long));
+}
+
+/* returns 1 if all bits set in a within words [first,last) are also set in
+   b, 0 otherwise. first and last must be multiples of BITSET_ALIGN_WORDS */
+int bitset_is_subset(const unsigned long * a,
+                     const unsigned long * b,
+                     long first,
+                     long last)
+{
+  long i;
+
+#if defined(__AVX2__)
+  for (i = first; i < last; i += 4)
+  {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(a+i));
+    __m256i y = _mm256_loadu_si256((const __m256i *)(b+i));
+
+    /* testc returns 1 if (~y & x) is zero */
+    if (!_mm256_testc_si256(y,x))
+      return 0;
+  }
+#elif defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+
+  for (i = first; i < last; i += 2)
+  {
+    __m128i x = _mm_loadu_si128((const __m128i *)(a+i));
+    __m128i y = _mm_loadu_si128((const __m128i *)(b+i));
+    __m128i z = _mm_andnot_si128(y,x);
+
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(z,zero)) != 0xFFFF)
+      return 0;
+  }
+#else
+  for (i = first; i < last; ++i)
+    if (a[i] & ~b[i])
+      return 0;
+#endif
+
+  return 1;
+}
@@ -22,64 +22,215 @@
 
 #include "newick-tools.h"
 
+typedef struct query_s
+{
+  unsigned long * bitset;
+  long first;           /* first word containing set bits */
+  long last;            /* one past the last word containing set bits */
+} query_t;
+
+/* creates the bitset of a label set over label ids and records the range of
+   words the subset test needs to examine */
+static void query_init(query_t * query, long * ids, long count)
+{
+  long i;
+  long minid = ids[0];
+  long maxid = ids[0];
+
+  for (i = 1; i < count; ++i)
+  {
+    if (ids[i] < minid) minid = ids[i];
+    if (ids[i] > maxid) maxid = ids[i];
+  }
+
+  query->bitset = bitset_create(maxid+1);
+  for (i = 0; i < count; ++i)
+    BITSET_SET(query->bitset, ids[i]);
+
+  /* align range to the padding of bitsets */
+  query->first = (minid / (long)BITSET_BITS) & ~(long)(BITSET_ALIGN_WORDS-1);
+  query->last  = bitset_words(maxid+1);
+}
+
+static query_t * load_label_sets(const char * filename, long * query_count)
+{
+  long count = 0;
+  long alloc = 16;
+  long ids_count;
+  long ids_alloc = 64;
+  char * line;
+  char * saveptr;
+  char * label;
+
+  FILE * fp = xopen(filename,"r");
+
+  query_t * queries = (query_t *)xmalloc((size_t)alloc * sizeof(query_t));
+  long * ids = (long *)xmalloc((size_t)ids_alloc * sizeof(long));
+
+  /* each line contains one set of labels separated by commas or spaces */
+  while ((line = getnextline(fp)))
+  {
+    ids_count = 0;
+    for (label = strtok_r(line, " \t\r\n,", &saveptr);
+         label;
+         label = strtok_r(NULL, " \t\r\n,", &saveptr))
+    {
+      if (ids_count == ids_alloc)
+      {
+        ids_alloc <<= 1;
+        ids = (long *)xrealloc(ids, (size_t)ids_alloc * sizeof(long));
+      }
+      ids[ids_count++] = label_intern(label);
+    }
+    free(line);
+
+    /* skip empty lines */
+    if (!ids_count) continue;
+
+    if (count == alloc)
+    {
+      alloc <<= 1;
+      queries = (query_t *)xrealloc(queries, (size_t)alloc * sizeof(query_t));
+    }
+    query_init(queries+count, ids, ids_count);
+    ++count;
+  }
+
+  if (!count)
+    fatal("File %s does not contain any label sets", filename);
+
+  free(ids);
+  fclose(fp);
+
+  *query_count = count;
+  return queries;
+}
+
+static query_t * load_labels(const char * filename, long * query_count)
+{
+  long i;
+  list_item_t * item;
+
+  list_t * labels = labels_parse_file(filename);
+  if (!labels)
+    fatal("Error while parsing file %s", filename);
+
+  if (!labels->count)
+    fatal("File %s does not contain any labels", filename);
+
+  long * ids = (long *)xmalloc((size_t)(labels->count) * sizeof(long));
+  for (i = 0, item = labels->head; item; item = item->next, ++i)
+    ids[i] = label_intern((char *)(item->data));
+
+  query_t * query = (query_t *)xmalloc(sizeof(query_t));
+  query_init(query, ids, labels->count);
+
+  free(ids);
+  list_clear(labels,free);
+  free(labels);
+
+  *query_count = 1;
+  return query;
+}
+
 void cmd_contains()
 {
   long i;
   long treeno = 0;
-  FILE * fp_input;
+  long query_count;
+  long words = 0;
+  treeio_t * fp_input;
   FILE * fp_output;
-  char * newick;
-  list_t * labels;
+  ntree_t * tree;
+  query_t * queries;
 
   if (!opt_treefile)
     fatal("An input file must be specified");
 
-  if (!opt_labels)
-    fatal("--labels option is required");
+  if (!opt_labels && !opt_label_sets)
+    fatal("Either --labels or --label_sets must be specified");
 
-  if (opt_labels)
-  {
-    labels = labels_parse_file(opt_labels);
-    if (!labels)
-      fatal("Error while parsing file %s", opt_labels);
-  }
-  
-  fp_input  = xopen(opt_treefile,"r");
+  if (opt_labels && opt_label_sets)
+    fatal("Cannot use both --labels and --label_sets");
+
+  if (opt_label_sets)
+    queries = load_label_sets(opt_label_sets, &query_count);
+  else
+    queries = load_labels(opt_labels, &query_count);
+
+  for (i = 0; i < query_count; ++i)
+    if (queries[i].last > words)
+      words = queries[i].last;
+
+  /* bitset of tree tips, grown as more labels get interned */
+  unsigned long * tipset = (unsigned long *)xcalloc((size_t)words,
+                                                    sizeof(unsigned long));
+
+  fp_input  = treeio_open_selected(opt_treefile);
 
   fp_output = opt_outfile ?
                 xopen(opt_outfile,"w") : stdout;
 
+  if (opt_label_sets)
+  {
+    fprintf(fp_output, "Tree");
+    for (i = 0; i < query_count; ++i)
+      fprintf(fp_output, "\tSet%ld", i+1);
+    fprintf(fp_output, "\n");
+  }
+
   /* main loop going through trees */
-  while ((newick = getnextline(fp_input)))
+  while (treeio_next(fp_input, &tree))
   {
-    ++treeno;
+    treeno = treeio_treeno(fp_input);
 
-    ntree_t * tree = ntree_parse_newick(newick);
     if (!tree)
-      fatal("Cannot parse tree file %s", opt_tree_labels);
-    free(newick);
+      fatal("Cannot parse tree %ld", treeno);
 
-    long found = 1;
-    list_item_t * item;
-    for (item = labels->head; item; item = item->next)
+    if (bitset_words(tree->taxa_count) > words)
     {
-      for (i = 0; i < tree->leaves_count; ++i)
-        if  (!strcmp(tree->leaves[i]->label,(char *)(item->data)))
-          break;
-      if (i == tree->leaves_count) 
-      {
-        found = 0;
-        break;
-      }
+      long new_words = bitset_words(tree->taxa_count);
+      tipset = (unsigned long *)xrealloc(tipset, (size_t)new_words *
+                                                 sizeof(unsigned long));
+      memset(tipset+words, 0, (size_t)(new_words-words) *
+                              sizeof(unsigned long));
+      words = new_words;
     }
-    
-    if (found)
+
+    for (i = 0; i < tree->leaves_count; ++i)
+      BITSET_SET(tipset, tree->leaves[i]->taxon);
+
+    if (opt_label_sets)
+    {
+      fprintf(fp_output, "%ld", treeno);
+      for (i = 0; i < query_count; ++i)
+        fprintf(fp_output, "\t%d", bitset_is_subset(queries[i].bitset,
+                                                    tipset,
+                                                    queries[i].first,
+                                                    queries[i].last));
+      fprintf(fp_output, "\n");
+    }
+    else if (bitset_is_subset(queries[0].bitset,
+                              tipset,
+                              queries[0].first,
+                              queries[0].last))
       fprintf(fp_output, "Labels found in tree %ld\n", treeno);
 
+    /* reset only the bits that were set */
+    for (i = 0; i < tree->leaves_count; ++i)
+      BITSET_CLEAR(tipset, tree->leaves[i]->taxon);
+
     /* deallocate tree structure */
     ntree_destroy(tree,NULL);
   }
 
-  list_clear(labels,NULL);
-  free(labels);
+  for (i = 0; i < query_count; ++i)
+    free(queries[i].bitset);
+  free(queries);
+  free(tipset);
+
+  if (opt_outfile)
+    fclose(fp_output);
+
+  treeio_close(fp_input);
 }
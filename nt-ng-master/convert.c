@@ -0,0 +1,86 @@
+/*
+    Copyright (C) 2015-2017 Tomas Flouri
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Tomas Flouri <t.flouris@ucl.ac.uk>,
+    Department of Genetics, Evolution and Environment,
+    University College London,
+    Gower Street, London WC1E 6BT, England
+*/
+
+
+#include "newick-tools.h"
+
+/* Convert a tree collection (newick or binary) to newick or to the binary
+   format of treeio.c */
+void cmd_convert()
+{
+  ntree_t * tree;
+  long count = 0;
+  int binary;
+  int float32 = 0;
+
+  if (!opt_treefile)
+    fatal("An input file must be specified");
+
+  if (!strcasecmp(opt_convert, "binary"))
+    binary = 1;
+  else if (!strcasecmp(opt_convert, "binary32"))
+    binary = float32 = 1;
+  else if (!strcasecmp(opt_convert, "newick"))
+    binary = 0;
+  else
+    fatal("Option --convert can be 'newick', 'binary' or 'binary32'");
+
+  if (binary && !opt_outfile)
+    fatal("Binary output requires --output");
+
+  treeio_t * fp_input = treeio_open_selected(opt_treefile);
+  btree_writer_t * writer = NULL;
+  FILE * fp_output = NULL;
+
+  if (binary)
+    writer = btree_writer_create(opt_outfile, float32);
+  else
+    fp_output = opt_outfile ? xopen(opt_outfile,"w") : stdout;
+
+  while (treeio_next(fp_input, &tree))
+  {
+    ++count;
+    if (!tree)
+      fatal("Cannot parse tree %ld", treeio_treeno(fp_input));
+
+    if (binary)
+      btree_writer_add(writer, tree);
+    else
+    {
+      char * newick = ntree_export_newick(tree);
+      fprintf(fp_output, "%s\n", newick);
+      free(newick);
+    }
+
+    ntree_destroy(tree,NULL);
+  }
+
+  treeio_close(fp_input);
+
+  if (binary)
+    btree_writer_close(writer);
+  else if (opt_outfile)
+    fclose(fp_output);
+
+  if (!opt_quiet)
+    fprintf(stdout, "Converted %ld trees\n", count);
+}
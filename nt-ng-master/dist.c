@@ -22,9 +22,7 @@
 
 #include "newick-tools.h"
 
-double rnd_uniform(double min, double max)
+double rnd_uniform(rng_t * rng, double min, double max)
 {
-  double r = ((double)random()) / RAND_MAX;
-
-  return min + (max - min)*r;
+  return min + (max - min)*rng_uniform(rng);
 }
@@ -22,37 +22,65 @@
 
 #include "newick-tools.h"
 
-static unsigned int is_rooted = 0;
+/* Exhaustive enumeration of binary tree topologies by stepwise addition.
+
+   Starting from the tree of the first 3 (unrooted) or 2 (rooted) tips, the
+   k-th tip is inserted in every edge of each tree with k tips, in the order
+   of the tips and then of the inner nodes below the edge. For rooted trees,
+   the edge above the root is included.
+
+   The search space is split into independent jobs by fixing the choices of
+   the first few insertion steps. Jobs are numbered in the order in which the
+   serial enumeration visits them, run in batches on up to opt_threads
+   threads, and each tree is passed to a visit callback together with the
+   batch slot of its job. Once a batch is finished, the flush callback is
+   called so that callers can output the slots in order.
+
+   The enumeration keeps its own arrays of tips and inner nodes in insertion
+   order. If requested, tree->leaves and tree->inner are refilled in postorder
+   and the node indices set before each visit, as wraptree() would do but
+   without allocating, such that the ntree_* routines that only read the tree
+   can be applied to it directly. */
+
+/* minimum number of jobs per thread for load balancing */
+#define ENUM_JOBS_PER_THREAD 256
+
+/* number of jobs per thread in each batch */
+#define ENUM_BATCH_PER_THREAD 4
+
+typedef struct enum_ws_s
+{
+  ntree_t * tree;
+  node_t ** tips;         /* tips in insertion order */
+  node_t ** inners;       /* inner nodes in insertion order */
+} enum_ws_t;
+
+typedef struct enum_s
+{
+  unsigned int tip_count;
+  int rooted;
+  char ** labels;
+  long * taxa;            /* label ids of the labels */
+  int wrap;               /* refill node arrays in postorder before visits */
+  long prefix_steps;      /* number of insertion steps fixed by a job */
+  long first_job;         /* job of the first slot in the current batch */
+  enum_ws_t * ws;         /* one workspace per thread */
+  void (*visit)(ntree_t * tree, long slot, long thread, void * data);
+  void * data;
+} enum_t;
 
 static node_t * create_tip_node()
 {
-  node_t * node = (node_t *)xmalloc(sizeof(node_t));
-  node->label = NULL;
-  node->length = 0;
-  node->parent = NULL;
-  node->mark = 0;
-  node->leaves = 0;
-  node->coord = NULL;
-  node->data = NULL;
-  node->age = 0;
-
-  node->children_count = 0;
-  node->children = NULL;
+  node_t * node = (node_t *)xcalloc(1,sizeof(node_t));
+  node->taxon = -1;
 
   return node;
 }
 
 static node_t * create_inner_node(int children_count)
 {
-  node_t * node = (node_t *)xmalloc(sizeof(node_t));
-  node->label = NULL;
-  node->length = 0;
-  node->parent = NULL;
-  node->mark = 0;
-  node->leaves = 0;
-  node->coord = NULL;
-  node->data = NULL;
-  node->age = 0;
+  node_t * node = (node_t *)xcalloc(1,sizeof(node_t));
+  node->taxon = -1;
 
   node->children_count = children_count;
   node->children = (node_t **)xmalloc(children_count * sizeof(node_t *));
@@ -60,162 +88,489 @@ static node_t * create_inner_node(int children_count)
   return node;
 }
 
-static void unlink_node(node_t * parent,
-                        node_t * old_child,
-                        node_t * new_inner)
+static void enum_tree_create(enum_t * e, enum_ws_t * ws)
 {
-  int i;
+  unsigned int i;
+  unsigned int tip_count = e->tip_count;
+  int rooted = e->rooted;
 
-  /* find new inner placeholder */
-  for (i = 0; i < parent->children_count; ++i)
-    if (parent->children[i] == new_inner)
-      break;
+  /* Create tree structure and the root node with 3 (unrooted) or 2 (rooted)
+     children */
+  ntree_t * tree = (ntree_t *)xcalloc(1,sizeof(ntree_t));
+  tree->root = create_inner_node(3 - rooted);
 
-  assert(i < parent->children_count);
+  /* Set the number of tips and inner nodes of the full tree */
+  tree->leaves_count = tip_count;
+  tree->inner_count = tip_count-2 + rooted;
 
-  parent->children[i] = old_child;
+  /* Allocate array of leaves and inners for the largest possible tree, and
+     their postorder arrays */
+  ws->tips   = (node_t **)xmalloc(tip_count * sizeof(node_t *));
+  ws->inners = (node_t **)xmalloc((tip_count-2+rooted)*sizeof(node_t *));
+  tree->leaves = (node_t **)xmalloc(tip_count * sizeof(node_t *));
+  tree->inner  = (node_t **)xmalloc((tip_count-2+rooted)*sizeof(node_t *));
 
-  old_child->parent = parent;
+  /* create inner nodes */
+  ws->inners[0] = tree->root;
+  for (i = 1; i < tip_count-2+rooted; ++i)
+    ws->inners[i] = create_inner_node(2);
+
+  /* create tip nodes, and the map of label ids to tips */
+  for (i = 0; i < tip_count; ++i)
+  {
+    ws->tips[i] = create_tip_node();
+    ws->tips[i]->label = e->labels[i];
+    ws->tips[i]->taxon = e->taxa[i];
+    if (e->taxa[i] >= tree->taxa_count)
+      tree->taxa_count = e->taxa[i]+1;
+  }
+
+  tree->taxa = (node_t **)xcalloc((size_t)tree->taxa_count, sizeof(node_t *));
+  for (i = 0; i < tip_count; ++i)
+    if (!tree->taxa[e->taxa[i]])
+      tree->taxa[e->taxa[i]] = ws->tips[i];
+
+  /* place first leaves */
+  for (i = 0; i < 3u - rooted; ++i)
+  {
+    tree->root->children[i] = ws->tips[i];
+    ws->tips[i]->parent = tree->root;
+  }
+
+  ws->tree = tree;
+}
+
+static void enum_tree_destroy(enum_ws_t * ws)
+{
+  long i;
+  ntree_t * tree = ws->tree;
+
+  ntree_heights_invalidate(tree);
+
+  for (i = 0; i < tree->leaves_count; ++i)
+    free(ws->tips[i]);
+  for (i = 0; i < tree->inner_count; ++i)
+  {
+    free(ws->inners[i]->children);
+    free(ws->inners[i]);
+  }
+  free(ws->inners);
+  free(ws->tips);
+  free(tree->inner);
+  free(tree->leaves);
+  free(tree->taxa);
+  free(tree);
 }
 
-static void link_node(node_t * parent,
+static void enum_postorder(ntree_t * tree,
+                           node_t * node,
+                           long * tip_count,
+                           long * inner_count)
+{
+  long i;
+
+  if (!node->children_count)
+  {
+    node->index = *tip_count;
+    tree->leaves[(*tip_count)++] = node;
+    return;
+  }
+
+  for (i = 0; i < node->children_count; ++i)
+    enum_postorder(tree, node->children[i], tip_count, inner_count);
+
+  node->index = *inner_count;
+  tree->inner[(*inner_count)++] = node;
+}
+
+/* refill the node arrays of a complete tree in postorder */
+static void enum_wrap(ntree_t * tree)
+{
+  long tip_count = 0;
+  long inner_count = 0;
+
+  ntree_heights_invalidate(tree);
+  enum_postorder(tree, tree->root, &tip_count, &inner_count);
+
+  assert(tip_count == tree->leaves_count);
+  assert(inner_count == tree->inner_count);
+}
+
+/* number of edges in which the next tip can be inserted when the tree has
+   tip_count tips */
+static long enum_choices(enum_t * e, long tip_count)
+{
+  return 2*tip_count - 3 + 2*e->rooted;
+}
+
+/* returns the node below the edge with the specified index */
+static node_t * enum_edge(enum_t * e, enum_ws_t * ws, long tip_count, long i)
+{
+  if (i < tip_count)
+    return ws->tips[i];
+
+  /* the root of unrooted trees (inners[0]) has no edge above it */
+  return ws->inners[i - tip_count + !e->rooted];
+}
+
+/* insert new_tip on the edge above child, using new_inner as the new node */
+static void link_node(ntree_t * tree,
                       node_t * child,
                       node_t * new_inner,
                       node_t * new_tip)
 {
   int i;
+  node_t * parent = child->parent;
+
+  new_inner->children[0] = child;
+  new_inner->children[1] = new_tip;
+  new_inner->parent = parent;
+
+  child->parent = new_inner;
+  new_tip->parent = new_inner;
 
-  /* find child placeholder */
+  if (!parent)
+  {
+    tree->root = new_inner;
+    return;
+  }
+
+  /* find child placeholder and replace it with new inner node */
   for (i = 0; i < parent->children_count; ++i)
     if (parent->children[i] == child)
       break;
 
   assert(i < parent->children_count);
 
-  /* replace child with new inner node */
   parent->children[i] = new_inner;
+}
 
-  new_inner->children[1] = new_tip;
-  new_inner->children[0] = child;
+static void unlink_node(ntree_t * tree, node_t * child, node_t * new_inner)
+{
+  int i;
+  node_t * parent = new_inner->parent;
 
-  child->parent = new_inner;
-  new_tip->parent = new_inner;
-  
-  new_inner->parent = parent;
-}
+  child->parent = parent;
 
+  if (!parent)
+  {
+    tree->root = child;
+    return;
+  }
 
-static void tree_exhaust_recursive(ntree_t * tree, unsigned int tip_count)
+  /* find new inner placeholder */
+  for (i = 0; i < parent->children_count; ++i)
+    if (parent->children[i] == new_inner)
+      break;
+
+  assert(i < parent->children_count);
+
+  parent->children[i] = child;
+}
+
+static void tree_exhaust_recursive(enum_t * e,
+                                   enum_ws_t * ws,
+                                   long tip_count,
+                                   long slot,
+                                   long thread)
 {
-  unsigned int i;
+  long i;
+  ntree_t * tree = ws->tree;
 
-  if (tip_count == opt_exhaustive)
+  if (tip_count == e->tip_count)
   {
-    char * newick = ntree_export_newick(tree);
-    fprintf(stdout, "%s\n", newick);
-    free(newick);
+    if (e->wrap)
+      enum_wrap(tree);
+    e->visit(tree, slot, thread, e->data);
     return;
   }
 
-  /* iterate through all edges leading to a tip */
-  for (i = 0; i < tip_count; ++i)
+  node_t * new_inner = ws->inners[tip_count-2+e->rooted];
+  node_t * new_tip = ws->tips[tip_count];
+  long choices = enum_choices(e, tip_count);
+
+  for (i = 0; i < choices; ++i)
   {
-    node_t * parent = tree->leaves[i]->parent;
+    node_t * child = enum_edge(e, ws, tip_count, i);
+
+    link_node(tree, child, new_inner, new_tip);
+    tree_exhaust_recursive(e, ws, tip_count+1, slot, thread);
+    unlink_node(tree, child, new_inner);
+  }
+}
 
-    link_node(parent,
-              tree->leaves[i],
-              tree->inner[tip_count-2+is_rooted],
-              tree->leaves[tip_count]);
+static void enum_job(long slot, long thread, void * data)
+{
+  long i;
+  enum_t * e = (enum_t *)data;
+  long first = 3 - e->rooted;
+  long job = e->first_job + slot;
 
-    tree_exhaust_recursive(tree, tip_count+1);
+  enum_ws_t * ws = e->ws + thread;
 
-    unlink_node(parent,
-                tree->leaves[i],
-                tree->inner[tip_count-2+is_rooted]);
+  if (!ws->tree)
+    enum_tree_create(e, ws);
+
+  ntree_t * tree = ws->tree;
+  node_t ** path = (node_t **)xmalloc((size_t)(e->prefix_steps+1) *
+                                      sizeof(node_t *));
+  long * choice = (long *)xmalloc((size_t)(e->prefix_steps+1) *
+                                  sizeof(long));
+
+  /* decode the choices of the prefix steps, the first step being the most
+     significant digit of the job number */
+  for (i = e->prefix_steps-1; i >= 0; --i)
+  {
+    long radix = enum_choices(e, first+i);
+    choice[i] = job % radix;
+    job /= radix;
   }
 
-  /* iterate through the remaining edges */
-  for (i = 1; i < tip_count - 2 + is_rooted; ++i)
+  for (i = 0; i < e->prefix_steps; ++i)
   {
-    node_t * parent = tree->inner[i]->parent;
+    path[i] = enum_edge(e, ws, first+i, choice[i]);
+    link_node(tree,
+              path[i],
+              ws->inners[first+i-2+e->rooted],
+              ws->tips[first+i]);
+  }
+
+  tree_exhaust_recursive(e, ws, first+e->prefix_steps, slot, thread);
 
-    link_node(parent,
-              tree->inner[i],
-              tree->inner[tip_count-2+is_rooted],
-              tree->leaves[tip_count]);
+  /* restore the initial tree */
+  for (i = e->prefix_steps-1; i >= 0; --i)
+    unlink_node(tree, path[i], ws->inners[first+i-2+e->rooted]);
 
-    tree_exhaust_recursive(tree, tip_count+1);
+  free(path);
+  free(choice);
+}
+
+/* Enumerates all binary rooted or unrooted topologies of tip_count tips with
+   the specified labels. The visit callback is called for each tree with the
+   batch slot of the job that produced it. The tree is reused for the next
+   tree and must not be modified. If wrap is set, it is wrapped as by the
+   parser, i.e. its node arrays are in postorder with valid indices and label
+   ids. Otherwise only the links between nodes and the label ids of tips are
+   valid, which is enough to print or count trees. After each batch of at
+   most ntree_enumerate_slots() jobs, flush is called with the number of
+   slots used */
+void ntree_enumerate(unsigned int tip_count,
+                     int rooted,
+                     char ** labels,
+                     int wrap,
+                     void (*visit)(ntree_t * tree,
+                                   long slot,
+                                   long thread,
+                                   void * data),
+                     void (*flush)(long slot_count, void * data),
+                     void * data)
+{
+  long i;
+  long jobs = 1;
+  long steps = tip_count - (3 - rooted);
+  enum_t e;
+
+  assert(tip_count >= 3u - rooted);
+
+  e.tip_count = tip_count;
+  e.rooted = rooted;
+  e.labels = labels;
+  e.wrap = wrap;
+  e.visit = visit;
+
+  /* label interning is not thread-safe */
+  e.taxa = (long *)xmalloc(tip_count * sizeof(long));
+  for (i = 0; i < (long)tip_count; ++i)
+    e.taxa[i] = label_intern(labels[i]);
+
+  e.data = data;
+  e.ws = (enum_ws_t *)xcalloc((size_t)opt_threads, sizeof(enum_ws_t));
+
+  /* fix the first steps until there are enough jobs */
+  for (e.prefix_steps = 0;
+       e.prefix_steps < steps && jobs < ENUM_JOBS_PER_THREAD * opt_threads;
+       ++e.prefix_steps)
+    jobs *= enum_choices(&e, 3 - rooted + e.prefix_steps);
+
+  long batch = ntree_enumerate_slots();
+
+  for (e.first_job = 0; e.first_job < jobs; e.first_job += batch)
+  {
+    long count = MIN(batch, jobs - e.first_job);
+
+    threads_parallel_for(count, enum_job, &e);
 
-    unlink_node(parent,
-                tree->inner[i],
-                tree->inner[tip_count-2+is_rooted]);
+    if (flush)
+      flush(count, data);
   }
+
+  for (i = 0; i < opt_threads; ++i)
+    if (e.ws[i].tree)
+      enum_tree_destroy(e.ws+i);
+  free(e.ws);
+  free(e.taxa);
 }
-static void tree_exhaust(unsigned int tip_count, char ** tip_labels)
+
+/* maximum number of slots in a batch of ntree_enumerate() */
+long ntree_enumerate_slots(void)
 {
-  unsigned int i;
+  return ENUM_BATCH_PER_THREAD * opt_threads;
+}
 
-  assert(tip_count >= 3 - is_rooted);
-  
-    /* created the following
-          
-            *
-           /
-      *---*
-           \
-            *
-  
-  */
+typedef struct exhaust_output_s
+{
+  FILE * fp;
+  strbuf_t * slots;
+  unsigned long * count;  /* number of trees enumerated by each thread */
+  unsigned long ** hashes;  /* topology hashes computed by each thread */
+  int unrooted;
+} exhaust_output_t;
+
+static void cb_write_tree(ntree_t * tree, long slot, long thread, void * data)
+{
+  exhaust_output_t * out = (exhaust_output_t *)data;
+
+  ntree_newick_append(out->slots+slot, tree->root, tree->root->length);
+  strbuf_append(out->slots+slot, "\n", 1);
+  out->count[thread]++;
+}
 
-  /* Create tree structure and the root node with 3 children */
-  ntree_t * tree = (ntree_t *)xmalloc(sizeof(ntree_t));
-  tree->root = create_inner_node(3 - is_rooted);
+static void cb_count_tree(ntree_t * tree, long slot, long thread, void * data)
+{
+  exhaust_output_t * out = (exhaust_output_t *)data;
 
-  /* Set the number of tips and inner nodes of the full tree */
-  tree->leaves_count = tip_count;
-  tree->inner_count = tip_count-2 + is_rooted;
+  out->count[thread]++;
+}
 
-  /* Allocate array of leaves and inners for the largest possible tree */
-  tree->leaves = (node_t **)xmalloc(tip_count * sizeof(node_t *));
-  tree->inner  = (node_t **)xmalloc((tip_count-2+is_rooted)*sizeof(node_t *));
+static void cb_hash_tree(ntree_t * tree, long slot, long thread, void * data)
+{
+  exhaust_output_t * out = (exhaust_output_t *)data;
+  unsigned long n = out->count[thread]++;
 
-  /* create inner nodes */
-  tree->inner[0] = tree->root;
-  for (i = 1; i < tip_count-2+is_rooted; ++i)
-    tree->inner[i] = create_inner_node(2);
-    
-  /* create tip nodes */
-  for (i = 0; i < tip_count; ++i)
+  /* grow the array of the thread whenever its size reaches a power of two */
+  if (n >= 1024 && !(n & (n-1)))
+    out->hashes[thread] = (unsigned long *)xrealloc(out->hashes[thread],
+                                                    2*n*sizeof(unsigned long));
+
+  out->hashes[thread][n] = ntree_hash_topology(tree, out->unrooted);
+}
+
+static int cb_cmp_hash(const void * a, const void * b)
+{
+  unsigned long x = *(unsigned long *)a;
+  unsigned long y = *(unsigned long *)b;
+
+  if (x > y) return 1;
+  if (x < y) return -1;
+
+  return 0;
+}
+
+/* number of distinct topology hashes of the enumerated trees */
+static unsigned long count_hashes(exhaust_output_t * out, unsigned long total)
+{
+  long i;
+  unsigned long j,k = 0;
+  unsigned long distinct = 0;
+
+  unsigned long * all = (unsigned long *)xmalloc((size_t)(total ? total : 1) *
+                                                 sizeof(unsigned long));
+  for (i = 0; i < opt_threads; ++i)
   {
-    tree->leaves[i] = create_tip_node();
-    tree->leaves[i]->label = tip_labels[i];
+    memcpy(all+k, out->hashes[i], out->count[i] * sizeof(unsigned long));
+    k += out->count[i];
+    free(out->hashes[i]);
   }
+  free(out->hashes);
+
+  qsort(all, (size_t)total, sizeof(unsigned long), cb_cmp_hash);
+  for (j = 0; j < total; ++j)
+    if (!j || all[j] != all[j-1])
+      distinct++;
 
-  /* place first three leaves */
-  for (i = 0; i < 3 - is_rooted; ++i)
+  free(all);
+  return distinct;
+}
+
+static void cb_flush_trees(long slot_count, void * data)
+{
+  long i;
+  exhaust_output_t * out = (exhaust_output_t *)data;
+
+  for (i = 0; i < slot_count; ++i)
   {
-    tree->root->children[i] = tree->leaves[i];
-    tree->leaves[i]->parent = tree->root;
+    fwrite(out->slots[i].data, 1, out->slots[i].len, out->fp);
+    out->slots[i].len = 0;
   }
+}
 
-  /* recursively and exhaustively print all possible trees */
-  tree_exhaust_recursive(tree,3-is_rooted);  
-  
+static void tree_exhaust(unsigned int tip_count, char ** tip_labels, int rooted)
+{
+  long i;
+  exhaust_output_t out;
+  long slot_count = ntree_enumerate_slots();
+  unsigned long total = 0;
+
+  out.fp = NULL;
+  out.slots = NULL;
+  out.hashes = NULL;
+  out.unrooted = !rooted;
+  out.count = (unsigned long *)xcalloc((size_t)opt_threads,
+                                       sizeof(unsigned long));
+
+  if (opt_unique)
+  {
+    /* hash each tree, which needs the node arrays in postorder */
+    out.hashes = (unsigned long **)xmalloc((size_t)opt_threads *
+                                           sizeof(unsigned long *));
+    for (i = 0; i < opt_threads; ++i)
+      out.hashes[i] = (unsigned long *)xmalloc(1024*sizeof(unsigned long));
 
-  /* deallocate tree structure */
-  for (i = 0; i < tip_count; ++i)
+    ntree_enumerate(tip_count, rooted, tip_labels, 1, cb_hash_tree, NULL, &out);
+  }
+  else if (opt_count)
   {
-    free(tree->leaves[i]->label);
-    free(tree->leaves[i]);
+    ntree_enumerate(tip_count, rooted, tip_labels, 0, cb_count_tree, NULL, &out);
   }
-  for (i = 0; i < tip_count-2+is_rooted; ++i)
+  else
   {
-    free(tree->inner[i]->children);
-    free(tree->inner[i]);
+    out.fp = opt_outfile ? xopen(opt_outfile,"w") : stdout;
+    out.slots = (strbuf_t *)xmalloc((size_t)slot_count * sizeof(strbuf_t));
+    for (i = 0; i < slot_count; ++i)
+      strbuf_init(out.slots+i);
+
+    ntree_enumerate(tip_count,
+                    rooted,
+                    tip_labels,
+                    0,
+                    cb_write_tree,
+                    cb_flush_trees,
+                    &out);
+
+    for (i = 0; i < slot_count; ++i)
+      strbuf_free(out.slots+i);
+    free(out.slots);
+
+    if (opt_outfile)
+      fclose(out.fp);
   }
-  free(tree->inner);
-  free(tree->leaves);
-  free(tree);
+
+  for (i = 0; i < opt_threads; ++i)
+    total += out.count[i];
+
+  if (opt_count || opt_unique)
+    fprintf(stdout,
+            "Number of %s trees with %u tips: %lu\n",
+            rooted ? "rooted" : "unrooted", tip_count, total);
+
+  if (opt_unique)
+    fprintf(stdout,
+            "Number of distinct topology hashes: %lu\n",
+            count_hashes(&out, total));
+
+  free(out.count);
+  for (i = 0; i < tip_count; ++i)
+    free(tip_labels[i]);
 }
 
 static char ** labels_load()
@@ -271,7 +626,7 @@ static void cmd_utree_bf()
   labels = labels_load();
 
   /* generate all tree topologies */
-  tree_exhaust(opt_exhaustive, labels);
+  tree_exhaust(opt_exhaustive, labels, 0);
 
   free(labels);
 }
@@ -283,10 +638,8 @@ static void cmd_rtree_bf()
   /* load labels */
   labels = labels_load();
 
-  is_rooted = 1;
-
   /* generate all tree topologies */
-  tree_exhaust(opt_exhaustive, labels);
+  tree_exhaust(opt_exhaustive, labels, 1);
 
   free(labels);
 }
@@ -49,16 +49,6 @@ unsigned long hash_fnv(char * s)
   return hash;
 }
 
-static ht_item_t * hashitem_create(unsigned long key, void * value)
-{
-  ht_item_t * hi = (ht_item_t *)xmalloc(sizeof(ht_item_t));
-  
-  hi->key   = key;
-  hi->value = value;
-
-  return hi;
-}
-
 int hashtable_strcmp(void * x, void * y)
 {
   return !strcmp((char *)x, (char *)y);
@@ -77,37 +67,102 @@ int hashtable_paircmp(void * stored, void * query)
   return !strcmp(stored_pair->label, query_label);
 }
 
+/* The hash table uses open addressing with linear probing and Robin Hood
+   insertion, i.e. an element being inserted displaces any element that is
+   closer to its home slot. This keeps probe sequences short and allows a
+   lookup to stop as soon as it meets an element closer to home than the
+   number of probes done so far. Empty slots are denoted by a NULL value, and
+   therefore NULL values cannot be stored */
+
+static unsigned long probe_distance(hashtable_t * ht,
+                                    unsigned long slot,
+                                    unsigned long key)
+{
+  return (slot - (key & (ht->table_size-1))) & (ht->table_size-1);
+}
+
+static void hashtable_place(hashtable_t * ht, unsigned long key, void * value)
+{
+  unsigned long mask = ht->table_size-1;
+  unsigned long index = key & mask;
+  unsigned long dist = 0;
+
+  while (ht->entries[index].value)
+  {
+    ht_item_t * hi = ht->entries+index;
+    unsigned long hi_dist = probe_distance(ht,index,hi->key);
+
+    /* displace the element if it is closer to its home slot */
+    if (hi_dist < dist)
+    {
+      unsigned long tkey = hi->key;
+      void * tvalue = hi->value;
+
+      hi->key = key;
+      hi->value = value;
+
+      key = tkey;
+      value = tvalue;
+      dist = hi_dist;
+    }
+
+    index = (index+1) & mask;
+    ++dist;
+  }
+
+  ht->entries[index].key = key;
+  ht->entries[index].value = value;
+}
+
+static void hashtable_grow(hashtable_t * ht)
+{
+  unsigned long i;
+  unsigned long old_size = ht->table_size;
+  ht_item_t * old_entries = ht->entries;
+
+  ht->table_size <<= 1;
+  ht->entries = (ht_item_t *)xcalloc(ht->table_size, sizeof(ht_item_t));
+
+  for (i = 0; i < old_size; ++i)
+    if (old_entries[i].value)
+      hashtable_place(ht, old_entries[i].key, old_entries[i].value);
+
+  free(old_entries);
+}
+
 void * hashtable_find(hashtable_t * ht,
                       void * x,
                       unsigned long hash,
                       int (*cb_cmp)(void *, void *))
 {
-  unsigned long index = hash & (ht->table_size-1);
-  list_item_t * li = (list_item_t *)(ht->entries[index]->head);
+  unsigned long mask = ht->table_size-1;
+  unsigned long index = hash & mask;
+  unsigned long dist = 0;
 
-  while (li)
+  while (ht->entries[index].value)
   {
-    ht_item_t * hi = (ht_item_t *)(li->data);
+    ht_item_t * hi = ht->entries+index;
 
     if ((hash == hi->key) && cb_cmp(hi->value, x))
       return hi->value;
-    
-    li = li->next; 
+
+    /* the element would have displaced this one */
+    if (probe_distance(ht,index,hi->key) < dist)
+      break;
+
+    index = (index+1) & mask;
+    ++dist;
   }
 
   return NULL;
 }
-               
 
 hashtable_t * hashtable_create(unsigned long items_count)
 {
-  unsigned long i;
-  unsigned long size = 1;
-
-  if (!items_count) return NULL;
+  unsigned long size = 16;
 
   /* compute a size of at least double the items count that is a
-     multiple of 2 */
+     power of 2 */
   items_count <<= 1;
   while (size < items_count)
     size <<= 1;
@@ -116,14 +171,7 @@ hashtable_t * hashtable_create(unsigned long items_count)
   hashtable_t * ht = (hashtable_t *)xmalloc(sizeof(hashtable_t));
   ht->table_size = size;
   ht->entries_count = 0;
-
-  /* allocate and init entries array */
-  ht->entries = (list_t **)xmalloc(size*sizeof(list_t *));
-  for (i = 0; i < size; ++i)
-  {
-    ht->entries[i] = (list_t *)xmalloc(sizeof(list_t));
-    memset(ht->entries[i], 0, sizeof(list_t));
-  }
+  ht->entries = (ht_item_t *)xcalloc(size, sizeof(ht_item_t));
 
   return ht;
 }
@@ -133,17 +181,14 @@ int hashtable_insert(hashtable_t * ht,
                      unsigned long hash,
                      int (*cb_cmp)(void *, void *))
 {
-  /* size is always a multiple of 2 and greater than 2 */
-  unsigned long index = hash & (ht->table_size-1);
-
-  list_t * list = ht->entries[index];
-
-
   if (hashtable_find(ht, x, hash, cb_cmp))
     return 0;
 
-  ht_item_t * item = hashitem_create(hash,x);
-  list_append(list, item);
+  /* keep load factor below 3/4 */
+  if ((ht->entries_count+1)*4 > ht->table_size*3)
+    hashtable_grow(ht);
+
+  hashtable_place(ht, hash, x);
 
   ht->entries_count++;
 
@@ -157,24 +202,10 @@ void hashtable_destroy(hashtable_t * ht, void (*cb_dealloc)(void *))
   if (cb_dealloc)
   {
     for (i = 0; i < ht->table_size; ++i)
-    {
-      list_t * list = ht->entries[i];
-      
-      list_item_t * head = list->head;
-      while (head)
-      {
-        ht_item_t * hi = (ht_item_t *)(head->data);
-        cb_dealloc(hi->value);
-        head = head->next;
-      }
-    }
+      if (ht->entries[i].value)
+        cb_dealloc(ht->entries[i].value);
   }
 
-  for (i = 0; i < ht->table_size; ++i)
-  {
-    list_clear(ht->entries[i], free);
-    free(ht->entries[i]);
-  }
   free(ht->entries);
   free(ht); 
 }
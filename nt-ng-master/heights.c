@@ -0,0 +1,130 @@
+/*
+    Copyright (C) 2015-2017 Tomas Flouri
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Tomas Flouri <t.flouris@ucl.ac.uk>,
+    Department of Genetics, Evolution and Environment,
+    University College London,
+    Gower Street, London WC1E 6BT, England
+*/
+
+
+#include "newick-tools.h"
+
+/* Node ages, heights and depths of a tree, computed once with two linear
+   sweeps over tree->inner and cached on the tree until its topology or
+   branch lengths change. Arrays are indexed by NTREE_SLOT(). */
+
+/* tolerance for comparing root-to-tip path lengths */
+#define ULTRAMETRIC_EPSILON 1e-5
+
+static heights_t * heights_alloc(long nodes)
+{
+  heights_t * h = (heights_t *)xmalloc(sizeof(heights_t));
+
+  h->age = (double *)xmalloc((size_t)nodes * sizeof(double));
+  h->dist = (double *)xmalloc((size_t)nodes * sizeof(double));
+  h->height = (long *)xmalloc((size_t)nodes * sizeof(long));
+  h->depth = (long *)xmalloc((size_t)nodes * sizeof(long));
+
+  return h;
+}
+
+static void heights_compute(ntree_t * tree, heights_t * h)
+{
+  long i;
+  int j;
+
+  h->ultrametric = 1;
+
+  for (i = 0; i < tree->leaves_count; ++i)
+  {
+    h->age[i] = 0;
+    h->height[i] = 0;
+  }
+
+  /* postorder: the age of a node is taken over its first child and the
+     remaining children must agree with it for the tree to be ultrametric */
+  for (i = 0; i < tree->inner_count; ++i)
+  {
+    node_t * node = tree->inner[i];
+    long slot = tree->leaves_count + i;
+    long height = 0;
+    node_t * child = node->children[0];
+    double age = h->age[NTREE_SLOT(tree,child)] + child->length;
+
+    for (j = 0; j < node->children_count; ++j)
+    {
+      long cslot;
+
+      child = node->children[j];
+      cslot = NTREE_SLOT(tree,child);
+
+      if (h->height[cslot] > height)
+        height = h->height[cslot];
+
+      if (fabs(h->age[cslot] + child->length - age) > ULTRAMETRIC_EPSILON)
+        h->ultrametric = 0;
+    }
+
+    h->age[slot] = age;
+    h->height[slot] = height+1;
+  }
+
+  /* reverse postorder visits parents before their children */
+  i = NTREE_SLOT(tree,tree->root);
+  h->depth[i] = 0;
+  h->dist[i] = 0;
+  for (i = tree->inner_count-1; i >= 0; --i)
+  {
+    node_t * node = tree->inner[i];
+    long slot = tree->leaves_count + i;
+
+    for (j = 0; j < node->children_count; ++j)
+    {
+      node_t * child = node->children[j];
+      long cslot = NTREE_SLOT(tree,child);
+
+      h->depth[cslot] = h->depth[slot] + 1;
+      h->dist[cslot] = h->dist[slot] + child->length;
+    }
+  }
+}
+
+heights_t * ntree_heights(ntree_t * tree)
+{
+  if (!tree->heights)
+  {
+    tree->heights = heights_alloc(tree->leaves_count + tree->inner_count);
+    heights_compute(tree, tree->heights);
+  }
+
+  return tree->heights;
+}
+
+void ntree_heights_invalidate(ntree_t * tree)
+{
+  heights_t * h = tree->heights;
+
+  if (!h) return;
+
+  free(h->age);
+  free(h->dist);
+  free(h->height);
+  free(h->depth);
+  free(h);
+
+  tree->heights = NULL;
+}
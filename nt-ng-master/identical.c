@@ -22,6 +22,18 @@
 
 #include "newick-tools.h"
 
+static void reverse_nodes(node_t ** nodelist, int count)
+{
+  int i,j;
+
+  for (i = 0, j = count-1; i < j; ++i, --j)
+  {
+    node_t * temp = nodelist[i];
+    nodelist[i] = nodelist[j];
+    nodelist[j] = temp;
+  }
+}
+
 static void traverse_sorted(node_t * root, node_t ** nodelist, int * index)
 {
   if (!root) return;
@@ -84,35 +96,61 @@ static void traverse_sorted(node_t * root, node_t ** nodelist, int * index)
 
   if (swap)
   {
-    /* swap the two trees */
-    node_t ** temp = (node_t **)xmalloc(left_len * sizeof(node_t *));
-    memcpy(temp, nodelist+left_start, left_len * sizeof(node_t *));
-    memcpy(nodelist+left_start, nodelist+right_start, right_len * sizeof(node_t *));
-    memcpy(nodelist+left_start+right_len, temp, left_len * sizeof(node_t *));
-    free(temp);
+    /* swap the two trees in place by rotating the two ranges */
+    reverse_nodes(nodelist+left_start, left_len);
+    reverse_nodes(nodelist+right_start, right_len);
+    reverse_nodes(nodelist+left_start, left_len+right_len);
   }
 
   nodelist[(*index)++] = root;
 }
 
+/* list the nodes of a binary rooted tree in postorder, such that of two
+   sibling subtrees the smaller one (or the one with the smaller first tip
+   label) comes first. Two trees have the same topology iff their lists
+   match node by node */
+void identical_sort(ntree_t * tree, node_t ** nodelist)
+{
+  int index = 0;
+
+  traverse_sorted(tree->root, nodelist, &index);
+}
+
+/* compare two lists of count nodes obtained with identical_sort */
+int identical_match(node_t ** ref_nodes, node_t ** tgt_nodes, long count)
+{
+  long j;
+
+  for (j = 0; j < count; ++j)
+  {
+    node_t * x = ref_nodes[j];
+    node_t * y = tgt_nodes[j];
+
+    if (!x->children_count != !y->children_count)
+      return 0;
+
+    if (!x->label != !y->label)
+      return 0;
+
+    if (x->label && strcmp(x->label, y->label))
+      return 0;
+  }
+
+  return 1;
+}
+
 void cmd_identical(void)
 {
   long i = 0;
-  long j = 0;
-  FILE * fp_input;
+  treeio_t * fp_input;
   FILE * fp_output;
-  FILE * fp_ref;
 
   if (!opt_treefile)
     fatal("An input file must be specified");
 
-  fp_input  = xopen(opt_treefile,"r");
+  fp_input  = treeio_open_selected(opt_treefile);
 
-  fp_ref = xopen(opt_identical,"r");
-  char * ref_newick = getnextline(fp_ref);
-  fclose(fp_ref);
-
-  ntree_t * reftree = ntree_parse_newick(ref_newick);
+  ntree_t * reftree = treeio_read_first(opt_identical);
   if (!ntree_check_rbinary(reftree))
     fatal("--identical works only on binary rooted trees");
 
@@ -125,20 +163,18 @@ void cmd_identical(void)
   else
     fp_output = xopen(opt_outfile,"w");
 
-  char * newick;
+  ntree_t * tree;
 
   node_t ** ref_nodes = (node_t **)xcalloc(reftree->leaves_count+reftree->inner_count,
                                            sizeof(node_t *));
   node_t ** tgt_nodes = (node_t **)xcalloc(reftree->leaves_count+reftree->inner_count,
                                            sizeof(node_t *));
 
-  int index = 0;
-  traverse_sorted(reftree->root, ref_nodes, &index);
+  identical_sort(reftree, ref_nodes);
 
-  while ((newick = getnextline(fp_input)))
+  while (treeio_next(fp_input, &tree))
   {
-    ++i;
-    ntree_t * tree = ntree_parse_newick(newick);
+    i = treeio_treeno(fp_input);
     if (!tree)
       fatal("Cannot parse tree %d",i);
 
@@ -151,56 +187,21 @@ void cmd_identical(void)
       continue;
     }
 
-    index = 0;
-    traverse_sorted(tree->root, tgt_nodes, &index);
-
-    for (j = 0; j < index; ++j)
-    {
-      if (ref_nodes[j]->children_count == 0 && tgt_nodes[j]->children_count > 0)
-      {
-//        printf("Trees have different topologies\n");
-        break;
-      }
-      else if (ref_nodes[j]->children_count > 0 && tgt_nodes[j]->children_count == 0)
-      {
-//        printf("Trees have different topologies\n");
-        break;
-      }
-
-      if (!ref_nodes[j]->label && tgt_nodes[j]->label)
-      {
-//        printf("Trees have different topologies\n");
-        break;
-      }
-      else if (ref_nodes[j]->label && !tgt_nodes[j]->label)
-      {
- //       printf("Trees have different topologies\n");
-        break;
-      }
-      else if (ref_nodes[j]->label && tgt_nodes[j]->label)
-      {
-        if (strcmp(ref_nodes[j]->label, tgt_nodes[j]->label))
-        {
-  //        printf("Trees have different topologies\n");
-          break;
-        }
-      }
-    }
+    identical_sort(tree, tgt_nodes);
 
-    if (j == index)
+    if (identical_match(ref_nodes, tgt_nodes,
+                        reftree->leaves_count + reftree->inner_count))
       printf("Tree %ld has identical topology\n", i);
 
 
     ntree_destroy(tree,NULL);
-    free(newick);
   }
 
   free(ref_nodes);
   free(tgt_nodes);
   ntree_destroy(reftree,NULL);
-  free(ref_newick);
 
-  fclose(fp_input);
+  treeio_close(fp_input);
   if (opt_outfile)
     fclose(fp_output);
 
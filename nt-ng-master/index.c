@@ -0,0 +1,98 @@
+/*
+    Copyright (C) 2015-2017 Tomas Flouri
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Tomas Flouri <t.flouris@ucl.ac.uk>,
+    Department of Genetics, Evolution and Environment,
+    University College London,
+    Gower Street, London WC1E 6BT, England
+*/
+
+
+#include "newick-tools.h"
+#include <sys/stat.h>
+
+/* Writes the sidecar index FILE.index of a newick file (see treeio.c). After
+   a header line with the size of the file in bytes, there is one line per
+   tree with the tree number, the offset and length in bytes of its newick
+   string (without the newline), its number of tips, and the FNV hash of the
+   string. Every tree is parsed, such that the index also checks the file */
+
+void cmd_index(void)
+{
+  long treeno = 0;
+  long offset = 0;
+  char * newick;
+  char * index_file;
+  struct stat st;
+
+  if (!opt_treefile)
+    fatal("An input file must be specified");
+
+  FILE * fp_input = xopen(opt_treefile, "r");
+
+  newick = getnextline(fp_input);
+  if (newick && !strncmp(newick, "NTRB", 4))
+    fatal("File %s is a binary tree file, which needs no index",
+          opt_treefile);
+
+  asprintf(&index_file, "%s%s", opt_treefile, INDEX_SUFFIX);
+  FILE * fp_index = xopen(index_file, "w");
+
+  /* the size identifies the indexed version of the file */
+  fprintf(fp_index,
+          INDEX_HEADER,
+          stat(opt_treefile, &st) ? -1l : (long)st.st_size);
+  fprintf(fp_index, "# tree\toffset\tlength\ttips\thash\n");
+
+  for (; newick; newick = getnextline(fp_input))
+  {
+    ++treeno;
+
+    /* a partial index would look complete, as its header matches the file */
+    ntree_t * tree = ntree_parse_newick(newick);
+    if (!tree)
+    {
+      fclose(fp_index);
+      unlink(index_file);
+      fatal("Cannot parse tree %ld", treeno);
+    }
+
+    long length = (long)strlen(newick);
+
+    fprintf(fp_index,
+            "%ld\t%ld\t%ld\t%d\t%016lx\n",
+            treeno, offset, length, tree->leaves_count, hash_fnv(newick));
+
+    /* the newline */
+    offset += length + 1;
+
+    ntree_destroy(tree,NULL);
+    free(newick);
+  }
+
+  fclose(fp_input);
+
+  if (fclose(fp_index))
+  {
+    unlink(index_file);
+    fatal("Cannot write file %s", index_file);
+  }
+
+  if (!opt_quiet)
+    fprintf(stdout, "Indexed %ld trees in %s\n", treeno, index_file);
+
+  free(index_file);
+}
@@ -22,6 +22,25 @@
 
 #include "newick-tools.h"
 
+/* number of trees parsed per thread before computing --table rows */
+#define INFO_BATCH_TREES 16
+
+typedef struct info_ws_s
+{
+  double * blen;              /* branch lengths */
+  dinfo_t * dinfo;            /* DP table for the diameter */
+  long * depth;               /* depth (in edges) of each inner node */
+  long * hist;                /* number of tips at each depth */
+  long alloc;                 /* number of nodes the arrays can hold */
+} info_ws_t;
+
+typedef struct info_batch_s
+{
+  ntree_t ** trees;
+  long * treeno;              /* input number of each tree in the batch */
+  info_ws_t * ws;
+} info_batch_t;
+
 static void find_innerdegrees(ntree_t * tree,
                                int * min_inner_degree,
                                int * max_inner_degree)
@@ -103,18 +122,11 @@ static void show_tree_info(ntree_t * tree)
   printf("  Branch length variance: %.*f\n", opt_precision, var_blen);
   printf("  Branch length stdev: %.*f\n\n", opt_precision, stdev_blen);
 
-  fill_dinfo_table(tree);
+  dinfo = (dinfo_t *)xmalloc((size_t)(tree->leaves_count+tree->inner_count) *
+                             sizeof(dinfo_t));
+  double diameter = ntree_diameter(tree, dinfo, NULL);
+  free(dinfo);
 
-  /* other interesting stuff */
-  dinfo = tree->inner[0]->data;
-  double diameter = dinfo->diameter;
-  for (i = 1; i < tree->inner_count; ++i)
-  {
-    dinfo = tree->inner[i]->data;
-
-    if (dinfo->diameter > diameter)
-      diameter = dinfo->diameter;
-  }
   printf("  Diameter: %.*f\n", opt_precision, diameter);
 
   free(blen);
@@ -205,41 +217,248 @@ void ntree_info(ntree_t * tree)
 }
 #endif
 
+static void info_ws_reserve(info_ws_t * ws, long nodes)
+{
+  if (nodes <= ws->alloc)
+    return;
+
+  free(ws->blen);
+  free(ws->dinfo);
+  free(ws->depth);
+  free(ws->hist);
+
+  ws->blen = (double *)xmalloc((size_t)nodes * sizeof(double));
+  ws->dinfo = (dinfo_t *)xmalloc((size_t)nodes * sizeof(dinfo_t));
+  ws->depth = (long *)xmalloc((size_t)nodes * sizeof(long));
+  ws->hist = (long *)xcalloc((size_t)(nodes+1), sizeof(long));
+  ws->alloc = nodes;
+}
+
+static void info_row(long index, long thread, strbuf_t * out, void * data)
+{
+  long i;
+  int j;
+  info_batch_t * batch = (info_batch_t *)data;
+  info_ws_t * ws = batch->ws + thread;
+  ntree_t * tree = batch->trees[index];
+  long nodes = tree->leaves_count + tree->inner_count;
+  long edges = nodes - 1;
+  double min_blen, max_blen, mean_blen, median_blen, var_blen, stdev_blen;
+  double diameter = 0;
+  long colless = 0;
+  long sackin = 0;
+  long cherries = 0;
+  long max_depth = 0;
+  const char * shape;
+
+  info_ws_reserve(ws, nodes);
+
+  /* branch length statistics (the root branch is excluded) */
+  for (i = 0; i < tree->leaves_count; ++i)
+    ws->blen[i] = tree->leaves[i]->length;
+  for (i = 0; i < tree->inner_count - 1; ++i)
+    ws->blen[i+tree->leaves_count] = tree->inner[i]->length;
+
+  stats(ws->blen,
+        edges,
+        &min_blen,
+        &max_blen,
+        &mean_blen,
+        &median_blen,
+        &var_blen,
+        &stdev_blen);
+
+  if (tree->inner_count)
+    diameter = ntree_diameter(tree, ws->dinfo, NULL);
+
+  /* shape statistics in one sweep over the inner nodes in reverse postorder,
+     such that the depth of a parent is known before its children */
+  for (i = tree->inner_count-1; i >= 0; --i)
+  {
+    node_t * node = tree->inner[i];
+    long depth = node->parent ? ws->depth[node->parent->index] + 1 : 0;
+    int tip_children = 0;
+
+    ws->depth[i] = depth;
+
+    for (j = 0; j < node->children_count; ++j)
+    {
+      if (node->children[j]->children_count)
+        continue;
+
+      tip_children++;
+      ws->hist[depth+1]++;
+      sackin += depth+1;
+      if (depth+1 > max_depth)
+        max_depth = depth+1;
+    }
+
+    if (node->children_count == 2)
+      colless += labs((long)node->children[0]->leaves -
+                      (long)node->children[1]->leaves);
+
+    if (tip_children == 2)
+      cherries++;
+  }
+
+  if (!tree->inner_count)
+    shape = "-";
+  else if (ntree_check_rbinary(tree))
+    shape = "rooted";
+  else if (ntree_check_unrooted(tree))
+    shape = "unrooted";
+  else
+    shape = "n-ary";
+
+  strbuf_printf(out,
+                "%ld\t%d\t%d\t%d\t%s\t",
+                batch->treeno[index],
+                tree->leaves_count,
+                tree->inner_count,
+                tree->root->children_count,
+                shape);
+  strbuf_append_double(out, mean_blen*edges, opt_precision);
+  strbuf_append(out, "\t", 1);
+  strbuf_append_double(out, min_blen, opt_precision);
+  strbuf_append(out, "\t", 1);
+  strbuf_append_double(out, max_blen, opt_precision);
+  strbuf_append(out, "\t", 1);
+  strbuf_append_double(out, mean_blen, opt_precision);
+  strbuf_append(out, "\t", 1);
+  strbuf_append_double(out, median_blen, opt_precision);
+  strbuf_append(out, "\t", 1);
+  strbuf_append_double(out, var_blen, opt_precision);
+  strbuf_append(out, "\t", 1);
+  strbuf_append_double(out, stdev_blen, opt_precision);
+  strbuf_append(out, "\t", 1);
+  strbuf_append_double(out, diameter, opt_precision);
+  strbuf_printf(out,
+                "\t%ld\t%ld\t%ld\t%ld\t",
+                colless,
+                sackin,
+                cherries,
+                max_depth);
+
+  /* number of tips at depths 1..max_depth */
+  for (i = 1; i <= max_depth; ++i)
+  {
+    strbuf_printf(out, i > 1 ? ",%ld" : "%ld", ws->hist[i]);
+    ws->hist[i] = 0;
+  }
+  if (!max_depth)
+    strbuf_append(out, "-", 1);
+  strbuf_append(out, "\n", 1);
+
+  ntree_destroy(tree,NULL);
+  batch->trees[index] = NULL;
+}
+
+/* Stream a collection of trees and write one tab-separated row of branch
+   length and shape statistics per tree. Trees are parsed sequentially and
+   their rows computed in parallel, one batch at a time */
+static void info_table()
+{
+  long i;
+  long batch_size;
+  long count;
+  treeio_t * fp_input;
+  FILE * fp_output;
+  info_batch_t batch;
+  ntree_t * tree;
+
+  fp_input = treeio_open_selected(opt_treefile);
+  fp_output = opt_outfile ?
+                xopen(opt_outfile,"w") : stdout;
+
+  batch_size = opt_threads * INFO_BATCH_TREES;
+  batch.trees = (ntree_t **)xmalloc((size_t)batch_size * sizeof(ntree_t *));
+  batch.treeno = (long *)xmalloc((size_t)batch_size * sizeof(long));
+  batch.ws = (info_ws_t *)xcalloc((size_t)opt_threads, sizeof(info_ws_t));
+
+  fprintf(fp_output,
+          "tree\ttips\tinner\troot_degree\tshape\tlength\tmin_blen\tmax_blen\t"
+          "mean_blen\tmedian_blen\tvar_blen\tstdev_blen\tdiameter\tcolless\t"
+          "sackin\tcherries\tmax_depth\tdepth_histogram\n");
+
+  while (1)
+  {
+    count = 0;
+    while (count < batch_size && treeio_next(fp_input, &tree))
+    {
+      if (!tree)
+        fatal("Cannot parse tree %ld", treeio_treeno(fp_input));
+
+      batch.treeno[count] = treeio_treeno(fp_input);
+      batch.trees[count++] = tree;
+    }
+
+    if (!count)
+      break;
+
+    threads_write_ordered(fp_output,
+                          count,
+                          batch.trees[0]->leaves_count,
+                          info_row,
+                          &batch);
+  }
+
+  if (opt_outfile)
+    fclose(fp_output);
+  treeio_close(fp_input);
+
+  for (i = 0; i < opt_threads; ++i)
+  {
+    free(batch.ws[i].blen);
+    free(batch.ws[i].dinfo);
+    free(batch.ws[i].depth);
+    free(batch.ws[i].hist);
+  }
+  free(batch.ws);
+  free(batch.trees);
+  free(batch.treeno);
+}
+
 void cmd_info()
 {
-  char * newick;
+  ntree_t * tree;
   long i = 0;
-  FILE * fp_input;
+  treeio_t * fp_input;
+
+  if (opt_table)
+  {
+    info_table();
+    return;
+  }
 
   /* parse tree */
   if (!opt_quiet)
     fprintf(stdout, "Parsing tree file...\n");
 
   /* open input tree file */
-  fp_input = xopen(opt_treefile,"r");
+  fp_input = treeio_open_selected(opt_treefile);
 
   /* loop through the collection of trees */
-  while ((newick = getnextline(fp_input)))
+  while (treeio_next(fp_input, &tree))
   {
-    fprintf(stdout, "\nProcessing tree %ld:\n", ++i);
-    ntree_t * tree = ntree_parse_newick(newick);
+    i = treeio_treeno(fp_input);
+    fprintf(stdout, "\nProcessing tree %ld:\n", i);
+    if (!tree)
+      fatal("Cannot parse tree %ld", i);
 
     show_tree_info(tree);
 
-    free(newick);
-
     /* deallocate tree structure */
     ntree_destroy(tree,free);
   }
 
-  fclose(fp_input);
+  treeio_close(fp_input);
 }
 
 void cmd_showlabels()
 {
-  char * newick;
+  ntree_t * tree;
   long i = 0;
-  FILE * fp_input;
+  treeio_t * fp_input;
   int j;
 
   /* parse tree */
@@ -247,12 +466,11 @@ void cmd_showlabels()
     fprintf(stdout, "Parsing tree file...\n");
 
   /* open input tree file */
-  fp_input = xopen(opt_treefile,"r");
+  fp_input = treeio_open_selected(opt_treefile);
 
   /* loop through the collection of trees */
-  while ((newick = getnextline(fp_input)))
+  while (treeio_next(fp_input, &tree))
   {
-    ntree_t * tree = ntree_parse_newick(newick);
     if (!tree)
       fatal("Error while reading tree");
 
@@ -263,18 +481,18 @@ void cmd_showlabels()
         printf("%s\n", tree->leaves[j]->label);
     }
 
-    free(newick);
-
     /* deallocate tree structure */
     ntree_destroy(tree,NULL);
   }
+
+  treeio_close(fp_input);
 }
 
 void cmd_showbranches()
 {
-  char * newick;
+  ntree_t * tree;
   long i = 0;
-  FILE * fp_input;
+  treeio_t * fp_input;
   int j;
 
   /* parse tree */
@@ -282,12 +500,11 @@ void cmd_showbranches()
     fprintf(stdout, "Parsing tree file...\n");
 
   /* open input tree file */
-  fp_input = xopen(opt_treefile,"r");
+  fp_input = treeio_open_selected(opt_treefile);
 
   /* loop through the collection of trees */
-  while ((newick = getnextline(fp_input)))
+  while (treeio_next(fp_input, &tree))
   {
-    ntree_t * tree = ntree_parse_newick(newick);
     if (!tree)
       fatal("Error while reading tree");
 
@@ -302,11 +519,9 @@ void cmd_showbranches()
         printf("[-] %.*f\n", opt_precision, tree->inner[j]->length);
     }
 
-    free(newick);
-
     /* deallocate tree structure */
     ntree_destroy(tree,NULL);
   }
 
-  fclose(fp_input);
+  treeio_close(fp_input);
 }
@@ -0,0 +1,112 @@
+/*
+    Copyright (C) 2015-2017 Tomas Flouri
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Tomas Flouri <t.flouris@ucl.ac.uk>,
+    Department of Genetics, Evolution and Environment,
+    University College London,
+    Gower Street, London WC1E 6BT, England
+*/
+
+
+#include "newick-tools.h"
+
+/* Global pool of tip labels. Every distinct label is assigned a small
+   integer id (in order of first appearance) that is shared across all trees
+   processed in a run, such that tips of different trees can be matched by
+   comparing ids instead of strings. The pool is not thread-safe, but it can
+   be read by several threads as long as no labels are interned meanwhile,
+   i.e. trees must be parsed outside parallel sections, or, as in
+   threads_pipeline, by one thread while the others leave the pool alone */
+
+static hashtable_t * label_ht = NULL;
+static char ** label_list = NULL;
+static long label_list_count = 0;
+static long label_list_alloc = 0;
+
+long label_find(char * label)
+{
+  if (!label_ht) return -1;
+
+  pair_t * pair = (pair_t *)hashtable_find(label_ht,
+                                           label,
+                                           hash_fnv(label),
+                                           hashtable_paircmp);
+
+  return pair ? pair->index : -1;
+}
+
+long label_intern(char * label)
+{
+  unsigned long hash = hash_fnv(label);
+
+  if (!label_ht)
+    label_ht = hashtable_create(1024);
+
+  pair_t * pair = (pair_t *)hashtable_find(label_ht,
+                                           label,
+                                           hash,
+                                           hashtable_paircmp);
+  if (pair)
+    return pair->index;
+
+  if (label_list_count == label_list_alloc)
+  {
+    label_list_alloc = label_list_alloc ? label_list_alloc << 1 : 1024;
+    label_list = (char **)xrealloc(label_list,
+                                   (size_t)label_list_alloc * sizeof(char *));
+  }
+
+  pair = (pair_t *)xmalloc(sizeof(pair_t));
+  pair->label = xstrdup(label);
+  pair->index = (int)label_list_count;
+  hashtable_insert(label_ht, (void *)pair, hash, hashtable_paircmp);
+
+  label_list[label_list_count] = pair->label;
+
+  return label_list_count++;
+}
+
+char * label_string(long id)
+{
+  assert(id >= 0 && id < label_list_count);
+
+  return label_list[id];
+}
+
+long label_count()
+{
+  return label_list_count;
+}
+
+static void dealloc_pair(void * data)
+{
+  pair_t * pair = (pair_t *)data;
+
+  free(pair->label);
+  free(pair);
+}
+
+void label_pool_destroy()
+{
+  if (label_ht)
+    hashtable_destroy(label_ht, dealloc_pair);
+
+  free(label_list);
+
+  label_ht = NULL;
+  label_list = NULL;
+  label_list_count = label_list_alloc = 0;
+}
@@ -0,0 +1,214 @@
+/*
+    Copyright (C) 2015-2017 Tomas Flouri
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Tomas Flouri <t.flouris@ucl.ac.uk>,
+    Department of Genetics, Evolution and Environment,
+    University College London,
+    Gower Street, London WC1E 6BT, England
+*/
+
+
+#include "newick-tools.h"
+
+/* Simulation of lineage-tracing barcodes on uniform cell divisions.
+
+   Starting from a single cell, every cell divides opt_lineage times, giving a
+   balanced tree of 2^opt_lineage cells. Each cell carries a barcode of
+   opt_targets CRISPR target sites, initially unedited. After each division,
+   every unedited target of a daughter cell is edited with probability
+   opt_mutation_rate into one of opt_states-1 edited states, chosen uniformly.
+   Edits are irreversible. With probability opt_deletion_rate, a daughter cell
+   also suffers an intertarget deletion that removes all targets between two
+   distinct, uniformly chosen target sites (inclusive).
+
+   The ground truth tree is written in the format of the reference trees,
+   i.e. the balanced tree of cells c_0000001, c_0000002, ... rooted by the
+   unedited ancestral barcode 'root'. Barcodes of each replicate are written
+   to a separate file as a table of cell name and barcode, separated by a tab,
+   in the format and with the symbols of the simulated barcodes in
+   sampling_test/simulations: 0 for unedited targets, then 1-9, A-Z, _, a-w
+   and so on for the edited states, and x for deleted targets.
+*/
+
+#define LINEAGE_MAX_DIVISIONS 30
+
+/* unedited state followed by the edited states */
+static const char alphabet[] =
+  "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ_abcdefghijklmnopqrstuvwyz";
+
+#define LINEAGE_MAX_STATES ((long)sizeof(alphabet) - 1)
+#define LINEAGE_DELETED 'x'
+
+static void edit_barcode(char * barcode, rng_t * rng)
+{
+  long i,j;
+
+  for (i = 0; i < opt_targets; ++i)
+    if (barcode[i] == alphabet[0] && rng_uniform(rng) < opt_mutation_rate)
+      barcode[i] = alphabet[1+rng_bounded(rng,(unsigned long)(opt_states-1))];
+
+  if (opt_deletion_rate && rng_uniform(rng) < opt_deletion_rate)
+  {
+    /* select two distinct targets such that i < j */
+    i = (long)rng_bounded(rng, (unsigned long)opt_targets);
+    j = (long)rng_bounded(rng, (unsigned long)(opt_targets-1));
+    if (j >= i) ++j;
+    if (i > j) SWAP(i,j);
+
+    memset(barcode+i, LINEAGE_DELETED, (size_t)(j-i+1));
+  }
+}
+
+/* barcodes[d] holds the barcode of the current cell at division depth d */
+static void divide(char ** barcodes,
+                   long depth,
+                   long * cell,
+                   rng_t * rng,
+                   FILE * fp)
+{
+  long i;
+
+  if (depth == opt_lineage)
+  {
+    fprintf(fp, "c_%07ld\t%.*s\n",
+            ++(*cell), (int)opt_targets, barcodes[depth]);
+    return;
+  }
+
+  for (i = 0; i < 2; ++i)
+  {
+    memcpy(barcodes[depth+1], barcodes[depth], (size_t)opt_targets);
+    edit_barcode(barcodes[depth+1], rng);
+    divide(barcodes, depth+1, cell, rng, fp);
+  }
+}
+
+/* returns the file name of replicate index. A .gz or .zst suffix of
+   --barcodes is moved to the end, such that the files are compressed */
+static char * replicate_filename(long index)
+{
+  char * filename;
+  const char * suffix = "";
+  size_t len = strlen(opt_barcodes);
+
+  if (len > 3 && !strcmp(opt_barcodes+len-3, ".gz"))
+    suffix = ".gz";
+  else if (len > 4 && !strcmp(opt_barcodes+len-4, ".zst"))
+    suffix = ".zst";
+
+  asprintf(&filename, "%.*s_%04ldrep.fas%s",
+           (int)(len - strlen(suffix)), opt_barcodes, index+1, suffix);
+
+  return filename;
+}
+
+static void simulate_replicate(long index, long thread, void * data)
+{
+  long i;
+  long cell = 0;
+  rng_t rng;
+  char * filename;
+
+  char ** barcodes = (char **)xmalloc((size_t)(opt_lineage+1) *
+                                      sizeof(char *));
+  for (i = 0; i <= opt_lineage; ++i)
+    barcodes[i] = (char *)xmalloc((size_t)opt_targets);
+
+  memset(barcodes[0], alphabet[0], (size_t)opt_targets);
+
+  /* each replicate has its own random stream, such that results do not
+     depend on the number of threads */
+  rng_seed(&rng, (unsigned long)opt_seed, (unsigned long)index);
+
+  /* rows are written as they are generated */
+  filename = replicate_filename(index);
+  FILE * fp = xopen(filename, "w");
+
+  divide(barcodes, 0, &cell, &rng, fp);
+
+  if (ferror(fp) | fclose(fp))
+    fatal("Cannot write file %s", filename);
+  free(filename);
+
+  for (i = 0; i <= opt_lineage; ++i)
+    free(barcodes[i]);
+  free(barcodes);
+}
+
+static void append_cells(strbuf_t * out, long depth, long * cell)
+{
+  if (depth == opt_lineage)
+  {
+    strbuf_printf(out, "c_%07ld", ++(*cell));
+    return;
+  }
+
+  strbuf_append(out, "(", 1);
+  append_cells(out, depth+1, cell);
+  strbuf_append(out, ",", 1);
+  append_cells(out, depth+1, cell);
+  strbuf_append(out, ")", 1);
+}
+
+void cmd_simulate_lineage(void)
+{
+  long cell = 0;
+  strbuf_t tree;
+
+  if (opt_lineage < 1 || opt_lineage > LINEAGE_MAX_DIVISIONS)
+    fatal("Argument --lineage must be between 1 and %d",
+          LINEAGE_MAX_DIVISIONS);
+
+  if (opt_targets < 2)
+    fatal("Argument --targets must be at least 2");
+
+  if (opt_states < 2 || opt_states > LINEAGE_MAX_STATES)
+    fatal("Argument --states must be between 2 and %ld", LINEAGE_MAX_STATES);
+
+  if (opt_replicates < 1)
+    fatal("Argument --replicates must be a positive integer");
+
+  if (!opt_outfile && !opt_barcodes)
+    fatal("At least one of --output and --barcodes must be specified");
+
+  /* the tree is the same for all replicates. The two subtrees of the first
+     division are attached directly to the root */
+  if (opt_outfile)
+  {
+    strbuf_init(&tree);
+    strbuf_append(&tree, "(root,", 6);
+    append_cells(&tree, 1, &cell);
+    strbuf_append(&tree, ",", 1);
+    append_cells(&tree, 1, &cell);
+    strbuf_append(&tree, ");\n", 3);
+
+    FILE * fp_output = xopen(opt_outfile,"w");
+    fwrite(tree.data, 1, tree.len, fp_output);
+    if (ferror(fp_output) | fclose(fp_output))
+      fatal("Cannot write file %s", opt_outfile);
+
+    strbuf_free(&tree);
+  }
+
+  if (opt_barcodes)
+  {
+    if (!opt_quiet)
+      fprintf(stdout, "Simulating %ld replicates of %ld cells...\n",
+              opt_replicates, 1l << opt_lineage);
+
+    threads_parallel_for(opt_replicates, simulate_replicate, NULL);
+  }
+}
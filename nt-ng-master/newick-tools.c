@@ -64,6 +64,8 @@ long opt_svg_margintop;
 long opt_svg_marginbottom;
 long opt_svg_showlegend;
 long opt_svg_noderadius;
+long opt_svg_collapse;
+long opt_svg_paths;
 long opt_test;
 long opt_agetree;
 long opt_shuffle_order;
@@ -77,6 +79,19 @@ long opt_filter_eq;
 long opt_force;
 long opt_noprune;
 long opt_contains;
+long opt_unique;
+long opt_replicates;
+long opt_threads;
+long opt_lineage;
+long opt_permutations;
+long opt_count;
+long opt_table;
+long opt_depths;
+double opt_collapse;
+long opt_targets;
+long opt_states;
+double opt_mutation_rate;
+double opt_deletion_rate;
 double opt_svg_legendratio;
 double opt_reset_branches;
 double opt_randomize_min;
@@ -101,6 +116,24 @@ char * opt_shape;
 char * opt_identical;
 char * opt_difftree;
 char * opt_tree_labels;
+char * opt_label_sets;
+char * opt_barcodes;
+char * opt_model;
+char * opt_batch;
+char * opt_range;
+char * opt_measure;
+char * opt_cell_prefix;
+char * opt_checkpoint;
+char * opt_binary;
+char * opt_aggregate;
+char * opt_convert;
+char * opt_profile;
+long opt_bench;
+long opt_max_memory;
+long opt_multiplex;
+long opt_index;
+char * opt_tree_range;
+char * opt_tree_ids;
 
 char * STDIN_NAME = (char*) "/dev/stdin";
 char * STDOUT_NAME = (char*) "/dev/stdout";
@@ -172,6 +205,39 @@ static struct option long_options[] =
   {"force",                no_argument,       0, 0 },  /* 62 */
   {"no-prune",             no_argument,       0, 0 },  /* 63 */
   {"contains",             no_argument,       0, 0 },  /* 64 */
+  {"unique",               no_argument,       0, 0 },  /* 65 */
+  {"label_sets",           required_argument, 0, 0 },  /* 66 */
+  {"replicates",           required_argument, 0, 0 },  /* 67 */
+  {"threads",              required_argument, 0, 0 },  /* 68 */
+  {"lineage",              required_argument, 0, 0 },  /* 69 */
+  {"targets",              required_argument, 0, 0 },  /* 70 */
+  {"states",               required_argument, 0, 0 },  /* 71 */
+  {"mutation_rate",        required_argument, 0, 0 },  /* 72 */
+  {"deletion_rate",        required_argument, 0, 0 },  /* 73 */
+  {"barcodes",             required_argument, 0, 0 },  /* 74 */
+  {"permutations",         required_argument, 0, 0 },  /* 75 */
+  {"count",                no_argument,       0, 0 },  /* 76 */
+  {"model",                required_argument, 0, 0 },  /* 77 */
+  {"collapse",             required_argument, 0, 0 },  /* 78 */
+  {"table",                no_argument,       0, 0 },  /* 79 */
+  {"svg_collapse",         no_argument,       0, 0 },  /* 80 */
+  {"svg_paths",            no_argument,       0, 0 },  /* 81 */
+  {"batch",                required_argument, 0, 0 },  /* 82 */
+  {"range",                required_argument, 0, 0 },  /* 83 */
+  {"measure",              required_argument, 0, 0 },  /* 84 */
+  {"depths",               required_argument, 0, 0 },  /* 85 */
+  {"cell_prefix",          required_argument, 0, 0 },  /* 86 */
+  {"checkpoint",           required_argument, 0, 0 },  /* 87 */
+  {"binary",               required_argument, 0, 0 },  /* 88 */
+  {"aggregate",            required_argument, 0, 0 },  /* 89 */
+  {"convert",              required_argument, 0, 0 },  /* 90 */
+  {"profile",              required_argument, 0, 0 },  /* 91 */
+  {"bench",                required_argument, 0, 0 },  /* 92 */
+  {"max_memory",           required_argument, 0, 0 },  /* 93 */
+  {"multiplex",            no_argument,       0, 0 },  /* 94 */
+  {"index",                no_argument,       0, 0 },  /* 95 */
+  {"tree_range",           required_argument, 0, 0 },  /* 96 */
+  {"tree_ids",             required_argument, 0, 0 },  /* 97 */
   { 0, 0, 0, 0 }
 };
 
@@ -186,6 +252,38 @@ long args_getlong(char * arg)
   return temp;
 }
 
+/* parse INT-INT, INT- or INT into first and last (LONG_MAX if open ended),
+   returning 0 if arg is not of this form */
+int args_getrange(char * arg, long * first, long * last)
+{
+  char * end;
+  char * s;
+
+  *first = strtol(arg, &end, 10);
+  if (end == arg || *first < 1)
+    return 0;
+
+  if (!*end)
+  {
+    *last = *first;
+    return 1;
+  }
+
+  if (*end != '-')
+    return 0;
+
+  s = end+1;
+  if (!*s)
+  {
+    *last = LONG_MAX;
+    return 1;
+  }
+
+  *last = strtol(s, &end, 10);
+
+  return end != s && !*end && *last >= *first;
+}
+
 double args_getdouble(char * arg)
 {
   int len = 0;
@@ -270,6 +368,19 @@ void args_init(int argc, char ** argv)
   opt_force = 0;
   opt_noprune = 0;
   opt_contains = 0;
+  opt_unique = 0;
+  opt_replicates = 1;
+  opt_threads = 1;
+  opt_lineage = 0;
+  opt_permutations = 0;
+  opt_count = 0;
+  opt_collapse = 0.5;
+  opt_table = 0;
+  opt_depths = 9;
+  opt_targets = 10;
+  opt_states = 60;
+  opt_mutation_rate = 0.1;
+  opt_deletion_rate = 0;
 
   opt_show_bitmask = 0;
   opt_bipartitions = 0;
@@ -284,6 +395,8 @@ void args_init(int argc, char ** argv)
   opt_svg_legendratio = 0.1;
   opt_svg_showlegend = 1;
   opt_svg_noderadius = 0;
+  opt_svg_collapse = 0;
+  opt_svg_paths = 0;
   opt_print_ages = 0;
   opt_exhaustive = 0;
   opt_resolve_ladder = 0;
@@ -297,6 +410,24 @@ void args_init(int argc, char ** argv)
   opt_svg_rootpath_color = NULL;
   opt_difftree = NULL;
   opt_tree_labels = NULL;
+  opt_label_sets = NULL;
+  opt_barcodes = NULL;
+  opt_model = NULL;
+  opt_batch = NULL;
+  opt_range = NULL;
+  opt_measure = NULL;
+  opt_cell_prefix = "c_";
+  opt_checkpoint = NULL;
+  opt_binary = NULL;
+  opt_aggregate = NULL;
+  opt_convert = NULL;
+  opt_profile = NULL;
+  opt_bench = 0;
+  opt_max_memory = 1024;
+  opt_multiplex = 0;
+  opt_index = 0;
+  opt_tree_range = NULL;
+  opt_tree_ids = NULL;
 
   while ((c = getopt_long_only(argc, argv, "", long_options, &option_index)) == 0)
   {
@@ -586,6 +717,154 @@ void args_init(int argc, char ** argv)
         opt_contains = 1;
         break;
 
+      case 65:
+        opt_unique = 1;
+        break;
+
+      case 66:
+        opt_label_sets = optarg;
+        break;
+
+      case 67:
+        opt_replicates = args_getlong(optarg);
+        break;
+
+      case 68:
+        opt_threads = args_getlong(optarg);
+        if (opt_threads < 1)
+          fatal("Argument --threads must be a positive integer");
+        break;
+
+      case 69:
+        opt_lineage = args_getlong(optarg);
+        break;
+
+      case 70:
+        opt_targets = args_getlong(optarg);
+        break;
+
+      case 71:
+        opt_states = args_getlong(optarg);
+        break;
+
+      case 72:
+        opt_mutation_rate = args_getdouble(optarg);
+        if (opt_mutation_rate < 0 || opt_mutation_rate > 1)
+          fatal("Argument --mutation_rate must be between 0 and 1");
+        break;
+
+      case 73:
+        opt_deletion_rate = args_getdouble(optarg);
+        if (opt_deletion_rate < 0 || opt_deletion_rate > 1)
+          fatal("Argument --deletion_rate must be between 0 and 1");
+        break;
+
+      case 74:
+        opt_barcodes = optarg;
+        break;
+
+      case 75:
+        opt_permutations = args_getlong(optarg);
+        if (opt_permutations < 0)
+          fatal("Argument --permutations must be a non-negative integer");
+        break;
+
+      case 76:
+        opt_count = 1;
+        break;
+
+      case 77:
+        opt_model = optarg;
+        break;
+
+      case 78:
+        opt_collapse = args_getdouble(optarg);
+        if (opt_collapse < 0 || opt_collapse > 1)
+          fatal("Argument --collapse must be between 0 and 1");
+        break;
+
+      case 79:
+        opt_table = 1;
+        break;
+
+      case 80:
+        opt_svg_collapse = 1;
+        break;
+
+      case 81:
+        opt_svg_paths = 1;
+        break;
+
+      case 82:
+        opt_batch = optarg;
+        break;
+
+      case 83:
+        opt_range = optarg;
+        break;
+
+      case 84:
+        opt_measure = optarg;
+        break;
+
+      case 85:
+        opt_depths = args_getlong(optarg);
+        if (opt_depths < 1 || opt_depths > 30)
+          fatal("Argument --depths must be between 1 and 30");
+        break;
+
+      case 86:
+        opt_cell_prefix = optarg;
+        break;
+
+      case 87:
+        opt_checkpoint = optarg;
+        break;
+
+      case 88:
+        opt_binary = optarg;
+        break;
+
+      case 89:
+        opt_aggregate = optarg;
+        break;
+
+      case 90:
+        opt_convert = optarg;
+        break;
+
+      case 91:
+        opt_profile = optarg;
+        if (strcmp(opt_profile,"table") && strcmp(opt_profile,"json"))
+          fatal("Argument --profile must be either 'table' or 'json'");
+        break;
+
+      case 92:
+        opt_bench = args_getlong(optarg);
+        break;
+
+      case 93:
+        opt_max_memory = args_getlong(optarg);
+        if (opt_max_memory < 1)
+          fatal("Argument --max_memory must be a positive integer");
+        break;
+
+      case 94:
+        opt_multiplex = 1;
+        break;
+
+      case 95:
+        opt_index = 1;
+        break;
+
+      case 96:
+        opt_tree_range = optarg;
+        break;
+
+      case 97:
+        opt_tree_ids = optarg;
+        break;
+
       default:
         fatal("Internal error in option parsing");
     }
@@ -651,9 +930,30 @@ void args_init(int argc, char ** argv)
     commands++;
   if (opt_contains)
     commands++;
+  if (opt_unique && !opt_exhaustive)
+    commands++;
+  if (opt_lineage)
+    commands++;
+  if (opt_batch)
+    commands++;
+
+  if (opt_aggregate)
+    commands++;
+
+  if (opt_convert)
+    commands++;
+
+  if (opt_bench)
+    commands++;
+
+  if (opt_index)
+    commands++;
 
   if (commands > 1)
     fatal("More than one command specified");
+
+  if (opt_tree_range && opt_tree_ids)
+    fatal("Cannot use both --tree_range and --tree_ids");
 }
 
 void cmd_none()
@@ -668,12 +968,15 @@ void cmd_none()
             "\n"
             "newick-tools --randomize 100 --shape rooted --branch_dist uni --output FILENAME\n"
             "newick-tools --simulate 10 --birthrate 2 --deathrate 1 --origin 100 --output FILENAME\n"
+            "newick-tools --lineage 16 --replicates 100 --output FILENAME --barcodes PREFIX\n"
             "newick-tools --attach FILENAME --tree FILENAME --attach_at TAXON --output FILENAME\n"
             "newick-tools --info --tree FILENAME\n"
+            "newick-tools --info --table --tree FILENAME --output FILENAME\n"
             "newick-tools --prune_random 10 --tree FILENAME --output FILENAME\n"
             "newick-tools --prune_labels TAXA --tree FILENAME --output FILENAME\n"
             "newick-tools --svg --tree FILENAME --output FILENAME\n"
             "newick-tools --identical FILENAME --tree FILENAME\n"
+            "newick-tools --unique --tree FILENAME --output FILENAME\n"
             "newick-tools --root --outgroup TAXA --tree FILENAME --output FILENAME\n"
             "newick-tools --unroot --tree FILENAME --output FILENAME\n"
             "newick-tools --show_branches --tree FILENAME\n"
@@ -681,6 +984,11 @@ void cmd_none()
             "newick-tools --resolve_ladder --tree FILENAME\n"
             "newick-tools --resolve_random --tree FILENAME\n"
             "newick-tools --difftree FILENAME --tree FILENAME\n"
+            "newick-tools --batch FILENAME --tree FILENAME --range 1-100 --output FILENAME\n"
+            "newick-tools --aggregate FILENAME --output FILENAME\n"
+            "newick-tools --convert binary --tree FILENAME --output FILENAME\n"
+            "newick-tools --bench 1000000 --output FILENAME\n"
+            "newick-tools --index --tree FILENAME\n"
             "newick-tools --exhaustive 5 --output FILENAME\n"
             "newick-tools --shuffle_order FILENAME --output FILENAME\n"
             "newick-tools --shuffle_labels FILENAME --output FILENAME\n"
@@ -706,11 +1014,49 @@ void cmd_help()
             "  --quiet                 Only output warnings and fatal errors to stderr.\n"
             "  --precision             Number of digits to display after decimal point.\n"
             "  --seed INT              Seed to initialize random number generator.\n"
+            "  --threads INT           Number of threads to use (default: 1).\n"
+            "  --profile STRING        Report time and allocations per phase to stderr\n"
+            "                          at exit, as 'table' or 'json'.\n"
+            "  --max_memory INT        Memory in MB for trees and outputs being processed\n"
+            "                          by --threads (default: 1024).\n"
+            "  --multiplex             Write the outputs of all trees to one file with an\n"
+            "                          index OUTPUT.idx, instead of one file per tree.\n"
+            "  --tree_range INT-INT    Read only input trees INT-INT (or INT-, or INT).\n"
+            "  --tree_ids FILENAME     Read only the input trees numbered in FILENAME.\n"
+            "\n"
+            "  Input files may be gzip or zstd compressed, or members of a tar archive\n"
+            "  given as ARCHIVE.tar[.gz|.zst]/MEMBER. Output files ending in .gz or .zst\n"
+            "  are compressed. Tree files may be newick or binary (see --convert).\n"
+            "\n"
+            "Converting tree files\n"
+            "  --convert STRING        'newick', 'binary' or 'binary32' (float lengths)\n"
+            " Parameters\n"
+            "  --tree FILENAME         tree file to convert\n"
+            " Output\n"
+            "  --output FILENAME       converted tree file\n"
+            "\n"
+            "Indexing tree files\n"
+            "  --index                 write FILENAME.index with the offset, length, tip\n"
+            "                          count and hash of each tree, such that\n"
+            "                          --tree_range and --tree_ids go directly to trees\n"
+            " Parameters\n"
+            "  --tree FILENAME         newick tree file to index\n"
+            "\n"
+            "Benchmarking\n"
+            "  --bench INT             time the core operations on balanced, caterpillar\n"
+            "                          and random trees of 4 up to INT tips\n"
+            " Parameters\n"
+            "  --seed INT              seed for the random trees\n"
+            " Output\n"
+            "  --output FILENAME       tab-separated throughput and peak memory\n"
             "\n"
             "Generating random trees\n"
             "  --randomize INT         number of tips the generated tree will have\n"
             " Parameters\n"
             "  --shape STRING          topology shape, 'rooted', 'unrooted', or 'n-ary'\n"
+            "  --model STRING          'yule' (default), 'pda' (uniform) or 'balanced'\n"
+            "  --collapse REAL         probability to contract inner edges for 'n-ary'\n"
+            "  --replicates INT        number of trees to generate (default: 1)\n"
             "  --branch_dist STRING    branch length distribution, 'uni', 'exp' or 'none'\n"
             "  --min REAL              minimum branch length (only when 'uni' is used)\n"
             "  --max REAL              minimum branch length (only when 'uni' is used)\n"
@@ -728,9 +1074,23 @@ void cmd_help()
             "  --labels FILENAME       use labels from file as tips, otherwise numbers\n"
             "  --origin REAL           scale branches such that origin is at given age\n"
             "  --scale_branch REAL     multiply all branch lengths with given number\n"
+            "  --replicates INT        number of trees to simulate (default: 1)\n"
             " Output\n"
             "  --output FILENAME       file to write output tree\n"
             "\n"
+            "Simulate lineage-tracing barcodes\n"
+            "  --lineage INT           number of uniform cell divisions (2^INT cells)\n"
+            " Parameters\n"
+            "  --targets INT           number of target sites per barcode (default: 10)\n"
+            "  --states INT            states per target incl. unedited (default: 60)\n"
+            "  --mutation_rate REAL    edit probability per target/division (default: 0.1)\n"
+            "  --deletion_rate REAL    deletion probability per cell/division (default: 0)\n"
+            "  --replicates INT        number of barcode sets to simulate (default: 1)\n"
+            " Output\n"
+            "  --output FILENAME       file to write the ground truth tree\n"
+            "  --barcodes STRING       write barcodes of replicate N to STRING_NNNNrep.fas\n"
+            "                          (compressed if STRING ends in .gz or .zst)\n"
+            "\n"
             "Merge trees\n"
             "  --attach FILENAME       attach source tree at destination tree's tip node\n"
             " Parameteres\n"
@@ -746,6 +1106,9 @@ void cmd_help()
             " Parameters\n"
             "  --tree FILENAME         file containing input tree\n"
             "  --precision INT         number of decimal digits for branch lengths\n"
+            "  --table                 with --info, one tab-separated row per tree\n"
+            " Output\n"
+            "  --output FILENAME       file to write the --table rows\n"
             "\n"
             "Pruning\n"
             "  --prune_random INT      Randomly prune INT tips from input tree\n"
@@ -771,6 +1134,8 @@ void cmd_help()
             "  --svg_margintop INT     top margin in pixels (default: 20)\n"
             "  --svg_marginbottom INT  bottom margin in pixels (default: 20)\n"
             "  --svg_noderadius INT    radius of inner nodes in pixels (default: 0)\n"
+            "  --svg_collapse          draw clades without marked nodes as one triangle\n"
+            "  --svg_paths             merge branches into <path> elements (smaller file)\n"
             " Output\n"
             "  --output FILENAME       file to write output SVG\n"
             "\n" 
@@ -779,6 +1144,14 @@ void cmd_help()
             " Parameters\n"
             "  --tree FILENAME         file containing input tree\n"
             "\n"
+            "Counting unique topologies\n"
+            "  --unique                output first occurrence of each topology\n"
+            " Parameters\n"
+            "  --shape STRING          compare as 'rooted' (default) or 'unrooted'\n"
+            "  --tree FILENAME         file containing input trees\n"
+            " Output\n"
+            "  --output FILENAME       file to write unique trees\n"
+            "\n"
             "Rooting (or re-rooting) trees\n"
             "  --root                  root (or re-root) a tree at a specific edge\n"
             " Parameters\n"
@@ -796,6 +1169,16 @@ void cmd_help()
             " Output\n"
             "  --output FILENAME       file to write output tree\n"
             "\n"
+            "Enumerating all binary tree topologies\n"
+            "  --exhaustive INT        output all topologies with INT tips\n"
+            " Parameters\n"
+            "  --shape STRING          'rooted' or 'unrooted'\n"
+            "  --labels FILENAME       use labels from file as tips, otherwise numbers\n"
+            "  --count                 only output the number of topologies\n"
+            "  --unique                also count distinct topologies, by hash\n"
+            " Output\n"
+            "  --output FILENAME       file to write output trees\n"
+            "\n"
             "Resolving n-ary trees to binary rooted\n"
             "  --resolve_random        resolve clades randomly\n"
             "  --resolve_ladder        resolve clades as ladders (caterpillars)\n"
@@ -823,8 +1206,29 @@ void cmd_help()
             "  --filter_gt INT        output subtrees with more than specified leaves\n"
             "  --filter_lt INT        output subtrees with less than specified leaves\n"
             "  --force                compare even if trees have different leaves by pruning\n"
+            "  --permutations INT     null distribution of matches over INT label shuffles\n"
+            "  --svg_collapse         draw fully matching clades as one triangle\n"
+            "  --svg_paths            merge branches into <path> elements (smaller file)\n"
             "  --output FILENAME      filename template to write output SVG\n"
             "\n"
+            "Batch FP/FN evaluation of inferred trees\n"
+            "  --batch FILENAME       manifest with one inferred tree file per line\n"
+            " Parameters\n"
+            "  --tree FILENAME        reference tree (unless given in second column)\n"
+            "  --range INT-INT        manifest lines to evaluate (default: all)\n"
+            "  --measure STRING       'fp' (default) or 'fn'\n"
+            "  --depths INT           number of subtree size bands (default: 9)\n"
+            "  --cell_prefix STRING   count only tips with this label prefix (default: c_)\n"
+            "  --checkpoint FILENAME  result log to resume an interrupted run from\n"
+            " Output\n"
+            "  --output FILENAME      file to write one row per tree and depth\n"
+            "  --binary FILENAME      also write the metrics to a binary results file\n"
+            "\n"
+            "Summaries of batch results\n"
+            "  --aggregate FILENAME   per depth summary (CSV) of a --binary results file\n"
+            " Output\n"
+            "  --output FILENAME      file to write the CSV\n"
+            "\n"
             "Shuffling\n"
             "  --shuffle_order        shuffle order of inner nodes\n"
             "  --shuffle_labels       shuffle tip labels\n"
@@ -840,6 +1244,14 @@ void cmd_help()
             "  --labels FILENAME      list of labels to use for extraction\n"
             "  --no-prune             does not prune extra tips from induced tree\n"
             "  --output FILENAME      file to write induced tree\n"
+            "\n"
+            "Finding trees that contain specific tips\n"
+            "  --contains             report trees containing all specified labels\n"
+            " Parameters\n"
+            "  --tree FILENAME        file containing input trees\n"
+            "  --labels FILENAME      list of labels to search for\n"
+            "  --label_sets FILENAME  one label set per line (outputs tree x set table)\n"
+            "  --output FILENAME      file to write output\n"
   /*         01234567890123456789012345678901234567890123456789012345678901234567890123456789 */
            );
   }
@@ -885,8 +1297,9 @@ int main (int argc, char * argv[])
   getentirecommandline(argc, argv);
 
   args_init(argc, argv);
-  
-  srand((unsigned int)opt_seed);
+
+  if (opt_profile)
+    profile_init();
 
   if (!opt_quiet)
     show_header();
@@ -991,9 +1404,41 @@ int main (int argc, char * argv[])
   {
     cmd_contains();
   }
+  else if (opt_unique)
+  {
+    cmd_unique();
+  }
+  else if (opt_lineage)
+  {
+    cmd_simulate_lineage();
+  }
+  else if (opt_batch)
+  {
+    cmd_batch();
+  }
+  else if (opt_aggregate)
+  {
+    cmd_aggregate();
+  }
+  else if (opt_convert)
+  {
+    cmd_convert();
+  }
+  else if (opt_bench)
+  {
+    cmd_bench();
+  }
+  else if (opt_index)
+  {
+    cmd_index();
+  }
   else
     cmd_none();
 
+  profile_report();
+
+  label_pool_destroy();
+
   free(cmdline);
   return (0);
 }
@@ -104,8 +104,18 @@ typedef struct node_s
   coord_t * coord;
   void * data;
   double age;
+  long taxon;         /* label id of tip nodes (see intern.c), -1 otherwise */
 } node_t;
 
+typedef struct heights_s
+{
+  double * age;       /* path length to the tips, following first children */
+  double * dist;      /* path length from the root */
+  long * height;      /* edges on the longest path to a descendant tip */
+  long * depth;       /* edges from the root */
+  int ultrametric;    /* all root-to-tip path lengths agree */
+} heights_t;
+
 typedef struct ntree_s
 {
   int leaves_count;
@@ -113,6 +123,9 @@ typedef struct ntree_s
   node_t * root;
   node_t ** leaves;
   node_t ** inner;
+  node_t ** taxa;     /* tip nodes indexed by label id, NULL if absent */
+  long taxa_count;    /* one more than the largest label id of a tip */
+  heights_t * heights;  /* cached by ntree_heights(), NULL if not computed */
 } ntree_t;
 
 typedef struct list_item_s
@@ -138,7 +151,7 @@ typedef struct hashtable_s
 {
   unsigned long table_size;
   unsigned long entries_count;
-  list_t ** entries;
+  ht_item_t * entries;
 } hashtable_t;
 
 typedef struct pair_s
@@ -147,6 +160,47 @@ typedef struct pair_s
   int index;
 } pair_t;
 
+typedef struct strbuf_s
+{
+  char * data;
+  size_t len;
+  size_t alloc;
+} strbuf_t;
+
+typedef struct rng_s
+{
+  unsigned long s[4];
+} rng_t;
+
+/* --batch metrics of one tree at one depth */
+typedef struct batch_metrics_s
+{
+  long line;                  /* line number in manifest */
+  long depth;
+  long matches;               /* -1 if the trees could not be compared */
+  long mismatches;            /* -1 if the trees could not be compared */
+  long fp_cells;              /* cells in lca clades but not in subtrees */
+  long lca_cells;             /* cells in lca clades of mismatching subtrees */
+  long cells;                 /* cells in mismatching subtrees */
+  long rf;                    /* clades in only one of the trees, or -1 */
+  double rate;                /* sum of fp_cells/lca_cells over subtrees */
+} batch_metrics_t;
+
+typedef struct treeio_s treeio_t;
+typedef struct btree_writer_s btree_writer_t;
+
+typedef struct treeout_s
+{
+  FILE * fp;                  /* stream trees are written to */
+  FILE * file;                /* underlying file, or NULL if not yet open */
+  FILE * index;               /* index of a multiplexed output, or NULL */
+  char * filename;
+  char * ext;
+  long offset;                /* bytes written to fp */
+  long start;                 /* offset at which the current tree starts */
+  int console;                /* fp is stdout or stderr */
+} treeout_t;
+
 typedef struct dinfo_s
 {
   double diameter;
@@ -162,6 +216,35 @@ typedef struct dinfo_s
 #define MAX(a,b) ((a) > (b) ? (a) : (b))
 #define SWAP(x,y) do { __typeof__ (x) _t = x; x = y; y = _t; } while(0)
 
+/* position of a node in per-node arrays: tips first, then inner nodes */
+#define NTREE_SLOT(t,n) ((n)->children_count ? \
+                         (t)->leaves_count + (n)->index : (n)->index)
+
+/* --batch --measure */
+#define MEASURE_FP 0
+#define MEASURE_FN 1
+
+/* --profile phases */
+#define PROFILE_READ    0
+#define PROFILE_PARSE   1
+#define PROFILE_CLONE   2
+#define PROFILE_PRUNE   3
+#define PROFILE_BITMASK 4
+#define PROFILE_MATCH   5
+#define PROFILE_EXPORT  6
+#define PROFILE_SVG     7
+#define PROFILE_PHASES  8
+
+/* sidecar index of a newick file (see treeio.c and index.c) */
+#define INDEX_SUFFIX ".index"
+#define INDEX_HEADER "# newick-tools tree index\tbytes %ld\n"
+
+#define BITSET_BITS (sizeof(unsigned long) * CHAR_BIT)
+#define BITSET_ALIGN_WORDS 4
+#define BITSET_SET(b,i)   ((b)[(i)/BITSET_BITS] |= 1ul << ((i)%BITSET_BITS))
+#define BITSET_CLEAR(b,i) ((b)[(i)/BITSET_BITS] &= ~(1ul << ((i)%BITSET_BITS)))
+#define BITSET_TEST(b,i)  (((b)[(i)/BITSET_BITS] >> ((i)%BITSET_BITS)) & 1ul)
+
 /* options */
 
 extern int opt_quiet;
@@ -216,8 +299,23 @@ extern long opt_svg_margintop;
 extern long opt_svg_marginbottom;
 extern long opt_svg_showlegend;
 extern long opt_svg_noderadius;
+extern long opt_svg_collapse;
+extern long opt_svg_paths;
 extern long opt_test;
 extern long opt_contains;
+extern long opt_unique;
+extern long opt_replicates;
+extern long opt_threads;
+extern long opt_lineage;
+extern long opt_permutations;
+extern long opt_count;
+extern long opt_table;
+extern long opt_depths;
+extern double opt_collapse;
+extern long opt_targets;
+extern long opt_states;
+extern double opt_mutation_rate;
+extern double opt_deletion_rate;
 extern double opt_svg_legendratio;
 
 extern char * opt_treefile;
@@ -234,6 +332,24 @@ extern char * opt_shape;
 extern char * opt_identical;
 extern char * opt_difftree;
 extern char * opt_tree_labels;
+extern char * opt_label_sets;
+extern char * opt_barcodes;
+extern char * opt_model;
+extern char * opt_batch;
+extern char * opt_range;
+extern char * opt_measure;
+extern char * opt_cell_prefix;
+extern char * opt_checkpoint;
+extern char * opt_binary;
+extern char * opt_aggregate;
+extern char * opt_convert;
+extern char * opt_profile;
+extern long opt_bench;
+extern long opt_max_memory;
+extern long opt_multiplex;
+extern long opt_index;
+extern char * opt_tree_range;
+extern char * opt_tree_ids;
 
 /* common data */
 
@@ -265,7 +381,15 @@ char * xstrndup(const char * s, size_t len);
 long getusec(void);
 void show_rusage(void);
 FILE * xopen(const char * filename, const char * mode);
-void shuffle(void * array, size_t n, size_t size);
+void shuffle(rng_t * rng, void * array, size_t n, size_t size);
+void strbuf_init(strbuf_t * buf);
+void strbuf_reserve(strbuf_t * buf, size_t extra);
+void strbuf_append(strbuf_t * buf, const char * s, size_t len);
+void strbuf_printf(strbuf_t * buf, const char * format, ...)
+  __attribute__ ((format (printf, 2, 3)));
+void strbuf_append_double(strbuf_t * buf, double x, int precision);
+char * strbuf_detach(strbuf_t * buf);
+void strbuf_free(strbuf_t * buf);
 
 /* functions in newick-tools.c */
 
@@ -276,6 +400,7 @@ void fillheader(void);
 void show_header(void);
 void cmd_tree_show(void);
 long args_getlong(char * arg);
+int args_getrange(char * arg, long * first, long * last);
 double args_getdouble(char * arg);
 
 /* functions in randomize.c */
@@ -318,9 +443,15 @@ void ntree_node_count(ntree_t * root,
 
 char * ntree_export_newick(ntree_t * tree);
 char * ntree_export_subtree_newick(node_t * node,int keep_origin);
-void fill_dinfo_table(ntree_t * tree);
+void ntree_newick_append(strbuf_t * buf, node_t * root, double root_length);
+double ntree_diameter(ntree_t * tree, dinfo_t * table, node_t ** droot);
+node_t * ntree_diameter_descent(ntree_t * tree,
+                                dinfo_t * table,
+                                node_t * node);
 ntree_t * ntree_clone(const ntree_t * tree,
                       void * (*cb_clonedata)(void *));
+size_t ntree_size(const ntree_t * tree);
+node_t * ntree_find_tip(ntree_t * tree, char * label);
 
 #if 0
 rtree_t * ntree_to_rtree(ntree_t * root);
@@ -449,6 +580,13 @@ void stats(double * values, int count,
            double * min, double * max, 
            double * mean, double * median, 
            double * var, double * stdev);
+double select_kth(double * values, long count, long k);
+double stats_quantile(double * values, long count, double p);
+void stats_moments(const double * values,
+                   long count,
+                   double * sum,
+                   double * min,
+                   double * max);
 
 
 /* functions in info.c */
@@ -459,7 +597,7 @@ void cmd_showbranches(void);
 
 /* functions in dist.c */
 
-double rnd_uniform(double min, double max);
+double rnd_uniform(rng_t * rng, double min, double max);
 
 /* functions in info.c */
 void ntree_info(ntree_t * root);
@@ -469,7 +607,7 @@ char * getnextline(FILE * fd);
 /* functions in svg_ntree.c */
 
 void cmd_svg(void);
-void svg_plot(ntree_t * tree, FILE * fp_output, int marked);
+void svg_plot(ntree_t * tree, FILE * fp_output, FILE * fp_log, int marked);
 
 /* function sin unroot.c */
 
@@ -494,6 +632,59 @@ unsigned long hash_djb2a(char * x);
 unsigned long hash_fnv(char * s);
 void hashtable_destroy(hashtable_t * ht, void (*cb_dealloc)(void *));
 
+/* functions in intern.c */
+
+long label_intern(char * label);
+long label_find(char * label);
+char * label_string(long id);
+long label_count(void);
+void label_pool_destroy(void);
+
+/* functions in rng.c */
+
+void rng_seed(rng_t * rng, unsigned long seed, unsigned long stream);
+unsigned long rng_next(rng_t * rng);
+double rng_uniform(rng_t * rng);
+unsigned long rng_bounded(rng_t * rng, unsigned long n);
+
+/* functions in threads.c */
+
+void threads_parallel_for(long count,
+                          void (*job)(long index, long thread, void * data),
+                          void * data);
+void threads_write_ordered(FILE * fp,
+                           long count,
+                           long units_per_job,
+                           void (*job)(long index,
+                                       long thread,
+                                       strbuf_t * out,
+                                       void * data),
+                           void * data);
+void threads_steal_for(long count,
+                       const long * cost,
+                       void (*job)(long index, long thread, void * data),
+                       void * data,
+                       long * done);
+void threads_pipeline(treeout_t ** outs,
+                      long streams,
+                      void * (*read)(long * treeno,
+                                     size_t * cost,
+                                     void * data),
+                      int (*job)(long treeno,
+                                 void * item,
+                                 FILE ** fp,
+                                 void * data),
+                      void * data);
+
+/* functions in bitset.c */
+
+long bitset_words(long bits);
+unsigned long * bitset_create(long bits);
+int bitset_is_subset(const unsigned long * a,
+                     const unsigned long * b,
+                     long first,
+                     long last);
+
 /* functions in list.c */
 
 void list_append(list_t * list, void * data);
@@ -502,8 +693,9 @@ void list_clear(list_t * list, void (*cb_dealloc)(void *));
 
 /* functions in treehash.c */
 
-hashtable_t * create_hashtable(ntree_t * tree);
 int duplicate_tiplabels(ntree_t * tree);
+unsigned long ntree_hash_topology(ntree_t * tree, int unrooted);
+char * ntree_canonical_topology(ntree_t * tree, int unrooted);
 
 /* functions in root.c */
 
@@ -513,6 +705,11 @@ void cmd_print_ages(void);
 void cmd_attach(void);
 void cmd_prunelabels();
 void cmd_prunerandom();
+void ntree_prune(ntree_t * tree,
+                 unsigned long * remove,
+                 int suppress_unary,
+                 int unrooted);
+unsigned long * ntree_prune_first(ntree_t * tree, long remove_count);
 
 int ntree_check_rbinary(ntree_t * tree);
 int ntree_check_unrooted(ntree_t * tree);
@@ -523,6 +720,17 @@ list_t * list_create(void * data);
 void cmd_simulate_bd(void);
 void cmd_scale(void);
 void cmd_exhaustive(void);
+void ntree_enumerate(unsigned int tip_count,
+                     int rooted,
+                     char ** labels,
+                     int wrap,
+                     void (*visit)(ntree_t * tree,
+                                   long slot,
+                                   long thread,
+                                   void * data),
+                     void (*flush)(long slot_count, void * data),
+                     void * data);
+long ntree_enumerate_slots(void);
 
 /* functions in resolve.c */
 
@@ -536,12 +744,22 @@ void cmd_test(void);
 
 void cmd_identical(void);
 
+void identical_sort(ntree_t * tree, node_t ** nodelist);
+
+int identical_match(node_t ** ref_nodes, node_t ** tgt_nodes, long count);
+
 /* bipart.c */
 
 void cmd_bipartitions_show(void);
 
 void cmd_difftree(void);
 
+int bipart_difftree(ntree_t * reftree, ntree_t * inptree);
+
+long bipart_count_matches(ntree_t * inptree, long filter_gt, long filter_lt);
+
+void bipart_compute(FILE * out, ntree_t * tree);
+
 /* agetree.c */
 
 void cmd_agetree(void);
@@ -554,6 +772,85 @@ void cmd_shuffle(void);
 
 void cmd_induce(void);
 
+node_t * ntree_lca(ntree_t * tree, node_t ** tips, long count);
+
+ntree_t * ntree_induce(const ntree_t * reftree,
+                       ntree_t * inptree,
+                       FILE * fp_log);
+
 /* contains.c */
 
 void cmd_contains(void);
+
+/* unique.c */
+
+void cmd_unique(void);
+
+/* batch.c */
+
+void cmd_batch(void);
+
+/* treeio.c */
+
+treeio_t * treeio_open(const char * filename);
+treeio_t * treeio_open_selected(const char * filename);
+int treeio_next(treeio_t * in, ntree_t ** tree);
+long treeio_treeno(treeio_t * in);
+void treeio_close(treeio_t * in);
+ntree_t * treeio_read_first(const char * filename);
+btree_writer_t * btree_writer_create(const char * filename, int float32);
+void btree_writer_add(btree_writer_t * out, ntree_t * tree);
+void btree_writer_close(btree_writer_t * out);
+
+/* convert.c */
+
+void cmd_convert(void);
+
+/* index.c */
+
+void cmd_index(void);
+
+/* bench.c */
+
+void cmd_bench(void);
+
+/* treeout.c */
+
+treeout_t * treeout_open(const char * ext);
+treeout_t * treeout_console(FILE * fp);
+FILE * treeout_begin(treeout_t * out, long treeno);
+void treeout_end(treeout_t * out, long treeno, int processed);
+void treeout_write(treeout_t * out,
+                   long treeno,
+                   const char * data,
+                   size_t len,
+                   int processed);
+void treeout_close(treeout_t * out);
+
+/* profile.c */
+
+void profile_init(void);
+void profile_begin(int phase);
+void profile_end(int phase);
+void profile_alloc(size_t size);
+void profile_report(void);
+
+/* stream.c */
+
+FILE * stream_open(const char * filename, const char * mode);
+
+/* results.c */
+
+FILE * results_create(const char * filename, int measure, long depths);
+void results_write(FILE * fp, const batch_metrics_t * metrics, long count);
+void results_close(FILE * fp);
+void cmd_aggregate(void);
+
+/* heights.c */
+
+heights_t * ntree_heights(ntree_t * tree);
+void ntree_heights_invalidate(ntree_t * tree);
+
+/* lineage.c */
+
+void cmd_simulate_lineage(void);
@@ -193,59 +193,104 @@ int ntree_check_unrooted(ntree_t * tree)
   return 1;
 }
 
-static char * ntree_export_newick_recursive(node_t * root)
+static void newick_append_tip(strbuf_t * buf, node_t * tip, double length)
 {
-  int i;
-  char * newick;
-  char * x;
+  const char * label = tip->label ? tip->label : "(null)";
 
-  if (!root) return NULL;
+  strbuf_append(buf, label, strlen(label));
+  strbuf_append(buf, ":", 1);
+  strbuf_append_double(buf, length, opt_precision);
+}
+
+static void newick_append_inner(strbuf_t * buf, node_t * node, double length)
+{
+  strbuf_append(buf, ")", 1);
+  if (node->label)
+    strbuf_append(buf, node->label, strlen(node->label));
+  strbuf_append(buf, ":", 1);
+  strbuf_append_double(buf, length, opt_precision);
+}
+
+/* Appends the newick string of the subtree rooted at root to buf, using
+   root_length as the length of the root branch. The subtree is traversed
+   iteratively with an explicit stack, and therefore the running time is
+   linear in the output size regardless of the tree depth. Inner roots are
+   terminated with a semicolon */
+void ntree_newick_append(strbuf_t * buf, node_t * root, double root_length)
+{
+  long top = 0;
+  long stack_size = 64;
 
   if (!root->children_count)
-    asprintf(&newick, "%s:%.*f", root->label, opt_precision, root->length);
-  else
   {
-    char * subtree = ntree_export_newick_recursive(root->children[0]);
-    asprintf(&newick, "(%s", subtree);
-    free(subtree);
-    for (i = 1; i < root->children_count; ++i)
+    newick_append_tip(buf, root, root->length);
+    return;
+  }
+
+  node_t ** node_stack = (node_t **)xmalloc((size_t)stack_size *
+                                            sizeof(node_t *));
+  int * child_stack = (int *)xmalloc((size_t)stack_size * sizeof(int));
+
+  node_stack[0] = root;
+  child_stack[0] = 0;
+  strbuf_append(buf, "(", 1);
+
+  while (top >= 0)
+  {
+    node_t * node = node_stack[top];
+    int i = child_stack[top];
+
+    if (i == node->children_count)
+    {
+      newick_append_inner(buf, node, top ? node->length : root_length);
+      --top;
+      continue;
+    }
+
+    child_stack[top]++;
+    if (i)
+      strbuf_append(buf, ",", 1);
+
+    node_t * child = node->children[i];
+    if (!child->children_count)
+    {
+      newick_append_tip(buf, child, child->length);
+      continue;
+    }
+
+    if (++top == stack_size)
     {
-      subtree = ntree_export_newick_recursive(root->children[i]);
-      asprintf(&x, "%s,%s", newick, subtree);
-      free(newick);
-      free(subtree);
-      newick = x;
+      stack_size *= 2;
+      node_stack = (node_t **)xrealloc(node_stack,
+                                       (size_t)stack_size * sizeof(node_t *));
+      child_stack = (int *)xrealloc(child_stack,
+                                    (size_t)stack_size * sizeof(int));
     }
-    asprintf(&x, "%s)%s:%.*f", newick,
-                               root->label ? root->label : "",
-                               opt_precision,
-                               root->length);
-    free(newick);
-    newick = x;
+    node_stack[top] = child;
+    child_stack[top] = 0;
+    strbuf_append(buf, "(", 1);
   }
 
-  return newick;
+  strbuf_append(buf, ";", 1);
+
+  free(node_stack);
+  free(child_stack);
+}
+
+/* returns the tip with the specified label, or NULL if there is none */
+node_t * ntree_find_tip(ntree_t * tree, char * label)
+{
+  long id = label_find(label);
+
+  if (id < 0 || id >= tree->taxa_count)
+    return NULL;
+
+  return tree->taxa[id];
 }
 
 int ntree_mark_tips(ntree_t * tree, char * tipstring)
 {
   int rc = 1;
-  long i;
-
-  /* create hash table */
-  hashtable_t * ht = hashtable_create(tree->leaves_count);
-  for (i = 0; i < tree->leaves_count; ++i)
-  {
-    pair_t * pair = (pair_t *)xmalloc(sizeof(pair_t));
-    pair->label = tree->leaves[i]->label;
-    pair->index = i;
-
-    if (!hashtable_insert(ht,
-                          (void *)pair,
-                          hash_fnv(tree->leaves[i]->label),
-                          hashtable_paircmp))
-      fprintf(stderr,"WARNING: Duplicate taxon (%s)\n",tree->leaves[i]->label);
-  }
 
   char * tips_list = tipstring;
   char * taxon;
@@ -260,20 +305,16 @@ int ntree_mark_tips(ntree_t * tree, char * tipstring)
 
     taxon = strndup(tips_list, taxon_len);
 
-    /* find the taxon in the hash table */
-    pair_t * query = hashtable_find(ht,
-                                    taxon,
-                                    hash_fnv(taxon),
-                                    hashtable_paircmp);
+    node_t * tip = ntree_find_tip(tree,taxon);
 
-    if (!query)
+    if (!tip)
     {
       rc = 0;
       fprintf(stderr,"WARNING: taxon %s does not appear in the tree\n", taxon);
     }
     else
     {
-      tree->leaves[query->index]->mark = 1;
+      tip->mark = 1;
       printf("  Found tip label %s\n", taxon);
       taxa_count++;
     }
@@ -284,8 +325,6 @@ int ntree_mark_tips(ntree_t * tree, char * tipstring)
       tips_list += 1;
   }
 
-  hashtable_destroy(ht,free);
-
   if (!rc && !opt_force) return 0;
 
   if (!taxa_count)
@@ -296,97 +335,51 @@ int ntree_mark_tips(ntree_t * tree, char * tipstring)
 
 char * ntree_export_newick(ntree_t * tree)
 {
-  int i;
-  char * newick;
-  char * x;
-
+  strbuf_t buf;
   node_t * root = tree->root;
 
   if (!root) return NULL;
 
-  if (!root->children_count)
-  {
-    asprintf(&newick, "%s:%.*f", root->label, opt_precision, root->length);
-  }
-  else
-  {
-    char * subtree = ntree_export_newick_recursive(root->children[0]);
-    asprintf(&newick, "(%s", subtree);
-    free(subtree);
-    for (i = 1; i < root->children_count; ++i)
-    {
-      subtree = ntree_export_newick_recursive(root->children[i]);
-      asprintf(&x, "%s,%s", newick, subtree);
-      free(newick);
-      free(subtree);
-      newick = x;
-    }
-    asprintf(&x, "%s)%s:%.*f;", 
-                                      newick,
-                                      root->label ? root->label : "",
-                                      opt_precision,
-                                      root->length);
-    free(newick);
-    newick = x;
-  }
+  profile_begin(PROFILE_EXPORT);
+  strbuf_init(&buf);
+  ntree_newick_append(&buf, root, root->length);
+  profile_end(PROFILE_EXPORT);
 
-  return newick;
+  return strbuf_detach(&buf);
 }
 
 char * ntree_export_subtree_newick(node_t * root, int keep_origin)
 {
-  int i;
-  char * newick;
-  char * x;
-  double origin;
+  strbuf_t buf;
 
   if (!root) return NULL;
 
-  origin = (keep_origin) ? root->length : 0;
-
-  if (!root->children_count)
-  {
-    asprintf(&newick, "%s:%.*f", root->label, opt_precision, root->length);
-  }
-  else
-  {
-    char * subtree = ntree_export_newick_recursive(root->children[0]);
-    asprintf(&newick, "(%s", subtree);
-    free(subtree);
-    for (i = 1; i < root->children_count; ++i)
-    {
-      subtree = ntree_export_newick_recursive(root->children[i]);
-      asprintf(&x, "%s,%s", newick, subtree);
-      free(newick);
-      free(subtree);
-      newick = x;
-    }
-    asprintf(&x, "%s)%s:%.*f;", 
-                                      newick,
-                                      root->label ? root->label : "",
-                                      opt_precision,
-                                      origin);
-    free(newick);
-    newick = x;
-  }
+  profile_begin(PROFILE_EXPORT);
+  strbuf_init(&buf);
+  ntree_newick_append(&buf, root, keep_origin ? root->length : 0);
+  profile_end(PROFILE_EXPORT);
 
-  return newick;
+  return strbuf_detach(&buf);
 }
 
-
-void fill_dinfo_table(ntree_t * tree)
+/* Compute the diameter (longest tip-to-tip path) of a tree in one postorder
+   sweep over its inner nodes. The DP table must hold leaves_count +
+   inner_count entries: tips are stored at their index, followed by the inner
+   nodes. If droot is not NULL, it receives the inner node at which the
+   longest path turns. */
+double ntree_diameter(ntree_t * tree, dinfo_t * table, node_t ** droot)
 {
-  int i,j;
+  long i;
+  int j;
+  double diameter = 0;
   dinfo_t * dinfo;
 
   /* requires that nodes are in postorder */
 
   for (i = 0; i < tree->leaves_count; ++i)
   {
-    dinfo = (dinfo_t *)xmalloc(sizeof(dinfo_t));
-    dinfo->diameter = 0;
-    dinfo->height = 0;
-    tree->leaves[i]->data = (void *)dinfo;
+    table[i].diameter = 0;
+    table[i].height = 0;
   }
 
   for (i = 0; i < tree->inner_count; ++i)
@@ -395,15 +388,19 @@ void fill_dinfo_table(ntree_t * tree)
 
     double a;
     int index_a = 0;
-    dinfo = (dinfo_t *)(node->children[0]->data);
+    dinfo = table + NTREE_SLOT(tree,node->children[0]);
     a = node->children[0]->length + dinfo->height;
 
+    dinfo = table + tree->leaves_count + i;
+    dinfo->child1_index = index_a;
+    dinfo->diameter = -__DBL_MAX__;
+
     if (node->children_count > 1)
     {
       double b;
       int index_b = 1;
-      dinfo = (dinfo_t *)(node->children[1]->data);
-      b = node->children[1]->length + dinfo->height;
+      b = node->children[1]->length +
+          table[NTREE_SLOT(tree,node->children[1])].height;
 
       /* a holds the maximum and b the second highest */
       if (b > a)
@@ -414,9 +411,8 @@ void fill_dinfo_table(ntree_t * tree)
 
       for (j = 2; j < node->children_count; ++j)
       {
-        dinfo = (dinfo_t *)(node->children[j]->data);
-
-        double c = dinfo->height + node->children[j]->length;
+        double c = table[NTREE_SLOT(tree,node->children[j])].height +
+                   node->children[j]->length;
 
         if (c > a)
         {
@@ -432,22 +428,32 @@ void fill_dinfo_table(ntree_t * tree)
         }
       }
 
-      dinfo = (dinfo_t *)xmalloc(sizeof(dinfo_t));
-      dinfo->height = a;
       dinfo->diameter = a+b;
       dinfo->child1_index = index_a;
       dinfo->child2_index = index_b;
     }
-    else
+    dinfo->height = a;
+
+    /* keep the first inner node in postorder with the largest diameter */
+    if (!i || dinfo->diameter > diameter)
     {
-      dinfo = (dinfo_t *)xmalloc(sizeof(dinfo_t));
-      dinfo->height = a;
-      dinfo->diameter = -__DBL_MAX__;
-      dinfo->child1_index = index_a;
+      diameter = dinfo->diameter;
+      if (droot)
+        *droot = node;
     }
-
-    tree->inner[i]->data = dinfo;
   }
+
+  return diameter;
+}
+
+/* follow the deepest path below node using the table filled by
+   ntree_diameter() and return the tip it ends at */
+node_t * ntree_diameter_descent(ntree_t * tree, dinfo_t * table, node_t * node)
+{
+  while (node->children_count)
+    node = node->children[table[NTREE_SLOT(tree,node)].child1_index];
+
+  return node;
 }
 
 static node_t * clone_node(const node_t * node,
@@ -494,6 +500,8 @@ static node_t * clone_node(const node_t * node,
 ntree_t * ntree_clone(const ntree_t * tree,
                       void * (*cb_clonedata)(void *))
 {
+  profile_begin(PROFILE_CLONE);
+
   ntree_t * new_tree = (ntree_t *)xcalloc(1,sizeof(ntree_t));
 
   new_tree->root = clone_node(tree->root,cb_clonedata);
@@ -501,6 +509,17 @@ ntree_t * ntree_clone(const ntree_t * tree,
   new_tree->inner_count = tree->inner_count;
 
   wraptree(new_tree);
+  profile_end(PROFILE_CLONE);
 
   return new_tree;
 }
+
+/* Return an estimate of the heap memory used by tree, in bytes */
+size_t ntree_size(const ntree_t * tree)
+{
+  size_t nodes = (size_t)(tree->leaves_count + tree->inner_count);
+
+  /* a node, its entries in children, leaves or inner and taxa, a short label
+     and allocator overhead */
+  return sizeof(ntree_t) + nodes * (sizeof(node_t) + 3*sizeof(node_t *) + 32);
+}
@@ -40,7 +40,7 @@ static void reallocline(long newmaxsize)
   line_maxsize = newmaxsize;
 }
 
-char * getnextline(FILE * fd)
+static char * readnextline(FILE * fd)
 {
   long len;
 
@@ -84,6 +84,15 @@ char * getnextline(FILE * fd)
   return NULL;
 }
 
+char * getnextline(FILE * fd)
+{
+  profile_begin(PROFILE_READ);
+  char * s = readnextline(fd);
+  profile_end(PROFILE_READ);
+
+  return s;
+}
+
 #if 0
 void parse(FILE * fd)
 {
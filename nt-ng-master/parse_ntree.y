@@ -23,7 +23,7 @@
 %{
 #include "newick-tools.h"
 
-#define YYMAXDEPTH 1000000
+#define YYMAXDEPTH 10000000
 
 extern int ntree_lex();
 extern void ntree_lex_destroy();
@@ -76,6 +76,11 @@ void ntree_destroy(ntree_t * tree, void (*cb_data_destroy)(void *))
   if (tree->inner)
     free(tree->inner);
 
+  if (tree->taxa)
+    free(tree->taxa);
+
+  ntree_heights_invalidate(tree);
+
   free(tree);
 }
 
@@ -136,7 +141,7 @@ input: subtree SEMICOLON
 forest: forest COMMA subtree
 {
   /* allocate space for one more subtree */
-  node_t ** children = (node_t **)calloc($1->count + 1, sizeof(node_t *));
+  node_t ** children = (node_t **)xcalloc($1->count + 1, sizeof(node_t *));
   memcpy(children, $1->children, $1->count * sizeof(node_t *));
   children[$1->count] = $3;
   free($1->children);
@@ -148,8 +153,8 @@ forest: forest COMMA subtree
 }
       | subtree
 {
-  $$ = (struct forest_s *)calloc(1, sizeof(struct forest_s));
-  $$->children = (node_t **)calloc(1,sizeof(node_t *));
+  $$ = (struct forest_s *)xcalloc(1, sizeof(struct forest_s));
+  $$->children = (node_t **)xcalloc(1,sizeof(node_t *));
   $$->children[0] = $1;
   $$->count = 1;
   $$->leaves = $1->leaves;
@@ -159,7 +164,7 @@ subtree: OPAR forest CPAR optional_label optional_length
 {
   int i;
 
-  $$ = (node_t *)calloc(1, sizeof(node_t));
+  $$ = (node_t *)xcalloc(1, sizeof(node_t));
   $$->children = $2->children;
   $$->label = $4;
   $$->length = $5 ? atof($5) : 0;
@@ -171,6 +176,7 @@ subtree: OPAR forest CPAR optional_label optional_length
   $$->coord = NULL;
   $$->data = NULL;
   $$->leaves = $2->leaves;
+  $$->taxon = -1;
 
   free($2);
   free($5);
@@ -179,7 +185,7 @@ subtree: OPAR forest CPAR optional_label optional_length
 }
        | label optional_length
 {
-  $$ = (node_t *)calloc(1, sizeof(node_t));
+  $$ = (node_t *)xcalloc(1, sizeof(node_t));
   $$->label  = $1;
   $$->length = $2 ? atof($2) : 0;
   $$->children = NULL;
@@ -188,6 +194,7 @@ subtree: OPAR forest CPAR optional_label optional_length
   $$->coord  = NULL;
   $$->data   = NULL;
   $$->leaves = 1;
+  $$->taxon  = label_intern($1);
   free($2);
 
   tree->leaves_count++;
@@ -264,6 +271,9 @@ void wraptree(ntree_t * tree)
 {
   long i;
 
+  /* node indices change, so cached heights are no longer valid */
+  ntree_heights_invalidate(tree);
+
   tree->leaves = (node_t **)xmalloc(tree->leaves_count * sizeof(node_t *));
   tree->inner  = (node_t **)xmalloc(tree->inner_count * sizeof(node_t *));
 
@@ -274,7 +284,37 @@ void wraptree(ntree_t * tree)
     tree->leaves[i]->index = i;
 
   for (i = 0; i < tree->inner_count; ++i)
+  {
     tree->inner[i]->index = i;
+    tree->inner[i]->taxon = -1;
+  }
+
+  /* tips of trees not created by the parser may not have a label id */
+  tree->taxa_count = 0;
+  for (i = 0; i < tree->leaves_count; ++i)
+  {
+    node_t * tip = tree->leaves[i];
+
+    if (tip->taxon < 0 && tip->label)
+      tip->taxon = label_intern(tip->label);
+
+    if (tip->taxon >= tree->taxa_count)
+      tree->taxa_count = tip->taxon+1;
+  }
+
+  /* build map of label ids to tips. In case of duplicate labels, the first
+     tip in postorder is kept */
+  free(tree->taxa);
+  tree->taxa = (node_t **)xcalloc((size_t)(tree->taxa_count ?
+                                           tree->taxa_count : 1),
+                                  sizeof(node_t *));
+  for (i = 0; i < tree->leaves_count; ++i)
+  {
+    node_t * tip = tree->leaves[i];
+
+    if (tip->taxon >= 0 && !tree->taxa[tip->taxon])
+      tree->taxa[tip->taxon] = tip;
+  }
 }
 
 ntree_t * ntree_parse_newick(char * s)
@@ -282,7 +322,7 @@ ntree_t * ntree_parse_newick(char * s)
   int rc;
   struct ntree_s * tree;
 
-  tree = (ntree_t *)calloc(1, sizeof(ntree_t));
+  tree = (ntree_t *)xcalloc(1, sizeof(ntree_t));
 
   struct ntree_buffer_state * buffer = ntree__scan_string(s);
 //  ntree__switch_to_buffer(buffer);
@@ -24,41 +24,30 @@
 
 void cmd_print_ages(void)
 {
-  long i = 0;
+  long i;
+  long treeno = 0;
   int j;
-  FILE * fp_input;
+  treeio_t * fp_input;
 
   if (!opt_treefile)
     fatal("An input file must be specified");
 
-  fp_input  = xopen(opt_treefile,"r");
+  fp_input  = treeio_open_selected(opt_treefile);
 
   /* parse tree */
   if (!opt_quiet)
     fprintf(stdout, "Parsing tree file...\n");
 
-  char * newick;
-  while ((newick = getnextline(fp_input)))
+  ntree_t * tree;
+  while (treeio_next(fp_input, &tree))
   {
-    ++i;
-    ntree_t * tree = ntree_parse_newick(newick);
+    treeno = treeio_treeno(fp_input);
     if (!tree)
       fatal("Cannot parse tree file");
 
-    printf("Tree %ld\n",i);
+    printf("Tree %ld\n",treeno);
 
-    /* fill tip ages */
-    for (i = 0; i < tree->leaves_count; ++i)
-    {
-      tree->leaves[i]->age = 0;
-    }
-
-    /* fill inner ages */
-    for (i = 0; i < tree->inner_count; ++i)
-    {
-      node_t * node = tree->inner[i];
-      node->age = node->children[0]->age + node->children[0]->length; 
-    }
+    heights_t * h = ntree_heights(tree);
 
     for (i = 0; i < tree->inner_count; ++i)
     {
@@ -68,11 +57,13 @@ void cmd_print_ages(void)
         if (node->children[j]->children_count == 0)
           printf("tip: %s\n", node->children[j]->label);
 
-      printf("age : %f\n", node->age);
+      printf("age : %f\n", h->age[tree->leaves_count + i]);
     }
 
+    ntree_destroy(tree,NULL);
+
   }
-  fclose(fp_input);
+  treeio_close(fp_input);
 
   if (!opt_quiet)
     fprintf(stdout, "\nDone...\n");
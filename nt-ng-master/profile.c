@@ -0,0 +1,272 @@
+/*
+    Copyright (C) 2015-2017 Tomas Flouri
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Tomas Flouri <t.flouris@ucl.ac.uk>,
+    Department of Genetics, Evolution and Environment,
+    University College London,
+    Gower Street, London WC1E 6BT, England
+*/
+
+
+#include "newick-tools.h"
+
+/* Per-phase timing and allocation counters for --profile.
+
+   Each thread keeps its own counters and a small stack of the phases it is
+   in, such that time spent in a nested phase (e.g. export called while
+   pruning) is charged to the inner phase only. Allocations through
+   xmalloc, xcalloc and xrealloc are charged to the innermost phase, or to
+   'other' outside of any phase. When a thread exits its counters are
+   folded into a retired total and its record is freed; the report merges
+   the retired total with the records of the threads still alive, and
+   counts threads as the peak number alive at any one time */
+
+#define PROFILE_DEPTH 16
+#define PROFILE_OTHER PROFILE_PHASES
+
+typedef struct profile_counter_s
+{
+  long calls;
+  long wall;                  /* nanoseconds */
+  long cpu;                   /* nanoseconds */
+  long allocs;
+  long bytes;
+} profile_counter_t;
+
+typedef struct profile_thread_s
+{
+  profile_counter_t counter[PROFILE_PHASES+1];
+  int stack[PROFILE_DEPTH];
+  int depth;
+  long wall_start;
+  long cpu_start;
+  struct profile_thread_s * next;
+} profile_thread_t;
+
+static const char * phase_names[PROFILE_PHASES+1] =
+  { "read", "parse", "clone", "prune", "bitmask", "match", "export", "svg",
+    "other" };
+
+static __thread profile_thread_t * profile_self;
+static profile_thread_t * profile_threads;
+static profile_counter_t profile_retired[PROFILE_PHASES+1];
+static long profile_live;
+static long profile_peak;
+static pthread_key_t profile_key;
+static pthread_mutex_t profile_mutex = PTHREAD_MUTEX_INITIALIZER;
+static long profile_start;
+
+static long clock_ns(clockid_t clock)
+{
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void profile_fold(profile_counter_t * total, profile_thread_t * t)
+{
+  long i;
+
+  for (i = 0; i <= PROFILE_PHASES; ++i)
+  {
+    total[i].calls  += t->counter[i].calls;
+    total[i].wall   += t->counter[i].wall;
+    total[i].cpu    += t->counter[i].cpu;
+    total[i].allocs += t->counter[i].allocs;
+    total[i].bytes  += t->counter[i].bytes;
+  }
+}
+
+/* thread-specific data destructor, run when a thread with a record exits */
+static void profile_retire(void * data)
+{
+  profile_thread_t * t = (profile_thread_t *)data;
+  profile_thread_t ** p;
+
+  pthread_mutex_lock(&profile_mutex);
+  for (p = &profile_threads; *p; p = &(*p)->next)
+    if (*p == t)
+    {
+      *p = t->next;
+      break;
+    }
+  profile_fold(profile_retired, t);
+  profile_live--;
+  pthread_mutex_unlock(&profile_mutex);
+
+  profile_self = NULL;
+  free(t);
+}
+
+static profile_thread_t * profile_thread()
+{
+  if (profile_self)
+    return profile_self;
+
+  /* not xcalloc, as it would charge the allocation to this very thread */
+  profile_thread_t * t = (profile_thread_t *)calloc(1,
+                                                    sizeof(profile_thread_t));
+  if (!t)
+    fatal("Unable to allocate enough memory.");
+
+  pthread_mutex_lock(&profile_mutex);
+  t->next = profile_threads;
+  profile_threads = t;
+  if (++profile_live > profile_peak)
+    profile_peak = profile_live;
+  pthread_mutex_unlock(&profile_mutex);
+
+  profile_self = t;
+  pthread_setspecific(profile_key, t);
+  return t;
+}
+
+/* charge the time since the last phase change to the current phase */
+static void profile_charge(profile_thread_t * t)
+{
+  long wall = clock_ns(CLOCK_MONOTONIC);
+  long cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+
+  if (t->depth)
+  {
+    profile_counter_t * c = t->counter + t->stack[t->depth-1];
+    c->wall += wall - t->wall_start;
+    c->cpu += cpu - t->cpu_start;
+  }
+
+  t->wall_start = wall;
+  t->cpu_start = cpu;
+}
+
+void profile_init()
+{
+  profile_start = clock_ns(CLOCK_MONOTONIC);
+
+  if (pthread_key_create(&profile_key, profile_retire))
+    fatal("Unable to create profiling thread key");
+}
+
+void profile_begin(int phase)
+{
+  if (!opt_profile) return;
+
+  profile_thread_t * t = profile_thread();
+
+  profile_charge(t);
+  if (t->depth == PROFILE_DEPTH)
+    fatal("Internal error: profiling phases nested too deeply");
+
+  t->stack[t->depth++] = phase;
+  t->counter[phase].calls++;
+}
+
+void profile_end(int phase)
+{
+  if (!opt_profile) return;
+
+  profile_thread_t * t = profile_thread();
+
+  if (!t->depth || t->stack[t->depth-1] != phase)
+    fatal("Internal error: profiling phase %s not active", phase_names[phase]);
+
+  profile_charge(t);
+  t->depth--;
+}
+
+void profile_alloc(size_t size)
+{
+  profile_thread_t * t = profile_thread();
+  profile_counter_t * c = t->counter + (t->depth ?
+                                          t->stack[t->depth-1] : PROFILE_OTHER);
+  c->allocs++;
+  c->bytes += (long)size;
+}
+
+/* merge the counters of all threads and print them to stderr, either as a
+   table or as JSON */
+void profile_report()
+{
+  long i;
+  long thread_count;
+  profile_counter_t total[PROFILE_PHASES+1];
+  struct rusage r_usage;
+
+  if (!opt_profile) return;
+
+  double elapsed = (clock_ns(CLOCK_MONOTONIC) - profile_start) * 1e-9;
+  getrusage(RUSAGE_SELF, &r_usage);
+  double user = r_usage.ru_utime.tv_sec + r_usage.ru_utime.tv_usec * 1e-6;
+  double sys = r_usage.ru_stime.tv_sec + r_usage.ru_stime.tv_usec * 1e-6;
+
+  memcpy(total, profile_retired, sizeof(total));
+
+  pthread_mutex_lock(&profile_mutex);
+  while (profile_threads)
+  {
+    profile_thread_t * t = profile_threads;
+    profile_fold(total, t);
+    profile_threads = t->next;
+    free(t);
+  }
+  thread_count = profile_peak;
+  profile_self = NULL;
+  pthread_setspecific(profile_key, NULL);
+  pthread_mutex_unlock(&profile_mutex);
+
+  if (!strcmp(opt_profile, "json"))
+  {
+    fprintf(stderr,
+            "{\"elapsed\": %.6f, \"user\": %.6f, \"sys\": %.6f, "
+            "\"maxrss_kb\": %ld, \"threads\": %ld, \"phases\": [",
+            elapsed, user, sys, (long)r_usage.ru_maxrss, thread_count);
+    for (i = 0; i <= PROFILE_PHASES; ++i)
+      fprintf(stderr,
+              "%s\n  {\"phase\": \"%s\", \"calls\": %ld, \"wall\": %.6f, "
+              "\"cpu\": %.6f, \"allocs\": %ld, \"bytes\": %ld}",
+              i ? "," : "",
+              phase_names[i],
+              total[i].calls,
+              total[i].wall * 1e-9,
+              total[i].cpu * 1e-9,
+              total[i].allocs,
+              total[i].bytes);
+    fprintf(stderr, "\n]}\n");
+    return;
+  }
+
+  fprintf(stderr,
+          "\nProfile (%ld threads, times summed over threads)\n"
+          "Phase            Calls     Wall (s)      CPU (s)       Allocs"
+          "          Bytes\n",
+          thread_count);
+  for (i = 0; i <= PROFILE_PHASES; ++i)
+  {
+    if (i == PROFILE_OTHER)
+      fprintf(stderr, "%-8s %13s %12s %12s %12ld %14ld\n",
+              phase_names[i], "-", "-", "-", total[i].allocs, total[i].bytes);
+    else
+      fprintf(stderr, "%-8s %13ld %12.3f %12.3f %12ld %14ld\n",
+              phase_names[i],
+              total[i].calls,
+              total[i].wall * 1e-9,
+              total[i].cpu * 1e-9,
+              total[i].allocs,
+              total[i].bytes);
+  }
+  fprintf(stderr,
+          "Elapsed: %.3fs  User: %.3fs  Sys: %.3fs  Memory: %.0fMB\n",
+          elapsed, user, sys, r_usage.ru_maxrss * 1.0e-3);
+}
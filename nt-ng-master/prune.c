@@ -22,314 +22,207 @@
 
 #include "newick-tools.h"
 
-static void prune_tree(ntree_t * tree, int remove_count)
+static void node_delete(node_t * node)
 {
-  int i,j,k;
+  if (node->label)
+    free(node->label);
+  if (node->children)
+    free(node->children);
+  free(node);
+}
 
-  /* TODO: Implement also a function that eliminates unary nodes */
+/* Removes the tips whose positions in tree->leaves are set in the bitset
+   remove, together with all inner nodes left without children, in a single
+   postorder pass. If suppress_unary is set, inner nodes left with one child
+   are also removed and their branch length is added to that of the child,
+   except at the root where the child becomes the new root. If unrooted is
+   set and the root ends up with two children, one of them (an inner node) is
+   dissolved such that the root becomes trifurcating again. The tree is then
+   wrapped again, i.e. indices of the remaining nodes change */
+void ntree_prune(ntree_t * tree,
+                 unsigned long * remove,
+                 int suppress_unary,
+                 int unrooted)
+{
+  long i,j,k;
+  long leaves_count = 0;
+  long inner_count = 0;
 
-  for (i = 0; i < remove_count; ++i)
+  profile_begin(PROFILE_PRUNE);
+
+  char * empty = (char *)xcalloc((size_t)(tree->inner_count),sizeof(char));
+
+  /* inner nodes are stored in postorder, and therefore the children of a node
+     are always processed before the node itself */
+  for (i = 0; i < tree->inner_count; ++i)
   {
-    if (!opt_quiet)
-      fprintf(stdout, "Pruning tip: %s\n", tree->leaves[i]->label);
+    node_t * node = tree->inner[i];
 
-    node_t * parent = tree->leaves[i]->parent;
-    node_t * child  = tree->leaves[i];
+    node->leaves = 0;
+    for (j = 0, k = 0; j < node->children_count; ++j)
+    {
+      node_t * child = node->children[j];
 
-    /* 
-       if parent (inner node) remains with no children then delete
-       all adjacent ancestors with out-degree 1, i.e. nodes c and d 
+      if (!child->children_count)
+      {
+        if (BITSET_TEST(remove, child->index))
+        {
+          node_delete(child);
+          continue;
+        }
+        leaves_count++;
+      }
+      else
+      {
+        if (empty[child->index])
+        {
+          node_delete(child);
+          continue;
+        }
 
-              /
-        *----*---*---*---*-------* 
-        a    b   c   d   parent   child
+        if (suppress_unary && child->children_count == 1)
+        {
+          node_t * grandchild = child->children[0];
 
-    */
-    while (parent && child->children_count == 0)
-    {
-      node_t ** children = (node_t **)xmalloc((parent->children_count-1) *
-                                              sizeof(node_t *));
+          grandchild->length += child->length;
+          node_delete(child);
+          child = grandchild;
+        }
+        else
+          inner_count++;
+      }
 
-      /* copy remaining children */
-      k = 0;
-      for (j = 0; j < parent->children_count; ++j)
-        if (parent->children[j] != child)
-          children[k++] = parent->children[j];
-      parent->children_count--;
-
-      free(parent->children);
-      parent->children = children;
-
-      /* delete child */
-      if (child->label)
-        free(child->label);
-      if (child->children)
-        free(child->children);
-      free(child);
-
-      child = parent;
-      parent = parent->parent;
+      child->parent = node;
+      node->children[k++] = child;
+      node->leaves += child->leaves;
     }
+
+    /* nodes left without children keep their children count such that they
+       are not mistaken for tips, and are deleted when their parent is
+       processed */
+    if (k)
+      node->children_count = k;
+    else
+      empty[i] = 1;
   }
-}
 
-static void prune_binary(ntree_t * tree, int remove_count)
-{
-  int i;
+  free(empty);
 
-  for (i = 0; i < remove_count; ++i)
-  {
-    if (!opt_quiet)
-      fprintf(stdout, "Pruning tip: %s\n", tree->leaves[i]->label);
+  node_t * root = tree->root;
 
-    node_t * parent = tree->leaves[i]->parent;
-    node_t * grandparent = parent->parent;
+  assert(root->children_count);
 
-    /* if rooted tree */
-    if (!grandparent)
-    {
+  if (suppress_unary && root->children_count == 1)
+  {
+    if (!unrooted)
       fprintf(stderr,
               "WARNING: All taxa from one subtree deleted. Root changed.\n");
-    }
-
 
-    /*
-
-      1. If grantparent exists:
-
-                  *  grandparent                 *  grandparemt
-                 / \                            / \
-                /   \                          /   \
-       parent  *    /\            ->          /    /\
-              / \  /__\                      /\   /__\
-             *   \                          /__\
-        tip      /\                 sibling
-                /__\
-                     sibling
-
-      2. Otherwise:
-               
-                  *  parent
-                 / \                         /\
-                /   \             ->        /__\
-               *    /\                            sibling
-           tip     /__\
-                        sibling
-          
-    */
-
-    node_t * sibling = (parent->children[0] == tree->leaves[i]) ?
-                             parent->children[1] : parent->children[0];
-
-    /* delete leaf */
-    if (tree->leaves[i]->label)
-      free(tree->leaves[i]->label);
-    free(tree->leaves[i]);
-
-    /* delete parent node */
-    if (parent->label)
-      free(parent->label);
-
-    /* check whether grandparent exists to distinguish cases */
-    if (grandparent)
-    {
-      if (grandparent->children[0] == parent)
-        grandparent->children[0] = sibling;
-      else
-        grandparent->children[1] = sibling;
-
-      sibling->length += parent->length;
-      sibling->parent = grandparent;
-    }
-    else
-    {
-      sibling->parent = NULL;
+    /* the only child of the root becomes the new root. In an unrooted tree
+       its branch led to the deleted taxa, and is dropped */
+    tree->root = root->children[0];
+    tree->root->parent = NULL;
+    node_delete(root);
 
-      /* the next line will zero-out the root branch (origin) */
-      /* sibling->length = 0; */
-      tree->root = sibling;
-    }
-    free(parent->children);
-    free(parent);
+    root = tree->root;
+    if (unrooted)
+      root->length = 0;
   }
-}
-
-static void prune_unrooted(ntree_t * tree, int remove_count)
-{
-  int i,j;
+  else
+    inner_count++;
 
-  for (i = 0; i < remove_count; ++i)
+  if (unrooted && root->children_count == 2)
   {
-    if (!opt_quiet)
-      fprintf(stdout, "Pruning tip: %s\n", tree->leaves[i]->label);
-
-    node_t * parent = tree->leaves[i]->parent;
-    node_t * grandparent = parent->parent;
-
-    /*
-      
-      1. If grandparent exists
-
-                  *  grandparent                      *  grandparent
-                 /|\                                 /|\
-                / | \                               / | \
-               / /\  \                             / /\  \
-       parent * /__\  \           ->       parent / /__\  \
-             / \      /\                         /\       /\
-            *   \    /__\                       /__\     /__\
-        tip     /\                     sibling 
-               /__\
-                     sibling
-
-      2. Otherwise:
-
-                  *  parent                * newroot
-                 /|\                      /|\
-                / | \                    / | \
-               / u*  \                  /  |  \
-              /  / \  \        ->      /\  |  /\
-             *  /   \  \              /__\ | /__\
-        tip    /\   /\  \              a   |  b
-              /__\ /__\ /\                / \
-               a    b  /__\              /___\
-                        c                  c
-    */
-
-
-    if (grandparent)
+    /* dissolve the first inner child u of the root, and make its children
+       and its sibling the children of the root */
+    node_t * u = root->children[0]->children_count ?
+                   root->children[0] : root->children[1];
+    node_t * sibling = (u == root->children[0]) ?
+                         root->children[1] : root->children[0];
+
+    if (u->children_count)
     {
-      node_t * sibling = (parent->children[0] == tree->leaves[i]) ?
-                               parent->children[1] : parent->children[0];
-      
-
-      /* delete parent node */
-      if (parent->label)
-        free(parent->label);
-
-      for (j = 0; j < grandparent->children_count; ++j)
-        if (grandparent->children[j] == parent)
-        {
-          grandparent->children[j] = sibling;
-          break;
-        }
-       
-       /* sanity check */
-       assert(j < grandparent->children_count);
-
-       sibling->length += parent->length;
-       sibling->parent = grandparent;
-
-       free(parent->children);
-       free(parent);
+      node_t ** children = (node_t **)xmalloc((size_t)(u->children_count+1) *
+                                              sizeof(node_t *));
+      memcpy(children, u->children, u->children_count * sizeof(node_t *));
+      children[u->children_count] = sibling;
+      sibling->length += u->length;
+
+      free(root->children);
+      root->children = children;
+      root->children_count = u->children_count+1;
+      for (j = 0; j < root->children_count; ++j)
+        root->children[j]->parent = root;
+
+      node_delete(u);
+      inner_count--;
     }
-    else
-    {
-      node_t * newroot = xmalloc(sizeof(node_t));
-      newroot->data = newroot->coord = NULL;
-      newroot->parent = NULL;
-      newroot->label = NULL;
-      newroot->length = 0;
-      newroot->children = (node_t **)xmalloc(3*sizeof(node_t *));
-      newroot->children_count = 3;
-
-      node_t * u;
-
-      /* find node u, i.e. the first inner node that is child of parent, and
-         copy its children (a,b) as children of the new root */
-      for (j = 0; j < parent->children_count; ++j)
-      {
-        if ((parent->children[j] != tree->leaves[i]) &&
-            (parent->children[j]->children_count))
-        {
-          u = parent->children[j];
-          memcpy(newroot->children,
-                 parent->children[j]->children,
-                 2*sizeof(node_t *));        /* node u */
-          break;
-        }
-      }
+  }
 
-      /* sanity check */
-      assert(j < parent->children_count);
+  tree->leaves_count = leaves_count;
+  tree->inner_count = inner_count;
+  free(tree->leaves);
+  free(tree->inner);
 
-      /* find the remaining third child (irrespective of whether it is an inner
-         or tip node and make it a child of the new root */
-      assert(parent->children_count == 3);
-      for (j = 0; j < parent->children_count; ++j)
-      {
-        if ((parent->children[j] != tree->leaves[i]) &&
-            (parent->children[j] != u))
-        {
-          newroot->children[2] = parent->children[j];
-          break;
-        }
-      }
-
-      /* sanity check */
-      assert(j < parent->children_count);
+  wraptree(tree);
+  profile_end(PROFILE_PRUNE);
+}
 
-      /* re-parent children */
-      for (j = 0; j < 3; ++j)
-        newroot->children[j]->parent = newroot;
-      
-      /* fix the length of subtree c */
-      newroot->children[2]->length += u->length;
+/* returns a removal bitset for ntree_prune() selecting the first
+   remove_count tips of tree->leaves */
+unsigned long * ntree_prune_first(ntree_t * tree, long remove_count)
+{
+  long i;
 
-      if (parent->label)
-      {
-        newroot->label = xstrdup(parent->label);
-        free(parent->label);
-      }
-      if (parent->label)
-        free(parent->label);
-      free(parent->children);
-      free(parent);
+  unsigned long * remove = bitset_create(tree->leaves_count);
+  for (i = 0; i < remove_count; ++i)
+    BITSET_SET(remove, tree->leaves[i]->index);
 
-      if (u->label)
-        free(u->label);
-      free(u->children);
-      free(u);
+  return remove;
+}
 
-      tree->root = newroot;
+static unsigned long * select_tips(ntree_t * tree, long remove_count)
+{
+  long i;
 
-    }
+  if (!opt_quiet)
+    for (i = 0; i < remove_count; ++i)
+      fprintf(stdout, "Pruning tip: %s\n", tree->leaves[i]->label);
 
-    /* delete leaf */
-    if (tree->leaves[i]->label)
-      free(tree->leaves[i]->label);
-    free(tree->leaves[i]);
-  }
+  return ntree_prune_first(tree, remove_count);
 }
 
 void cmd_prunerandom()
 {
-  FILE * fp_input;
+  rng_t rng;
+  treeio_t * fp_input;
   FILE * fp_output;
 
   if (!opt_treefile)
     fatal("An input file must be specified");
 
-  fp_input  = xopen(opt_treefile,"r");
+  fp_input  = treeio_open_selected(opt_treefile);
 
   /* parse tree */
   if (!opt_quiet)
     fprintf(stdout, "Parsing tree file...\n");
 
-  char * newick;
+  ntree_t * tree;
 
-  while ((newick = getnextline(fp_input)))
+  while (treeio_next(fp_input, &tree))
   {
-    ntree_t * tree = ntree_parse_newick(newick);
     if (!tree)
       fatal("Cannot parse tree file");
 
     fp_output = opt_outfile ?
                   xopen(opt_outfile,"w") : stdout;
 
-    free(newick);
+    /* shuffle list of tips using a separate random stream for each tree */
+    rng_seed(&rng, (unsigned long)opt_seed,
+             (unsigned long)(treeio_treeno(fp_input)-1));
+    shuffle(&rng,(void *)(tree->leaves),tree->leaves_count,sizeof(node_t *));
 
-    /* shuffle list of tips */
-    shuffle((void *)(tree->leaves),tree->leaves_count,sizeof(node_t *));
+    unsigned long * remove = select_tips(tree, opt_prunerandom);
 
     if (!opt_nokeep)
     {
@@ -339,14 +232,14 @@ void cmd_prunerandom()
           fatal("Number of tips to prune can be at most %d for this tree",
                 tree->root->leaves-2);
 
-        prune_binary(tree, opt_prunerandom);
+        ntree_prune(tree, remove, 1, 0);
       }
       else if (ntree_check_unrooted(tree))
       {
         if (opt_prunerandom > tree->root->leaves - 3)
           fatal("Number of tips to prune can be at most %d for this tree",
                 tree->root->leaves-3);
-        prune_unrooted(tree, opt_prunerandom);
+        ntree_prune(tree, remove, 1, 1);
       }
       else
       {
@@ -354,7 +247,7 @@ void cmd_prunerandom()
           fatal("Number of tips to prune can be at most %d for this tree",
                 tree->root->leaves-1);
 
-        prune_tree(tree, opt_prunerandom);
+        ntree_prune(tree, remove, 0, 0);
       }
 
     }
@@ -363,9 +256,11 @@ void cmd_prunerandom()
       if (opt_prunerandom > tree->root->leaves - 1)
         fatal("Number of tips to prune can be at most %d for this tree",
               tree->root->leaves-1);
-      prune_tree(tree, opt_prunerandom);
+      ntree_prune(tree, remove, 0, 0);
     }
 
+    free(remove);
+
     /* output tree */
     char * newick = ntree_export_newick(tree);
     fprintf(fp_output, "%s\n", newick);
@@ -377,7 +272,7 @@ void cmd_prunerandom()
     if (opt_outfile)
       fclose(fp_output);
   }
-  fclose(fp_input);
+  treeio_close(fp_input);
 }
 
 static int reposition_leaves(ntree_t * tree)
@@ -406,34 +301,33 @@ static int reposition_leaves(ntree_t * tree)
 
 void cmd_prunelabels()
 {
-  FILE * fp_input;
+  treeio_t * fp_input;
   FILE * fp_output;
 
   if (!opt_treefile)
     fatal("An input file must be specified");
 
-  fp_input  = xopen(opt_treefile,"r");
+  fp_input  = treeio_open_selected(opt_treefile);
 
   /* parse tree */
   if (!opt_quiet)
     fprintf(stdout, "Parsing tree file...\n");
 
-  char * newick;
+  ntree_t * tree;
 
-  while ((newick = getnextline(fp_input)))
+  while (treeio_next(fp_input, &tree))
   {
-    ntree_t * tree = ntree_parse_newick(newick);
     if (!tree)
       fatal("Cannot parse tree file");
 
     fp_output = opt_outfile ?
                   xopen(opt_outfile,"w") : stdout;
 
-    free(newick);
-
     /* shuffle list of tips */
     int remove_count = reposition_leaves(tree);
 
+    unsigned long * remove = select_tips(tree, remove_count);
+
     if (!opt_nokeep)
     {
       if (ntree_check_rbinary(tree))
@@ -442,14 +336,14 @@ void cmd_prunelabels()
           fatal("Number of tips to prune can be at most %d for this tree",
                 tree->root->leaves-2);
 
-        prune_binary(tree, remove_count);
+        ntree_prune(tree, remove, 1, 0);
       }
       else if (ntree_check_unrooted(tree))
       {
         if (remove_count > tree->root->leaves - 3)
           fatal("Number of tips to prune can be at most %d for this tree",
                 tree->root->leaves-3);
-        prune_unrooted(tree, remove_count);
+        ntree_prune(tree, remove, 1, 1);
       }
       else
       {
@@ -457,7 +351,7 @@ void cmd_prunelabels()
           fatal("Number of tips to prune can be at most %d for this tree",
                 tree->root->leaves-1);
 
-        prune_tree(tree, remove_count);
+        ntree_prune(tree, remove, 0, 0);
       }
 
     }
@@ -466,9 +360,11 @@ void cmd_prunelabels()
       if (remove_count > tree->root->leaves - 1)
         fatal("Number of tips to prune can be at most %d for this tree",
               tree->root->leaves-1);
-      prune_tree(tree, remove_count);
+      ntree_prune(tree, remove, 0, 0);
     }
 
+    free(remove);
+
     /* output tree */
     char * newick = ntree_export_newick(tree);
     fprintf(fp_output, "%s\n", newick);
@@ -480,5 +376,5 @@ void cmd_prunelabels()
     if (opt_outfile)
       fclose(fp_output);
   }
-  fclose(fp_input);
+  treeio_close(fp_input);
 }
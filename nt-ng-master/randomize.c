@@ -20,70 +20,370 @@
     Gower Street, London WC1E 6BT, England
 */
 
+
 #include "newick-tools.h"
 
+/* Random tree generators for null models.
+
+   yule      random joining of two subtrees, starting from the tips
+   pda       uniform distribution over labelled topologies (proportional to
+             distinguishable arrangements), using Remy's algorithm
+   balanced  fixed balanced shape (2^k tips give the complete binary tree of
+             k uniform divisions) with randomly permuted tip labels
+
+   Unrooted trees have a root with three children. For the n-ary shape, a
+   rooted binary tree is generated and then each inner edge is contracted
+   independently with probability opt_collapse. All generators run in time
+   linear in the number of tips, using per-thread node arrays that are re-used
+   across replicates. */
+
+#define MODEL_YULE      0
+#define MODEL_PDA       1
+#define MODEL_BALANCED  2
+
 static const int tree_rooted   = 1;
 static const int tree_unrooted = 2;
 static const int tree_nary     = 4;
 
-static void cmd_randomize_binary(int treetype)
+typedef struct rtree_ws_s
+{
+  node_t * nodes;             /* tips followed by inner nodes */
+  node_t ** children;         /* children arrays of binary inner nodes */
+  node_t ** nary_children;    /* children arrays after edge contraction */
+  node_t ** active;           /* scratch list of nodes */
+  long * order;               /* scratch list of tip indices */
+  long inner_used;            /* number of inner nodes taken from arena */
+  long children_used;         /* number of children pointers taken */
+} rtree_ws_t;
+
+typedef struct rtree_batch_s
+{
+  int treetype;
+  int model;
+  long tips;
+  char ** labels;
+  rtree_ws_t * ws;
+} rtree_batch_t;
+
+static void workspace_init(rtree_ws_t * ws, rtree_batch_t * batch)
+{
+  long i;
+  long tips = batch->tips;
+
+  ws->nodes = (node_t *)xcalloc((size_t)(2*tips), sizeof(node_t));
+  ws->children = (node_t **)xmalloc((size_t)(2*tips+1) * sizeof(node_t *));
+  ws->nary_children = (node_t **)xmalloc((size_t)(2*tips+1) *
+                                         sizeof(node_t *));
+  ws->active = (node_t **)xmalloc((size_t)(2*tips) * sizeof(node_t *));
+  ws->order = (long *)xmalloc((size_t)tips * sizeof(long));
+
+  for (i = 0; i < tips; ++i)
+  {
+    ws->nodes[i].label = batch->labels[i];
+    ws->nodes[i].taxon = -1;
+  }
+}
+
+static void workspace_destroy(rtree_ws_t * ws)
+{
+  free(ws->nodes);
+  free(ws->children);
+  free(ws->nary_children);
+  free(ws->active);
+  free(ws->order);
+}
+
+/* take a new inner node with the specified children from the arena */
+static node_t * inner_create(rtree_ws_t * ws,
+                             long tips,
+                             node_t ** children,
+                             int children_count)
 {
-  FILE * out;
   int i;
+  node_t * node = ws->nodes + tips + ws->inner_used++;
 
-  int root_child_count = 0;
+  node->children = ws->children + ws->children_used;
+  node->children_count = children_count;
+  node->label = NULL;
+  node->taxon = -1;
+  node->parent = NULL;
+  ws->children_used += children_count;
 
-  /* ensure that necessary number of tips is specified */
-  if (treetype == tree_rooted)
+  for (i = 0; i < children_count; ++i)
+  {
+    node->children[i] = children[i];
+    children[i]->parent = node;
+  }
+
+  return node;
+}
+
+static node_t * gen_yule(rtree_ws_t * ws,
+                         rng_t * rng,
+                         long tips,
+                         int root_child_count)
+{
+  long i;
+  long count = tips;
+  node_t ** nodes = ws->active;
+  node_t * pair[2];
+
+  for (i = 0; i < tips; ++i)
   {
-    if (opt_randomize < 2)
-      fatal("Rooted tree must consist at least 2 tips");
-    root_child_count = 2;
+    nodes[i] = ws->nodes + i;
+    nodes[i]->length = rnd_uniform(rng, opt_randomize_min, opt_randomize_max);
   }
-  else if (treetype == tree_unrooted)
+
+  while (count != root_child_count)
   {
-    if (opt_randomize < 3)
-      fatal("Unrooted binary tree must consist at least 3 tips");
-    root_child_count = 3;
+    /* randomly select two nodes. In case we did not select the last node in
+       the list, move the last node to the position of the selected node */
+    i = (long)rng_bounded(rng, (unsigned long)count);
+    pair[0] = nodes[i];
+    nodes[i] = nodes[--count];
+
+    i = (long)rng_bounded(rng, (unsigned long)count);
+    pair[1] = nodes[i];
+    nodes[i] = nodes[--count];
+
+    nodes[count] = inner_create(ws, tips, pair, 2);
+    nodes[count]->length = rnd_uniform(rng,
+                                       opt_randomize_min,
+                                       opt_randomize_max);
+    ++count;
   }
-  else if (treetype == tree_nary)
+
+  /* create the root */
+  node_t * root = inner_create(ws, tips, nodes, root_child_count);
+  root->length = rnd_uniform(rng, opt_randomize_min, opt_randomize_max);
+
+  return root;
+}
+
+/* Remy's algorithm: the k-th tip is inserted on an edge chosen uniformly
+   among the edges of the current tree. Rooted trees start from a single tip
+   and include the edge above the root (2k-1 edges), while unrooted trees
+   start from the star tree of three tips (2k-3 edges). Each labelled
+   topology is produced by exactly one sequence of insertions */
+static node_t * gen_pda(rtree_ws_t * ws,
+                        rng_t * rng,
+                        long tips,
+                        int root_child_count)
+{
+  int j;
+  long k;
+  node_t ** nodes = ws->active;
+  long count = 0;
+  node_t * pair[2];
+  node_t * root;
+
+  if (root_child_count == 3)
   {
-      fatal("Not implemented yet");
+    for (count = 0; count < 3; ++count)
+      nodes[count] = ws->nodes + count;
+    root = inner_create(ws, tips, nodes, 3);
   }
   else
-    fatal("Internal error");
+  {
+    root = nodes[count++] = ws->nodes;
+    root->parent = NULL;
+  }
+
+  for (k = count; k < tips; ++k)
+  {
+    node_t * x = nodes[rng_bounded(rng, (unsigned long)count)];
+    node_t * parent = x->parent;
+
+    pair[0] = x;
+    pair[1] = ws->nodes + k;
+    node_t * y = inner_create(ws, tips, pair, 2);
+
+    y->parent = parent;
+    if (!parent)
+      root = y;
+    else
+    {
+      for (j = 0; parent->children[j] != x; ++j);
+      parent->children[j] = y;
+    }
+
+    nodes[count++] = y;
+    nodes[count++] = pair[1];
+  }
+
+  return root;
+}
+
+static node_t * gen_balanced_recursive(rtree_ws_t * ws,
+                                       long tips,
+                                       long * order,
+                                       long count,
+                                       int child_count)
+{
+  int i;
+  long offset = 0;
+  node_t * children[3];
+
+  if (count == 1)
+    return ws->nodes + order[0];
+
+  /* split into child_count parts of sizes as equal as possible */
+  for (i = 0; i < child_count; ++i)
+  {
+    long size = count / child_count + (i < count % child_count);
+
+    children[i] = gen_balanced_recursive(ws, tips, order+offset, size, 2);
+    offset += size;
+  }
+
+  return inner_create(ws, tips, children, child_count);
+}
+
+static node_t * gen_balanced(rtree_ws_t * ws,
+                             rng_t * rng,
+                             long tips,
+                             int root_child_count)
+{
+  long i;
+
+  for (i = 0; i < tips; ++i)
+    ws->order[i] = i;
+  shuffle(rng, ws->order, (size_t)tips, sizeof(long));
+
+  return gen_balanced_recursive(ws, tips, ws->order, tips, root_child_count);
+}
+
+/* draw branch lengths for all nodes, tips first */
+static void set_lengths(rtree_ws_t * ws, rng_t * rng, long tips)
+{
+  long i;
+
+  for (i = 0; i < tips + ws->inner_used; ++i)
+    ws->nodes[i].length = rnd_uniform(rng,
+                                      opt_randomize_min,
+                                      opt_randomize_max);
+}
+
+/* contract each inner non-root edge with probability opt_collapse. The new
+   children of each remaining inner node are gathered in one preorder pass,
+   descending through contracted nodes */
+static void collapse_edges(rtree_ws_t * ws, rng_t * rng, long tips)
+{
+  long i;
+  long used = 0;
+  long top;
+  node_t ** stack = ws->active;
 
-  /* create binary rooted tree */
+  for (i = 0; i < ws->inner_used; ++i)
+  {
+    node_t * node = ws->nodes + tips + i;
+    node->mark = node->parent && rng_uniform(rng) < opt_collapse;
+  }
+
+  for (i = 0; i < ws->inner_used; ++i)
+  {
+    node_t * node = ws->nodes + tips + i;
+    node_t ** children = ws->nary_children + used;
+    int count = 0;
 
-  ntree_t * tree = (ntree_t *)xmalloc(sizeof(ntree_t));
-  tree->leaves_count = opt_randomize;
+    if (node->mark) continue;
 
-  if (treetype == tree_rooted)
-    tree->inner_count = tree->leaves_count - 1;
-  else if (treetype == tree_unrooted)
-    tree->inner_count = tree->leaves_count - 2;
+    top = 0;
+    stack[top++] = node;
+    while (top)
+    {
+      node_t * x = stack[--top];
+      int j;
+
+      /* push in reverse order to keep the order of children */
+      for (j = x->children_count-1; j >= 0; --j)
+      {
+        node_t * c = x->children[j];
+
+        if (c->children_count && c->mark)
+          stack[top++] = c;
+        else
+          children[count++] = c;
+      }
+    }
+
+    /* children were gathered in reverse order */
+    for (top = 0; top < count/2; ++top)
+      SWAP(children[top], children[count-1-top]);
+
+    node->children = children;
+    node->children_count = count;
+    for (top = 0; top < count; ++top)
+      children[top]->parent = node;
+    used += count;
+  }
+}
+
+static void randomize_replicate(long index,
+                                long thread,
+                                strbuf_t * out,
+                                void * data)
+{
+  rtree_batch_t * batch = (rtree_batch_t *)data;
+  rtree_ws_t * ws = batch->ws + thread;
+  long tips = batch->tips;
+  int root_child_count = (batch->treetype == tree_unrooted) ? 3 : 2;
+  node_t * root = NULL;
+  rng_t rng;
+
+  if (!ws->nodes)
+    workspace_init(ws, batch);
+
+  ws->inner_used = 0;
+  ws->children_used = 0;
+
+  /* each replicate has its own random stream */
+  rng_seed(&rng, (unsigned long)opt_seed, (unsigned long)index);
+
+  if (batch->model == MODEL_YULE)
+  {
+    root = gen_yule(ws, &rng, tips, root_child_count);
+  }
+  else if (batch->model == MODEL_PDA)
+  {
+    root = gen_pda(ws, &rng, tips, root_child_count);
+    set_lengths(ws, &rng, tips);
+  }
   else
-    fatal("Not implemented yet");
+  {
+    root = gen_balanced(ws, &rng, tips, root_child_count);
+    set_lengths(ws, &rng, tips);
+  }
 
-  tree->leaves = (node_t **)xmalloc(tree->leaves_count * sizeof(node_t *));
-  tree->inner = (node_t **)xmalloc(tree->inner_count * sizeof(node_t *));
+  if (batch->treetype == tree_nary)
+    collapse_edges(ws, &rng, tips);
 
-  /* create array of nodes */
-  node_t ** nodes = (node_t **)xmalloc(tree->leaves_count *
-                                         sizeof(node_t *));
+  ntree_newick_append(out, root, root->length);
+  strbuf_append(out, "\n", 1);
+}
 
-  /* allocate tip nodes */
-  for (i = 0; i < opt_randomize; ++i)
+static void cmd_randomize_tree(int treetype, int model)
+{
+  FILE * out;
+  long i;
+  rtree_batch_t batch;
+
+  /* ensure that necessary number of tips is specified */
+  if (treetype == tree_unrooted)
   {
-    nodes[i] = (node_t *)xmalloc(sizeof(node_t));
-    nodes[i]->children_count = 0;
-    nodes[i]->children = NULL;
-    nodes[i]->coord = NULL;
-    nodes[i]->data = NULL;
-    nodes[i]->length = rnd_uniform(opt_randomize_min,
-                                   opt_randomize_max);
-    tree->leaves[i] = nodes[i];
+    if (opt_randomize < 3)
+      fatal("Unrooted binary tree must consist at least 3 tips");
   }
+  else if (opt_randomize < 2)
+    fatal("Rooted tree must consist at least 2 tips");
+
+  if (opt_replicates < 1)
+    fatal("Argument --replicates must be a positive integer");
+
+  batch.treetype = treetype;
+  batch.model = model;
+  batch.tips = opt_randomize;
+  batch.labels = (char **)xmalloc((size_t)opt_randomize * sizeof(char *));
 
   if (opt_labels)
   {
@@ -98,120 +398,73 @@ static void cmd_randomize_binary(int treetype)
     
     if (labels->count < opt_randomize)
       fatal("File %s contains %ld labels, but %ld are needed",
-            labels->count, opt_randomize);
+            opt_labels, labels->count, opt_randomize);
 
     list_item_t * item;
 
-    for (i=0, item = labels->head; i < opt_randomize; item = item->next, ++i)
-      nodes[i]->label = (char *)(item->data);
+    for (i=0, item = labels->head; item; item = item->next, ++i)
+    {
+      if (i < opt_randomize)
+        batch.labels[i] = (char *)(item->data);
+      else
+        free(item->data);
+    }
 
     list_clear(labels,NULL);
     free(labels);
   }
   else
   {
-    char * label;
     for (i = 0; i < opt_randomize; ++i)
-    {
-      asprintf(&label, "%d", i);
-      nodes[i]->label = label;
-    }
+      asprintf(batch.labels+i, "%ld", i);
   }
 
-  int count = opt_randomize;
-
-  int inner_count = 0;
-  while (count != root_child_count)
-  {
-    /* randomly select first node */
-    i = random() % count;
-    node_t * a = nodes[i];
-
-    /* in case we did not select the last node in the list, move the last
-       node to the position of the node we selected */
-    if (i != count-1)
-      nodes[i] = nodes[count-1];
-
-    /* decrease number of nodes in list */
-    --count;
-
-    /* randomly select second node */
-    i = random() % count;
-    node_t * b = nodes[i];
-
-    /* in case we did not select the last node in the list, move the last
-       node to the position of the node we selected */
-    if (i != count-1)
-      nodes[i] = nodes[count-1];
-
-    /* decrease number of nodes in list */
-    --count;
-
-    nodes[count] = (node_t *)xmalloc(sizeof(node_t));
-    nodes[count]->parent = NULL;
-    nodes[count]->coord = NULL;
-    nodes[count]->data = NULL;
-    tree->inner[inner_count++] = nodes[count];
-
-    nodes[count]->children = (node_t **)xmalloc(2*sizeof(node_t *));
-    nodes[count]->children[0] = a;
-    nodes[count]->children[1] = b;
-    a->parent = nodes[count];
-    b->parent = nodes[count];
-    nodes[count]->children_count = 2;
-
-    ++count;
-
-    nodes[count-1]->label = NULL;
-    nodes[count-1]->length = rnd_uniform(opt_randomize_min,
-                                         opt_randomize_max);
-  }
-
-  /* create the root */
-  node_t * root = (node_t *)xmalloc(sizeof(node_t));
-  tree->root = tree->inner[inner_count++] = root;
-  root->parent = NULL;
-  root->coord = NULL;
-  root->data = NULL;
-  root->children = (node_t **)xmalloc(root_child_count*sizeof(node_t *));
-  root->children_count = root_child_count;
-  root->label = NULL;
-  root->length = rnd_uniform(opt_randomize_min,opt_randomize_max);
-  for (i = 0; i < root_child_count; ++i)
-  {
-    root->children[i] = nodes[i];
-    nodes[i]->parent = root;
-  }
-
-  assert(inner_count == tree->inner_count);
-
-  char * newick = ntree_export_newick(tree);
+  batch.ws = (rtree_ws_t *)xcalloc((size_t)opt_threads, sizeof(rtree_ws_t));
 
   /* attempt to open output file */
   out = opt_outfile ?
           xopen(opt_outfile,"w") : stdout;
 
-  fprintf(out, "%s\n", newick);
+  threads_write_ordered(out,
+                        opt_replicates,
+                        opt_randomize,
+                        randomize_replicate,
+                        &batch);
 
   if (opt_outfile)
     fclose(out);
 
-  ntree_destroy(tree,NULL);
-  free(nodes);
-  free(newick);
+  for (i = 0; i < opt_threads; ++i)
+    if (batch.ws[i].nodes)
+      workspace_destroy(batch.ws+i);
+  for (i = 0; i < opt_randomize; ++i)
+    free(batch.labels[i]);
+  free(batch.labels);
+  free(batch.ws);
 }
 
 void cmd_randomize()
 {
+  int model;
+
   if (!opt_shape)
     fatal(" Required --shape option");
 
+  if (!opt_model || !strcasecmp(opt_model, "yule"))
+    model = MODEL_YULE;
+  else if (!strcasecmp(opt_model, "pda"))
+    model = MODEL_PDA;
+  else if (!strcasecmp(opt_model, "balanced"))
+    model = MODEL_BALANCED;
+  else
+    fatal("Option --model can be 'yule', 'pda' or 'balanced'");
+
   if (!strcasecmp(opt_shape, "rooted"))
-    cmd_randomize_binary(tree_rooted);
+    cmd_randomize_tree(tree_rooted, model);
   else if (!strcasecmp(opt_shape, "unrooted"))
-    cmd_randomize_binary(tree_unrooted);
+    cmd_randomize_tree(tree_unrooted, model);
   else if (!strcasecmp(opt_shape, "n-ary"))
-    fatal("Not implemented"); 
+    cmd_randomize_tree(tree_nary, model);
   else
     fatal(" Unknown --shape argument");
 }
@@ -22,7 +22,7 @@
 
 #include "newick-tools.h"
 
-static node_t * resolve_recursive(node_t * node)
+static node_t * resolve_recursive(node_t * node, rng_t * rng)
 {
   int i;
   double length = 0;
@@ -39,6 +39,7 @@ static node_t * resolve_recursive(node_t * node)
   node_t * newnode = (node_t *)xcalloc(1,sizeof(node_t));
   newnode->label = (node->label) ? xstrdup(node->label) : NULL;
   newnode->length = length;
+  newnode->taxon = node->taxon;
 
   /* allocate space for storing children if node is not a tip */
   if (node->children_count == 0)
@@ -55,8 +56,8 @@ static node_t * resolve_recursive(node_t * node)
     if (node->children_count == 2)
     {
       newnode->leaves = node->children[0]->leaves + node->children[1]->leaves;
-      newnode->children[0] = resolve_recursive(node->children[0]);
-      newnode->children[1] = resolve_recursive(node->children[1]);
+      newnode->children[0] = resolve_recursive(node->children[0], rng);
+      newnode->children[1] = resolve_recursive(node->children[1], rng);
       node->children[0]->parent = node;
       node->children[1]->parent = node;
     }
@@ -70,7 +71,7 @@ static node_t * resolve_recursive(node_t * node)
       
       /* resolve children */
       for (i=0; i < node->children_count; ++i)
-        children[i] = resolve_recursive(node->children[i]);
+        children[i] = resolve_recursive(node->children[i], rng);
 
       /* resolve current node */
 
@@ -81,10 +82,9 @@ static node_t * resolve_recursive(node_t * node)
         while (i != 2)
         {
           /* select two children such that r1 < r2 */
-          int r1 = (rand() % i);
-          int r2 = (rand() % i);
-          if (r1 == r2)
-            r2 = (r1 == i-1) ? r2-1 : r2+1;
+          int r1 = (int)rng_bounded(rng, (unsigned long)i);
+          int r2 = (int)rng_bounded(rng, (unsigned long)(i-1));
+          if (r2 >= r1) ++r2;
             if (r1 > r2) SWAP(r1,r2);
 
             /* create a new node */
@@ -148,11 +148,11 @@ static node_t * resolve_recursive(node_t * node)
   return newnode;
 }
 
-static ntree_t * resolve(ntree_t * tree)
+static ntree_t * resolve(ntree_t * tree, rng_t * rng)
 {
   ntree_t * resolvedtree = (ntree_t *)xcalloc(1,sizeof(ntree_t));
   
-  resolvedtree->root = resolve_recursive(tree->root);
+  resolvedtree->root = resolve_recursive(tree->root, rng);
 
   resolvedtree->leaves = NULL;
   resolvedtree->inner = NULL;
@@ -166,7 +166,8 @@ static ntree_t * resolve(ntree_t * tree)
 
 void cmd_resolve()
 {
-  FILE * fp_input;
+  rng_t rng;
+  treeio_t * fp_input;
   FILE * fp_output;
 
   assert((opt_resolve_ladder && !opt_resolve_random) ||
@@ -175,30 +176,31 @@ void cmd_resolve()
   if (!opt_treefile)
     fatal("An input file must be specified");
 
-  fp_input  = xopen(opt_treefile,"r");
+  fp_input  = treeio_open_selected(opt_treefile);
 
   /* parse tree */
   if (!opt_quiet)
     fprintf(stdout, "Parsing tree file...\n");
 
-  char * newick;
+  ntree_t * tree;
 
   fp_output = opt_outfile ?
                 xopen(opt_outfile,"w") : stdout;
 
-  while ((newick = getnextline(fp_input)))
+  while (treeio_next(fp_input, &tree))
   {
     ntree_t * resolvedtree;
 
-    ntree_t * tree = ntree_parse_newick(newick);
     if (!tree)
       fatal("Cannot parse tree file");
 
-    free(newick);
+    /* each tree has its own random stream */
+    rng_seed(&rng, (unsigned long)opt_seed,
+             (unsigned long)(treeio_treeno(fp_input)-1));
 
     resolvedtree = tree;
     if (!ntree_check_rbinary(tree))
-      resolvedtree = resolve(tree);
+      resolvedtree = resolve(tree, &rng);
 
     /* output tree */
     char * newick = ntree_export_newick(resolvedtree);
@@ -216,5 +218,5 @@ void cmd_resolve()
 
   if (opt_outfile)
     fclose(fp_output);
-  fclose(fp_input);
+  treeio_close(fp_input);
 }
@@ -0,0 +1,310 @@
+/*
+    Copyright (C) 2015-2017 Tomas Flouri
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Tomas Flouri <t.flouris@ucl.ac.uk>,
+    Department of Genetics, Evolution and Environment,
+    University College London,
+    Gower Street, London WC1E 6BT, England
+*/
+
+
+#include "newick-tools.h"
+
+/* Binary result files of --batch --binary, read by --aggregate.
+
+   The file starts with a 16-byte header (magic "NTRS", then the format
+   version, the measure and the number of depths as 32-bit integers) and
+   is followed by blocks of rows, one block per evaluated chunk. A block is
+   the 64-bit number of rows n followed by the columns of the rows, each
+   stored as n consecutive values in the order
+
+     line, depth, matches, mismatches, fp_cells, lca_cells, cells, rf
+                                                                  (int64)
+     fp, acc                                                      (double)
+
+   where rf is the Robinson-Foulds distance of the depth (see batch.c), fp
+   and acc are NaN when no subtree of that depth was compared, and matches,
+   mismatches and rf are -1 when the two trees could not be compared at
+   all. Values are stored in native (little-endian) byte order, such that
+   a reader can load a column with a single read. */
+
+#define RESULTS_MAGIC "NTRS"
+#define RESULTS_VERSION 2
+
+/* upper bound on rows per block, to reject corrupt files early */
+#define RESULTS_MAX_BLOCK (1l << 28)
+
+typedef struct results_header_s
+{
+  char magic[4];
+  unsigned int version;
+  unsigned int measure;
+  unsigned int depths;
+} results_header_t;
+
+/* per depth values collected by --aggregate */
+typedef struct depth_summary_s
+{
+  double * fp;
+  double * acc;
+  long count;
+  long alloc;
+  double matches;
+  double mismatches;
+  double rf;
+} depth_summary_t;
+
+FILE * results_create(const char * filename, int measure, long depths)
+{
+  results_header_t header;
+  FILE * fp = xopen(filename,"w");
+
+  memcpy(header.magic, RESULTS_MAGIC, 4);
+  header.version = RESULTS_VERSION;
+  header.measure = (unsigned int)measure;
+  header.depths = (unsigned int)depths;
+
+  if (fwrite(&header, sizeof(header), 1, fp) != 1)
+    fatal("Unable to write results file %s", filename);
+
+  return fp;
+}
+
+static void write_column(FILE * fp, const void * data, size_t size, long n)
+{
+  if (fwrite(data, size, (size_t)n, fp) != (size_t)n)
+    fatal("Unable to write results file");
+}
+
+/* append one block with the given rows */
+void results_write(FILE * fp, const batch_metrics_t * metrics, long count)
+{
+  long i;
+
+  if (!count) return;
+
+  long * ivalues = (long *)xmalloc((size_t)count * sizeof(long));
+  double * dvalues = (double *)xmalloc((size_t)count * sizeof(double));
+
+  write_column(fp, &count, sizeof(long), 1);
+
+  #define RESULTS_LONG_COLUMN(field)                  \
+    do {                                              \
+      for (i = 0; i < count; ++i)                     \
+        ivalues[i] = metrics[i].field;                \
+      write_column(fp, ivalues, sizeof(long), count); \
+    } while (0)
+
+  RESULTS_LONG_COLUMN(line);
+  RESULTS_LONG_COLUMN(depth);
+  RESULTS_LONG_COLUMN(matches);
+  RESULTS_LONG_COLUMN(mismatches);
+  RESULTS_LONG_COLUMN(fp_cells);
+  RESULTS_LONG_COLUMN(lca_cells);
+  RESULTS_LONG_COLUMN(cells);
+  RESULTS_LONG_COLUMN(rf);
+
+  #undef RESULTS_LONG_COLUMN
+
+  for (i = 0; i < count; ++i)
+  {
+    long total = metrics[i].matches + metrics[i].mismatches;
+    dvalues[i] = metrics[i].matches >= 0 && total > 0 ?
+                   metrics[i].rate / total : NAN;
+  }
+  write_column(fp, dvalues, sizeof(double), count);
+
+  for (i = 0; i < count; ++i)
+  {
+    long total = metrics[i].matches + metrics[i].mismatches;
+    dvalues[i] = metrics[i].matches >= 0 && total > 0 ?
+                   metrics[i].matches / (double)total : NAN;
+  }
+  write_column(fp, dvalues, sizeof(double), count);
+
+  free(ivalues);
+  free(dvalues);
+}
+
+void results_close(FILE * fp)
+{
+  if (ferror(fp) | fclose(fp))
+    fatal("Unable to write results file");
+}
+
+static void read_column(FILE * fp, void * data, size_t size, long n)
+{
+  if (fread(data, size, (size_t)n, fp) != (size_t)n)
+    fatal("Results file %s is truncated", opt_aggregate);
+}
+
+static void print_value(FILE * fp, double x)
+{
+  fprintf(fp, ",%.*f", opt_precision, x);
+}
+
+void cmd_aggregate()
+{
+  long i;
+  long d;
+  long block;
+  long alloc = 0;
+  results_header_t header;
+  FILE * fp_input;
+  FILE * fp_output;
+
+  fp_input = xopen(opt_aggregate,"r");
+
+  if (fread(&header, sizeof(header), 1, fp_input) != 1 ||
+      memcmp(header.magic, RESULTS_MAGIC, 4))
+    fatal("File %s is not a newick-tools results file", opt_aggregate);
+  if (header.version != RESULTS_VERSION)
+    fatal("Results file %s has unsupported version %u",
+          opt_aggregate, header.version);
+  if (header.depths < 1 || header.depths > 64 ||
+      (header.measure != MEASURE_FP && header.measure != MEASURE_FN))
+    fatal("Results file %s is malformed", opt_aggregate);
+
+  depth_summary_t * summary = (depth_summary_t *)xcalloc(header.depths,
+                                                         sizeof(depth_summary_t));
+
+  /* columns of the current block */
+  long * line = NULL;
+  long * depth = NULL;
+  long * matches = NULL;
+  long * mismatches = NULL;
+  long * rf = NULL;
+  long * skip = NULL;
+  double * fp = NULL;
+  double * acc = NULL;
+
+  while (fread(&block, sizeof(long), 1, fp_input) == 1)
+  {
+    if (block < 1 || block > RESULTS_MAX_BLOCK)
+      fatal("Results file %s is malformed", opt_aggregate);
+
+    if (block > alloc)
+    {
+      alloc = block;
+      line = (long *)xrealloc(line, (size_t)alloc * sizeof(long));
+      depth = (long *)xrealloc(depth, (size_t)alloc * sizeof(long));
+      matches = (long *)xrealloc(matches, (size_t)alloc * sizeof(long));
+      mismatches = (long *)xrealloc(mismatches, (size_t)alloc * sizeof(long));
+      rf = (long *)xrealloc(rf, (size_t)alloc * sizeof(long));
+      skip = (long *)xrealloc(skip, (size_t)alloc * sizeof(long));
+      fp = (double *)xrealloc(fp, (size_t)alloc * sizeof(double));
+      acc = (double *)xrealloc(acc, (size_t)alloc * sizeof(double));
+    }
+
+    read_column(fp_input, line, sizeof(long), block);
+    read_column(fp_input, depth, sizeof(long), block);
+    read_column(fp_input, matches, sizeof(long), block);
+    read_column(fp_input, mismatches, sizeof(long), block);
+
+    /* cell counts are not summarized */
+    for (i = 0; i < 3; ++i)
+      read_column(fp_input, skip, sizeof(long), block);
+    read_column(fp_input, rf, sizeof(long), block);
+
+    read_column(fp_input, fp, sizeof(double), block);
+    read_column(fp_input, acc, sizeof(double), block);
+
+    for (i = 0; i < block; ++i)
+    {
+      if (depth[i] < 1 || depth[i] > header.depths)
+        fatal("Results file %s has an invalid depth at manifest line %ld",
+              opt_aggregate, line[i]);
+
+      if (isnan(fp[i]))
+        continue;
+
+      depth_summary_t * s = summary + depth[i] - 1;
+      if (s->count == s->alloc)
+      {
+        s->alloc = s->alloc ? 2*s->alloc : 1024;
+        s->fp = (double *)xrealloc(s->fp, (size_t)s->alloc * sizeof(double));
+        s->acc = (double *)xrealloc(s->acc, (size_t)s->alloc * sizeof(double));
+      }
+      s->fp[s->count] = fp[i];
+      s->acc[s->count] = acc[i];
+      s->matches += matches[i];
+      s->mismatches += mismatches[i];
+      s->rf += rf[i];
+      s->count++;
+    }
+  }
+  if (!feof(fp_input))
+    fatal("Results file %s is truncated", opt_aggregate);
+  fclose(fp_input);
+
+  fp_output = opt_outfile ?
+                xopen(opt_outfile,"w") : stdout;
+
+  const char * m = header.measure == MEASURE_FP ? "fp" : "fn";
+  fprintf(fp_output,
+          "depth,trees,%s_mean,%s_min,%s_q25,%s_median,%s_q75,%s_max,"
+          "acc_mean,acc_median,matches_mean,mismatches_mean,rf_mean\n",
+          m, m, m, m, m, m);
+
+  for (d = 0; d < header.depths; ++d)
+  {
+    depth_summary_t * s = summary + d;
+    double sum, min, max;
+
+    fprintf(fp_output, "%ld,%ld", d+1, s->count);
+
+    if (!s->count)
+    {
+      fprintf(fp_output, ",NA,NA,NA,NA,NA,NA,NA,NA,NA,NA,NA\n");
+      continue;
+    }
+
+    stats_moments(s->fp, s->count, &sum, &min, &max);
+    print_value(fp_output, sum / s->count);
+    print_value(fp_output, min);
+    print_value(fp_output, stats_quantile(s->fp, s->count, 0.25));
+    print_value(fp_output, stats_quantile(s->fp, s->count, 0.5));
+    print_value(fp_output, stats_quantile(s->fp, s->count, 0.75));
+    print_value(fp_output, max);
+
+    stats_moments(s->acc, s->count, &sum, &min, &max);
+    print_value(fp_output, sum / s->count);
+    print_value(fp_output, stats_quantile(s->acc, s->count, 0.5));
+
+    print_value(fp_output, s->matches / s->count);
+    print_value(fp_output, s->mismatches / s->count);
+    print_value(fp_output, s->rf / s->count);
+    fprintf(fp_output, "\n");
+  }
+
+  if (opt_outfile)
+    fclose(fp_output);
+
+  for (d = 0; d < header.depths; ++d)
+  {
+    free(summary[d].fp);
+    free(summary[d].acc);
+  }
+  free(summary);
+  free(line);
+  free(depth);
+  free(matches);
+  free(mismatches);
+  free(rf);
+  free(skip);
+  free(fp);
+  free(acc);
+}
@@ -0,0 +1,100 @@
+/*
+    Copyright (C) 2015-2017 Tomas Flouri
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Tomas Flouri <t.flouris@ucl.ac.uk>,
+    Department of Genetics, Evolution and Environment,
+    University College London,
+    Gower Street, London WC1E 6BT, England
+*/
+
+
+#include "newick-tools.h"
+
+/* Random number generation based on xoshiro256** by Blackman and Vigna.
+
+   There is no global generator. Each generator is seeded from a (seed,
+   stream) pair through splitmix64, where the seed is --seed and the stream is
+   the index of the work item that consumes it (a replicate, or an input tree).
+   Every work item therefore draws the same sequence no matter which thread
+   processes it, in which order, or how many threads there are. */
+
+static unsigned long splitmix64(unsigned long * x)
+{
+  unsigned long z = (*x += 0x9e3779b97f4a7c15ul);
+
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ul;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebul;
+  return z ^ (z >> 31);
+}
+
+static inline unsigned long rotl(unsigned long x, int k)
+{
+  return (x << k) | (x >> (64 - k));
+}
+
+void rng_seed(rng_t * rng, unsigned long seed, unsigned long stream)
+{
+  int i;
+  unsigned long x = seed;
+
+  /* decorrelate neighbouring streams before expanding the state */
+  x ^= splitmix64(&stream);
+
+  for (i = 0; i < 4; ++i)
+    rng->s[i] = splitmix64(&x);
+}
+
+unsigned long rng_next(rng_t * rng)
+{
+  unsigned long * s = rng->s;
+  unsigned long result = rotl(s[1] * 5, 7) * 9;
+  unsigned long t = s[1] << 17;
+
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+
+  s[2] ^= t;
+  s[3] = rotl(s[3], 45);
+
+  return result;
+}
+
+/* uniform double in the open interval (0,1) */
+double rng_uniform(rng_t * rng)
+{
+  return ((rng_next(rng) >> 11) + 0.5) * (1.0 / 9007199254740992.0);
+}
+
+/* unbiased integer in [0,n) using Lemire's multiply-and-reject method */
+unsigned long rng_bounded(rng_t * rng, unsigned long n)
+{
+  __uint128_t m = (__uint128_t)rng_next(rng) * n;
+  unsigned long low = (unsigned long)m;
+
+  if (low < n)
+  {
+    unsigned long threshold = -n % n;
+    while (low < threshold)
+    {
+      m = (__uint128_t)rng_next(rng) * n;
+      low = (unsigned long)m;
+    }
+  }
+
+  return (unsigned long)(m >> 64);
+}
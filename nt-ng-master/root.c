@@ -22,6 +22,18 @@
 
 #include "newick-tools.h"
 
+/* number of trees parsed per thread before rooting them in parallel */
+#define ROOT_BATCH_TREES 16
+
+typedef struct root_batch_s
+{
+  ntree_t ** trees;           /* parsed trees of the current batch */
+  char ** outgroup;           /* taxa given with --outgroup */
+  long outgroup_count;
+  dinfo_t ** scratch;         /* per-thread DP table for midpoint rooting */
+  long * scratch_size;
+} root_batch_t;
+
 int check_binunrooted(ntree_t * tree)
 {
   int i;
@@ -73,18 +85,6 @@ static void replace_child(node_t * node, node_t * which, node_t * with)
   }
 }
 
-static node_t * descent_recursive(node_t * node)
-{
-  dinfo_t * dinfo;
-
-  if (!node->children_count)
-    return node; 
-
-  dinfo = (dinfo_t *)(node->data);
-  
-  return descent_recursive(node->children[dinfo->child1_index]);
-}
-
 static void branches_recursive(node_t * node)
 {
   if (!node->parent)
@@ -136,6 +136,7 @@ static void reroot(ntree_t * tree, node_t * parent, node_t * child, double paren
   newroot->parent = NULL;
   newroot->label = NULL;
   newroot->length = 0;
+  newroot->mark = 0;
 
   update_rootpath(parent,child,newroot);
 
@@ -152,42 +153,27 @@ static void reroot(ntree_t * tree, node_t * parent, node_t * child, double paren
 
 }
 
-void midpoint_root(ntree_t * tree)
+static void midpoint_root(ntree_t * tree, dinfo_t * table)
 {
-  int i;
   double diameter;
   dinfo_t * dinfo;
   node_t * droot;
 
-  /* run DP algorithm to compute distance */
-  fill_dinfo_table(tree);
-
-  /* initialize diameter and droot with some node */
-  dinfo = tree->inner[0]->data;
-  diameter = dinfo->diameter;
-  droot = tree->inner[0];
-
-  /* find inner node with highest diameter */
-  for (i = 1; i < tree->inner_count; ++i)
-  {
-    dinfo = tree->inner[i]->data;
-
-    if (dinfo->diameter > diameter)
-    {
-      diameter = dinfo->diameter;
-      droot = tree->inner[i];
-    }
-  }
-
-  printf("Diameter: %f\n", diameter);
+  /* run DP algorithm to compute distance and the inner node with the
+     highest diameter */
+  diameter = ntree_diameter(tree, table, &droot);
 
   /* find the two tips */
   assert(droot->children_count > 1);
-  dinfo = (dinfo_t *)(droot->data);
+  dinfo = table + tree->leaves_count + droot->index;
 
-  /* recursively descent to tips using backtracking information */
-  node_t * tipa = descent_recursive(droot->children[dinfo->child1_index]);
-  node_t * tipb = descent_recursive(droot->children[dinfo->child2_index]);
+  /* descent to tips using backtracking information */
+  node_t * tipa = ntree_diameter_descent(tree,
+                                         table,
+                                         droot->children[dinfo->child1_index]);
+  node_t * tipb = ntree_diameter_descent(tree,
+                                         table,
+                                         droot->children[dinfo->child2_index]);
 
   /* compute mid-pojnt */
   double midpoint = diameter / 2.;
@@ -216,11 +202,6 @@ void midpoint_root(ntree_t * tree)
     }
   }
 
-  printf("Diameter : %s %s\n", tipa->label, tipb->label);
-  printf("Midpoint : %f\n", midpoint);
-  printf("Edge: %f\n", prev->length);
-
-
   /* do the re-rooting */
   double edgelen = prev->length;
 
@@ -230,7 +211,7 @@ void midpoint_root(ntree_t * tree)
   reroot(tree, node,prev,parent_length,child_length);
 }
 
-void longest_branch_root(ntree_t * tree)
+static void longest_branch_root(ntree_t * tree)
 {
   int i;
   node_t * parent;
@@ -406,60 +387,22 @@ static node_t * outgroup_node(ntree_t * tree, int taxa_count)
   return outgroup;
 }
 
-static node_t * find_outgroup_mrca(ntree_t * tree)
+static node_t * find_outgroup_mrca(ntree_t * tree, root_batch_t * batch)
 {
   long i;
 
-  /* create hash table */
-  hashtable_t * ht = hashtable_create(tree->leaves_count);
-  for (i = 0; i < tree->leaves_count; ++i)
+  for (i = 0; i < batch->outgroup_count; ++i)
   {
-    pair_t * pair = (pair_t *)xmalloc(sizeof(pair_t));
-    pair->label = tree->leaves[i]->label;
-    pair->index = i;
-
-    if (!hashtable_insert(ht,
-                          (void *)pair,
-                          hash_fnv(tree->leaves[i]->label),
-                          hashtable_paircmp))
-      fprintf(stderr,"WARNING: Duplicate taxon (%s)\n",tree->leaves[i]->label);
-  }
+    node_t * tip = ntree_find_tip(tree,batch->outgroup[i]);
 
-  char * outgroup_list = opt_outgroup;
-  char * taxon;
-  size_t taxon_len;
-  int taxa_count = 0;
-
-  while (*outgroup_list)
-  {
-    taxon_len = strcspn(outgroup_list, ",");
-    if (!taxon_len)
-      fatal("Erroneous outgroup format (double comma)/taxon missing");
-
-    taxon = strndup(outgroup_list, taxon_len);
-
-    /* find the taxon in the hash table */
-    pair_t * query = hashtable_find(ht,
-                                    taxon,
-                                    hash_fnv(taxon),
-                                    hashtable_paircmp);
-
-    if (!query)
-      fatal("Taxon %s in --outgroup does not appear in the tree", taxon);
+    if (!tip)
+      fatal("Taxon %s in --outgroup does not appear in the tree",
+            batch->outgroup[i]);
 
-    tree->leaves[query->index]->mark = 1;
-    printf("\t%s\n", taxon);
-    taxa_count++;
-
-    free(taxon);
-    outgroup_list += taxon_len;
-    if (*outgroup_list == ',') 
-      outgroup_list += 1;
+    tip->mark = 1;
   }
 
-  hashtable_destroy(ht,free);
-
-  return outgroup_node(tree,taxa_count);
+  return outgroup_node(tree,batch->outgroup_count);
 }
 
 static node_t * find_outgroup_node(ntree_t * tree)
@@ -478,15 +421,15 @@ static node_t * find_outgroup_node(ntree_t * tree)
   return tree->leaves[i];
 }
 
-static void outgroup_root(ntree_t * tree)
+static void outgroup_root(ntree_t * tree, root_batch_t * batch)
 {
   node_t * outgroup_child;
   node_t * outgroup_parent;
 
-  if (!strchr(opt_outgroup, ','))
+  if (batch->outgroup_count == 1)
     outgroup_child = find_outgroup_node(tree);
   else 
-    outgroup_child = find_outgroup_mrca(tree);
+    outgroup_child = find_outgroup_mrca(tree,batch);
 
   assert(outgroup_child->parent);
   
@@ -498,10 +441,82 @@ static void outgroup_root(ntree_t * tree)
   reroot(tree,outgroup_parent,outgroup_child,edgelen,edgelen);
 }
 
+static void outgroup_parse(root_batch_t * batch)
+{
+  char * outgroup_list = opt_outgroup;
+  size_t taxon_len;
+  long alloc = 0;
+
+  batch->outgroup = NULL;
+  batch->outgroup_count = 0;
+
+  while (*outgroup_list)
+  {
+    taxon_len = strcspn(outgroup_list, ",");
+    if (!taxon_len)
+      fatal("Erroneous outgroup format (double comma)/taxon missing");
+
+    if (batch->outgroup_count == alloc)
+    {
+      alloc = alloc ? 2*alloc : 8;
+      batch->outgroup = (char **)xrealloc(batch->outgroup,
+                                          (size_t)alloc * sizeof(char *));
+    }
+    batch->outgroup[batch->outgroup_count++] = strndup(outgroup_list,
+                                                       taxon_len);
+
+    outgroup_list += taxon_len;
+    if (*outgroup_list == ',') 
+      outgroup_list += 1;
+  }
+
+  if (!batch->outgroup_count)
+    fatal("Erroneous outgroup format (taxon missing)");
+}
+
+static void root_tree(long index, long thread, strbuf_t * out, void * data)
+{
+  root_batch_t * batch = (root_batch_t *)data;
+  ntree_t * tree = batch->trees[index];
+
+  if (opt_midpoint)
+  {
+    /* the DP table of each thread is reused across trees */
+    long size = tree->leaves_count + tree->inner_count;
+    if (size > batch->scratch_size[thread])
+    {
+      free(batch->scratch[thread]);
+      batch->scratch[thread] = (dinfo_t *)xmalloc((size_t)size *
+                                                  sizeof(dinfo_t));
+      batch->scratch_size[thread] = size;
+    }
+    midpoint_root(tree, batch->scratch[thread]);
+  }
+  else if (opt_longest_branch)
+    longest_branch_root(tree);
+  else if (opt_outgroup)
+    outgroup_root(tree, batch);
+  else
+    assert(0);
+
+  /* output tree */
+  profile_begin(PROFILE_EXPORT);
+  ntree_newick_append(out, tree->root, tree->root->length);
+  strbuf_append(out, "\n", 1);
+  profile_end(PROFILE_EXPORT);
+
+  /* deallocate tree structure */
+  ntree_destroy(tree,NULL);
+  batch->trees[index] = NULL;
+}
+
 void cmd_root()
 {
-  FILE * fp_input;
+  long i;
+  long batch_size;
+  treeio_t * fp_input;
   FILE * fp_output;
+  root_batch_t batch;
 
   int options = 0;
 
@@ -521,48 +536,71 @@ void cmd_root()
   if (!opt_treefile)
     fatal("An input file must be specified");
 
-  fp_input  = xopen(opt_treefile,"r");
+  fp_input  = treeio_open_selected(opt_treefile);
+  fp_output = opt_outfile ?
+                xopen(opt_outfile,"w") : stdout;
+
+  batch_size = opt_threads * ROOT_BATCH_TREES;
+  batch.trees = (ntree_t **)xmalloc((size_t)batch_size * sizeof(ntree_t *));
+  batch.scratch = (dinfo_t **)xcalloc((size_t)opt_threads, sizeof(dinfo_t *));
+  batch.scratch_size = (long *)xcalloc((size_t)opt_threads, sizeof(long));
+  batch.outgroup = NULL;
+  batch.outgroup_count = 0;
+
+  if (opt_outgroup)
+  {
+    outgroup_parse(&batch);
+
+    if (!opt_quiet)
+    {
+      fprintf(stdout, "Outgroup:\n");
+      for (i = 0; i < batch.outgroup_count; ++i)
+        fprintf(stdout, "\t%s\n", batch.outgroup[i]);
+    }
+  }
 
   /* parse tree */
   if (!opt_quiet)
     fprintf(stdout, "Parsing tree file...\n");
 
-  char * newick;
-
-  while ((newick = getnextline(fp_input)))
+  /* trees are parsed sequentially and rooted in parallel, a batch at a time,
+     and written out in input order */
+  while (1)
   {
-    ntree_t * tree = ntree_parse_newick(newick);
-    if (!tree)
-      fatal("Cannot parse tree file");
-
-    fp_output = opt_outfile ?
-                  xopen(opt_outfile,"w") : stdout;
+    ntree_t * tree;
+    long count = 0;
 
-    free(newick);
+    while (count < batch_size && treeio_next(fp_input, &tree))
+    {
+      if (!tree)
+        fatal("Cannot parse tree file");
 
-    /* TODO: check if tree is unrooted binary */
-    if (!check_binunrooted(tree))
-      fprintf(stderr, "WARNING: Input tree is not binary unrooted");
+      if (!check_binunrooted(tree))
+        fprintf(stderr, "WARNING: Input tree is not binary unrooted\n");
 
-    if (opt_midpoint) 
-      midpoint_root(tree);
-    else if (opt_longest_branch)
-      longest_branch_root(tree);
-    else if (opt_outgroup)
-      outgroup_root(tree);
-    else
-      assert(0);
+      batch.trees[count++] = tree;
+    }
 
-    /* output tree */
-    char * newick = ntree_export_newick(tree);
-    fprintf(fp_output, "%s\n", newick);
-    free(newick);
+    if (!count)
+      break;
 
-    /* deallocate tree structure */
-    ntree_destroy(tree,free);
-  
-    if (opt_outfile)
-      fclose(fp_output);
+    threads_write_ordered(fp_output,
+                          count,
+                          batch.trees[0]->leaves_count,
+                          root_tree,
+                          &batch);
   }
-  fclose(fp_input);
+
+  if (opt_outfile)
+    fclose(fp_output);
+  treeio_close(fp_input);
+
+  for (i = 0; i < opt_threads; ++i)
+    free(batch.scratch[i]);
+  for (i = 0; i < batch.outgroup_count; ++i)
+    free(batch.outgroup[i]);
+  free(batch.outgroup);
+  free(batch.scratch);
+  free(batch.scratch_size);
+  free(batch.trees);
 }
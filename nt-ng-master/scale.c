@@ -36,7 +36,8 @@ static void scale_tree(ntree_t * tree)
 void cmd_scale()
 {
   char * newick;
-  FILE * fp_input;
+  treeio_t * fp_input;
+  ntree_t * tree;
   FILE * fp_output;
 
   /* parse tree */
@@ -44,7 +45,7 @@ void cmd_scale()
     fprintf(stdout, "Parsing tree file...\n");
 
   /* open input tree file */
-  fp_input = xopen(opt_treefile,"r");
+  fp_input = treeio_open_selected(opt_treefile);
 
   /* attempt to open output file */
   fp_output = opt_outfile ?
@@ -52,16 +53,13 @@ void cmd_scale()
 
 
   /* loop through the collection of trees */
-  while ((newick = getnextline(fp_input)))
+  while (treeio_next(fp_input, &tree))
   {
-    ntree_t * tree = ntree_parse_newick(newick);
     if (!tree)
       fatal("Cannot parse tree file");
 
     scale_tree(tree);
 
-    free(newick);
-
     newick = ntree_export_newick(tree);
 
     fprintf(fp_output, "%s\n", newick);
@@ -76,5 +74,5 @@ void cmd_scale()
   if (opt_outfile)
     fclose(fp_output);
 
-  fclose(fp_input);
+  treeio_close(fp_input);
 }
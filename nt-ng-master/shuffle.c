@@ -22,17 +22,18 @@
 
 #include "newick-tools.h"
 
-static void shuffle_order(ntree_t * tree)
+static void shuffle_order(ntree_t * tree, rng_t * rng)
 {
   long i;
 
   for (i = 0; i < tree->inner_count; ++i)
-    shuffle((void *)(tree->inner[i]->children),
+    shuffle(rng,
+            (void *)(tree->inner[i]->children),
             tree->inner[i]->children_count,
             sizeof(node_t *));
 }
 
-static void shuffle_labels(ntree_t * tree)
+static void shuffle_labels(ntree_t * tree, rng_t * rng)
 {
   long i;
 
@@ -42,7 +43,8 @@ static void shuffle_labels(ntree_t * tree)
   for (i = 0; i < tree->leaves_count; ++i)
     labels[i] = tree->leaves[i]->label;
 
-  shuffle((void *)labels,
+  shuffle(rng,
+          (void *)labels,
           tree->leaves_count,
           sizeof(char *));
 
@@ -53,14 +55,16 @@ static void shuffle_labels(ntree_t * tree)
 void cmd_shuffle()
 {
   long treeno = 0;
-  FILE * fp_input;
+  rng_t rng;
+  treeio_t * fp_input;
   FILE * fp_output;
   char * newick;
+  ntree_t * tree;
 
   if (!opt_treefile)
     fatal("An input file must be specified");
 
-  fp_input  = xopen(opt_treefile,"r");
+  fp_input  = treeio_open_selected(opt_treefile);
 
   /* prepare output medium */
   fp_output = opt_outfile ?
@@ -70,25 +74,26 @@ void cmd_shuffle()
   if (!opt_quiet)
     fprintf(stdout, "Parsing tree file...\n");
 
-  while ((newick = getnextline(fp_input)))
+  while (treeio_next(fp_input, &tree))
   {
-    ++treeno;
+    treeno = treeio_treeno(fp_input);
 
-    ntree_t * tree = ntree_parse_newick(newick);
     if (!tree)
     {
       fprintf(stderr, "Cannot parse tree in line %ld\n", treeno);
-      free(newick);
       continue;
     }
     
+    /* each tree has its own random stream */
+    rng_seed(&rng, (unsigned long)opt_seed, (unsigned long)(treeno-1));
+
     if (opt_shuffle_order)
     {
-      shuffle_order(tree);
+      shuffle_order(tree, &rng);
     }
     else if (opt_shuffle_labels)
     {
-      shuffle_labels(tree);
+      shuffle_labels(tree, &rng);
     }
 
     newick = ntree_export_newick(tree);
@@ -103,5 +108,5 @@ void cmd_shuffle()
   /* close output and input file */
   if (opt_outfile)
     fclose(fp_output);
-  fclose(fp_input);
+  treeio_close(fp_input);
 }
@@ -83,17 +83,155 @@ static double origin(double t)
   return terma*termb;
 }
 
-static void set_branchlength(node_t * node, double parent_age)
+/* per-thread scratch space, allocated once and reused for every replicate */
+typedef struct bd_workspace_s
 {
-  double * node_ageptr;
+  node_t * nodes;             /* tips followed by inner nodes */
+  node_t ** children;         /* children arrays of inner nodes */
+  node_t ** active;           /* roots of the subtrees not yet joined */
+  double * s;                 /* node ages */
+} bd_workspace_t;
 
-  if (!node->data)
-    node->length = parent_age;
-  else
+typedef struct bd_batch_s
+{
+  long tips;
+  char ** labels;
+  long * taxa;
+  bd_workspace_t * ws;
+} bd_batch_t;
+
+static void workspace_init(bd_workspace_t * ws, bd_batch_t * batch)
+{
+  long i;
+  long tips = batch->tips;
+
+  ws->nodes = (node_t *)xcalloc((size_t)(2*tips-1), sizeof(node_t));
+  ws->children = (node_t **)xmalloc((size_t)(2*tips-2) * sizeof(node_t *));
+  ws->active = (node_t **)xmalloc((size_t)tips * sizeof(node_t *));
+  ws->s = (double *)xmalloc((size_t)(tips-1) * sizeof(double));
+
+  for (i = 0; i < tips; ++i)
   {
-    node_ageptr = (double *)(node->data);
-    node->length = parent_age - *node_ageptr;
+    ws->nodes[i].label = batch->labels[i];
+    ws->nodes[i].taxon = batch->taxa[i];
+    ws->nodes[i].leaves = 1;
+    ws->nodes[i].index = i;
   }
+
+  for (i = 0; i < tips-1; ++i)
+  {
+    node_t * node = ws->nodes + tips + i;
+
+    node->children = ws->children + 2*i;
+    node->children_count = 2;
+    node->taxon = -1;
+    node->index = i;
+  }
+}
+
+static void workspace_destroy(bd_workspace_t * ws)
+{
+  free(ws->nodes);
+  free(ws->children);
+  free(ws->active);
+  free(ws->s);
+}
+
+/* simulates one tree in the nodes of the workspace and returns its root.
+   The age of the origin is stored in t */
+static node_t * simulate_tree(bd_workspace_t * ws,
+                              long tips,
+                              rng_t * rng,
+                              double * t)
+{
+  long i,k;
+  double * s = ws->s;
+  node_t ** active = ws->active;
+
+  /* compute origin in absolute */
+  *t = origin(rng_uniform(rng));
+
+  /* compute waiting times */
+  for (i=0; i<tips-1; ++i)
+    s[i] = create_waiting_time(rng_uniform(rng), *t);
+
+  /* re-scale if specified */
+  if (opt_origin)
+  {
+    double scaler = opt_origin / *t;
+
+    *t = opt_origin;
+
+    for (i=0; i<tips-1; ++i)
+      s[i] *= scaler;
+  }
+
+  /* round to the decimal point specified by opt_precision */
+  *t = fround(*t);
+  for (i=0; i<tips-1; ++i)
+    s[i] = fround(s[i]);
+
+  /* sort them from smallest to largest */
+  qsort((void *)s, tips-1, sizeof(double), cb_asc);
+
+  for (i = 0; i < tips; ++i)
+    active[i] = ws->nodes + i;
+
+  /* randomly join two subtrees at each age, from youngest to oldest */
+  for (i = tips, k = 0; i != 1; --i, ++k)
+  {
+    /* select two distinct subtrees such that r1 < r2 */
+    long r1 = (long)rng_bounded(rng, (unsigned long)i);
+    long r2 = (long)rng_bounded(rng, (unsigned long)(i-1));
+    if (r2 >= r1) ++r2;
+    if (r1 > r2) SWAP(r1,r2);
+
+    node_t * new = ws->nodes + tips + k;
+    new->age = s[k];
+    new->children[0] = active[r1];
+    new->children[1] = active[r2];
+    new->leaves = new->children[0]->leaves + new->children[1]->leaves;
+
+    new->children[0]->length = new->age - new->children[0]->age;
+    new->children[1]->length = new->age - new->children[1]->age;
+    new->children[0]->parent = new;
+    new->children[1]->parent = new;
+
+    /* update list of subtrees with new inner node and remove old invalid
+       ones */
+    active[r1] = new;
+    if (r2 != i-1)
+      active[r2] = active[i-1];
+  }
+
+  node_t * root = active[0];
+  root->parent = NULL;
+  root->length = *t - root->age;
+
+  return root;
+}
+
+static void simulate_replicate(long index,
+                               long thread,
+                               strbuf_t * out,
+                               void * data)
+{
+  bd_batch_t * batch = (bd_batch_t *)data;
+  bd_workspace_t * ws = batch->ws + thread;
+  rng_t rng;
+  double t;
+
+  if (!ws->nodes)
+    workspace_init(ws, batch);
+
+  /* each replicate has its own random stream, and hence the output does not
+     depend on the number of threads */
+  rng_seed(&rng, (unsigned long)opt_seed, (unsigned long)index);
+
+  node_t * root = simulate_tree(ws, batch->tips, &rng, &t);
+
+  ntree_newick_append(out, root, root->length);
+  strbuf_append(out, "\n", 1);
 }
 
 /* Simulates a tree based on the constant-rate birth death process using the
@@ -104,11 +242,15 @@ static void set_branchlength(node_t * node, double parent_age)
    Syst. Biol. 59(4):465-476, 2010.
    DOI: https://doi.org/10.1093/sysbio/syq026
 
+   Replicates are simulated in batches in parallel and written in order. Tree
+   nodes are taken from per-thread arrays that are reused across replicates,
+   and all trees share the same tip labels.
 */
 void cmd_simulate_bd(void)
 {
   FILE * out;
-  int i;
+  long i;
+  bd_batch_t batch;
 
   if (!opt_birthrate)
     fatal("Argument --birthrate must be specified");
@@ -116,25 +258,20 @@ void cmd_simulate_bd(void)
   if (opt_birthrate - opt_deathrate < 0)
     fatal("Argument --birthrate must be greater or equal to --deathrate");
 
+  if (opt_replicates < 1)
+    fatal("Argument --replicates must be a positive integer");
+
   roundfactor = pow(10, opt_precision);
 
   assert(opt_simulate > 1);
 
-  /* create an array of nodes */
-
-  node_t ** children = (node_t **)xmalloc(opt_simulate*sizeof(node_t *));
+  /* create the table of tip labels shared by all replicates */
+  batch.tips = opt_simulate;
+  batch.labels = (char **)xmalloc(opt_simulate*sizeof(char *));
+  batch.taxa = (long *)xmalloc(opt_simulate*sizeof(long));
 
   if (opt_labels)
   {
-    /* OLD CODE */
-    #if 0 
-    int count;
-    labels = parse_labels(opt_labels, &count); 
-    if (count != opt_simulate_tips)
-      fatal("Number of labels in %s differs from --opt_simulate_bd",
-            opt_labels);
-    #endif
-
     list_t * labels = labels_parse_file(opt_labels);
     if (!labels)
       fatal("Error while parsing file %s", opt_labels);
@@ -146,15 +283,16 @@ void cmd_simulate_bd(void)
     
     if (labels->count < opt_simulate)
       fatal("File %s contains %ld labels, but %ld are needed",
-            labels->count, opt_simulate);
+            opt_labels, labels->count, opt_simulate);
 
     list_item_t * item;
 
-    for (i=0, item = labels->head; i < opt_simulate; item = item->next, ++i)
+    for (i=0, item = labels->head; item; item = item->next, ++i)
     {
-      children[i] = (node_t *)xcalloc(1,sizeof(node_t));
-      children[i]->leaves = 1;
-      children[i]->label = (char *)(item->data);
+      if (i < opt_simulate)
+        batch.labels[i] = (char *)(item->data);
+      else
+        free(item->data);
     }
 
     list_clear(labels,NULL);
@@ -163,139 +301,35 @@ void cmd_simulate_bd(void)
   else
   {
     for (i=0; i<opt_simulate; ++i)
-    {
-      children[i] = (node_t *)xcalloc(1,sizeof(node_t));
-      children[i]->leaves = 1;
-      asprintf(&(children[i]->label), "%d", i+1);
-    }
-  }
-
-  /* compute origin in absolute */
-  double t = origin(rnd_uniform(0,1));
-
-  /* allocate space for tips-1 waiting times */
-  double * s = (double *)xmalloc((opt_simulate-1)*sizeof(double));
-
-  
-  /* compute waiting times */
-  for (i=0; i<opt_simulate-1; ++i)
-    s[i] = create_waiting_time(rnd_uniform(0,1), t);
-
-  /* re-scale if specified */
-  if (opt_origin)
-  {
-    double scaler = opt_origin / t; 
-
-    t = opt_origin;
-
-    for (i=0; i<opt_simulate-1; ++i)
-      s[i] *= scaler;
+      asprintf(batch.labels+i, "%ld", i+1);
   }
 
-  /* round to the decimal point specified by opt_precision */
-  t = fround(t);
-  for (i=0; i<opt_simulate-1; ++i)
-    s[i] = fround(s[i]);
-
-  /* sort them from smallest to largest */
-  qsort((void *)s, opt_simulate-1, sizeof(double), cb_asc);
-
-
-  node_t * new = NULL;
-  /* randomly resolve current node */
-  i = opt_simulate;
-  while (i != 1)
-  {
-    /* select two children such that r1 < r2 */
-    int r1 = rand() % i;
-    int r2 = rand() % i;
-    if (r1 == r2)
-      r2 = (r1 == i-1) ? r2-1 : r2+1;
-    if (r1 > r2) SWAP(r1,r2);
-
-    /* create a new inner node */
-    new = (node_t *)xmalloc(sizeof(node_t));
-    new->children = (node_t **)xmalloc(2*sizeof(node_t *));
-    new->children_count = 2;
-    new->children[0] = children[r1];
-    new->children[1] = children[r2];
-    new->leaves = new->children[0]->leaves + new->children[1]->leaves;
-    new->length = 0;
-    new->label  = NULL;
-    new->mark   = 0;
-    new->coord  = NULL;
+  for (i=0; i<opt_simulate; ++i)
+    batch.taxa[i] = label_intern(batch.labels[i]);
 
-    /* store pointer to waiting time */
-    new->data   = (void *)(s + opt_simulate - i);
-
-    set_branchlength(new->children[0], s[opt_simulate-i]);
-    set_branchlength(new->children[1], s[opt_simulate-i]);
-
-    new->children[0]->data = NULL;
-    new->children[1]->data = NULL;
-
-    new->children[0]->parent = new;
-    new->children[1]->parent = new;
-
-    /* update list of children with new inner node and remove old
-       invalid children */
-    children[r1] = new;
-    if (r2 != i-1)
-      children[r2] = children[i-1];
-
-    --i;
-  }
-
-  assert(new);
-
-  /* new is the root */
-  set_branchlength(new, t);
-  new->data = NULL;
-  new->parent = NULL;
-
-  ntree_t * tree = (ntree_t *)xmalloc(sizeof(ntree_t));
-  tree->root = new;
-  tree->leaves_count = tree->root->leaves;
-  tree->inner_count = tree->leaves_count - 1;
-  wraptree(tree);
-
-//  /* scale time of origin */
-//  if (opt_origin_scale)
-//  {
-//    double scaler = opt_origin / t; 
-//
-//    rtree_t ** nodes = (rtree_t **)xmalloc((2*opt_simulate_tips-1) *
-//                                           sizeof(rtree_t *));
-//
-//    rtree_query_tipnodes(new, nodes);
-//    rtree_query_innernodes(new, nodes+opt_simulate_tips);
-//
-//    for (i=0; i <2*opt_simulate_tips-1; ++i)
-//      nodes[i]->length *= scaler;
-//
-//    double maxlength = rtree_longest_path(new);
-//
-//    /* correct any numerical errors */
-//    new->length += opt_origin - maxlength;
-//    free(nodes);
-//    assert(new->length > 0);
-//  }
-
-  /* prepare for output */
-  char * newick = ntree_export_newick(tree);
+  batch.ws = (bd_workspace_t *)xcalloc((size_t)opt_threads,
+                                       sizeof(bd_workspace_t));
 
   /* attempt to open output file */
   out = opt_outfile ?
           xopen(opt_outfile,"w") : stdout;
 
-  
-  fprintf(out, "%s\n", newick); 
+  threads_write_ordered(out,
+                        opt_replicates,
+                        opt_simulate,
+                        simulate_replicate,
+                        &batch);
 
   if (opt_outfile)
     fclose(out);
 
-  ntree_destroy(tree,free);
-  free(children);
-  free(s);
-  free(newick);
+  for (i = 0; i < opt_threads; ++i)
+    if (batch.ws[i].nodes)
+      workspace_destroy(batch.ws+i);
+  for (i = 0; i < opt_simulate; ++i)
+    free(batch.labels[i]);
+
+  free(batch.ws);
+  free(batch.labels);
+  free(batch.taxa);
 }
@@ -22,15 +22,137 @@
 
 #include "newick-tools.h"
 
-static int cb_desc(const void * va, const void * vb)
+/* Return the k-th smallest (0-based) element of values. The array is
+   partially reordered (quickselect with median-of-three pivots), which runs
+   in expected linear time instead of sorting the whole array */
+double select_kth(double * values, long count, long k)
 {
-  double a = *(double *)va;
-  double b = *(double *)vb;
-  
-  if (a - b > 0) return 1;
-  else if (a - b < 0) return -1;
+  long lo = 0;
+  long hi = count-1;
+
+  assert(k >= 0 && k < count);
+
+  while (hi > lo)
+  {
+    long mid = lo + (hi - lo) / 2;
+
+    /* order lo, mid, hi and use the middle value as pivot */
+    if (values[mid] < values[lo]) SWAP(values[mid],values[lo]);
+    if (values[hi] < values[lo]) SWAP(values[hi],values[lo]);
+    if (values[hi] < values[mid]) SWAP(values[hi],values[mid]);
+
+    double pivot = values[mid];
+    long i = lo;
+    long j = hi;
+
+    while (i <= j)
+    {
+      while (values[i] < pivot) ++i;
+      while (values[j] > pivot) --j;
+      if (i <= j)
+      {
+        SWAP(values[i],values[j]);
+        ++i;
+        --j;
+      }
+    }
+
+    if (k <= j)
+      hi = j;
+    else if (k >= i)
+      lo = i;
+    else
+      break;
+  }
+
+  return values[k];
+}
+
+/* Return the p-quantile of values, interpolating between order statistics
+   as R's default (type 7) does. The array is partially reordered */
+double stats_quantile(double * values, long count, double p)
+{
+  long i;
+  double h = (count - 1) * p;
+  long k = (long)floor(h);
+
+  double lower = select_kth(values, count, k);
+  if (k+1 >= count || h == k)
+    return lower;
+
+  /* the next order statistic is the minimum of the right part */
+  double upper = values[k+1];
+  for (i = k+2; i < count; ++i)
+    upper = MIN(upper, values[i]);
+
+  return lower + (h - k) * (upper - lower);
+}
+
+/* Sum, minimum and maximum of an array. Four independent accumulators break
+   the dependency chain of the reduction and let the compiler keep them in
+   vector registers */
+void stats_moments(const double * values,
+                   long count,
+                   double * sum,
+                   double * min,
+                   double * max)
+{
+  long i;
+  double s[4] = {0,0,0,0};
+  double lo[4], hi[4];
+
+  *sum = *min = *max = 0;
+  if (!count)
+    return;
 
-  return 0;
+  for (i = 0; i < 4; ++i)
+    lo[i] = hi[i] = values[0];
+
+  for (i = 0; i+4 <= count; i += 4)
+  {
+    s[0] += values[i];
+    s[1] += values[i+1];
+    s[2] += values[i+2];
+    s[3] += values[i+3];
+    lo[0] = MIN(lo[0],values[i]);
+    lo[1] = MIN(lo[1],values[i+1]);
+    lo[2] = MIN(lo[2],values[i+2]);
+    lo[3] = MIN(lo[3],values[i+3]);
+    hi[0] = MAX(hi[0],values[i]);
+    hi[1] = MAX(hi[1],values[i+1]);
+    hi[2] = MAX(hi[2],values[i+2]);
+    hi[3] = MAX(hi[3],values[i+3]);
+  }
+  for (; i < count; ++i)
+  {
+    s[0] += values[i];
+    lo[0] = MIN(lo[0],values[i]);
+    hi[0] = MAX(hi[0],values[i]);
+  }
+
+  *sum = (s[0] + s[1]) + (s[2] + s[3]);
+  *min = MIN(MIN(lo[0],lo[1]),MIN(lo[2],lo[3]));
+  *max = MAX(MAX(hi[0],hi[1]),MAX(hi[2],hi[3]));
+}
+
+/* sum of squared deviations from mean, with the same accumulator layout as
+   stats_moments() */
+static double sum_sqdev(const double * values, long count, double mean)
+{
+  long i;
+  double s[4] = {0,0,0,0};
+
+  for (i = 0; i+4 <= count; i += 4)
+  {
+    s[0] += (values[i]   - mean) * (values[i]   - mean);
+    s[1] += (values[i+1] - mean) * (values[i+1] - mean);
+    s[2] += (values[i+2] - mean) * (values[i+2] - mean);
+    s[3] += (values[i+3] - mean) * (values[i+3] - mean);
+  }
+  for (; i < count; ++i)
+    s[0] += (values[i] - mean) * (values[i] - mean);
+
+  return (s[0] + s[1]) + (s[2] + s[3]);
 }
 
 void stats(double * values, int count, 
@@ -38,8 +160,7 @@ void stats(double * values, int count,
            double * mean, double * median, 
            double * var, double * stdev)
 {
-  int i;
-  double sum = 0;
+  double sum;
   
   *min = 0;
   *max = 0;
@@ -51,33 +172,31 @@ void stats(double * values, int count,
   if (!count)
     return;
 
-  qsort((void *)values, count, sizeof(double), cb_desc);
-
   /* sum, min, max */
-  for (i=0; i<count; ++i)
-    sum += values[i]; 
-
-  *min = values[0];
-  *max = values[count-1];
+  stats_moments(values, count, &sum, min, max);
 
   /* mean */
   *mean = sum/count;
 
+  /* variance (computed before selection reorders the values) */
+  *var = sum_sqdev(values, count, *mean) / count;
+
   /* median */
   if (count % 2)
-    *median = values[count/2];
+    *median = select_kth(values, count, count/2);
   else
   {
     assert(count/2-1 >= 0);
-    *median = (values[count/2] + values[count/2-1])/2;
-  }
 
-  /* variance */
-  for (i=0; i<count; ++i)
-  {
-    *var += (*mean - values[i])*(*mean - values[i]);
+    /* after selecting the upper middle element, the lower one is the
+       maximum of the left part */
+    double upper = select_kth(values, count, count/2);
+    double lower = values[0];
+    long i;
+    for (i = 1; i < count/2; ++i)
+      lower = MAX(lower, values[i]);
+    *median = (upper + lower)/2;
   }
-  *var /= count;
 
   /* standard deviation */
   *stdev = sqrt(*var);
@@ -0,0 +1,530 @@
+/*
+    Copyright (C) 2015-2017 Tomas Flouri
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Tomas Flouri <t.flouris@ucl.ac.uk>,
+    Department of Genetics, Evolution and Environment,
+    University College London,
+    Gower Street, London WC1E 6BT, England
+*/
+
+
+#include "newick-tools.h"
+#include <zlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/* Transparent compressed input and output for xopen.
+
+   Files opened for reading are recognized by their first bytes: gzip is
+   decompressed with zlib and zstd by a zstd child process, and other files
+   are read as they are. Files opened for writing whose name ends in .gz or
+   .zst are compressed the same way. The returned streams are ordinary FILE
+   pointers (glibc fopencookie), so getnextline, fprintf and fclose work on
+   them unchanged.
+
+   A path that does not exist but starts with an existing tar archive
+   (optionally compressed), such as Inferred_trees.tar.gz/Inferred_trees/t1,
+   names a member of that archive. The archive is read as a stream and kept
+   open between calls, and members are looked up by scanning forward from the
+   previous one, so members opened in archive order are found with a single
+   pass over the archive. The archive cache is not thread-safe, i.e. files
+   must be opened outside parallel sections */
+
+#define TAR_BLOCK 512
+
+#define GZIP_SUFFIX ".gz"
+#define ZSTD_SUFFIX ".zst"
+
+typedef struct pipe_cookie_s
+{
+  FILE * fp;
+  pid_t pid;                  /* zero once the child has been waited for */
+  int writing;
+  char * filename;
+} pipe_cookie_t;
+
+typedef struct mem_cookie_s
+{
+  char * data;
+  size_t size;
+  size_t pos;
+} mem_cookie_t;
+
+typedef struct archive_s
+{
+  char * filename;
+  FILE * fp;
+  long pos;                   /* position in the uncompressed archive */
+} archive_t;
+
+static archive_t archive = { NULL, NULL, 0 };
+
+static int has_suffix(const char * s, const char * suffix)
+{
+  size_t len = strlen(s);
+  size_t slen = strlen(suffix);
+
+  return len >= slen && !strcmp(s + len - slen, suffix);
+}
+
+/* gzip streams */
+
+static ssize_t gz_read(void * cookie, char * buf, size_t size)
+{
+  int n = gzread((gzFile)cookie, buf, (unsigned int)MIN(size, INT_MAX));
+
+  return n < 0 ? -1 : n;
+}
+
+static ssize_t gz_write(void * cookie, const char * buf, size_t size)
+{
+  if (!size) return 0;
+
+  int n = gzwrite((gzFile)cookie, buf, (unsigned int)MIN(size, INT_MAX));
+
+  return n <= 0 ? -1 : n;
+}
+
+static int gz_close(void * cookie)
+{
+  return gzclose((gzFile)cookie) == Z_OK ? 0 : EOF;
+}
+
+static FILE * gz_open(const char * filename, int writing)
+{
+  cookie_io_functions_t io = { gz_read, gz_write, NULL, gz_close };
+  gzFile gz = gzopen(filename, writing ? "wb6" : "rb");
+
+  if (!gz) return NULL;
+
+  gzbuffer(gz, 1 << 17);
+
+  return fopencookie(gz, writing ? "w" : "r", io);
+}
+
+/* zstd streams, through a child process */
+
+/* wait for the zstd child of p, and stop with an error if it failed. A
+   reader may stop early, in which case zstd dies of a broken pipe */
+static int pipe_wait(pipe_cookie_t * p)
+{
+  int status;
+
+  if (waitpid(p->pid, &status, 0) < 0)
+    return EOF;
+  p->pid = 0;
+
+  if (WIFEXITED(status) && !WEXITSTATUS(status))
+    return 0;
+
+  if (p->writing)
+    return EOF;
+
+  if (!WIFSIGNALED(status) || WTERMSIG(status) != SIGPIPE)
+    fatal("Cannot decompress %s", p->filename);
+
+  return 0;
+}
+
+static ssize_t pipe_read(void * cookie, char * buf, size_t size)
+{
+  pipe_cookie_t * p = (pipe_cookie_t *)cookie;
+  size_t n = fread(buf, 1, size, p->fp);
+
+  if (n) return (ssize_t)n;
+
+  if (ferror(p->fp)) return -1;
+
+  /* end of the decompressed data, which is only complete if zstd succeeded */
+  if (p->pid)
+    pipe_wait(p);
+
+  return 0;
+}
+
+static ssize_t pipe_write(void * cookie, const char * buf, size_t size)
+{
+  pipe_cookie_t * p = (pipe_cookie_t *)cookie;
+
+  return fwrite(buf, 1, size, p->fp) == size ? (ssize_t)size : -1;
+}
+
+static int pipe_close(void * cookie)
+{
+  pipe_cookie_t * p = (pipe_cookie_t *)cookie;
+  int rc = fclose(p->fp);
+
+  if (p->pid && pipe_wait(p))
+    rc = EOF;
+
+  free(p->filename);
+  free(p);
+  return rc;
+}
+
+static FILE * pipe_open(const char * filename, int writing)
+{
+  cookie_io_functions_t io = { pipe_read, pipe_write, NULL, pipe_close };
+  int fd[2];
+  int st[2];
+  int out = -1;
+  int err;
+
+  if (writing)
+  {
+    out = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (out < 0) return NULL;
+  }
+
+  /* close-on-exec, such that other zstd processes do not inherit the pipe
+     and keep it open */
+  if (pipe2(fd, O_CLOEXEC))
+    fatal("Cannot create pipe");
+
+  /* the child reports a failed exec through st, which a successful exec
+     closes */
+  if (pipe2(st, O_CLOEXEC))
+    fatal("Cannot create pipe");
+
+  pid_t pid = fork();
+  if (pid < 0)
+    fatal("Cannot fork zstd process");
+
+  if (!pid)
+  {
+    if (writing)
+    {
+      dup2(fd[0], STDIN_FILENO);
+      dup2(out, STDOUT_FILENO);
+      close(out);
+    }
+    else
+      dup2(fd[1], STDOUT_FILENO);
+    close(fd[0]);
+    close(fd[1]);
+    close(st[0]);
+
+    if (writing)
+      execlp("zstd", "zstd", "-q", "-c", (char *)NULL);
+    else
+      execlp("zstd", "zstd", "-q", "-d", "-c", "--", filename, (char *)NULL);
+
+    err = errno;
+    if (write(st[1], &err, sizeof(err)) < 0)
+      _exit(126);
+    _exit(127);
+  }
+
+  close(st[1]);
+  ssize_t n;
+  while ((n = read(st[0], &err, sizeof(err))) < 0 && errno == EINTR);
+  close(st[0]);
+
+  if (n > 0)
+  {
+    waitpid(pid, NULL, 0);
+    if (writing)
+      unlink(filename);
+    fatal("zstd is required to %s %s", writing ? "write" : "read", filename);
+  }
+
+  pipe_cookie_t * p = (pipe_cookie_t *)xmalloc(sizeof(pipe_cookie_t));
+  p->pid = pid;
+  p->writing = writing;
+  p->filename = xstrdup(filename);
+  if (writing)
+  {
+    close(out);
+    close(fd[0]);
+    p->fp = fdopen(fd[1], "w");
+  }
+  else
+  {
+    close(fd[1]);
+    p->fp = fdopen(fd[0], "r");
+  }
+
+  return fopencookie(p, writing ? "w" : "r", io);
+}
+
+/* in-memory streams holding a tar member */
+
+static ssize_t mem_read(void * cookie, char * buf, size_t size)
+{
+  mem_cookie_t * m = (mem_cookie_t *)cookie;
+  size_t n = MIN(size, m->size - m->pos);
+
+  memcpy(buf, m->data + m->pos, n);
+  m->pos += n;
+
+  return (ssize_t)n;
+}
+
+static int mem_close(void * cookie)
+{
+  mem_cookie_t * m = (mem_cookie_t *)cookie;
+
+  free(m->data);
+  free(m);
+
+  return 0;
+}
+
+static FILE * mem_open(char * data, size_t size)
+{
+  cookie_io_functions_t io = { mem_read, NULL, NULL, mem_close };
+  mem_cookie_t * m = (mem_cookie_t *)xmalloc(sizeof(mem_cookie_t));
+
+  m->data = data;
+  m->size = size;
+  m->pos = 0;
+
+  return fopencookie(m, "r", io);
+}
+
+/* open a file for reading, decompressing it if needed */
+static FILE * open_read(const char * filename)
+{
+  unsigned char magic[4];
+  FILE * fp = fopen(filename, "r");
+
+  if (!fp) return NULL;
+
+  size_t n = fread(magic, 1, 4, fp);
+
+  if (n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+  {
+    fclose(fp);
+    return gz_open(filename, 0);
+  }
+
+  if (n == 4 && magic[0] == 0x28 && magic[1] == 0xb5 &&
+      magic[2] == 0x2f && magic[3] == 0xfd)
+  {
+    fclose(fp);
+    return pipe_open(filename, 0);
+  }
+
+  rewind(fp);
+  return fp;
+}
+
+/* tar archives */
+
+static long tar_octal(const char * field, size_t len)
+{
+  long value = 0;
+  size_t i;
+
+  for (i = 0; i < len && field[i] == ' '; ++i);
+  for (; i < len && field[i] >= '0' && field[i] <= '7'; ++i)
+    value = value*8 + (field[i] - '0');
+
+  return value;
+}
+
+static int tar_skip(long size)
+{
+  char block[TAR_BLOCK];
+
+  for (; size > 0; size -= TAR_BLOCK)
+  {
+    if (fread(block, 1, TAR_BLOCK, archive.fp) != TAR_BLOCK)
+      return 0;
+    archive.pos += TAR_BLOCK;
+  }
+
+  return 1;
+}
+
+static int archive_reopen(const char * filename)
+{
+  if (archive.fp)
+    fclose(archive.fp);
+  if (!archive.filename || strcmp(archive.filename, filename))
+  {
+    free(archive.filename);
+    archive.filename = xstrdup(filename);
+  }
+
+  archive.fp = open_read(filename);
+  archive.pos = 0;
+
+  return archive.fp != NULL;
+}
+
+/* scan the archive forward from the current position, up to stop (or the
+   end if negative), for member name. Returns its contents or NULL */
+static char * archive_scan(const char * name, long stop, size_t * size)
+{
+  char header[TAR_BLOCK];
+  char * longname = NULL;
+
+  while (stop < 0 || archive.pos < stop)
+  {
+    if (fread(header, 1, TAR_BLOCK, archive.fp) != TAR_BLOCK)
+      break;
+    archive.pos += TAR_BLOCK;
+
+    /* end of archive */
+    if (!header[0])
+      break;
+
+    long member_size = tar_octal(header+124, 12);
+    char type = header[156];
+    char path[256+1];
+
+    if (type == 'L')
+    {
+      /* GNU long name of the next member */
+      free(longname);
+      longname = (char *)xmalloc((size_t)member_size + TAR_BLOCK);
+      long blocks = (member_size + TAR_BLOCK - 1) / TAR_BLOCK;
+      if (fread(longname, TAR_BLOCK, (size_t)blocks, archive.fp) !=
+          (size_t)blocks)
+        break;
+      longname[member_size] = 0;
+      archive.pos += blocks * TAR_BLOCK;
+      continue;
+    }
+
+    if (longname)
+      snprintf(path, sizeof(path), "%s", longname);
+    else if (!memcmp(header+257, "ustar", 5) && header[345])
+      snprintf(path, sizeof(path), "%.155s/%.100s", header+345, header);
+    else
+      snprintf(path, sizeof(path), "%.100s", header);
+
+    const char * p = path;
+    while (p[0] == '.' && p[1] == '/')
+      p += 2;
+
+    int match = (type == '0' || type == '\0') &&
+                !strcmp(p, name) &&
+                (!longname || strlen(longname) < sizeof(path));
+    free(longname);
+    longname = NULL;
+
+    if (match)
+    {
+      long padded = (member_size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+      char * data = (char *)xmalloc((size_t)padded + 1);
+
+      if (fread(data, 1, (size_t)padded, archive.fp) != (size_t)padded)
+      {
+        free(data);
+        break;
+      }
+      archive.pos += padded;
+      data[member_size] = 0;
+      *size = (size_t)member_size;
+      return data;
+    }
+
+    if (!tar_skip(member_size))
+      break;
+  }
+
+  free(longname);
+  return NULL;
+}
+
+/* open member name of the tar archive filename */
+static FILE * archive_open(const char * filename, const char * name)
+{
+  size_t size;
+  char * data = NULL;
+  long start = 0;
+
+  while (name[0] == '.' && name[1] == '/')
+    name += 2;
+
+  if (archive.fp && archive.filename && !strcmp(archive.filename, filename))
+  {
+    /* continue from the previous member, and wrap around if needed */
+    start = archive.pos;
+    data = archive_scan(name, -1, &size);
+    if (!data && start && archive_reopen(filename))
+      data = archive_scan(name, start, &size);
+  }
+  else if (archive_reopen(filename))
+    data = archive_scan(name, -1, &size);
+
+  if (!data)
+  {
+    errno = ENOENT;
+    return NULL;
+  }
+
+  return mem_open(data, size);
+}
+
+/* split paths such as dir/trees.tar.gz/dir/tree into the archive and the
+   member name, trying each tar-like path component that is a regular file */
+static FILE * open_member(const char * filename)
+{
+  char * path = xstrdup(filename);
+  char * s = path;
+  FILE * fp = NULL;
+
+  while ((s = strchr(s, '/')))
+  {
+    *s = 0;
+    if (has_suffix(path, ".tar") || has_suffix(path, ".tar.gz") ||
+        has_suffix(path, ".tgz") || has_suffix(path, ".tar.zst"))
+    {
+      struct stat st;
+      if (!stat(path, &st) && S_ISREG(st.st_mode))
+      {
+        fp = archive_open(path, s+1);
+        break;
+      }
+    }
+    *s++ = '/';
+  }
+
+  free(path);
+  return fp;
+}
+
+/* fopen with transparent (de)compression and tar member access, see above.
+   Returns NULL on failure */
+FILE * stream_open(const char * filename, const char * mode)
+{
+  FILE * fp;
+
+  if (!strcmp(mode, "r") || !strcmp(mode, "rb"))
+  {
+    if ((fp = open_read(filename)) || (errno != ENOENT && errno != ENOTDIR))
+      return fp;
+
+    return open_member(filename);
+  }
+
+  if (!strcmp(mode, "w") || !strcmp(mode, "wb"))
+  {
+    if (has_suffix(filename, GZIP_SUFFIX))
+      return gz_open(filename, 1);
+
+    if (has_suffix(filename, ZSTD_SUFFIX))
+      return pipe_open(filename, 1);
+  }
+
+  return fopen(filename, mode);
+}
@@ -22,10 +22,11 @@
 
 #include "newick-tools.h"
 
-static double canvas_width;
-static double scaler;
-static double tree_len;
-static double maxlabel_len;
+/* thread-local, as --difftree plots several trees at once */
+static __thread double canvas_width;
+static __thread double scaler;
+static __thread double tree_len;
+static __thread double maxlabel_len;
 static long legend_spacing = 10;
 static long stroke_width = 3;
 
@@ -33,51 +34,141 @@ static char * stroke_color = "#31a354";
 static char rootpath_color[7] = "#ff0000";
 
 
+/* An SVG document is rendered into memory and written with a single call.
+   With --svg_paths, all horizontal and vertical branch segments of the same
+   color are merged into one <path> element instead of one <line> each */
+typedef struct svg_canvas_s
+{
+  strbuf_t out;
+  strbuf_t path[2];           /* segments in stroke_color and rootpath_color */
+  node_t ** stack;            /* scratch for the iterative traversal */
+  int * next_child;
+  char * collapsed;           /* per node slot: root of a collapsed clade */
+  char * clean;               /* per node slot: no marked node in subtree */
+  double * clade_maxx;        /* rightmost tip coordinate below a node */
+  long * clade_tips;
+} svg_canvas_t;
+
+static void svg_coord(strbuf_t * buf, double x)
+{
+  strbuf_append_double(buf, x, 2);
+
+  /* trim trailing zeros of the fraction */
+  while (buf->data[buf->len-1] == '0')
+    buf->len--;
+  if (buf->data[buf->len-1] == '.')
+    buf->len--;
+  buf->data[buf->len] = 0;
+}
+
 static void svg_line(double x1,
                      double y1,
                      double x2,
                      double y2,
                      double stroke_width,
                      const char * stroke_color,
-                     FILE * fp_output)
+                     svg_canvas_t * canvas)
 {
-  fprintf(fp_output,
-          "<line x1=\"%f\" y1=\"%f\" x2=\"%f\" y2=\"%f\" "
-          "stroke=\"%s\" stroke-width=\"%f\" />\n",
-          x1, y1, x2, y2, stroke_color, stroke_width);
+  if (opt_svg_paths)
+  {
+    strbuf_t * path = canvas->path + (stroke_color == rootpath_color);
+
+    strbuf_append(path, "M", 1);
+    svg_coord(path, x1);
+    strbuf_append(path, " ", 1);
+    svg_coord(path, y1);
+    if (y1 == y2)
+    {
+      strbuf_append(path, "H", 1);
+      svg_coord(path, x2);
+    }
+    else if (x1 == x2)
+    {
+      strbuf_append(path, "V", 1);
+      svg_coord(path, y2);
+    }
+    else
+    {
+      strbuf_append(path, "L", 1);
+      svg_coord(path, x2);
+      strbuf_append(path, " ", 1);
+      svg_coord(path, y2);
+    }
+    return;
+  }
+
+  strbuf_printf(&canvas->out,
+                "<line x1=\"%f\" y1=\"%f\" x2=\"%f\" y2=\"%f\" "
+                "stroke=\"%s\" stroke-width=\"%f\" />\n",
+                x1, y1, x2, y2, stroke_color, stroke_width);
 }
 
 static void svg_circle(double cx,
                        double cy,
                        double r,
                        const char * stroke_color,
-                       FILE * fp_output)
+                       svg_canvas_t * canvas)
 {
-  fprintf(fp_output,
-          "<circle cx=\"%f\" cy=\"%f\" r=\"%f\" fill=\"%s\" "
-          "stroke=\"%s\" />\n",
-          cx, cy, r, stroke_color, stroke_color);
+  /* zero-radius circles are invisible, so compact output omits them */
+  if (opt_svg_paths && r <= 0)
+    return;
+
+  strbuf_printf(&canvas->out,
+                "<circle cx=\"%f\" cy=\"%f\" r=\"%f\" fill=\"%s\" "
+                "stroke=\"%s\" />\n",
+                cx, cy, r, stroke_color, stroke_color);
 }
 
-static void ntree_set_xcoord(node_t * node)
+static void svg_paths_flush(svg_canvas_t * canvas)
 {
   int i;
+  const char * color[2] = { stroke_color, rootpath_color };
+
+  for (i = 0; i < 2; ++i)
+  {
+    if (!canvas->path[i].len)
+      continue;
+
+    strbuf_printf(&canvas->out,
+                  "<path fill=\"none\" stroke=\"%s\" stroke-width=\"%ld\" "
+                  "d=\"",
+                  color[i],
+                  stroke_width);
+    strbuf_append(&canvas->out, canvas->path[i].data, canvas->path[i].len);
+    strbuf_append(&canvas->out, "\" />\n", 5);
+    canvas->path[i].len = 0;
+  }
+}
 
-  if (!node->coord)
-    node->coord = (coord_t *)xmalloc(sizeof(coord_t));
+/* horizontal coordinates are set parent before children, by visiting inner
+   nodes in reverse postorder */
+static void ntree_set_xcoord(ntree_t * tree)
+{
+  long i;
+  int j;
 
-  node->coord->x = node->length * scaler;
+  for (i = 0; i < tree->leaves_count; ++i)
+    if (!tree->leaves[i]->coord)
+      tree->leaves[i]->coord = (coord_t *)xmalloc(sizeof(coord_t));
+  for (i = 0; i < tree->inner_count; ++i)
+    if (!tree->inner[i]->coord)
+      tree->inner[i]->coord = (coord_t *)xmalloc(sizeof(coord_t));
 
-  /* if the node has a parent then add the x coord of the parent such that
-     the branch is shifted towards right, otherwise, if the node is the root,
-     align it with the left margin */
-  if (node->parent)
-    node->coord->x += node->parent->coord->x;
-  else
-    node->coord->x += opt_svg_marginleft;
+  /* the root is aligned with the left margin */
+  tree->root->coord->x = tree->root->length * scaler + opt_svg_marginleft;
 
-  for (i = 0; i < node->children_count; ++i)
-    ntree_set_xcoord(node->children[i]);
+  /* otherwise add the x coord of the parent such that the branch is shifted
+     towards right */
+  for (i = tree->inner_count-1; i >= 0; --i)
+  {
+    node_t * node = tree->inner[i];
+
+    for (j = 0; j < node->children_count; ++j)
+    {
+      node_t * child = node->children[j];
+      child->coord->x = child->length * scaler + node->coord->x;
+    }
+  }
 }
 
 
@@ -86,7 +177,7 @@ static void scaler_init(ntree_t * tree)
   int i;
   double len;
   double label_len;
-  node_t * node;
+  heights_t * h = ntree_heights(tree);
 
   /* set global variables */
   tree_len = -__DBL_MAX__;
@@ -97,11 +188,8 @@ static void scaler_init(ntree_t * tree)
   /* find longest path to root */
   for (i = 0; i < tree->leaves_count; ++i)
   {
-    len = 0;
-
     /* get length upto the root */
-    for (node = tree->leaves[i]; node; node = node->parent)
-      len += node->length;
+    len = h->dist[i] + tree->root->length;
 
     if (len > tree_len)
       tree_len = len;
@@ -120,22 +208,19 @@ static void scaler_init(ntree_t * tree)
   }
 }
 
-static void svg_ntree_init(ntree_t * tree, FILE * fp_output)
+static void svg_ntree_init(long rows, svg_canvas_t * canvas)
 {
   long svg_height;
 
-  canvas_width = opt_svg_width - opt_svg_marginleft - opt_svg_marginright;
-
-  scaler_init(tree);
-
   svg_height = opt_svg_margintop + legend_spacing + opt_svg_marginbottom +
-               opt_svg_tipspace * tree->leaves_count;
+               opt_svg_tipspace * rows;
 
   /* print svg header tag with dimensions and grey border */
-  fprintf(fp_output, "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%ld\" "
-          "height=\"%ld\" style=\"border: 1px solid #cccccc;\">\n",
-          opt_svg_width,
-          svg_height);
+  strbuf_printf(&canvas->out,
+                "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%ld\" "
+                "height=\"%ld\" style=\"border: 1px solid #cccccc;\">\n",
+                opt_svg_width,
+                svg_height);
 
   /* show legend */
   if (opt_svg_showlegend)
@@ -147,27 +232,29 @@ static void svg_ntree_init(ntree_t * tree, FILE * fp_output)
              10,
              3,
              stroke_color,
-             fp_output);
+             canvas);
 
     /* draw legend length */
-    fprintf(fp_output, "<text x=\"%f\" y=\"%f\" font-size=\"%ld\" "
-                    "font-family=\"Arial;\">%.*f</text>\n",
-            (canvas_width - maxlabel_len)*opt_svg_legendratio + opt_svg_marginleft + 5,
-            20-opt_svg_fontsize/3.0,
-            (long)opt_svg_fontsize, opt_precision, tree_len * opt_svg_legendratio);
+    strbuf_printf(&canvas->out,
+                  "<text x=\"%f\" y=\"%f\" font-size=\"%ld\" "
+                  "font-family=\"Arial;\">%.*f</text>\n",
+                  (canvas_width - maxlabel_len)*opt_svg_legendratio + opt_svg_marginleft + 5,
+                  20-opt_svg_fontsize/3.0,
+                  (long)opt_svg_fontsize, opt_precision, tree_len * opt_svg_legendratio);
   }
 
   /* print a dashed border to indicate margins */
-  fprintf(fp_output, "<rect x=\"%ld\" y=\"%ld\" width=\"%ld\" fill=\"none\" "
-          "height=\"%ld\" stroke=\"#999999\" stroke-dasharray=\"5,5\" "
-          "stroke-width=\"1\" />\n",
-          opt_svg_marginleft, 
-          opt_svg_margintop + legend_spacing, 
-          opt_svg_width - opt_svg_marginleft - opt_svg_marginright,
-          svg_height - opt_svg_margintop - legend_spacing - opt_svg_marginbottom);
+  strbuf_printf(&canvas->out,
+                "<rect x=\"%ld\" y=\"%ld\" width=\"%ld\" fill=\"none\" "
+                "height=\"%ld\" stroke=\"#999999\" stroke-dasharray=\"5,5\" "
+                "stroke-width=\"1\" />\n",
+                opt_svg_marginleft, 
+                opt_svg_margintop + legend_spacing, 
+                opt_svg_width - opt_svg_marginleft - opt_svg_marginright,
+                svg_height - opt_svg_margintop - legend_spacing - opt_svg_marginbottom);
 }
 
-static void plot_tip(FILE * fp_output, node_t * tip, int * tip_index, int marked)
+static void plot_tip(svg_canvas_t * canvas, node_t * tip, long * tip_index, int marked)
 {
   char * color = stroke_color;
 
@@ -187,21 +274,63 @@ static void plot_tip(FILE * fp_output, node_t * tip, int * tip_index, int marked
            tip->coord->y,
            stroke_width,
            color,
-           fp_output);
+           canvas);
 
   /* draw tip label */
-  fprintf(fp_output,
-          "<text x=\"%f\" y=\"%f\" "
-          "font-size=\"%ld\" font-family=\"Arial;\">%s</text>\n",
-          tip->coord->x+5,
-          tip->coord->y+opt_svg_fontsize/3.0,
-          opt_svg_fontsize,
-          tip->label);
+  strbuf_printf(&canvas->out,
+                "<text x=\"%f\" y=\"%f\" "
+                "font-size=\"%ld\" font-family=\"Arial;\">%s</text>\n",
+                tip->coord->x+5,
+                tip->coord->y+opt_svg_fontsize/3.0,
+                opt_svg_fontsize,
+                tip->label);
 
   *tip_index = *tip_index + 1;
 }
 
-static void plot_inner(FILE * fp_output, node_t * node, int marked)
+/* draw a fully matched clade as a single triangle occupying one row */
+static void plot_clade(svg_canvas_t * canvas,
+                       ntree_t * tree,
+                       node_t * node,
+                       long * tip_index)
+{
+  long slot = NTREE_SLOT(tree,node);
+  double maxx = canvas->clade_maxx[slot];
+  double half = opt_svg_tipspace * 0.4;
+
+  node->coord->y = *tip_index * opt_svg_tipspace + 
+                   opt_svg_margintop +
+                   legend_spacing;
+
+  svg_line(node->parent->coord->x,
+           node->coord->y,
+           node->coord->x,
+           node->coord->y,
+           stroke_width,
+           stroke_color,
+           canvas);
+
+  strbuf_printf(&canvas->out,
+                "<path d=\"M%.2f %.2fL%.2f %.2fL%.2f %.2fZ\" fill=\"%s\" "
+                "fill-opacity=\"0.3\" stroke=\"%s\" />\n",
+                node->coord->x, node->coord->y,
+                maxx, node->coord->y - half,
+                maxx, node->coord->y + half,
+                stroke_color,
+                stroke_color);
+
+  strbuf_printf(&canvas->out,
+                "<text x=\"%f\" y=\"%f\" "
+                "font-size=\"%ld\" font-family=\"Arial;\">%ld tips</text>\n",
+                maxx+5,
+                node->coord->y+opt_svg_fontsize/3.0,
+                opt_svg_fontsize,
+                canvas->clade_tips[slot]);
+
+  *tip_index = *tip_index + 1;
+}
+
+static void plot_inner(svg_canvas_t * canvas, node_t * node, int marked)
 {
   int i;
   double ymin = node->children[0]->coord->y;
@@ -230,7 +359,7 @@ static void plot_inner(FILE * fp_output, node_t * node, int marked)
            ymax,
            stroke_width,
            stroke_color,
-           fp_output);
+           canvas);
 
   /* if its an inner node draw radius */
   if (node->children_count)
@@ -238,7 +367,7 @@ static void plot_inner(FILE * fp_output, node_t * node, int marked)
                node->coord->y,
                opt_svg_noderadius,
                stroke_color,
-               fp_output);
+               canvas);
 
   /* draw horizontal line from node to its parent (if it exists)
      or to left margin otherwise */
@@ -249,7 +378,7 @@ static void plot_inner(FILE * fp_output, node_t * node, int marked)
              node->coord->y,
              stroke_width,
              color,
-             fp_output);
+             canvas);
   else
   {
     svg_line(opt_svg_marginleft,
@@ -258,7 +387,7 @@ static void plot_inner(FILE * fp_output, node_t * node, int marked)
              node->coord->y,
              stroke_width,
              color,
-             fp_output);
+             canvas);
   }
 
   if (marked)
@@ -271,32 +400,111 @@ static void plot_inner(FILE * fp_output, node_t * node, int marked)
                  node->coord->y,
                  stroke_width,
                  rootpath_color,
-                 fp_output);
+                 canvas);
   }
 
-  fprintf(fp_output, "\n");
+  if (!opt_svg_paths)
+    strbuf_append(&canvas->out, "\n", 1);
 }
 
-static void svg_ntree_plot(FILE * fp_output, node_t * node, int * tip_index, int marked)
+/* Mark the maximal subtrees that contain no marked node (i.e. clades fully
+   matched with --difftree, or off the selected root paths) and have at least
+   two tips. Returns the number of rows needed to draw the tree */
+static long svg_collapse(ntree_t * tree, svg_canvas_t * canvas)
 {
-  int i;
+  long i;
+  int j;
+  long rows = tree->leaves_count;
+  long nodes = tree->leaves_count + tree->inner_count;
+  char * clean = canvas->clean;
 
-  /* traverse in post-order */
-  if (node->children_count)
+  canvas->clade_maxx = (double *)xmalloc((size_t)nodes * sizeof(double));
+  canvas->clade_tips = (long *)xmalloc((size_t)nodes * sizeof(long));
+
+  for (i = 0; i < tree->leaves_count; ++i)
   {
-    for (i = 0; i < node->children_count; ++i)
-      svg_ntree_plot(fp_output, node->children[i], tip_index, marked);
+    clean[i] = !tree->leaves[i]->mark;
+    canvas->clade_maxx[i] = tree->leaves[i]->coord->x;
+    canvas->clade_tips[i] = 1;
   }
-  else
+
+  /* postorder: a clade is clean if its root and all children are clean */
+  for (i = 0; i < tree->inner_count; ++i)
   {
-    plot_tip(fp_output,node,tip_index,marked);
-    return;
+    node_t * node = tree->inner[i];
+    long slot = tree->leaves_count + i;
+
+    clean[slot] = !node->mark;
+    canvas->clade_maxx[slot] = node->coord->x;
+    canvas->clade_tips[slot] = 0;
+    for (j = 0; j < node->children_count; ++j)
+    {
+      long cslot = NTREE_SLOT(tree,node->children[j]);
+
+      clean[slot] &= clean[cslot];
+      canvas->clade_maxx[slot] = MAX(canvas->clade_maxx[slot],
+                                     canvas->clade_maxx[cslot]);
+      canvas->clade_tips[slot] += canvas->clade_tips[cslot];
+    }
   }
 
-  plot_inner(fp_output,node,marked);
+  /* a clean inner node whose parent is not clean is collapsed */
+  for (i = 0; i < tree->inner_count - 1; ++i)
+  {
+    node_t * node = tree->inner[i];
+    long slot = tree->leaves_count + i;
+
+    if (clean[slot] && !clean[NTREE_SLOT(tree,node->parent)])
+    {
+      canvas->collapsed[slot] = 1;
+      rows -= canvas->clade_tips[slot] - 1;
+    }
+  }
+
+  return rows;
+}
+
+/* traverse in post-order with an explicit stack, without descending into
+   collapsed clades */
+static void svg_ntree_plot(svg_canvas_t * canvas, ntree_t * tree, int marked)
+{
+  long top = 0;
+  long tip_index = 0;
+
+  canvas->stack[0] = tree->root;
+  canvas->next_child[0] = 0;
+
+  while (top >= 0)
+  {
+    node_t * node = canvas->stack[top];
+
+    if (!node->children_count)
+    {
+      plot_tip(canvas,node,&tip_index,marked);
+      --top;
+    }
+    else if (canvas->collapsed[NTREE_SLOT(tree,node)])
+    {
+      plot_clade(canvas,tree,node,&tip_index);
+      --top;
+    }
+    else if (canvas->next_child[top] < node->children_count)
+    {
+      node_t * child = node->children[canvas->next_child[top]++];
+
+      ++top;
+      canvas->stack[top] = child;
+      canvas->next_child[top] = 0;
+    }
+    else
+    {
+      plot_inner(canvas,node,marked);
+      --top;
+    }
+  }
 }
 
-static void check_branches(ntree_t * tree)
+static void check_branches(ntree_t * tree, FILE * fp_log)
 {
   int i;
   int terminal_branches = 0;
@@ -311,11 +519,11 @@ static void check_branches(ntree_t * tree)
       inner_branches++;
 
   if (terminal_branches)
-    fprintf(stderr, "WARNING: Found zero-length terminal branches. "
+    fprintf(fp_log, "WARNING: Found zero-length terminal branches. "
             "Use --reset_branches to set a value.\n");
   
   if (inner_branches)
-    fprintf(stderr, "WARNING: Found zero-length inner branches. "
+    fprintf(fp_log, "WARNING: Found zero-length inner branches. "
             "Use --reset_branches to set a value.\n");
 }
 
@@ -339,34 +547,25 @@ static void reset_branches(ntree_t * tree)
   #endif
 }
 
-static void mark_rootpath(ntree_t * tree)
-{
-  long i;
-
-  /* create hash table */
-  hashtable_t * ht = hashtable_create(tree->leaves_count);
-  for (i = 0; i < tree->leaves_count; ++i)
-  {
-    pair_t * pair = (pair_t *)xmalloc(sizeof(pair_t));
-    pair->label = tree->leaves[i]->label;
-    pair->index = i;
-
-    if (!hashtable_insert(ht,
-                          (void *)pair,
-                          hash_fnv(tree->leaves[i]->label),
-                          hashtable_paircmp))
-      fprintf(stderr,"WARNING: Duplicate taxon (%s)\n",tree->leaves[i]->label);
-  }
+/* labels and label ids of the tips given with --svg_rootpath */
+static char ** rootpath_labels;
+static long * rootpath_taxa;
+static long rootpath_count;
 
+/* the labels are interned before any tree is parsed, such that they can be
+   looked up by id while other trees are being parsed */
+static void rootpath_init(void)
+{
   char * tip_list = opt_svg_rootpath;
   char * taxon;
   size_t taxon_len;
-  int taxa_count = 0;
 
-  if (!opt_quiet)
-    fprintf(stdout, "Coloring rootpaths from the following leaf nodes...\n");
+  size_t max_count = strlen(tip_list)/2 + 1;
+
+  rootpath_labels = (char **)xmalloc(max_count * sizeof(char *));
+  rootpath_taxa = (long *)xmalloc(max_count * sizeof(long));
+  rootpath_count = 0;
 
-  /* mark selected tips */
   while (*tip_list)
   {
     taxon_len = strcspn(tip_list, ",");
@@ -374,27 +573,35 @@ static void mark_rootpath(ntree_t * tree)
       fatal("Erroneous root path format (double comma)/taxon missing");
 
     taxon = strndup(tip_list, taxon_len);
+    rootpath_labels[rootpath_count] = taxon;
+    rootpath_taxa[rootpath_count++] = label_intern(taxon);
 
-    /* find the taxon in the hash table */
-    pair_t * query = hashtable_find(ht,
-                                    taxon,
-                                    hash_fnv(taxon),
-                                    hashtable_paircmp);
-
-    if (!query)
-      fatal("Taxon %s in --svg_rootpath does not appear in the tree", taxon);
-
-    tree->leaves[query->index]->mark = 1;
-    printf("  %s\n", taxon);
-    taxa_count++;
-
-    free(taxon);
     tip_list += taxon_len;
     if (*tip_list == ',') 
       tip_list += 1;
   }
+}
 
-  hashtable_destroy(ht,free);
+static void mark_rootpath(ntree_t * tree, FILE * out)
+{
+  long i;
+
+  if (!opt_quiet)
+    fprintf(out, "Coloring rootpaths from the following leaf nodes...\n");
+
+  /* mark selected tips */
+  for (i = 0; i < rootpath_count; ++i)
+  {
+    long id = rootpath_taxa[i];
+    node_t * tip = (id < tree->taxa_count) ? tree->taxa[id] : NULL;
+
+    if (!tip)
+      fatal("Taxon %s in --svg_rootpath does not appear in the tree",
+            rootpath_labels[i]);
+
+    tip->mark = 1;
+    fprintf(out, "  %s\n", tip->label);
+  }
 
   /* mark root paths */
   node_t * node;
@@ -408,28 +615,110 @@ static void mark_rootpath(ntree_t * tree)
   }
 }
 
-void svg_plot(ntree_t * tree, FILE * fp_output, int marked)
+/* Plot tree to fp_output, writing warnings to fp_log */
+void svg_plot(ntree_t * tree, FILE * fp_output, FILE * fp_log, int marked)
 {
-    /* set zero-branches to 1 */
-    if (opt_reset_branches == 0)
-      check_branches(tree);
-    else
-      reset_branches(tree);
+  long rows = tree->leaves_count;
+  long nodes = tree->leaves_count + tree->inner_count;
+  svg_canvas_t canvas;
+
+  profile_begin(PROFILE_SVG);
+
+  /* set zero-branches to 1 */
+  if (opt_reset_branches == 0)
+    check_branches(tree, fp_log);
+  else
+  {
+    reset_branches(tree);
+    ntree_heights_invalidate(tree);
+  }
+
+  strbuf_init(&canvas.out);
+  strbuf_init(canvas.path);
+  strbuf_init(canvas.path+1);
+  canvas.stack = (node_t **)xmalloc((size_t)nodes * sizeof(node_t *));
+  canvas.next_child = (int *)xmalloc((size_t)nodes * sizeof(int));
+  canvas.collapsed = (char *)xcalloc((size_t)nodes, sizeof(char));
+  canvas.clean = (char *)xcalloc((size_t)nodes, sizeof(char));
+  canvas.clade_maxx = NULL;
+  canvas.clade_tips = NULL;
+
+  /* x coordinates are needed to collapse clades, which in turn determine
+     the number of rows in the header */
+  canvas_width = opt_svg_width - opt_svg_marginleft - opt_svg_marginright;
+  scaler_init(tree);
+  ntree_set_xcoord(tree);
+
+  if (marked && opt_svg_collapse)
+    rows = svg_collapse(tree, &canvas);
+
+  svg_ntree_init(rows, &canvas);
+  svg_ntree_plot(&canvas, tree, marked);
+
+  if (opt_svg_paths)
+    svg_paths_flush(&canvas);
+  strbuf_append(&canvas.out, "</svg>\n", 7);
+
+  fwrite(canvas.out.data, 1, canvas.out.len, fp_output);
+
+  strbuf_free(&canvas.out);
+  strbuf_free(canvas.path);
+  strbuf_free(canvas.path+1);
+  free(canvas.stack);
+  free(canvas.next_child);
+  free(canvas.collapsed);
+  free(canvas.clean);
+  free(canvas.clade_maxx);
+  free(canvas.clade_tips);
+
+  profile_end(PROFILE_SVG);
+}
+
+static void * svg_read(long * treeno, size_t * cost, void * data)
+{
+  ntree_t * tree;
+
+  if (!treeio_next((treeio_t *)data, &tree))
+    return NULL;
 
-    svg_ntree_init(tree,fp_output);
-    ntree_set_xcoord(tree->root);
+  if (!tree)
+    fatal("Cannot parse tree file");
 
-    int tip_index = 0;
-    svg_ntree_plot(fp_output, tree->root, &tip_index, marked);
-    fprintf(fp_output, "</svg>\n");
+  *treeno = treeio_treeno((treeio_t *)data);
+
+  /* the tree, the plotting buffers and the SVG document */
+  *cost = ntree_size(tree) +
+          (size_t)(tree->leaves_count + tree->inner_count) * 256;
+
+  return tree;
+}
+
+/* output streams of cmd_svg */
+#define SVG_STDOUT      0
+#define SVG_STDERR      1
+#define SVG_OUTPUT      2
+#define SVG_STREAMS     3
+
+static int svg_job(long treeno, void * item, FILE ** fp, void * data)
+{
+  ntree_t * tree = (ntree_t *)item;
+
+  if (opt_svg_rootpath)
+    mark_rootpath(tree, fp[SVG_STDOUT]);
+
+  svg_plot(tree, fp[SVG_OUTPUT], fp[SVG_STDERR], !!opt_svg_rootpath);
+
+  /* deallocate tree structure */
+  ntree_destroy(tree,NULL);
+
+  return 1;
 }
 
 void cmd_svg(void)
 {
-  long i = 0;
-  FILE * fp_input;
-  FILE * fp_output;
-  char * output_file;
+  long i;
+  treeio_t * fp_input;
+  treeout_t * outs[SVG_STREAMS];
 
   if (!opt_treefile)
     fatal("An input file must be specified");
@@ -437,54 +726,34 @@ void cmd_svg(void)
   if (opt_svg_rootpath_color)
     strcpy(rootpath_color+1,opt_svg_rootpath_color);
 
-  fp_input  = xopen(opt_treefile,"r");
+  fp_input  = treeio_open_selected(opt_treefile);
 
   /* parse tree */
   if (!opt_quiet)
     fprintf(stdout, "Parsing tree file...\n");
 
-  char * newick;
-  while ((newick = getnextline(fp_input)))
-  {
-    ++i;
-    ntree_t * tree = ntree_parse_newick(newick);
-    if (!tree)
-      fatal("Cannot parse tree file");
+  if (opt_svg_rootpath)
+    rootpath_init();
 
-    if (!opt_outfile)
-      fp_output = stdout;
-    else
-    {
-      asprintf(&output_file, "%s.%ld.svg", opt_outfile,i);
-      fp_output = xopen(output_file,"w");
-      free(output_file);
-    }
+  outs[SVG_STDOUT] = treeout_console(stdout);
+  outs[SVG_STDERR] = treeout_console(stderr);
+  outs[SVG_OUTPUT] = treeout_open("svg");
 
-    /* set zero-branches to 1 */
-    if (opt_reset_branches == 0)
-      check_branches(tree);
-    else
-      reset_branches(tree);
-
-    if (opt_svg_rootpath)
-      mark_rootpath(tree);
-      
-    svg_ntree_init(tree,fp_output);
-    ntree_set_xcoord(tree->root);
+  threads_pipeline(outs, SVG_STREAMS, svg_read, svg_job, fp_input);
 
-    int tip_index = 0;
-    svg_ntree_plot(fp_output, tree->root, &tip_index, !!opt_svg_rootpath);
-    fprintf(fp_output, "</svg>\n");
+  treeout_close(outs[SVG_OUTPUT]);
+  treeout_close(outs[SVG_STDERR]);
+  treeout_close(outs[SVG_STDOUT]);
 
-    free(newick);
+  treeio_close(fp_input);
 
-    /* deallocate tree structure */
-    ntree_destroy(tree,NULL);
-  
-    if (opt_outfile)
-      fclose(fp_output);
+  if (opt_svg_rootpath)
+  {
+    for (i = 0; i < rootpath_count; ++i)
+      free(rootpath_labels[i]);
+    free(rootpath_labels);
+    free(rootpath_taxa);
   }
-  fclose(fp_input);
 
   if (!opt_quiet)
     fprintf(stdout, "\nDone...\n");
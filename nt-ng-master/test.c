@@ -255,24 +255,23 @@ static void svg_init(ntree_t * tree, FILE * fp_output)
 void cmd_test(void)
 {
   long i = 0;
-  FILE * fp_input;
+  treeio_t * fp_input;
   FILE * fp_output;
   char * output_file;
 
   if (!opt_treefile)
     fatal("An input file must be specified");
 
-  fp_input  = xopen(opt_treefile,"r");
+  fp_input  = treeio_open_selected(opt_treefile);
 
   /* parse tree */
   if (!opt_quiet)
     fprintf(stdout, "Parsing tree file...\n");
 
-  char * newick;
-  while ((newick = getnextline(fp_input)))
+  ntree_t * tree;
+  while (treeio_next(fp_input, &tree))
   {
-    ++i;
-    ntree_t * tree = ntree_parse_newick(newick);
+    i = treeio_treeno(fp_input);
     if (!tree)
       fatal("Cannot parse tree file");
 
@@ -298,15 +297,13 @@ void cmd_test(void)
     //svg_ntree_plot(fp_output, tree->root, &tip_index);
     fprintf(fp_output, "</svg>\n");
 
-    free(newick);
-
     /* deallocate tree structure */
     ntree_destroy(tree,NULL);
   
     if (opt_outfile)
       fclose(fp_output);
   }
-  fclose(fp_input);
+  treeio_close(fp_input);
 
   if (!opt_quiet)
     fprintf(stdout, "\nDone...\n");
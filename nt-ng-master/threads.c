@@ -0,0 +1,586 @@
+/*
+    Copyright (C) 2015-2017 Tomas Flouri
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Tomas Flouri <t.flouris@ucl.ac.uk>,
+    Department of Genetics, Evolution and Environment,
+    University College London,
+    Gower Street, London WC1E 6BT, England
+*/
+
+
+#include "newick-tools.h"
+
+typedef struct worker_s
+{
+  long thread;
+  long count;
+  long * next;
+  void (*job)(long, long, void *);
+  void * data;
+} worker_t;
+
+static void * worker(void * arg)
+{
+  worker_t * w = (worker_t *)arg;
+  long index;
+
+  while ((index = __atomic_fetch_add(w->next, 1, __ATOMIC_RELAXED)) < w->count)
+    w->job(index, w->thread, w->data);
+
+  return NULL;
+}
+
+/* Calls job(index, thread, data) for every index in [0,count) using up to
+   opt_threads threads. Indices are handed out dynamically, so jobs must not
+   depend on the thread that runs them other than for selecting per-thread
+   scratch space */
+void threads_parallel_for(long count,
+                          void (*job)(long index, long thread, void * data),
+                          void * data)
+{
+  long i;
+  long next = 0;
+  long threads = MIN(opt_threads, count);
+
+  if (threads <= 1)
+  {
+    for (i = 0; i < count; ++i)
+      job(i, 0, data);
+    return;
+  }
+
+  pthread_t * tid = (pthread_t *)xmalloc((size_t)threads * sizeof(pthread_t));
+  worker_t * w = (worker_t *)xmalloc((size_t)threads * sizeof(worker_t));
+
+  for (i = 0; i < threads; ++i)
+  {
+    w[i].thread = i;
+    w[i].count = count;
+    w[i].next = &next;
+    w[i].job = job;
+    w[i].data = data;
+
+    if (pthread_create(tid+i, NULL, worker, w+i))
+      fatal("Cannot create thread");
+  }
+
+  for (i = 0; i < threads; ++i)
+    if (pthread_join(tid[i], NULL))
+      fatal("Cannot join thread");
+
+  free(w);
+  free(tid);
+}
+
+typedef struct ordered_s
+{
+  long first;
+  strbuf_t * slots;
+  void (*job)(long, long, strbuf_t *, void *);
+  void * data;
+} ordered_t;
+
+static void ordered_job(long slot, long thread, void * data)
+{
+  ordered_t * o = (ordered_t *)data;
+
+  o->slots[slot].len = 0;
+  o->job(o->first + slot, thread, o->slots + slot, o->data);
+}
+
+/* Calls job(index, thread, out, data) for every index in [0,count) in
+   parallel, where each job appends its output to the buffer out. Jobs are
+   processed in batches and their outputs written to fp in the order of their
+   indices. The number of jobs per batch is chosen such that batches hold
+   roughly at most 2^24 units, each job producing approximately units_per_job
+   units (e.g. tips) */
+void threads_write_ordered(FILE * fp,
+                           long count,
+                           long units_per_job,
+                           void (*job)(long index,
+                                       long thread,
+                                       strbuf_t * out,
+                                       void * data),
+                           void * data)
+{
+  long i;
+  ordered_t o;
+  long threads = MIN(opt_threads, count);
+  long batch = MIN(threads*16, (1l << 24) / MAX(units_per_job,1));
+
+  batch = MIN(MAX(batch, threads), count);
+
+  o.job = job;
+  o.data = data;
+  o.slots = (strbuf_t *)xmalloc((size_t)batch * sizeof(strbuf_t));
+  for (i = 0; i < batch; ++i)
+    strbuf_init(o.slots+i);
+
+  for (o.first = 0; o.first < count; o.first += batch)
+  {
+    long slot_count = MIN(batch, count - o.first);
+
+    threads_parallel_for(slot_count, ordered_job, &o);
+
+    for (i = 0; i < slot_count; ++i)
+      fwrite(o.slots[i].data, 1, o.slots[i].len, fp);
+  }
+
+  for (i = 0; i < batch; ++i)
+    strbuf_free(o.slots+i);
+  free(o.slots);
+}
+
+typedef struct deque_s
+{
+  long * items;
+  long head;
+  long tail;
+  pthread_mutex_t lock;
+} deque_t;
+
+typedef struct stealer_s
+{
+  long thread;
+  long threads;
+  deque_t * deques;
+  long * done;
+  pthread_mutex_t * progress_lock;
+  void (*job)(long, long, void *);
+  void * data;
+} stealer_t;
+
+typedef struct costidx_s
+{
+  long cost;
+  long index;
+} costidx_t;
+
+static int cb_cmp_cost(const void * a, const void * b)
+{
+  const costidx_t * x = (const costidx_t *)a;
+  const costidx_t * y = (const costidx_t *)b;
+
+  if (x->cost != y->cost)
+    return x->cost > y->cost ? -1 : 1;
+
+  return x->index < y->index ? -1 : (x->index > y->index);
+}
+
+/* take the next job from the head of the own deque, or steal one from the
+   tail of the fullest other deque. Returns -1 once all deques are empty */
+static long next_job(stealer_t * s)
+{
+  long i;
+  long index = -1;
+  deque_t * own = s->deques + s->thread;
+
+  pthread_mutex_lock(&own->lock);
+  if (own->head < own->tail)
+  {
+    index = own->items[own->head];
+    __atomic_store_n(&own->head, own->head+1, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&own->lock);
+
+  while (index < 0)
+  {
+    deque_t * victim = NULL;
+    long most = 0;
+
+    /* sizes are read without locking, only to pick a victim */
+    for (i = 1; i < s->threads; ++i)
+    {
+      deque_t * d = s->deques + (s->thread + i) % s->threads;
+      long left = __atomic_load_n(&d->tail, __ATOMIC_RELAXED) -
+                  __atomic_load_n(&d->head, __ATOMIC_RELAXED);
+      if (left > most)
+      {
+        most = left;
+        victim = d;
+      }
+    }
+
+    /* no jobs are created while running, so empty deques mean we are done */
+    if (!victim)
+      return -1;
+
+    pthread_mutex_lock(&victim->lock);
+    if (victim->head < victim->tail)
+    {
+      __atomic_store_n(&victim->tail, victim->tail-1, __ATOMIC_RELAXED);
+      index = victim->items[victim->tail];
+    }
+    pthread_mutex_unlock(&victim->lock);
+  }
+
+  return index;
+}
+
+static void * stealer(void * arg)
+{
+  stealer_t * s = (stealer_t *)arg;
+  long index;
+
+  while ((index = next_job(s)) >= 0)
+  {
+    s->job(index, s->thread, s->data);
+
+    if (s->done)
+    {
+      long done = __atomic_add_fetch(s->done, 1, __ATOMIC_RELAXED);
+
+      pthread_mutex_lock(s->progress_lock);
+      progress_update((unsigned int)done);
+      pthread_mutex_unlock(s->progress_lock);
+    }
+  }
+
+  return NULL;
+}
+
+/* Like threads_parallel_for, but for jobs of very different sizes. Job i is
+   expected to take time proportional to cost[i]. Jobs are dealt, largest
+   first, round-robin to one deque per thread. Each thread runs the jobs of
+   its own deque from the largest down and, once it is empty, steals the
+   smallest remaining job of the fullest other deque. If done is not NULL it
+   is incremented after each job and passed to progress_update */
+void threads_steal_for(long count,
+                       const long * cost,
+                       void (*job)(long index, long thread, void * data),
+                       void * data,
+                       long * done)
+{
+  long i;
+  long threads = MIN(opt_threads, count);
+  pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;
+
+  if (threads <= 1)
+  {
+    for (i = 0; i < count; ++i)
+    {
+      job(i, 0, data);
+      if (done)
+        progress_update((unsigned int)++(*done));
+    }
+    return;
+  }
+
+  costidx_t * order = (costidx_t *)xmalloc((size_t)count * sizeof(costidx_t));
+  for (i = 0; i < count; ++i)
+  {
+    order[i].cost = cost ? cost[i] : 1;
+    order[i].index = i;
+  }
+  qsort(order, (size_t)count, sizeof(costidx_t), cb_cmp_cost);
+
+  deque_t * deques = (deque_t *)xmalloc((size_t)threads * sizeof(deque_t));
+  for (i = 0; i < threads; ++i)
+  {
+    deques[i].items = (long *)xmalloc((size_t)(count / threads + 1) *
+                                      sizeof(long));
+    deques[i].head = deques[i].tail = 0;
+    pthread_mutex_init(&deques[i].lock, NULL);
+  }
+  for (i = 0; i < count; ++i)
+  {
+    deque_t * d = deques + i % threads;
+    d->items[d->tail++] = order[i].index;
+  }
+  free(order);
+
+  pthread_t * tid = (pthread_t *)xmalloc((size_t)threads * sizeof(pthread_t));
+  stealer_t * s = (stealer_t *)xmalloc((size_t)threads * sizeof(stealer_t));
+
+  for (i = 0; i < threads; ++i)
+  {
+    s[i].thread = i;
+    s[i].threads = threads;
+    s[i].deques = deques;
+    s[i].done = done;
+    s[i].progress_lock = &progress_lock;
+    s[i].job = job;
+    s[i].data = data;
+
+    if (pthread_create(tid+i, NULL, stealer, s+i))
+      fatal("Cannot create thread");
+  }
+
+  for (i = 0; i < threads; ++i)
+    if (pthread_join(tid[i], NULL))
+      fatal("Cannot join thread");
+
+  for (i = 0; i < threads; ++i)
+  {
+    pthread_mutex_destroy(&deques[i].lock);
+    free(deques[i].items);
+  }
+  free(deques);
+  free(s);
+  free(tid);
+}
+
+typedef struct pipeslot_s
+{
+  void * item;
+  long treeno;
+  size_t cost;
+  int done;
+  int processed;              /* returned by the job */
+  FILE ** fp;
+  char ** buf;
+  size_t * len;
+} pipeslot_t;
+
+typedef struct pipeline_s
+{
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  pipeslot_t * slots;
+  long slot_count;
+  long read;                  /* items handed to the pipeline */
+  long taken;                 /* items taken by workers */
+  long written;               /* items whose outputs were written */
+  int eof;
+  size_t inflight;            /* cost of items read but not yet written */
+  size_t budget;
+  treeout_t ** outs;
+  long streams;
+  long * share;               /* stream k is written to buffer share[k] */
+  int (*job)(long, void *, FILE **, void *);
+  void * data;
+} pipeline_t;
+
+static void * pipeline_worker(void * arg)
+{
+  pipeline_t * p = (pipeline_t *)arg;
+  long k;
+
+  pthread_mutex_lock(&p->lock);
+  while (1)
+  {
+    while (p->taken == p->read && !p->eof)
+      pthread_cond_wait(&p->changed, &p->lock);
+
+    if (p->taken == p->read)
+      break;
+
+    long index = p->taken++;
+    pipeslot_t * s = p->slots + index % p->slot_count;
+    pthread_mutex_unlock(&p->lock);
+
+    for (k = 0; k < p->streams; ++k)
+    {
+      if (p->share[k] != k)
+        s->fp[k] = s->fp[p->share[k]];
+      else if (!(s->fp[k] = open_memstream(s->buf+k, s->len+k)))
+        fatal("Cannot allocate output buffer");
+    }
+
+    s->processed = p->job(s->treeno, s->item, s->fp, p->data);
+
+    size_t bytes = 0;
+    for (k = 0; k < p->streams; ++k)
+      if (p->share[k] == k)
+      {
+        fclose(s->fp[k]);
+        bytes += s->len[k];
+      }
+
+    pthread_mutex_lock(&p->lock);
+    s->done = 1;
+    s->cost += bytes;
+    p->inflight += bytes;
+    pthread_cond_broadcast(&p->changed);
+  }
+  pthread_mutex_unlock(&p->lock);
+
+  return NULL;
+}
+
+static void * pipeline_writer(void * arg)
+{
+  pipeline_t * p = (pipeline_t *)arg;
+  long k;
+
+  pthread_mutex_lock(&p->lock);
+  while (1)
+  {
+    pipeslot_t * s = p->slots + p->written % p->slot_count;
+
+    while (p->written < p->read ? !s->done : !p->eof)
+      pthread_cond_wait(&p->changed, &p->lock);
+
+    if (p->written == p->read)
+      break;
+
+    pthread_mutex_unlock(&p->lock);
+
+    for (k = 0; k < p->streams; ++k)
+      if (p->share[k] == k)
+      {
+        treeout_write(p->outs[k],
+                      s->treeno,
+                      s->buf[k],
+                      s->len[k],
+                      s->processed);
+        free(s->buf[k]);
+      }
+
+    pthread_mutex_lock(&p->lock);
+    s->done = 0;
+    p->inflight -= s->cost;
+    p->written++;
+    pthread_cond_broadcast(&p->changed);
+  }
+  pthread_mutex_unlock(&p->lock);
+
+  return NULL;
+}
+
+/* Streams trees through read, job and the output streams outs[0..streams).
+   read(treeno, cost, data) returns the next item, or NULL at the end, and
+   sets treeno to its tree number and cost to an estimate of the bytes needed
+   to process it. job(treeno, item, fp, data) processes and frees the item,
+   writing the output of stream k to fp[k], which ends up in outs[k] as the
+   output of tree treeno. It returns 0 if it skipped the tree, in which case
+   no empty per-tree files are created for it.
+
+   With one thread the three run in turn, writing directly to the outputs.
+   Otherwise the calling thread reads, opt_threads workers run the jobs into
+   memory buffers, and a writer thread writes the buffers in the order of the
+   items. Items wait in a fixed ring of slots, and reading blocks while the
+   ring is full or while the items in the ring, together with the outputs of
+   those already processed, would exceed --max_memory. A single item is
+   always admitted. read and job run concurrently and must not share state */
+void threads_pipeline(treeout_t ** outs,
+                      long streams,
+                      void * (*read)(long * treeno,
+                                     size_t * cost,
+                                     void * data),
+                      int (*job)(long treeno,
+                                 void * item,
+                                 FILE ** fp,
+                                 void * data),
+                      void * data)
+{
+  long i,k;
+  long treeno;
+  void * item;
+  size_t cost;
+  pipeline_t p;
+
+  if (opt_threads <= 1)
+  {
+    FILE ** fp = (FILE **)xmalloc((size_t)streams * sizeof(FILE *));
+
+    while ((item = read(&treeno, &cost, data)))
+    {
+      for (k = 0; k < streams; ++k)
+        fp[k] = treeout_begin(outs[k], treeno);
+
+      int processed = job(treeno, item, fp, data);
+
+      for (k = 0; k < streams; ++k)
+        treeout_end(outs[k], treeno, processed);
+    }
+
+    free(fp);
+    return;
+  }
+
+  pthread_mutex_init(&p.lock, NULL);
+  pthread_cond_init(&p.changed, NULL);
+  p.slot_count = 2*opt_threads;
+  p.read = p.taken = p.written = 0;
+  p.eof = 0;
+  p.inflight = 0;
+  p.budget = (size_t)opt_max_memory << 20;
+  p.outs = outs;
+  p.streams = streams;
+  p.job = job;
+  p.data = data;
+
+  /* console streams going to the same place share one buffer, such that the
+     order of their lines within an item is kept */
+  p.share = (long *)xmalloc((size_t)streams * sizeof(long));
+  for (k = 0; k < streams; ++k)
+  {
+    p.share[k] = k;
+    for (i = 0; i < k; ++i)
+      if (outs[i]->console && outs[k]->console && outs[i]->fp == outs[k]->fp)
+      {
+        p.share[k] = i;
+        break;
+      }
+  }
+
+  p.slots = (pipeslot_t *)xcalloc((size_t)p.slot_count, sizeof(pipeslot_t));
+  for (i = 0; i < p.slot_count; ++i)
+  {
+    p.slots[i].fp = (FILE **)xmalloc((size_t)streams * sizeof(FILE *));
+    p.slots[i].buf = (char **)xmalloc((size_t)streams * sizeof(char *));
+    p.slots[i].len = (size_t *)xmalloc((size_t)streams * sizeof(size_t));
+  }
+
+  pthread_t * tid = (pthread_t *)xmalloc((size_t)(opt_threads+1) *
+                                         sizeof(pthread_t));
+
+  for (i = 0; i < opt_threads; ++i)
+    if (pthread_create(tid+i, NULL, pipeline_worker, &p))
+      fatal("Cannot create thread");
+  if (pthread_create(tid+opt_threads, NULL, pipeline_writer, &p))
+    fatal("Cannot create thread");
+
+  while ((item = read(&treeno, &cost, data)))
+  {
+    pthread_mutex_lock(&p.lock);
+    while (p.read - p.written == p.slot_count ||
+           (p.read > p.written && p.inflight + cost > p.budget))
+      pthread_cond_wait(&p.changed, &p.lock);
+
+    pipeslot_t * s = p.slots + p.read % p.slot_count;
+    s->item = item;
+    s->treeno = treeno;
+    s->cost = cost;
+    s->done = 0;
+    p.inflight += cost;
+    p.read++;
+    pthread_cond_broadcast(&p.changed);
+    pthread_mutex_unlock(&p.lock);
+  }
+
+  pthread_mutex_lock(&p.lock);
+  p.eof = 1;
+  pthread_cond_broadcast(&p.changed);
+  pthread_mutex_unlock(&p.lock);
+
+  for (i = 0; i <= opt_threads; ++i)
+    if (pthread_join(tid[i], NULL))
+      fatal("Cannot join thread");
+
+  for (i = 0; i < p.slot_count; ++i)
+  {
+    free(p.slots[i].fp);
+    free(p.slots[i].buf);
+    free(p.slots[i].len);
+  }
+  free(p.slots);
+  free(p.share);
+  free(tid);
+  pthread_cond_destroy(&p.changed);
+  pthread_mutex_destroy(&p.lock);
+}
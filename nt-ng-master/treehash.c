@@ -22,29 +22,327 @@
 
 #include "newick-tools.h"
 
-hashtable_t * create_hashtable(ntree_t * tree)
+int duplicate_tiplabels(ntree_t * tree)
 {
   long i;
 
-  /* using a hash table check whether there are duplicate nodes */
-  hashtable_t * ht = hashtable_create(tree->leaves_count);
+  /* the id-indexed tip map keeps only the first tip of each label */
   for (i = 0; i < tree->leaves_count; ++i)
   {
-    if (!hashtable_insert(ht,
-                          (void *)(tree->leaves[i]->label),
-                          hash_fnv(tree->leaves[i]->label),
-                          hashtable_strcmp))
+    node_t * tip = tree->leaves[i];
+
+    if (tip->taxon >= 0 && tree->taxa[tip->taxon] != tip)
+      fprintf(stderr, "WARNING: Duplicate taxon (%s)\n", tip->label);
+  }
+
+  return 0;
+}
+
+/* 64-bit finalizer of splitmix64, used to spread the bits of combined
+   subtree hashes */
+static unsigned long hash_mix(unsigned long x)
+{
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9UL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebUL;
+  x ^= x >> 31;
+
+  return x;
+}
+
+static int cb_cmp_hash(const void * a, const void * b)
+{
+  unsigned long x = *(unsigned long *)a;
+  unsigned long y = *(unsigned long *)b;
+
+  if (x > y) return 1;
+  if (x < y) return -1;
+
+  return 0;
+}
+
+/* combines the hashes of the subtrees hanging from a node in an order
+   independent way. Unary nodes are transparent, i.e. they get the hash of
+   their only subtree */
+static unsigned long hash_combine(unsigned long * hashes, long count)
+{
+  long i,j;
+  unsigned long h;
+
+  if (count == 1)
+    return hashes[0];
+
+  /* sort child hashes; insertion sort for the (typical) small degrees */
+  if (count > 8)
+    qsort(hashes, (size_t)count, sizeof(unsigned long), cb_cmp_hash);
+  else
+  {
+    for (i = 1; i < count; ++i)
     {
-      fprintf(stderr, "WARNING: Duplicate taxon (%s)\n", tree->leaves[i]->label);
+      unsigned long x = hashes[i];
+      for (j = i; j > 0 && hashes[j-1] > x; --j)
+        hashes[j] = hashes[j-1];
+      hashes[j] = x;
     }
   }
-  return ht;
+
+  h = 0x9e3779b97f4a7c15UL ^ (unsigned long)count;
+  for (i = 0; i < count; ++i)
+    h = hash_mix(h ^ hashes[i]);
+
+  return h;
 }
 
-int duplicate_tiplabels(ntree_t * tree)
+static unsigned long hash_tip(node_t * node)
 {
-  hashtable_t * ht = create_hashtable(tree);
+  return hash_mix(hash_fnv(node->label ? node->label : ""));
+}
 
-  hashtable_destroy(ht,NULL);
-  return 0;
+/* Computes a hash of the tree topology that is invariant to the order of
+   children at each node and ignores branch lengths and inner node labels.
+   Hashes of the subtrees are computed in one postorder pass over
+   tree->inner. If unrooted is set, the tree is hashed as if it was rooted on
+   the branch leading to the tip with the lexicographically smallest label,
+   such that different placements of the root yield the same hash */
+unsigned long ntree_hash_topology(ntree_t * tree, int unrooted)
+{
+  long i,j,k;
+  long maxdegree = 1;
+  unsigned long h;
+
+  if (!tree->inner_count)
+    return hash_tip(tree->root);
+
+  for (i = 0; i < tree->inner_count; ++i)
+    if (tree->inner[i]->children_count > maxdegree)
+      maxdegree = tree->inner[i]->children_count;
+
+  unsigned long * tiphash = (unsigned long *)xmalloc((size_t)
+                                                     (tree->leaves_count) *
+                                                     sizeof(unsigned long));
+  unsigned long * innerhash = (unsigned long *)xmalloc((size_t)
+                                                       (tree->inner_count) *
+                                                       sizeof(unsigned long));
+  unsigned long * buffer = (unsigned long *)xmalloc((size_t)(maxdegree+1) *
+                                                    sizeof(unsigned long));
+
+  for (i = 0; i < tree->leaves_count; ++i)
+    tiphash[tree->leaves[i]->index] = hash_tip(tree->leaves[i]);
+
+  /* inner nodes are stored in postorder */
+  for (i = 0; i < tree->inner_count; ++i)
+  {
+    node_t * node = tree->inner[i];
+
+    for (j = 0; j < node->children_count; ++j)
+    {
+      node_t * child = node->children[j];
+      buffer[j] = child->children_count ?
+                    innerhash[child->index] : tiphash[child->index];
+    }
+    innerhash[node->index] = hash_combine(buffer, node->children_count);
+  }
+
+  h = innerhash[tree->root->index];
+
+  if (unrooted)
+  {
+    /* find anchor tip */
+    node_t * anchor = tree->leaves[0];
+    for (i = 1; i < tree->leaves_count; ++i)
+      if (strcmp(tree->leaves[i]->label, anchor->label) < 0)
+        anchor = tree->leaves[i];
+
+    /* mark the path from the anchor to the root */
+    node_t ** path = (node_t **)xmalloc((size_t)(tree->inner_count+1) *
+                                        sizeof(node_t *));
+    long path_len = 0;
+    node_t * node;
+    for (node = anchor; node; node = node->parent)
+      path[path_len++] = node;
+
+    /* descend from the root towards the anchor and re-orient the hashes of
+       the nodes on the path such that they point away from the anchor */
+    long have_up = 0;
+    unsigned long up = 0;
+    for (i = path_len-1; i > 0; --i)
+    {
+      node = path[i];
+      node_t * pathchild = path[i-1];
+
+      k = 0;
+      for (j = 0; j < node->children_count; ++j)
+      {
+        node_t * child = node->children[j];
+        if (child == pathchild) continue;
+
+        buffer[k++] = child->children_count ?
+                        innerhash[child->index] : tiphash[child->index];
+      }
+      if (have_up)
+        buffer[k++] = up;
+
+      if (k)
+      {
+        up = hash_combine(buffer, k);
+        have_up = 1;
+      }
+    }
+
+    buffer[0] = tiphash[anchor->index];
+    k = 1;
+    if (have_up)
+      buffer[k++] = up;
+    h = hash_combine(buffer,k);
+
+    free(path);
+  }
+
+  free(buffer);
+  free(innerhash);
+  free(tiphash);
+
+  return h;
+}
+
+static int cb_cmp_canonical(const void * a, const void * b)
+{
+  return strcmp(*(char **)a, *(char **)b);
+}
+
+/* joins the canonical forms of the subtrees hanging from a node, sorted
+   lexicographically. As in hash_combine, unary nodes are transparent */
+static char * canonical_combine(char ** parts, long count)
+{
+  long i;
+  size_t len = (size_t)count + 1;
+
+  if (count == 1)
+    return xstrdup(parts[0]);
+
+  qsort(parts, (size_t)count, sizeof(char *), cb_cmp_canonical);
+
+  for (i = 0; i < count; ++i)
+    len += strlen(parts[i]);
+
+  char * s = (char *)xmalloc(len+1);
+  char * p = s;
+
+  *p++ = '(';
+  for (i = 0; i < count; ++i)
+  {
+    size_t n = strlen(parts[i]);
+    if (i)
+      *p++ = ',';
+    memcpy(p, parts[i], n);
+    p += n;
+  }
+  *p++ = ')';
+  *p = 0;
+
+  return s;
+}
+
+/* Returns a newick-like string of the tree topology (tip labels only) with
+   the subtrees at each node in lexicographic order. Two trees have the same
+   string exactly when ntree_hash_topology considers them the same topology,
+   so the string can be used to confirm a hash match */
+char * ntree_canonical_topology(ntree_t * tree, int unrooted)
+{
+  long i,j,k;
+  long maxdegree = 1;
+  char * s;
+
+  if (!tree->inner_count)
+    return xstrdup(tree->root->label ? tree->root->label : "");
+
+  for (i = 0; i < tree->inner_count; ++i)
+    if (tree->inner[i]->children_count > maxdegree)
+      maxdegree = tree->inner[i]->children_count;
+
+  char ** tipform = (char **)xmalloc((size_t)(tree->leaves_count) *
+                                     sizeof(char *));
+  char ** innerform = (char **)xmalloc((size_t)(tree->inner_count) *
+                                       sizeof(char *));
+  char ** buffer = (char **)xmalloc((size_t)(maxdegree+1) * sizeof(char *));
+
+  for (i = 0; i < tree->leaves_count; ++i)
+    tipform[tree->leaves[i]->index] = tree->leaves[i]->label ?
+                                        tree->leaves[i]->label : "";
+
+  /* inner nodes are stored in postorder */
+  for (i = 0; i < tree->inner_count; ++i)
+  {
+    node_t * node = tree->inner[i];
+
+    for (j = 0; j < node->children_count; ++j)
+    {
+      node_t * child = node->children[j];
+      buffer[j] = child->children_count ?
+                    innerform[child->index] : tipform[child->index];
+    }
+    innerform[node->index] = canonical_combine(buffer, node->children_count);
+  }
+
+  if (!unrooted)
+    s = xstrdup(innerform[tree->root->index]);
+  else
+  {
+    /* same anchor and re-orientation as in ntree_hash_topology */
+    node_t * anchor = tree->leaves[0];
+    for (i = 1; i < tree->leaves_count; ++i)
+      if (strcmp(tree->leaves[i]->label, anchor->label) < 0)
+        anchor = tree->leaves[i];
+
+    node_t ** path = (node_t **)xmalloc((size_t)(tree->inner_count+1) *
+                                        sizeof(node_t *));
+    long path_len = 0;
+    node_t * node;
+    for (node = anchor; node; node = node->parent)
+      path[path_len++] = node;
+
+    char * up = NULL;
+    for (i = path_len-1; i > 0; --i)
+    {
+      node = path[i];
+      node_t * pathchild = path[i-1];
+
+      k = 0;
+      for (j = 0; j < node->children_count; ++j)
+      {
+        node_t * child = node->children[j];
+        if (child == pathchild) continue;
+
+        buffer[k++] = child->children_count ?
+                        innerform[child->index] : tipform[child->index];
+      }
+      if (up)
+        buffer[k++] = up;
+
+      if (k)
+      {
+        char * temp = canonical_combine(buffer, k);
+        free(up);
+        up = temp;
+      }
+    }
+
+    buffer[0] = tipform[anchor->index];
+    k = 1;
+    if (up)
+      buffer[k++] = up;
+    s = canonical_combine(buffer,k);
+
+    free(up);
+    free(path);
+  }
+
+  for (i = 0; i < tree->inner_count; ++i)
+    free(innerform[i]);
+  free(buffer);
+  free(innerform);
+  free(tipform);
+
+  return s;
 }
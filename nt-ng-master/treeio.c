@@ -0,0 +1,805 @@
+/*
+    Copyright (C) 2015-2017 Tomas Flouri
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Tomas Flouri <t.flouris@ucl.ac.uk>,
+    Department of Genetics, Evolution and Environment,
+    University College London,
+    Gower Street, London WC1E 6BT, England
+*/
+
+
+#include "newick-tools.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Reading tree collections in newick or in the binary format written by
+   --convert binary, and writing the binary format.
+
+   A binary tree file consists of
+
+     header   "NTRB", format version, flags (BTREE_FLOAT32)    16 bytes
+     trees    one record per tree, 8-byte aligned
+     labels   label_count+1 offsets (uint64) into the strings that follow,
+              each string NUL-terminated
+     index    tree_count offsets (uint64) of the tree records
+     trailer  tree_count, label_count, labels offset, index offset
+              (uint64), "NTRB", 4 reserved bytes                 40 bytes
+
+   A tree record holds the number of nodes and of tips (uint32, followed by
+   two reserved uint32) and three arrays over its nodes in postorder, the
+   root being last: the parent (int32, -1 for the root), the label as an
+   index into the label dictionary shared by all trees of the file (int32,
+   -1 if none), and the branch length (double, or float with
+   BTREE_FLOAT32). The children of a node are the nodes having it as parent,
+   in increasing order. All values are in native (little-endian) byte
+   order, and the trailer is at the end, such that files can be written in
+   one pass (also compressed) and read directly from a memory mapping.
+
+   Loading a tree needs no parsing, and each dictionary label is interned
+   once per file instead of once per tip. Nodes are still allocated one by
+   one, since ntree_t owns its nodes individually (e.g. pruning frees
+   them)
+
+   Trees can be selected by number with --tree_range or --tree_ids. Binary
+   files are read at the selected trees directly. Newick files are read
+   line by line up to the selected trees, unless they have a sidecar index
+   FILE.index written by --index, in which case the input is positioned at
+   the offset of a selected tree whenever trees are to be skipped. The index
+   is ignored if the file size has changed since it was written, and each
+   tree reached through the index is checked against its length and hash */
+
+#define BTREE_MAGIC "NTRB"
+#define BTREE_VERSION 1
+#define BTREE_FLOAT32 1
+
+typedef struct btree_header_s
+{
+  char magic[4];
+  unsigned int version;
+  unsigned int flags;
+  unsigned int reserved;
+} btree_header_t;
+
+typedef struct btree_record_s
+{
+  unsigned int nodes;
+  unsigned int tips;
+  unsigned int reserved[2];
+} btree_record_t;
+
+typedef struct btree_trailer_s
+{
+  unsigned long tree_count;
+  unsigned long label_count;
+  unsigned long labels_offset;
+  unsigned long index_offset;
+  char magic[4];
+  unsigned int reserved;
+} btree_trailer_t;
+
+struct treeio_s
+{
+  char * filename;
+  long treeno;                /* number of the last tree read, from 1 */
+
+  /* selected trees, numbered from 0 */
+  long * select;              /* ascending tree numbers, or NULL for a range */
+  long select_count;
+  long select_pos;
+  long range_next;
+  long range_last;
+
+  /* newick input */
+  FILE * fp;
+  long line;                  /* trees read or skipped so far */
+  FILE * index;               /* sidecar index, or NULL */
+  char * index_name;
+  long index_tree;            /* last index entry read */
+  long index_offset;
+  long index_length;
+  unsigned long index_hash;
+
+  /* binary input, either mapped or read into memory */
+  char * data;
+  size_t size;
+  int mapped;
+  unsigned int flags;
+  long tree_count;
+  long label_count;
+  const unsigned long * record_index;
+  const unsigned long * label_offsets;
+  const char * label_strings;
+  long * label_ids;           /* dictionary index to label id, or -1 */
+};
+
+struct btree_writer_s
+{
+  FILE * fp;
+  unsigned int flags;
+  unsigned long offset;       /* bytes written so far */
+  unsigned long * index;
+  long tree_count;
+  long index_alloc;
+  hashtable_t * labels;
+  char ** label_list;
+  long label_count;
+  long label_alloc;
+};
+
+static size_t record_size(unsigned int nodes, unsigned int flags)
+{
+  size_t length_size = (flags & BTREE_FLOAT32) ? sizeof(float) : sizeof(double);
+  size_t size = sizeof(btree_record_t) + 2 * (size_t)nodes * sizeof(int) +
+                (size_t)nodes * length_size;
+
+  return (size + 7) & ~(size_t)7;
+}
+
+/* check the trailer and set the dictionary and index of a binary file */
+static void binary_init(treeio_t * in)
+{
+  btree_trailer_t trailer;
+  long i;
+
+  if (in->size < sizeof(btree_header_t) + sizeof(btree_trailer_t))
+    fatal("Binary tree file %s is truncated", in->filename);
+
+  const btree_header_t * header = (const btree_header_t *)in->data;
+  if (header->version != BTREE_VERSION)
+    fatal("Binary tree file %s has unsupported version %u",
+          in->filename, header->version);
+  in->flags = header->flags;
+
+  memcpy(&trailer, in->data + in->size - sizeof(trailer), sizeof(trailer));
+  if (memcmp(trailer.magic, BTREE_MAGIC, 4) ||
+      trailer.labels_offset > trailer.index_offset ||
+      trailer.index_offset + trailer.tree_count * sizeof(unsigned long) >
+        in->size - sizeof(trailer) ||
+      trailer.labels_offset + (trailer.label_count+1) * sizeof(unsigned long) >
+        trailer.index_offset)
+    fatal("Binary tree file %s is truncated or malformed", in->filename);
+
+  in->tree_count = (long)trailer.tree_count;
+  in->label_count = (long)trailer.label_count;
+  in->record_index = (const unsigned long *)(in->data + trailer.index_offset);
+  in->label_offsets = (const unsigned long *)(in->data + trailer.labels_offset);
+  in->label_strings = (const char *)(in->label_offsets + in->label_count + 1);
+
+  if ((size_t)(in->label_strings - in->data) + in->label_offsets[in->label_count] >
+      trailer.index_offset)
+    fatal("Binary tree file %s is malformed", in->filename);
+
+  in->label_ids = (long *)xmalloc((size_t)(in->label_count+1) * sizeof(long));
+  for (i = 0; i < in->label_count; ++i)
+    in->label_ids[i] = -1;
+}
+
+treeio_t * treeio_open(const char * filename)
+{
+  char magic[4];
+  treeio_t * in = (treeio_t *)xcalloc(1, sizeof(treeio_t));
+
+  in->filename = xstrdup(filename);
+  in->range_last = LONG_MAX;
+
+  /* uncompressed binary files are mapped */
+  int fd = open(filename, O_RDONLY);
+  if (fd >= 0)
+  {
+    struct stat st;
+    if (read(fd, magic, 4) == 4 && !memcmp(magic, BTREE_MAGIC, 4) &&
+        !fstat(fd, &st))
+    {
+      in->size = (size_t)st.st_size;
+      in->data = (char *)mmap(NULL, in->size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (in->data == MAP_FAILED)
+        fatal("Cannot map file %s", filename);
+      in->mapped = 1;
+      close(fd);
+      binary_init(in);
+      return in;
+    }
+    close(fd);
+  }
+
+  in->fp = xopen(filename, "r");
+
+  /* newick starts with '(' or a tip label, hence peeking one character
+     decides whether a compressed stream or tar member is a binary file */
+  int c = getc(in->fp);
+  if (c != 'N')
+  {
+    if (c != EOF)
+      ungetc(c, in->fp);
+    return in;
+  }
+
+  magic[0] = (char)c;
+  if (fread(magic+1, 1, 3, in->fp) != 3 || memcmp(magic, BTREE_MAGIC, 4))
+    fatal("File %s is neither a newick nor a binary tree file", filename);
+
+  /* read the rest of the stream into memory */
+  profile_begin(PROFILE_READ);
+  size_t alloc = 1 << 20;
+  in->data = (char *)xmalloc(alloc);
+  memcpy(in->data, magic, 4);
+  in->size = 4;
+  size_t n;
+  while ((n = fread(in->data + in->size, 1, alloc - in->size, in->fp)) > 0)
+  {
+    in->size += n;
+    if (in->size == alloc)
+    {
+      alloc *= 2;
+      in->data = (char *)xrealloc(in->data, alloc);
+    }
+  }
+  fclose(in->fp);
+  in->fp = NULL;
+  profile_end(PROFILE_READ);
+
+  binary_init(in);
+  return in;
+}
+
+/* label id of dictionary entry index, interning it on first use */
+static long binary_label_id(treeio_t * in, long index)
+{
+  if (in->label_ids[index] < 0)
+    in->label_ids[index] = label_intern((char *)in->label_strings +
+                                        in->label_offsets[index]);
+
+  return in->label_ids[index];
+}
+
+static ntree_t * binary_load(treeio_t * in, long treeno)
+{
+  long i;
+  unsigned long offset = in->record_index[treeno];
+
+  if (offset + sizeof(btree_record_t) > in->size)
+    return NULL;
+
+  const btree_record_t * record = (const btree_record_t *)(in->data + offset);
+  long nodes = record->nodes;
+
+  if (!nodes || offset + record_size(record->nodes, in->flags) > in->size)
+    return NULL;
+
+  const int * parent = (const int *)(record + 1);
+  const int * label = parent + nodes;
+  const double * length64 = (const double *)(label + nodes);
+  const float * length32 = (const float *)(label + nodes);
+
+  /* nodes in postorder */
+  node_t ** list = (node_t **)xmalloc((size_t)nodes * sizeof(node_t *));
+
+  for (i = 0; i < nodes; ++i)
+  {
+    node_t * node = (node_t *)xcalloc(1, sizeof(node_t));
+
+    if (label[i] < -1 || label[i] >= in->label_count ||
+        (i < nodes-1 && (parent[i] <= i || parent[i] >= nodes)) ||
+        (i == nodes-1 && parent[i] != -1))
+    {
+      free(node);
+      while (i--)
+      {
+        free(list[i]->label);
+        free(list[i]->children);
+        free(list[i]);
+      }
+      free(list);
+      return NULL;
+    }
+
+    node->label = label[i] >= 0 ?
+                    xstrdup(in->label_strings + in->label_offsets[label[i]]) :
+                    NULL;
+    node->length = (in->flags & BTREE_FLOAT32) ? length32[i] : length64[i];
+    node->taxon = -1;
+    list[i] = node;
+  }
+
+  /* count children, then link them in order */
+  for (i = 0; i < nodes-1; ++i)
+    list[parent[i]]->children_count++;
+
+  for (i = 0; i < nodes; ++i)
+    if (list[i]->children_count)
+    {
+      list[i]->children = (node_t **)xmalloc((size_t)list[i]->children_count *
+                                             sizeof(node_t *));
+      list[i]->children_count = 0;
+    }
+
+  ntree_t * tree = (ntree_t *)xcalloc(1, sizeof(ntree_t));
+
+  for (i = 0; i < nodes; ++i)
+  {
+    node_t * node = list[i];
+
+    if (!node->children_count)
+    {
+      node->leaves = 1;
+      if (label[i] >= 0)
+        node->taxon = binary_label_id(in, label[i]);
+      tree->leaves_count++;
+    }
+    else
+      tree->inner_count++;
+
+    if (i < nodes-1)
+    {
+      node_t * p = list[parent[i]];
+      node->parent = p;
+      p->children[p->children_count++] = node;
+      p->leaves += node->leaves;
+    }
+  }
+
+  tree->root = list[nodes-1];
+  free(list);
+
+  wraptree(tree);
+  if (duplicate_tiplabels(tree))
+    fprintf(stderr, "WARNING: Duplicate tip labels\n");
+
+  return tree;
+}
+
+/* number of the next selected tree, or -1 after the last one */
+static long select_next(treeio_t * in)
+{
+  if (in->select)
+    return (in->select_pos < in->select_count) ?
+             in->select[in->select_pos++] : -1;
+
+  return (in->range_next <= in->range_last) ? in->range_next++ : -1;
+}
+
+/* selected tree treeno is past the end of the input */
+static int select_end(treeio_t * in, long treeno)
+{
+  if (in->select)
+    fatal("Tree %ld given with --tree_ids is not in %s",
+          treeno+1, in->filename);
+
+  return 0;
+}
+
+static int cb_cmp_long(const void * a, const void * b)
+{
+  long x = *(const long *)a;
+  long y = *(const long *)b;
+
+  return (x > y) - (x < y);
+}
+
+/* read the tree numbers of --tree_ids, sorted and without duplicates */
+static void select_ids(treeio_t * in)
+{
+  long i,j;
+  long id;
+  long alloc = 1024;
+  FILE * fp = xopen(opt_tree_ids, "r");
+
+  in->select = (long *)xmalloc((size_t)alloc * sizeof(long));
+
+  while (fscanf(fp, "%ld", &id) == 1)
+  {
+    if (id < 1)
+      fatal("Tree numbers in %s must be positive", opt_tree_ids);
+
+    if (in->select_count == alloc)
+    {
+      alloc *= 2;
+      in->select = (long *)xrealloc(in->select, (size_t)alloc * sizeof(long));
+    }
+    in->select[in->select_count++] = id-1;
+  }
+
+  if (!feof(fp))
+    fatal("File %s must list tree numbers", opt_tree_ids);
+  fclose(fp);
+
+  qsort(in->select, (size_t)(in->select_count), sizeof(long), cb_cmp_long);
+  for (i = 0, j = 0; i < in->select_count; ++i)
+    if (!j || in->select[i] != in->select[j-1])
+      in->select[j++] = in->select[i];
+  in->select_count = j;
+}
+
+/* open the sidecar index of a newick file, if the file can be positioned
+   and has not changed since it was indexed */
+static void index_open(treeio_t * in)
+{
+  struct stat st;
+  char buf[256];
+  long size;
+
+  if (ftello(in->fp) < 0 || stat(in->filename, &st))
+    return;
+
+  asprintf(&in->index_name, "%s%s", in->filename, INDEX_SUFFIX);
+  FILE * fp = fopen(in->index_name, "r");
+  if (!fp)
+    return;
+
+  if (!fgets(buf, sizeof(buf), fp) ||
+      sscanf(buf, INDEX_HEADER, &size) != 1)
+    fatal("File %s is not a tree index", in->index_name);
+
+  if (size != (long)st.st_size)
+  {
+    fprintf(stderr,
+            "WARNING: Ignoring %s, as %s changed after it was indexed\n",
+            in->index_name, in->filename);
+    fclose(fp);
+    return;
+  }
+
+  in->index = fp;
+}
+
+/* position the input at tree treeno. Returns 0 if it is not in the index */
+static int index_seek(treeio_t * in, long treeno)
+{
+  char buf[256];
+  long tips;
+
+  while (in->index_tree < treeno+1 && fgets(buf, sizeof(buf), in->index))
+  {
+    if (buf[0] == '#') continue;
+
+    if (sscanf(buf, "%ld %ld %ld %ld %lx",
+               &in->index_tree,
+               &in->index_offset,
+               &in->index_length,
+               &tips,
+               &in->index_hash) != 5)
+      fatal("Index %s is malformed", in->index_name);
+  }
+
+  if (in->index_tree != treeno+1)
+    return 0;
+
+  if (fseeko(in->fp, (off_t)in->index_offset, SEEK_SET))
+    fatal("Cannot position file %s", in->filename);
+
+  in->line = treeno;
+  return 1;
+}
+
+/* Open a tree file restricted to the trees given with --tree_range or
+   --tree_ids, if any */
+treeio_t * treeio_open_selected(const char * filename)
+{
+  long first;
+  treeio_t * in = treeio_open(filename);
+
+  if (opt_tree_range)
+  {
+    if (!args_getrange(opt_tree_range, &first, &in->range_last))
+      fatal("Argument --tree_range must be of the form INT-INT, INT- or INT");
+    in->range_next = first-1;
+    in->range_last = in->range_last == LONG_MAX ? LONG_MAX : in->range_last-1;
+  }
+  else if (opt_tree_ids)
+    select_ids(in);
+  else
+    return in;
+
+  if (in->fp)
+    index_open(in);
+
+  return in;
+}
+
+/* Read the next tree. Returns 0 at the end of the input; otherwise sets
+   tree to the next tree, or to NULL if it cannot be parsed */
+int treeio_next(treeio_t * in, ntree_t ** tree)
+{
+  long treeno = select_next(in);
+
+  if (treeno < 0)
+    return 0;
+
+  if (in->fp)
+  {
+    int indexed = 0;
+
+    if (treeno > in->line && in->index)
+    {
+      if (!index_seek(in, treeno))
+        return select_end(in, treeno);
+      indexed = 1;
+    }
+
+    /* without an index, skip to the selected tree */
+    while (in->line < treeno)
+    {
+      char * skipped = getnextline(in->fp);
+
+      if (!skipped)
+        return select_end(in, treeno);
+
+      free(skipped);
+      in->line++;
+    }
+
+    char * newick = getnextline(in->fp);
+
+    if (!newick)
+      return select_end(in, treeno);
+    in->line++;
+
+    if (indexed && ((long)strlen(newick) != in->index_length ||
+                    hash_fnv(newick) != in->index_hash))
+      fatal("Index %s does not match %s, rebuild it with --index",
+            in->index_name, in->filename);
+
+    in->treeno = treeno+1;
+
+    profile_begin(PROFILE_PARSE);
+    *tree = ntree_parse_newick(newick);
+    profile_end(PROFILE_PARSE);
+    free(newick);
+    return 1;
+  }
+
+  if (treeno >= in->tree_count)
+    return select_end(in, treeno);
+
+  in->treeno = treeno+1;
+
+  profile_begin(PROFILE_PARSE);
+  *tree = binary_load(in, treeno);
+  profile_end(PROFILE_PARSE);
+  return 1;
+}
+
+/* number of the last tree read, counting from 1 */
+long treeio_treeno(treeio_t * in)
+{
+  return in->treeno;
+}
+
+void treeio_close(treeio_t * in)
+{
+  if (in->index)
+    fclose(in->index);
+
+  if (in->fp)
+    fclose(in->fp);
+  else if (in->mapped)
+    munmap(in->data, in->size);
+  else
+    free(in->data);
+
+  free(in->label_ids);
+  free(in->select);
+  free(in->index_name);
+  free(in->filename);
+  free(in);
+}
+
+/* read the first tree of a file, or return NULL */
+ntree_t * treeio_read_first(const char * filename)
+{
+  ntree_t * tree = NULL;
+  treeio_t * in = treeio_open(filename);
+
+  if (!treeio_next(in, &tree))
+    tree = NULL;
+
+  treeio_close(in);
+  return tree;
+}
+
+/* binary output */
+
+static void writer_emit(btree_writer_t * out, const void * data, size_t size)
+{
+  if (size && fwrite(data, 1, size, out->fp) != size)
+    fatal("Unable to write binary tree file");
+  out->offset += size;
+}
+
+static void writer_pad(btree_writer_t * out)
+{
+  static const char zeros[8] = { 0 };
+
+  writer_emit(out, zeros, (8 - out->offset % 8) % 8);
+}
+
+btree_writer_t * btree_writer_create(const char * filename, int float32)
+{
+  btree_header_t header;
+  btree_writer_t * out = (btree_writer_t *)xcalloc(1, sizeof(btree_writer_t));
+
+  out->fp = xopen(filename, "w");
+  out->flags = float32 ? BTREE_FLOAT32 : 0;
+  out->labels = hashtable_create(1024);
+
+  memcpy(header.magic, BTREE_MAGIC, 4);
+  header.version = BTREE_VERSION;
+  header.flags = out->flags;
+  header.reserved = 0;
+  writer_emit(out, &header, sizeof(header));
+
+  return out;
+}
+
+static int writer_label(btree_writer_t * out, char * label)
+{
+  if (!label) return -1;
+
+  unsigned long hash = hash_fnv(label);
+  pair_t * pair = (pair_t *)hashtable_find(out->labels,
+                                           label,
+                                           hash,
+                                           hashtable_paircmp);
+  if (pair)
+    return pair->index;
+
+  if (out->label_count == out->label_alloc)
+  {
+    out->label_alloc = out->label_alloc ? 2*out->label_alloc : 1024;
+    out->label_list = (char **)xrealloc(out->label_list,
+                                        (size_t)out->label_alloc *
+                                        sizeof(char *));
+  }
+
+  pair = (pair_t *)xmalloc(sizeof(pair_t));
+  pair->label = xstrdup(label);
+  pair->index = (int)out->label_count;
+  hashtable_insert(out->labels, (void *)pair, hash, hashtable_paircmp);
+  out->label_list[out->label_count] = pair->label;
+
+  return (int)out->label_count++;
+}
+
+void btree_writer_add(btree_writer_t * out, ntree_t * tree)
+{
+  long i;
+  long nodes = tree->leaves_count + tree->inner_count;
+  btree_record_t record;
+
+  if (out->tree_count == out->index_alloc)
+  {
+    out->index_alloc = out->index_alloc ? 2*out->index_alloc : 1024;
+    out->index = (unsigned long *)xrealloc(out->index,
+                                           (size_t)out->index_alloc *
+                                           sizeof(unsigned long));
+  }
+  out->index[out->tree_count++] = out->offset;
+
+  /* postorder with an explicit stack; data holds the postorder number */
+  node_t ** order = (node_t **)xmalloc((size_t)nodes * sizeof(node_t *));
+  node_t ** stack = (node_t **)xmalloc((size_t)nodes * sizeof(node_t *));
+  int * next_child = (int *)xcalloc((size_t)nodes, sizeof(int));
+  long top = 0;
+  long count = 0;
+
+  stack[top++] = tree->root;
+  while (top)
+  {
+    node_t * node = stack[top-1];
+    long slot = NTREE_SLOT(tree,node);
+
+    if (next_child[slot] < node->children_count)
+      stack[top++] = node->children[next_child[slot]++];
+    else
+    {
+      order[count++] = node;
+      --top;
+    }
+  }
+  assert(count == nodes);
+
+  free(next_child);
+
+  int * parent = (int *)xmalloc((size_t)nodes * sizeof(int));
+  int * label = (int *)xmalloc((size_t)nodes * sizeof(int));
+  long * number = (long *)xmalloc((size_t)nodes * sizeof(long));
+
+  /* postorder number of each node slot */
+  for (i = 0; i < nodes; ++i)
+    number[NTREE_SLOT(tree,order[i])] = i;
+
+  for (i = 0; i < nodes; ++i)
+  {
+    node_t * node = order[i];
+
+    parent[i] = node->parent ? (int)number[NTREE_SLOT(tree,node->parent)] : -1;
+    label[i] = writer_label(out, node->label);
+  }
+
+  record.nodes = (unsigned int)nodes;
+  record.tips = (unsigned int)tree->leaves_count;
+  record.reserved[0] = record.reserved[1] = 0;
+  writer_emit(out, &record, sizeof(record));
+  writer_emit(out, parent, (size_t)nodes * sizeof(int));
+  writer_emit(out, label, (size_t)nodes * sizeof(int));
+
+  if (out->flags & BTREE_FLOAT32)
+  {
+    for (i = 0; i < nodes; ++i)
+    {
+      float x = (float)order[i]->length;
+      writer_emit(out, &x, sizeof(float));
+    }
+  }
+  else
+    for (i = 0; i < nodes; ++i)
+      writer_emit(out, &order[i]->length, sizeof(double));
+
+  writer_pad(out);
+
+  free(number);
+  free(parent);
+  free(label);
+  free(order);
+  free(stack);
+}
+
+static void dealloc_pair(void * data)
+{
+  pair_t * pair = (pair_t *)data;
+
+  free(pair->label);
+  free(pair);
+}
+
+void btree_writer_close(btree_writer_t * out)
+{
+  long i;
+  btree_trailer_t trailer;
+  unsigned long offset = 0;
+
+  trailer.tree_count = (unsigned long)out->tree_count;
+  trailer.label_count = (unsigned long)out->label_count;
+
+  /* label dictionary */
+  trailer.labels_offset = out->offset;
+  for (i = 0; i < out->label_count; ++i)
+  {
+    writer_emit(out, &offset, sizeof(unsigned long));
+    offset += strlen(out->label_list[i]) + 1;
+  }
+  writer_emit(out, &offset, sizeof(unsigned long));
+  for (i = 0; i < out->label_count; ++i)
+    writer_emit(out, out->label_list[i], strlen(out->label_list[i]) + 1);
+  writer_pad(out);
+
+  /* index of tree records */
+  trailer.index_offset = out->offset;
+  writer_emit(out, out->index, (size_t)out->tree_count * sizeof(unsigned long));
+
+  memcpy(trailer.magic, BTREE_MAGIC, 4);
+  trailer.reserved = 0;
+  writer_emit(out, &trailer, sizeof(trailer));
+
+  if (fclose(out->fp))
+    fatal("Unable to write binary tree file");
+
+  hashtable_destroy(out->labels, dealloc_pair);
+  free(out->label_list);
+  free(out->index);
+  free(out);
+}
@@ -0,0 +1,184 @@
+/*
+    Copyright (C) 2015-2017 Tomas Flouri
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Tomas Flouri <t.flouris@ucl.ac.uk>,
+    Department of Genetics, Evolution and Environment,
+    University College London,
+    Gower Street, London WC1E 6BT, England
+*/
+
+
+#include "newick-tools.h"
+
+/* Per-tree outputs of commands that process one tree at a time.
+
+   Without --output everything goes to the console. With --output, the
+   output of tree N goes to the file OUTPUT.N.EXT, or, with --multiplex, the
+   outputs of all trees are concatenated in the single file OUTPUT.EXT and
+   the line "N<tab>offset<tab>length" is appended to OUTPUT.EXT.idx for each
+   tree with non-empty output, where offset and length are in bytes of the
+   uncompressed output. Outputs without an extension are a single file
+   OUTPUT for all trees, indexed as OUTPUT.idx with --multiplex.
+
+   Trees are written through a stream that counts the bytes written and opens
+   per-tree files on the first write. A per-tree file is also created, empty,
+   for every tree processed without output, but not for trees the command
+   skipped. Multiplexed outputs index only trees with output */
+
+static ssize_t treeout_cookie_write(void * cookie, const char * buf, size_t size)
+{
+  treeout_t * out = (treeout_t *)cookie;
+
+  if (!out->file)
+    out->file = xopen(out->filename, "w");
+
+  if (fwrite(buf, 1, size, out->file) != size)
+    return -1;
+
+  out->offset += (long)size;
+
+  return (ssize_t)size;
+}
+
+static int treeout_cookie_close(void * cookie)
+{
+  treeout_t * out = (treeout_t *)cookie;
+
+  if (out->file && fclose(out->file))
+    return EOF;
+
+  out->file = NULL;
+  return 0;
+}
+
+treeout_t * treeout_console(FILE * fp)
+{
+  treeout_t * out = (treeout_t *)xcalloc(1, sizeof(treeout_t));
+
+  out->fp = fp;
+  out->console = 1;
+
+  return out;
+}
+
+treeout_t * treeout_open(const char * ext)
+{
+  cookie_io_functions_t io = { NULL,
+                               treeout_cookie_write,
+                               NULL,
+                               treeout_cookie_close };
+
+  if (!opt_outfile)
+    return treeout_console(stdout);
+
+  treeout_t * out = (treeout_t *)xcalloc(1, sizeof(treeout_t));
+
+  if (ext)
+    out->ext = xstrdup(ext);
+
+  if (!ext || opt_multiplex)
+  {
+    if (ext)
+      asprintf(&out->filename, "%s.%s", opt_outfile, ext);
+    else
+      out->filename = xstrdup(opt_outfile);
+
+    out->file = xopen(out->filename, "w");
+
+    if (opt_multiplex)
+    {
+      char * index_file;
+      asprintf(&index_file, "%s.idx", out->filename);
+      out->index = xopen(index_file, "w");
+      free(index_file);
+    }
+  }
+
+  out->fp = fopencookie(out, "w", io);
+  if (!out->fp)
+    fatal("Cannot create output stream");
+
+  return out;
+}
+
+/* Return the stream for the output of tree treeno */
+FILE * treeout_begin(treeout_t * out, long treeno)
+{
+  if (out->console)
+    return out->fp;
+
+  if (out->ext && !opt_multiplex)
+  {
+    free(out->filename);
+    asprintf(&out->filename, "%s.%ld.%s", opt_outfile, treeno, out->ext);
+  }
+
+  out->start = out->offset;
+
+  return out->fp;
+}
+
+void treeout_end(treeout_t * out, long treeno, int processed)
+{
+  if (out->console)
+    return;
+
+  fflush(out->fp);
+
+  if (out->ext && !opt_multiplex)
+  {
+    if (!out->file && processed)
+      out->file = xopen(out->filename, "w");
+    if (out->file)
+      fclose(out->file);
+    out->file = NULL;
+  }
+  else if (out->index && out->offset > out->start)
+    fprintf(out->index,
+            "%ld\t%ld\t%ld\n",
+            treeno, out->start, out->offset - out->start);
+}
+
+/* Write the complete output of tree treeno, produced elsewhere */
+void treeout_write(treeout_t * out,
+                   long treeno,
+                   const char * data,
+                   size_t len,
+                   int processed)
+{
+  if (!len && !processed) return;
+
+  FILE * fp = treeout_begin(out, treeno);
+  fwrite(data, 1, len, fp);
+  treeout_end(out, treeno, processed);
+}
+
+void treeout_close(treeout_t * out)
+{
+  if (!out->console)
+  {
+    if (fclose(out->fp))
+      fatal("Cannot write file %s", out->filename);
+    if (out->index)
+      fclose(out->index);
+  }
+  else
+    fflush(out->fp);
+
+  free(out->filename);
+  free(out->ext);
+  free(out);
+}
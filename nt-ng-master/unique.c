@@ -0,0 +1,154 @@
+/*
+    Copyright (C) 2015-2017 Tomas Flouri
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Tomas Flouri <t.flouris@ucl.ac.uk>,
+    Department of Genetics, Evolution and Environment,
+    University College London,
+    Gower Street, London WC1E 6BT, England
+*/
+
+
+#include "newick-tools.h"
+
+typedef struct topology_s
+{
+  unsigned long hash;
+  char * canonical;
+  long count;
+  long first;
+} topology_t;
+
+/* topologies are merged only if their canonical forms agree, such that a
+   64-bit hash collision cannot merge two different topologies */
+static int cb_cmp_topology(void * stored, void * query)
+{
+  topology_t * a = (topology_t *)stored;
+  topology_t * b = (topology_t *)query;
+
+  return a->hash == b->hash && !strcmp(a->canonical, b->canonical);
+}
+
+static void dealloc_topology(void * data)
+{
+  topology_t * topology = (topology_t *)data;
+
+  free(topology->canonical);
+  free(topology);
+}
+
+void cmd_unique()
+{
+  long i;
+  long treeno = 0;
+  long unique_count = 0;
+  long unique_alloc = 1024;
+  int unrooted = 0;
+  treeio_t * fp_input;
+  FILE * fp_output;
+  ntree_t * tree;
+
+  if (!opt_treefile)
+    fatal("An input file must be specified");
+
+  if (opt_shape)
+  {
+    if (!strcasecmp(opt_shape,"unrooted"))
+      unrooted = 1;
+    else if (strcasecmp(opt_shape,"rooted"))
+      fatal("--shape must be either 'rooted' or 'unrooted'");
+  }
+
+  fp_input  = treeio_open_selected(opt_treefile);
+
+  fp_output = opt_outfile ?
+                xopen(opt_outfile,"w") : stdout;
+
+  /* topologies in order of first occurrence */
+  topology_t ** unique = (topology_t **)xmalloc((size_t)unique_alloc *
+                                                sizeof(topology_t *));
+
+  hashtable_t * ht = hashtable_create(65536);
+
+  /* main loop going through trees */
+  while (treeio_next(fp_input, &tree))
+  {
+    ++treeno;
+
+    if (!tree)
+      fatal("Cannot parse tree %ld", treeio_treeno(fp_input));
+
+    topology_t query;
+    query.hash = ntree_hash_topology(tree,unrooted);
+    query.canonical = ntree_canonical_topology(tree,unrooted);
+
+    topology_t * topology = (topology_t *)hashtable_find(ht,
+                                                         (void *)&query,
+                                                         query.hash,
+                                                         cb_cmp_topology);
+    if (topology)
+    {
+      topology->count++;
+      free(query.canonical);
+    }
+    else
+    {
+      topology = (topology_t *)xmalloc(sizeof(topology_t));
+      topology->hash = query.hash;
+      topology->canonical = query.canonical;
+      topology->count = 1;
+      topology->first = treeio_treeno(fp_input);
+      hashtable_insert(ht,(void *)topology,topology->hash,cb_cmp_topology);
+
+      if (unique_count == unique_alloc)
+      {
+        unique_alloc <<= 1;
+        topology_t ** temp = (topology_t **)xmalloc((size_t)unique_alloc *
+                                                    sizeof(topology_t *));
+        memcpy(temp, unique, (size_t)unique_count * sizeof(topology_t *));
+        free(unique);
+        unique = temp;
+      }
+      unique[unique_count++] = topology;
+
+      /* write out first occurrence of each topology */
+      char * newick = ntree_export_newick(tree);
+      fprintf(fp_output, "%s\n", newick);
+      free(newick);
+    }
+
+    /* deallocate tree structure */
+    ntree_destroy(tree,NULL);
+  }
+
+  /* the summary goes to stderr, as the trees may be written to stdout */
+  if (!opt_quiet)
+  {
+    fprintf(stderr,
+            "Found %ld unique topologies in %ld trees\n", unique_count, treeno);
+    fprintf(stderr, "Topology\tFirst tree\tCount\tHash\n");
+    for (i = 0; i < unique_count; ++i)
+      fprintf(stderr, "%ld\t%ld\t%ld\t%016lx\n",
+              i+1, unique[i]->first, unique[i]->count, unique[i]->hash);
+  }
+
+  hashtable_destroy(ht,dealloc_topology);
+  free(unique);
+
+  if (opt_outfile)
+    fclose(fp_output);
+
+  treeio_close(fp_input);
+}
@@ -35,31 +35,28 @@ int check_binroot(ntree_t * tree)
 
 void cmd_unroot()
 {
-  FILE * fp_input;
+  treeio_t * fp_input;
   FILE * fp_output;
 
   if (!opt_treefile)
     fatal("An input file must be specified");
 
-  fp_input  = xopen(opt_treefile,"r");
+  fp_input  = treeio_open_selected(opt_treefile);
 
   /* parse tree */
   if (!opt_quiet)
     fprintf(stdout, "Parsing tree file...\n");
 
-  char * newick;
+  ntree_t * tree;
 
-  while ((newick = getnextline(fp_input)))
+  while (treeio_next(fp_input, &tree))
   {
-    ntree_t * tree = ntree_parse_newick(newick);
     if (!tree)
       fatal("Cannot parse tree file");
 
     fp_output = opt_outfile ?
                   xopen(opt_outfile,"w") : stdout;
 
-    free(newick);
-
     /* check if tree is rooted binary */
     if (!check_binroot(tree))
       fatal("Input tree is not binary rooted");
@@ -117,6 +114,6 @@ void cmd_unroot()
     if (opt_outfile)
       fclose(fp_output);
   }
-  fclose(fp_input);
+  treeio_close(fp_input);
   
 }
@@ -77,6 +77,9 @@ void * xcalloc(size_t nmemb, size_t size)
   if (!t)
     fatal("Unable to allocate enough memory.");
 
+  if (opt_profile)
+    profile_alloc(nmemb*size);
+
   return t;
 }
 
@@ -89,6 +92,9 @@ void * xmalloc(size_t size)
   if (!t)
     fatal("Unable to allocate enough memory.");
 
+  if (opt_profile)
+    profile_alloc(size);
+
   return t;
 }
 
@@ -97,6 +103,8 @@ void * xrealloc(void *ptr, size_t size)
   void * t = realloc(ptr, size);
   if (!t)
     fatal("Unable to allocate enough memory.");
+  if (opt_profile)
+    profile_alloc(size);
   return t;
 }
 
@@ -149,16 +157,17 @@ void show_rusage()
 #endif
 }
 
+/* open a file, transparently (de)compressing it (see stream.c) */
 FILE * xopen(const char * filename, const char * mode)
 {
-  FILE * out = fopen(filename, mode);
+  FILE * out = stream_open(filename, mode);
   if (!out)
-    fatal("Cannot open file %s", opt_outfile);
+    fatal("Cannot open file %s", filename);
 
   return out;
 }
 
-void shuffle(void * array, size_t n, size_t size)
+void shuffle(rng_t * rng, void * array, size_t n, size_t size)
 {
   size_t i;
 
@@ -168,8 +177,7 @@ void shuffle(void * array, size_t n, size_t size)
 
   for (i = 0; i < n; ++i)
   {
-    size_t rnd = (size_t)rand();
-    size_t j = i + rnd / (RAND_MAX / (n-i) + 1);
+    size_t j = i + (size_t)rng_bounded(rng, (unsigned long)(n-i));
 
     if (i == j) continue;
 
@@ -180,3 +188,128 @@ void shuffle(void * array, size_t n, size_t size)
 
   free(tmp);
 }
+
+void strbuf_init(strbuf_t * buf)
+{
+  buf->alloc = 256;
+  buf->len = 0;
+  buf->data = (char *)xmalloc(buf->alloc);
+  buf->data[0] = 0;
+}
+
+/* make room for at least extra more characters plus the terminating zero */
+void strbuf_reserve(strbuf_t * buf, size_t extra)
+{
+  if (buf->len + extra + 1 <= buf->alloc)
+    return;
+
+  if (!buf->alloc)
+    buf->alloc = 256;
+
+  while (buf->len + extra + 1 > buf->alloc)
+    buf->alloc *= 2;
+
+  buf->data = (char *)xrealloc(buf->data, buf->alloc);
+}
+
+void strbuf_append(strbuf_t * buf, const char * s, size_t len)
+{
+  strbuf_reserve(buf, len);
+  memcpy(buf->data + buf->len, s, len);
+  buf->len += len;
+  buf->data[buf->len] = 0;
+}
+
+void strbuf_printf(strbuf_t * buf, const char * format, ...)
+{
+  va_list argptr;
+  int len;
+
+  va_start(argptr, format);
+  len = vsnprintf(buf->data + buf->len, buf->alloc - buf->len, format, argptr);
+  va_end(argptr);
+
+  if (len < 0)
+    fatal("Unable to format output");
+
+  if (buf->len + (size_t)len + 1 > buf->alloc)
+  {
+    strbuf_reserve(buf, (size_t)len);
+
+    va_start(argptr, format);
+    vsnprintf(buf->data + buf->len, buf->alloc - buf->len, format, argptr);
+    va_end(argptr);
+  }
+
+  buf->len += (size_t)len;
+}
+
+/* Appends x formatted as printf("%.*f", precision, x). When x scaled by
+   10^precision is small and not close to a rounding tie, the digits are
+   produced from the nearest integer, which is then guaranteed to be the
+   correctly rounded result. Other values are formatted with snprintf */
+void strbuf_append_double(strbuf_t * buf, double x, int precision)
+{
+  static const double pow10[] = { 1e0, 1e1, 1e2, 1e3, 1e4,
+                                  1e5, 1e6, 1e7, 1e8, 1e9 };
+  char digits[32];
+  int len = 0;
+
+  if (precision < 0 || precision > 9)
+  {
+    strbuf_printf(buf, "%.*f", precision, x);
+    return;
+  }
+
+  double y = fabs(x) * pow10[precision];
+  double n = round(y);
+
+  /* the relative error of y is at most 2^-53, which for y < 1e9 is far below
+     the distance to a tie that we require */
+  if (!(y < 1e9) || fabs(y - n) > 0.49)
+  {
+    strbuf_printf(buf, "%.*f", precision, x);
+    return;
+  }
+
+  unsigned long v = (unsigned long)n;
+
+  /* write digits backwards */
+  do
+  {
+    digits[len++] = (char)('0' + v % 10);
+    v /= 10;
+    if (len == precision)
+      digits[len++] = '.';
+  }
+  while (v || len <= precision);
+
+  if (digits[len-1] == '.')
+    digits[len++] = '0';
+
+  if (signbit(x))
+    digits[len++] = '-';
+
+  strbuf_reserve(buf, (size_t)len);
+  while (len)
+    buf->data[buf->len++] = digits[--len];
+  buf->data[buf->len] = 0;
+}
+
+/* returns the buffer contents as a string owned by the caller and leaves the
+   buffer empty */
+char * strbuf_detach(strbuf_t * buf)
+{
+  char * s = (char *)xrealloc(buf->data, buf->len+1);
+
+  buf->data = NULL;
+  buf->len = buf->alloc = 0;
+  return s;
+}
+
+void strbuf_free(strbuf_t * buf)
+{
+  free(buf->data);
+  buf->data = NULL;
+  buf->len = buf->alloc = 0;
+}